@@ -0,0 +1,208 @@
+/**
+ * MediaBox - Linux based set-top firmware
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+/*
+ * Checks every set of blit kernels supported by the CPU against
+ * the scalar ones and prints how long each takes to process a
+ * 1080p frame. This is not part of mediabox, run it by hand.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/log.h"
+#include "lib/time_util.h"
+#include "lib/ui/blit.h"
+
+#define BENCH_W		(1920)
+#define BENCH_H		(1080)
+
+
+enum bench_op
+{
+	BENCH_BLEND,
+	BENCH_FILL,
+	BENCH_COPY,
+	BENCH_SWAPRB,
+	BENCH_MAX
+};
+
+
+static const char * const op_names[] =
+{
+	"blend",
+	"fill",
+	"copy",
+	"swaprb"
+};
+
+
+/**
+ * Runs a kernel on a single row.
+ */
+static void
+run_op(const enum bench_op op, uint32_t * const dst,
+	const uint32_t * const src, const int n)
+{
+	switch (op) {
+	case BENCH_BLEND: avbox_blit_blend(dst, src, n); break;
+	case BENCH_FILL: avbox_blit_fill(dst, src[0], n); break;
+	case BENCH_COPY: avbox_blit_copy(dst, src, n); break;
+	case BENCH_SWAPRB: avbox_blit_swaprb(dst, src, n); break;
+	default: abort();
+	}
+}
+
+
+/**
+ * Fills the buffers with a mix of transparent, translucent
+ * and opaque premultiplied pixels.
+ */
+static void
+init_buffers(uint32_t * const src, uint32_t * const dst)
+{
+	int i;
+	srand(0);
+	for (i = 0; i < BENCH_W; i++) {
+		const uint32_t a = (i % 3 == 0) ? 0 : (i % 3 == 1) ? 0xff : (rand() & 0xff);
+		src[i] = (a << 24) | (((rand() & 0xff) * a / 255) << 16) |
+			(((rand() & 0xff) * a / 255) << 8) | ((rand() & 0xff) * a / 255);
+		dst[i] = 0xff000000 | (rand() & 0xffffff);
+	}
+}
+
+
+/**
+ * Checks the current kernels against the scalar ones. Every
+ * row length up to BENCH_W is tried so the tails are checked
+ * too. Returns the number of mismatches.
+ */
+static int
+check_kernels(const char * const name, uint32_t * const src,
+	uint32_t * const dst, uint32_t * const ref, uint32_t * const base)
+{
+	int op, n, errors = 0;
+
+	for (op = 0; op < BENCH_MAX; op++) {
+		for (n = 1; n <= BENCH_W; n += (n < 64) ? 1 : 61) {
+			memcpy(dst, base, BENCH_W * sizeof(uint32_t));
+			memcpy(ref, base, BENCH_W * sizeof(uint32_t));
+
+			avbox_blit_usekernels("c");
+			run_op(op, ref, src + 1, n);
+			avbox_blit_usekernels(name);
+			run_op(op, dst, src + 1, n);
+
+			if (memcmp(dst, ref, BENCH_W * sizeof(uint32_t))) {
+				fprintf(stderr, "blitbench: '%s' %s kernel does not match "
+					"the scalar one (n=%i)!\n", name, op_names[op], n);
+				errors++;
+				break;
+			}
+		}
+	}
+	return errors;
+}
+
+
+/**
+ * Times each kernel over a full frame. The frames are bigger
+ * than the caches so this measures what a real blit costs.
+ */
+static void
+time_kernels(const char * const name, uint32_t * const src, uint32_t * const dst)
+{
+	int op, row;
+	struct timespec start, end;
+
+	printf("%-6s", name);
+	for (op = 0; op < BENCH_MAX; op++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (row = 0; row < BENCH_H; row++) {
+			run_op(op, dst + row * BENCH_W, src + row * BENCH_W, BENCH_W);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf(" %s=%6" PRIi64 "us", op_names[op], utimediff(&end, &start));
+	}
+	printf("\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+	int i, errors = 0;
+	uint32_t *src, *dst, *ref, *base, *src_frame, *dst_frame;
+	const char * const names[] = { "c", "sse2", "avx2", "neon", NULL };
+
+	(void) argc;
+	(void) argv;
+
+	log_init();
+
+	/* src has an extra pixel so we can test unaligned rows */
+	if ((src = malloc((BENCH_W * 4 + 1) * sizeof(uint32_t))) == NULL) {
+		fprintf(stderr, "blitbench: Out of memory\n");
+		return EXIT_FAILURE;
+	}
+	dst = src + BENCH_W + 1;
+	ref = dst + BENCH_W;
+	base = ref + BENCH_W;
+
+	if ((src_frame = malloc(BENCH_W * BENCH_H * 2 * sizeof(uint32_t))) == NULL) {
+		fprintf(stderr, "blitbench: Out of memory\n");
+		free(src);
+		return EXIT_FAILURE;
+	}
+	dst_frame = src_frame + BENCH_W * BENCH_H;
+
+	init_buffers(src + 1, base);
+	src[0] = 0;
+	for (i = 0; i < BENCH_H; i++) {
+		memcpy(src_frame + i * BENCH_W, src + 1, BENCH_W * sizeof(uint32_t));
+		memcpy(dst_frame + i * BENCH_W, base, BENCH_W * sizeof(uint32_t));
+	}
+
+	printf("%ix%i frame:\n", BENCH_W, BENCH_H);
+
+	for (i = 0; names[i] != NULL; i++) {
+		if (avbox_blit_usekernels(names[i]) == -1) {
+			continue;
+		}
+		errors += check_kernels(names[i], src, dst, ref, base);
+		avbox_blit_usekernels(names[i]);
+		time_kernels(names[i], src_frame, dst_frame);
+	}
+
+	avbox_blit_init();
+	printf("avbox_blit_init() selects '%s'\n", avbox_blit_kernels_name());
+
+	free(src_frame);
+	free(src);
+	return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -79,17 +79,26 @@ struct mbox_browser_loadlist_context
 };
 
 
-struct mbox_browser_additem_context
+/* number of items sent to the main thread at once */
+#define MBOX_BROWSER_PAGE_SIZE	(64)
+
+
+struct mbox_browser_additems_context
 {
 	struct mbox_browser *inst;
-	struct mbox_browser_playlist_item *item;
-	char *title;
+	struct avbox_listview_entry entries[MBOX_BROWSER_PAGE_SIZE];
+	int count;
+	int update;
 };
 
 
 #define LIBRARY_ROOT "/media/UPnP"
 
 
+static int
+mbox_browser_freeitems(void *item, void *data);
+
+
 static struct avbox_playlist_item *
 mbox_browser_addtoplaylist(struct mbox_browser * const inst, const char *file)
 {
@@ -159,20 +168,68 @@ mbox_browser_updatewindow(void *ctx)
 
 
 /**
- * Add a list item from the main thread.
+ * Add a page of list items from the main thread.
  */
 static void *
-mbox_browser_additem(void *ctx)
+mbox_browser_additems(void *ctx)
 {
-	struct mbox_browser * const inst = ((struct mbox_browser_additem_context*)ctx)->inst;
-	struct mbox_browser_playlist_item * const library_item =
-		((struct mbox_browser_additem_context*)ctx)->item;
-	char * const title = ((struct mbox_browser_additem_context*)ctx)->title;
-	avbox_listview_additem(inst->menu, title, library_item);
+	struct mbox_browser_additems_context * const page = ctx;
+	struct mbox_browser * const inst = page->inst;
+	int i;
+
+	if (avbox_listview_additems(inst->menu, page->entries, page->count) == -1) {
+		LOG_PRINT_ERROR("Could not add items to list");
+		for (i = 0; i < page->count; i++) {
+			mbox_browser_freeitems(page->entries[i].data, NULL);
+		}
+		return NULL;
+	}
+
+	/* show the first page as soon as it's loaded */
+	if (page->update) {
+		avbox_window_update(inst->window);
+	}
 	return NULL;
 }
 
 
+/**
+ * Sends a page of items to the main thread and waits
+ * for them to be added to the list.
+ */
+static void
+mbox_browser_flushitems(struct mbox_browser_additems_context * const page)
+{
+	int i;
+	struct avbox_delegate *del;
+
+	if (page->count == 0) {
+		return;
+	}
+
+	if (page->inst->abort) {
+		for (i = 0; i < page->count; i++) {
+			mbox_browser_freeitems(page->entries[i].data, NULL);
+		}
+	} else if ((del = avbox_application_delegate(mbox_browser_additems, page)) == NULL) {
+		LOG_VPRINT_ERROR("Could not add items. "
+			"avbox_application_delegate() failed: %s",
+			strerror(errno));
+		for (i = 0; i < page->count; i++) {
+			mbox_browser_freeitems(page->entries[i].data, NULL);
+		}
+	} else {
+		avbox_delegate_wait(del, NULL);
+		page->update = 0;
+	}
+
+	for (i = 0; i < page->count; i++) {
+		free((void*) page->entries[i].name);
+	}
+	page->count = 0;
+}
+
+
 /**
  * Populate the list from a background thread.
  */
@@ -184,6 +241,7 @@ __mbox_browser_loadlist(void *ctx)
 	const char * const path = ((struct mbox_browser_loadlist_context*) ctx)->path;
 	struct mbox_library_dir *dir = NULL;
 	struct mbox_library_dirent *ent;
+	struct mbox_browser_additems_context *page = NULL;
 	int ret = -1;
 	struct avbox_delegate *del;
 
@@ -193,6 +251,15 @@ __mbox_browser_loadlist(void *ctx)
 	/* first free the playlist */
 	mbox_browser_freeplaylist(inst);
 
+	if ((page = malloc(sizeof(struct mbox_browser_additems_context))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		LOG_PRINT_ERROR("Could not populate list. Out of memory");
+		goto end;
+	}
+	page->inst = inst;
+	page->count = 0;
+	page->update = 1;
+
 	if ((dir = mbox_library_opendir(path)) == NULL) {
 		LOG_VPRINT_ERROR("Cannot open library directory '%s': %s",
 			path, strerror(errno));
@@ -253,22 +320,25 @@ __mbox_browser_loadlist(void *ctx)
 				}
 			}
 
-			/* add item to menu */
-			struct mbox_browser_additem_context addctx;
-			addctx.inst = inst;
-			addctx.title = ent->name;
-			addctx.item = library_item;
-			if ((del = avbox_application_delegate(mbox_browser_additem, &addctx)) == NULL) {
-				LOG_VPRINT_ERROR("Could not add item. "
-					"avbox_application_delegate() failed: %s",
+			/* add item to the current page and send the
+			 * page to the menu when it's full */
+			if ((page->entries[page->count].name = strdup(ent->name)) == NULL) {
+				LOG_VPRINT_ERROR("Could not populate list: %s",
 					strerror(errno));
-			} else {
-				avbox_delegate_wait(del, NULL);
+				mbox_browser_freeitems(library_item, NULL);
+				mbox_library_freedirentry(ent);
+				goto end;
+			}
+			page->entries[page->count++].data = library_item;
+			if (page->count == MBOX_BROWSER_PAGE_SIZE) {
+				mbox_browser_flushitems(page);
 			}
 		}
 		mbox_library_freedirentry(ent);
 	}
 
+	mbox_browser_flushitems(page);
+
 	/* update the library window */
 	if ((del = avbox_application_delegate(mbox_browser_updatewindow, inst)) == NULL) {
 		LOG_VPRINT_ERROR("Could not update window!: %s",
@@ -283,6 +353,10 @@ end:
 		DEBUG_VPRINT(LOG_MODULE, "Loadlist baling with status %i",
 			ret);
 	}
+	if (page != NULL) {
+		mbox_browser_flushitems(page);
+		free(page);
+	}
 	if (dir != NULL) {
 		mbox_library_closedir(dir);
 	}
@@ -597,9 +597,9 @@ avbox_application_run(void)
 	avbox_torrent_shutdown();
 	avbox_audiostream_shutdown();
 	avbox_process_shutdown();
+	avbox_input_shutdown();
 	avbox_timers_shutdown();
 	avbox_settings_shutdown();
-	avbox_input_shutdown();
 #ifdef ENABLE_BLUETOOTH
 	avbox_bluetooth_shutdown();
 #endif
@@ -19,6 +19,7 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <assert.h>
 #include <time.h>
@@ -44,6 +45,17 @@
 
 #define AVBOX_AUDIOSTREAM_DATA_PACKET	(1)
 #define AVBOX_AUDIOSTREAM_CLOCK_SET	(2)
+#define AVBOX_AUDIOSTREAM_FORMAT	(3)
+
+/* channel counts and rates tested on the hardware */
+#define AVBOX_AUDIOSTREAM_PROBE_CHANNELS	(3)
+#define AVBOX_AUDIOSTREAM_PROBE_RATES		(7)
+
+
+static const unsigned int probe_channels[AVBOX_AUDIOSTREAM_PROBE_CHANNELS] =
+	{ 2, 6, 8 };
+static const unsigned int probe_rates[AVBOX_AUDIOSTREAM_PROBE_RATES] =
+	{ 32000, 44100, 48000, 88200, 96000, 176400, 192000 };
 
 
 struct avbox_audiostream_data_packet
@@ -68,6 +80,7 @@ LISTABLE_STRUCT(avbox_audio_packet,
 	union {
 		struct avbox_audiostream_data_packet data_packet;
 		struct avbox_audiostream_clock_set clock_set;
+		struct avbox_audio_format format;
 	};
 );
 
@@ -94,10 +107,17 @@ struct avbox_audiostream
 	int64_t frames;
 	int64_t clock_start;
 	int64_t clock_offset;
-	int64_t last_audio_time;
-	struct timespec last_system_time;
+	volatile unsigned int clock_seq;
+	int64_t clock_time;
+	int64_t clock_limit;
+	struct timespec clock_systime;
+	int clock_running;
 	snd_pcm_uframes_t buffer_size;
 	unsigned int framerate;
+	size_t framesize;
+	struct avbox_audio_format format;
+	unsigned int caps_rates[AVBOX_AUDIOSTREAM_PROBE_CHANNELS];
+	int caps_s32;
 	struct avbox_queue *packets;
 	avbox_audiostream_callback callback;
 	void *callback_context;
@@ -158,11 +178,7 @@ avbox_audiostream_frames2size(struct avbox_audiostream * const stream,
 	snd_pcm_uframes_t frames)
 {
 	assert(stream != NULL);
-
-	/* For now this is hardcoded to 4 bytes per frame since we
-	 * only support 16-bit stereo */
-	(void) stream;
-	return frames * 4;
+	return frames * stream->framesize;
 }
 
 
@@ -175,9 +191,8 @@ avbox_audiostream_recover(struct avbox_audiostream * const inst, snd_pcm_sframes
 	LOG_VPRINT_ERROR("Recovering from ALSA error: %s",
 		snd_strerror(err));
 
-	/* update the offset and invalidate last time */
+	/* update the offset */
 	inst->clock_offset = FRAMES2TIME(inst, inst->frames);
-	inst->last_audio_time = -1;
 
 	/* attempt to recover */
 	if (UNLIKELY((err = snd_pcm_recover(inst->pcm_handle, err, 1)) < 0)) {
@@ -248,20 +263,6 @@ __avbox_audiostream_drop(struct avbox_audiostream * const stream)
 }
 
 
-/**
- * Flush an audio stream.
- */
-void
-avbox_audiostream_drop(struct avbox_audiostream * const inst)
-{
-	pthread_mutex_lock(&inst->io_lock);
-	avbox_audiostream_pcm_drain(inst);
-	__avbox_audiostream_drop(inst);
-	pthread_cond_signal(&inst->io_wake);
-	pthread_mutex_unlock(&inst->io_lock);
-}
-
-
 /**
  * Gets a string for a pcm state.
  */
@@ -286,61 +287,28 @@ avbox_pcm_state_getstring(snd_pcm_state_t state)
 
 
 /**
- * Gets the time elapsed (in uSecs) since the
- * stream started playing. This clock stops when the audio stream is paused
- * or underruns.
+ * Reads the stream clock from the PCM. Must be called with
+ * the io lock held. Running is set to 1 if the clock is
+ * advancing.
  */
-int64_t
-avbox_audiostream_gettime(struct avbox_audiostream * const stream)
+static int64_t
+avbox_audiostream_readclock(struct avbox_audiostream * const stream,
+	int * const running)
 {
-	int err = 0;
-	snd_pcm_sframes_t avail;
+	int err;
 	snd_pcm_status_t *status;
 
-	if (stream->pcm_handle == NULL) {
-		goto end;
-	}
+	*running = 0;
 
 	/* if the stream is pause or hasn't started return
 	 * the internal offset */
-	if (stream->paused || stream->frames == 0) {
+	if (stream->pcm_handle == NULL || stream->paused || stream->frames == 0) {
 		goto end;
 	}
 
-	/* try to aquire the io mutex. If we can't then return
-	 * an approximation.
-	 * NOTE: It may not be necessary to lock here if libasound is
-	 * compiled with thread safety but we still want to do it here
-	 * because our io mutex has PTHREAD_PRIO_INHERIT to solve the
-	 * priority inversion problem when the video output thread has
-	 * to wait for this mutex (it gets preempted by the decoder threads
-	 * resulting in latencies in the 100s of ms). Now we're returning an
-	 * approximation when the mutex is lock so this call should never
-	 * cause a context switch (to another thread).
-	 */
-	if ((err = pthread_mutex_trylock(&stream->io_lock)) != 0) {
-		if (err == EBUSY) {
-			if (1 || stream->last_audio_time < 0) {
-				pthread_mutex_lock(&stream->io_lock);
-			} else {
-				struct timespec now;
-				clock_gettime(CLOCK_MONOTONIC, &now);
-				const int64_t time = stream->last_audio_time +
-					utimediff(&now, &stream->last_system_time);
-				return MAX(time, stream->clock_start +
-					FRAMES2TIME(stream, stream->frames));
-			}
-		} else {
-			ABORT("Mutex trylock returned error!");
-		}
-	}
-
-	/* make sure we're not in xrun */
-	if ((avail = snd_pcm_avail(stream->pcm_handle)) < 0) {
-		if (!avbox_audiostream_recover(stream, avail)) {
-			ABORT("Could not recover from ALSA error!");
-		}
-		pthread_mutex_unlock(&stream->io_lock);
+	/* make sure we're not in xrun. The output thread
+	 * will recover next time it checks the PCM */
+	if (snd_pcm_avail(stream->pcm_handle) < 0) {
 		goto end;
 	}
 
@@ -348,12 +316,9 @@ avbox_audiostream_gettime(struct avbox_audiostream * const stream)
 	snd_pcm_status_alloca(&status);
 	if ((err = snd_pcm_status(stream->pcm_handle, status)) < 0) {
 		LOG_VPRINT_ERROR("Stream status error: %s", snd_strerror(err));
-		pthread_mutex_unlock(&stream->io_lock);
 		goto end;
 	}
 
-	pthread_mutex_unlock(&stream->io_lock);
-
 	/* if the stream is running calculate it's runtime
 	 * based on the internal offset + timestamp - trigger timestamp */
 	switch (snd_pcm_status_get_state(status)) {
@@ -375,8 +340,7 @@ avbox_audiostream_gettime(struct avbox_audiostream * const stream)
 		time = stream->clock_start + stream->clock_offset;
 		time += SEC2USEC(ts.tv_sec) + ts.tv_usec;
 		time -= SEC2USEC(tts.tv_sec) + tts.tv_usec;
-		/* clock_gettime(CLOCK_MONOTONIC, &stream->last_system_time); 
-		return stream->last_audio_time = MAX(time, stream->last_audio_time); */
+		*running = 1;
 		return time;
 	}
 	default:
@@ -390,6 +354,89 @@ end:
 }
 
 
+/**
+ * Publishes a snapshot of the stream clock for
+ * avbox_audiostream_gettime(). Must be called with the
+ * io lock held.
+ */
+static void
+avbox_audiostream_updateclock(struct avbox_audiostream * const stream)
+{
+	int running;
+	struct timespec now;
+	const int64_t time = avbox_audiostream_readclock(stream, &running);
+	const int64_t limit = stream->clock_start +
+		(stream->framerate ? FRAMES2TIME(stream, stream->frames) : 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* the sequence number is odd while we're updating */
+	stream->clock_seq++;
+	MEMORY_BARRIER();
+	stream->clock_time = time;
+	stream->clock_limit = limit;
+	stream->clock_systime = now;
+	stream->clock_running = running;
+	MEMORY_BARRIER();
+	stream->clock_seq++;
+}
+
+
+/**
+ * Gets the time elapsed (in uSecs) since the
+ * stream started playing. This clock stops when the audio stream is paused
+ * or underruns.
+ *
+ * This is called by the video thread for every frame so it must
+ * not block. Instead of querying the PCM we extrapolate from the last
+ * snapshot published by the output thread. The result never goes past
+ * the end of the audio written to the PCM.
+ */
+int64_t
+avbox_audiostream_gettime(struct avbox_audiostream * const stream)
+{
+	int running;
+	unsigned int seq;
+	int64_t time, limit;
+	struct timespec systime, now;
+
+	do {
+		while (UNLIKELY((seq = stream->clock_seq) & 1)) {
+			sched_yield();
+		}
+		MEMORY_BARRIER();
+		time = stream->clock_time;
+		limit = stream->clock_limit;
+		systime = stream->clock_systime;
+		running = stream->clock_running;
+		MEMORY_BARRIER();
+	} while (UNLIKELY(seq != stream->clock_seq));
+
+	if (!running) {
+		return time;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time += utimediff(&now, &systime);
+	return MIN(time, limit);
+}
+
+
+/**
+ * Flush an audio stream.
+ */
+void
+avbox_audiostream_drop(struct avbox_audiostream * const inst)
+{
+	pthread_mutex_lock(&inst->io_lock);
+	avbox_audiostream_pcm_drain(inst);
+	__avbox_audiostream_drop(inst);
+	avbox_audiostream_updateclock(inst);
+	pthread_cond_signal(&inst->io_wake);
+	pthread_mutex_unlock(&inst->io_lock);
+}
+
+
 /**
  * Pauses the audio stream and synchronizes
  * the audio clock.
@@ -483,7 +530,7 @@ avbox_audiostream_pause(struct avbox_audiostream * const inst)
 	}
 
 end:
-	inst->last_audio_time = -1;
+	avbox_audiostream_updateclock(inst);
 	pthread_mutex_unlock(&inst->io_lock);
 	return ret;
 }
@@ -508,7 +555,7 @@ avbox_audiostream_resume(struct avbox_audiostream * const inst)
 	}
 
 	inst->paused = 0;
-	inst->last_audio_time = -1;
+	avbox_audiostream_updateclock(inst);
 	ret = 0;
 end:
 	/* signal IO thread */
@@ -523,92 +570,188 @@ end:
 
 
 /**
- * This is the main playback loop.
+ * Gets the ALSA sample format for a stream format.
  */
-static void*
-avbox_audiostream_output(void *arg)
+static inline snd_pcm_format_t
+avbox_audiostream_pcmformat(const int format)
+{
+	switch (format) {
+	case AVBOX_AUDIO_FORMAT_S32: return SND_PCM_FORMAT_S32_LE;
+	case AVBOX_AUDIO_FORMAT_S16:
+	case AVBOX_AUDIO_FORMAT_IEC61937:
+	default: return SND_PCM_FORMAT_S16_LE;
+	}
+}
+
+
+/**
+ * Gets the ALSA device to use for a stream format.
+ */
+static const char *
+avbox_audiostream_getdevice(const int format)
 {
-	int ret, underrun = 1;
-	int64_t timeout;
-	size_t n_frames;
-	struct avbox_audiostream * const inst = (struct avbox_audiostream * const) arg;
-	struct avbox_audio_packet * packet;
 	const char *device;
-	unsigned int period_usecs = 10;
-	int dir = 0;
-	snd_pcm_hw_params_t *params;
-	snd_pcm_sw_params_t *swparams;
-	snd_pcm_sframes_t avail;
-	snd_pcm_sframes_t frames;
-	snd_pcm_uframes_t period = 1024, silence_len,
-		start_thres, stop_thres, silen_thres;
 
-	DEBUG_SET_THREAD_NAME("audio_output");
-	DEBUG_PRINT(LOG_MODULE, "Audio playback thread started");
+	/* IEC 61937 bursts must reach the receiver untouched so
+	 * they go to a separate device (usually an hdmi: or iec958:
+	 * device with the non-audio bit set) */
+	if (format == AVBOX_AUDIO_FORMAT_IEC61937) {
+		return getenv("ALSA_PASSTHROUGH_DEVICE");
+	}
 
-	ASSERT(inst != NULL);
-	ASSERT(inst->pcm_handle == NULL);
-	ASSERT(inst->quit == 0);
-	ASSERT(inst->paused == 0);
+	/* if ALSA_DEVICE is set on the environment use that
+	 * instead of the default device */
+	if ((device = getenv("ALSA_DEVICE")) == NULL) {
+		device = "default";
+	}
+	return device;
+}
 
-	/* set the thread priority to realtime */
-#ifdef ENABLE_REALTIME
-	struct sched_param parms;
-	parms.sched_priority = sched_get_priority_max(SCHED_RR) - 21;
-	if (pthread_setschedparam(pthread_self(), SCHED_RR, &parms) != 0) {
-		LOG_PRINT_ERROR("Could not send main thread priority");
+
+/**
+ * Probes the capabilities of the output device.
+ *
+ * Plug devices (like "default") accept almost any format and
+ * convert it themselves, so their ranges tell us nothing about the
+ * hardware. Multichannel output, native rates and S32 are therefore
+ * only used when ALSA_HW_DEVICE names the hw: device under ALSA_DEVICE,
+ * and only for the exact channel counts and rates that it accepts.
+ * Otherwise we output stereo S16 at 48KHz like we always did.
+ */
+static void
+avbox_audiostream_probe(struct avbox_audiostream * const inst)
+{
+	int ret;
+	unsigned int i, j;
+	snd_pcm_t *pcm;
+	snd_pcm_hw_params_t *params;
+	const char * const device = getenv("ALSA_HW_DEVICE");
+
+	memset(inst->caps_rates, 0, sizeof(inst->caps_rates));
+	inst->caps_s32 = 0;
+
+	if (device == NULL) {
+		DEBUG_PRINT(LOG_MODULE, "ALSA_HW_DEVICE not set. Using stereo S16 at 48KHz");
+		return;
 	}
-#endif
 
 	snd_pcm_hw_params_alloca(&params);
-	snd_pcm_sw_params_alloca(&swparams);
-
-	inst->framerate = 48000;
 
 	(void) avbox_gainroot();
+	ret = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+	(void) avbox_droproot();
+	if (ret < 0) {
+		LOG_VPRINT_ERROR("Could not probe ALSA device '%s': %s",
+			device, snd_strerror(ret));
+		return;
+	}
 
-	/* if ALSA_DEVICE is set on the environment use that
-	 * instead of the default device */
-	if ((device = getenv("ALSA_DEVICE")) == NULL) {
-		device = "default";
+	/* test every rate for every channel count that we
+	 * can output */
+	for (i = 0; i < AVBOX_AUDIOSTREAM_PROBE_CHANNELS; i++) {
+		if ((ret = snd_pcm_hw_params_any(pcm, params)) < 0 ||
+			snd_pcm_hw_params_test_channels(pcm, params, probe_channels[i]) != 0 ||
+			(ret = snd_pcm_hw_params_set_channels(pcm, params, probe_channels[i])) < 0) {
+			continue;
+		}
+		for (j = 0; j < AVBOX_AUDIOSTREAM_PROBE_RATES; j++) {
+			if (snd_pcm_hw_params_test_rate(pcm, params, probe_rates[j], 0) == 0) {
+				inst->caps_rates[i] |= (1 << j);
+			}
+		}
+	}
+
+	if (snd_pcm_hw_params_any(pcm, params) >= 0) {
+		inst->caps_s32 = (snd_pcm_hw_params_test_format(pcm, params,
+			SND_PCM_FORMAT_S32_LE) == 0);
+	}
+
+	snd_pcm_close(pcm);
+
+	DEBUG_VPRINT(LOG_MODULE, "ALSA device '%s': rates(2ch)=0x%x rates(6ch)=0x%x rates(8ch)=0x%x s32=%i",
+		device, inst->caps_rates[0], inst->caps_rates[1],
+		inst->caps_rates[2], inst->caps_s32);
+}
+
+
+/**
+ * Opens the PCM device with the stream's current format.
+ */
+static int
+avbox_audiostream_pcm_open(struct avbox_audiostream * const inst,
+	snd_pcm_sw_params_t * const swparams, snd_pcm_uframes_t * const period,
+	unsigned int * const period_usecs)
+{
+	int ret, dir = 0;
+	const char *device;
+	snd_pcm_hw_params_t *params;
+	snd_pcm_uframes_t silence_len, start_thres, stop_thres, silen_thres;
+	const snd_pcm_format_t format = avbox_audiostream_pcmformat(inst->format.format);
+
+	ASSERT(inst->pcm_handle == NULL);
+
+	snd_pcm_hw_params_alloca(&params);
+
+	inst->framerate = inst->format.rate;
+	inst->framesize = inst->format.channels * snd_pcm_format_physical_width(format) / 8;
+	*period = 1024;
+
+	if ((device = avbox_audiostream_getdevice(inst->format.format)) == NULL) {
+		LOG_PRINT_ERROR("No passthrough device configured (ALSA_PASSTHROUGH_DEVICE)");
+		return -1;
 	}
 
 	/* initialize alsa device */
-	if ((ret = snd_pcm_open(&inst->pcm_handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+	(void) avbox_gainroot();
+	ret = snd_pcm_open(&inst->pcm_handle, device, SND_PCM_STREAM_PLAYBACK, 0);
+	(void) avbox_droproot();
+	if (ret < 0) {
 		LOG_VPRINT_ERROR("snd_pcm_open() failed: %s", snd_strerror(ret));
-		goto end;
+		inst->pcm_handle = NULL;
+		return -1;
 	}
 	if ((ret = snd_pcm_hw_params_any(inst->pcm_handle, params)) < 0) {
 		LOG_VPRINT_ERROR("Broken ALSA configuration: none available. %s", snd_strerror(ret));
-		goto end;
+		goto err;
 	}
 	if ((ret = snd_pcm_hw_params_set_access(inst->pcm_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
 		LOG_VPRINT_ERROR("INTERLEAVED RW access not available. %s", snd_strerror(ret));
-		goto end;
+		goto err;
 	}
-	if ((ret = snd_pcm_hw_params_set_format(inst->pcm_handle, params, SND_PCM_FORMAT_S16_LE)) < 0) {
-		LOG_VPRINT_ERROR("Format S16_LE not supported. %s", snd_strerror(ret));
-		goto end;
+	if ((ret = snd_pcm_hw_params_set_format(inst->pcm_handle, params, format)) < 0) {
+		LOG_VPRINT_ERROR("Format %s not supported. %s",
+			snd_pcm_format_name(format), snd_strerror(ret));
+		goto err;
 	}
-	if ((ret = snd_pcm_hw_params_set_channels(inst->pcm_handle, params, 2)) < 0) {
-		LOG_VPRINT_ERROR("2 Channels not available. %s", snd_strerror(ret));
-		goto end;
+	if ((ret = snd_pcm_hw_params_set_channels(inst->pcm_handle, params, inst->format.channels)) < 0) {
+		LOG_VPRINT_ERROR("%u Channels not available. %s",
+			inst->format.channels, snd_strerror(ret));
+		goto err;
 	}
-	if ((ret = snd_pcm_hw_params_set_rate_near(inst->pcm_handle, params, &inst->framerate, &dir)) < 0) {
-		LOG_VPRINT_ERROR("48000Hz not available. %s", snd_strerror(ret));
-		goto end;
+	if (inst->format.format == AVBOX_AUDIO_FORMAT_IEC61937) {
+		/* the bursts cannot be resampled */
+		if ((ret = snd_pcm_hw_params_set_rate_resample(inst->pcm_handle, params, 0)) < 0 ||
+			(ret = snd_pcm_hw_params_set_rate(inst->pcm_handle, params, inst->framerate, 0)) < 0) {
+			LOG_VPRINT_ERROR("%uHz not available for passthrough. %s",
+				inst->framerate, snd_strerror(ret));
+			goto err;
+		}
+	} else if ((ret = snd_pcm_hw_params_set_rate_near(inst->pcm_handle, params, &inst->framerate, &dir)) < 0) {
+		LOG_VPRINT_ERROR("%uHz not available. %s",
+			inst->format.rate, snd_strerror(ret));
+		goto err;
 	}
-	if ((ret = snd_pcm_hw_params_set_period_size_near(inst->pcm_handle, params, &period, &dir)) < 0) {
+	if ((ret = snd_pcm_hw_params_set_period_size_near(inst->pcm_handle, params, period, &dir)) < 0) {
 		LOG_VPRINT_ERROR("Cannot set period. %s", snd_strerror(ret));
-		goto end;
+		goto err;
 	}
 	if ((ret = snd_pcm_hw_params(inst->pcm_handle, params)) < 0) {
 		LOG_VPRINT_ERROR("Could not set ALSA params: %s", snd_strerror(ret));
-		goto end;
+		goto err;
 	}
 
 	/* read hw params */
-	if ((ret = snd_pcm_hw_params_get_period_time(params, &period_usecs, &dir)) < 0) {
+	if ((ret = snd_pcm_hw_params_get_period_time(params, period_usecs, &dir)) < 0) {
 		LOG_VPRINT_ERROR("Could not get period time: %s",
 			snd_strerror(ret));
 	}
@@ -616,7 +759,7 @@ avbox_audiostream_output(void *arg)
 		LOG_VPRINT_ERROR("Could not get framerate: %s",
 			snd_strerror(ret));
 	}
-	if ((ret = snd_pcm_hw_params_get_period_size(params, &period, &dir)) < 0) {
+	if ((ret = snd_pcm_hw_params_get_period_size(params, period, &dir)) < 0) {
 		LOG_VPRINT_ERROR("Could not get period size: %s",
 			snd_strerror(ret));
 	}
@@ -628,12 +771,12 @@ avbox_audiostream_output(void *arg)
 	/* set sw params */
 	if ((ret = snd_pcm_sw_params_current(inst->pcm_handle, swparams)) < 0) {
 		LOG_VPRINT_ERROR("Could not determine SW params. %s", snd_strerror(ret));
-		goto end;
+		goto err;
 	}
 #ifdef HAVE_SND_PCM_TSTAMP_TYPE_MONOTONIC
 	if ((ret = snd_pcm_sw_params_set_tstamp_type(inst->pcm_handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC)) < 0) {
 		LOG_VPRINT_ERROR("Could not set ALSA clock to CLOCK_MONOTONIC. %s", snd_strerror(ret));
-		goto end;
+		goto err;
 	}
 #endif
 	if ((ret = snd_pcm_sw_params_set_tstamp_mode(inst->pcm_handle, swparams, SND_PCM_TSTAMP_ENABLE)) < 0) {
@@ -641,15 +784,15 @@ avbox_audiostream_output(void *arg)
 	}
 	if ((ret = snd_pcm_sw_params_set_avail_min(inst->pcm_handle, swparams, 0)) < 0) {
 		LOG_VPRINT_ERROR("Could not set ALSA avail_min: %s", snd_strerror(ret));
-		goto end;
+		goto err;
 	}
 	if ((ret = snd_pcm_sw_params_set_start_threshold(inst->pcm_handle, swparams, 0)) < 0) {
 		LOG_VPRINT_ERROR("Could not set ALSA start threshold: %s", snd_strerror(ret));
-		goto end;
+		goto err;
 	}
 	if ((ret = snd_pcm_sw_params(inst->pcm_handle, swparams)) < 0) {
 		LOG_VPRINT_ERROR("Could not set ALSA SW paramms. %s", snd_strerror(ret));
-		goto end;
+		goto err;
 	}
 
 	/* read sw params */
@@ -668,9 +811,13 @@ avbox_audiostream_output(void *arg)
 
 	/* print debug info */
 	DEBUG_VPRINT("audio", "ALSA library version: %s", SND_LIB_VERSION_STR);
+	DEBUG_VPRINT("audio", "ALSA device: %s", device);
+	DEBUG_VPRINT("audio", "ALSA format: %s%s", snd_pcm_format_name(format),
+		(inst->format.format == AVBOX_AUDIO_FORMAT_IEC61937) ? " (IEC 61937)" : "");
+	DEBUG_VPRINT("audio", "ALSA channels: %u", inst->format.channels);
 	DEBUG_VPRINT("audio", "ALSA buffer size: %ld frames", (unsigned long) inst->buffer_size);
-	DEBUG_VPRINT("audio", "ALSA period size: %ld frames", (unsigned long) period);
-	DEBUG_VPRINT("audio", "ALSA period time: %ld usecs", period_usecs);
+	DEBUG_VPRINT("audio", "ALSA period size: %ld frames", (unsigned long) *period);
+	DEBUG_VPRINT("audio", "ALSA period time: %ld usecs", *period_usecs);
 	DEBUG_VPRINT("audio", "ALSA framerate: %u Hz", inst->framerate);
 	DEBUG_VPRINT("audio", "ALSA frame size: %" PRIi64 " bytes",
 		(int64_t) avbox_audiostream_frames2size(inst, 1));
@@ -693,8 +840,54 @@ avbox_audiostream_output(void *arg)
 			snd_strerror(ret));
 	}
 
-	/* drop superuser privileges */
-	(void) avbox_droproot();
+	return 0;
+err:
+	snd_pcm_close(inst->pcm_handle);
+	inst->pcm_handle = NULL;
+	return -1;
+}
+
+
+/**
+ * This is the main playback loop.
+ */
+static void*
+avbox_audiostream_output(void *arg)
+{
+	int ret, underrun = 1;
+	int64_t timeout;
+	size_t n_frames;
+	struct avbox_audiostream * const inst = (struct avbox_audiostream * const) arg;
+	struct avbox_audio_packet * packet;
+	unsigned int period_usecs = 10;
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_sframes_t avail;
+	snd_pcm_sframes_t frames;
+	snd_pcm_uframes_t period = 1024;
+
+	DEBUG_SET_THREAD_NAME("audio_output");
+	DEBUG_PRINT(LOG_MODULE, "Audio playback thread started");
+
+	ASSERT(inst != NULL);
+	ASSERT(inst->pcm_handle == NULL);
+	ASSERT(inst->quit == 0);
+	ASSERT(inst->paused == 0);
+
+	/* set the thread priority to realtime */
+#ifdef ENABLE_REALTIME
+	struct sched_param parms;
+	parms.sched_priority = sched_get_priority_max(SCHED_RR) - 21;
+	if (pthread_setschedparam(pthread_self(), SCHED_RR, &parms) != 0) {
+		LOG_PRINT_ERROR("Could not send main thread priority");
+	}
+#endif
+
+	snd_pcm_sw_params_alloca(&swparams);
+
+	/* open the PCM */
+	if (avbox_audiostream_pcm_open(inst, swparams, &period, &period_usecs) == -1) {
+		goto end;
+	}
 
 	/* signal that we've started successfully */
 	inst->running = 1;
@@ -710,7 +903,10 @@ avbox_audiostream_output(void *arg)
 		if (LIKELY(!underrun)) {
 
 			/* calculate how long until the stream dries out
-			 * and wait up to that long for new packets */
+			 * and wait up to that long for new packets. If nothing
+			 * has been written yet wait until we get a packet or
+			 * the queue is woken up. We never wait less than a period
+			 * so that we don't spin while the buffer drains */
 			pthread_mutex_lock(&inst->io_lock);
 			if (UNLIKELY((avail = snd_pcm_avail(inst->pcm_handle)) < 0)) {
 				pthread_mutex_unlock(&inst->io_lock);
@@ -718,8 +914,11 @@ avbox_audiostream_output(void *arg)
 					goto end;
 				}
 				continue;
+			} else if (inst->frames == 0) {
+				timeout = 0;
 			} else {
-				timeout = FRAMES2TIME(inst, inst->buffer_size - avail);
+				timeout = MAX(FRAMES2TIME(inst, inst->buffer_size - avail),
+					(int64_t) period_usecs);
 			}
 			pthread_mutex_unlock(&inst->io_lock);
 
@@ -735,15 +934,24 @@ avbox_audiostream_output(void *arg)
 						}
 					}
 					state = snd_pcm_state(inst->pcm_handle);
+
+					/* if we're paused sleep until we're resumed,
+					 * flushed or shutdown */
+					if (UNLIKELY(inst->paused && !inst->quit)) {
+						pthread_cond_wait(&inst->io_wake, &inst->io_lock);
+						pthread_mutex_unlock(&inst->io_lock);
+						continue;
+					}
 					pthread_mutex_unlock(&inst->io_lock);
 
+					/* if there's still audio on the buffer go back
+					 * to waiting for packets */
 					if (UNLIKELY(inst->frames == 0 || state == SND_PCM_STATE_RUNNING ||
 						state == SND_PCM_STATE_PAUSED ||
 						state == SND_PCM_STATE_SUSPENDED)) {
 						DEBUG_VPRINT(LOG_MODULE, "PCM state after timedpeek: %s. "
 							"Still waiting (timeout=%"PRIi64" frames=%"PRIi64")",
 							avbox_pcm_state_getstring(state), timeout, frames);
-						usleep(5LL * 1000LL);
 						continue;
 					}
 
@@ -793,6 +1001,46 @@ avbox_audiostream_output(void *arg)
 				inst->clock_start = packet->clock_set.value;
 				inst->clock_offset = 0;
 				inst->frames = ret = 0;
+				avbox_audiostream_updateclock(inst);
+				pthread_mutex_unlock(&inst->io_lock);
+				break;
+			}
+			case AVBOX_AUDIOSTREAM_FORMAT:
+			{
+				pthread_mutex_lock(&inst->io_lock);
+				if (packet->format.format == inst->format.format &&
+					packet->format.rate == inst->format.rate &&
+					packet->format.channels == inst->format.channels) {
+					pthread_mutex_unlock(&inst->io_lock);
+					break;
+				}
+
+				DEBUG_VPRINT(LOG_MODULE, "Changing format to %i (rate=%u channels=%u)",
+					packet->format.format, packet->format.rate,
+					packet->format.channels);
+
+				/* play what's left on the ring buffer and carry
+				 * the clock over to the new device */
+				avbox_audiostream_pcm_drain(inst);
+				inst->clock_start += FRAMES2TIME(inst, inst->frames);
+				inst->clock_offset = 0;
+				inst->frames = 0;
+
+				/* reopen the PCM with the new format */
+				snd_pcm_hw_free(inst->pcm_handle);
+				snd_pcm_close(inst->pcm_handle);
+				inst->pcm_handle = NULL;
+				inst->format = packet->format;
+				if (avbox_audiostream_pcm_open(inst, swparams, &period, &period_usecs) == -1) {
+					pthread_mutex_unlock(&inst->io_lock);
+					LOG_PRINT_ERROR("Could not reopen PCM!");
+					if (inst->callback != NULL) {
+						inst->callback(inst, AVBOX_AUDIOSTREAM_CRITICAL_ERROR,
+							NULL, inst->callback_context);
+					}
+					goto end;
+				}
+				avbox_audiostream_updateclock(inst);
 				pthread_mutex_unlock(&inst->io_lock);
 				break;
 			}
@@ -847,15 +1095,15 @@ avbox_audiostream_output(void *arg)
 			/* the packet changed. Mostlikely because the stream was
 			 * flushed while we waited for the PCM */
 			pthread_mutex_unlock(&inst->io_lock);
-			usleep(5LL * 1000LL);
 			continue;
 		}
 
 		/* write fragment to ring buffer */
 		if (UNLIKELY((frames = snd_pcm_writei(inst->pcm_handle, packet->data_packet.data, n_frames)) < 0)) {
 			if (NONBLOCK && (frames == -EAGAIN || frames == -EBUSY)) {
+				/* wait for room on the ring buffer */
 				pthread_mutex_unlock(&inst->io_lock);
-				usleep(10LL * 1000LL);
+				snd_pcm_wait(inst->pcm_handle, (period_usecs / 1000) + 1);
 				continue;
 			}
 
@@ -865,10 +1113,11 @@ avbox_audiostream_output(void *arg)
 			}
 		}
 
-		/* update frame counts */
+		/* update frame counts and publish the new clock */
 		inst->frames += frames;
 		packet->data_packet.data += avbox_audiostream_frames2size(inst, frames);
 		packet->data_packet.n_frames -= frames;
+		avbox_audiostream_updateclock(inst);
 
 		/* we got some samples in so be nice */
 		pthread_mutex_unlock(&inst->io_lock);
@@ -941,6 +1190,112 @@ avbox_audiostream_setclock(struct avbox_audiostream * const inst,
 }
 
 
+/**
+ * Picks the output format that best matches the wanted
+ * format given the capabilities of the device.
+ */
+int
+avbox_audiostream_negotiate(struct avbox_audiostream * const inst,
+	const struct avbox_audio_format * const want,
+	struct avbox_audio_format * const got)
+{
+	int i, j;
+
+	ASSERT(inst != NULL);
+	ASSERT(want != NULL);
+	ASSERT(got != NULL);
+
+	/* passthrough is only available if the user
+	 * has configured a device for it */
+	if (want->format == AVBOX_AUDIO_FORMAT_IEC61937) {
+		if (avbox_audiostream_getdevice(AVBOX_AUDIO_FORMAT_IEC61937) == NULL) {
+			errno = ENOTSUP;
+			return -1;
+		}
+		got->format = AVBOX_AUDIO_FORMAT_IEC61937;
+		got->rate = want->rate;
+		got->channels = 2;
+		return 0;
+	}
+
+	/* we only output the layouts that have the same
+	 * meaning on ALSA and ffmpeg, everything else gets
+	 * downmixed to stereo */
+	for (i = AVBOX_AUDIOSTREAM_PROBE_CHANNELS - 1; i > 0; i--) {
+		if (want->channels >= probe_channels[i] && inst->caps_rates[i] != 0) {
+			break;
+		}
+	}
+	got->channels = probe_channels[i];
+
+	/* use the native rate if the hardware can do
+	 * it with that many channels */
+	got->rate = 48000;
+	for (j = 0; j < AVBOX_AUDIOSTREAM_PROBE_RATES; j++) {
+		if (probe_rates[j] == want->rate && (inst->caps_rates[i] & (1 << j))) {
+			got->rate = want->rate;
+			break;
+		}
+	}
+
+	if (want->format == AVBOX_AUDIO_FORMAT_S32 && inst->caps_s32) {
+		got->format = AVBOX_AUDIO_FORMAT_S32;
+	} else {
+		got->format = AVBOX_AUDIO_FORMAT_S16;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Changes the format of the stream.
+ */
+int
+avbox_audiostream_setformat(struct avbox_audiostream * const inst,
+	const struct avbox_audio_format * const format)
+{
+	struct avbox_audio_packet *packet;
+
+	ASSERT(inst != NULL);
+	ASSERT(format != NULL);
+
+	pthread_mutex_lock(&inst->io_lock);
+
+	/* if the output thread has not been started and there's
+	 * nothing queued just change the format that it will use
+	 * to open the device */
+	if (!inst->started && avbox_queue_count(inst->packets) == 0) {
+		inst->format = *format;
+		inst->framesize = format->channels *
+			snd_pcm_format_physical_width(avbox_audiostream_pcmformat(format->format)) / 8;
+		inst->framerate = format->rate;
+		pthread_mutex_unlock(&inst->io_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&inst->io_lock);
+
+	/* otherwise queue the change so that it happens after
+	 * the frames already queued are played */
+	if ((packet = alloc_packet(inst)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+
+	packet->type = AVBOX_AUDIOSTREAM_FORMAT;
+	packet->format = *format;
+
+	if (avbox_queue_put(inst->packets, packet) == -1) {
+		LOG_VPRINT_ERROR("Could not add packet to queue: %s",
+			strerror(errno));
+		release_packet(inst, packet);
+		return -1;
+	}
+
+	return 0;
+}
+
+
 /**
  * Check if the stream is blocking another thread on write().
  */
@@ -1029,6 +1384,10 @@ avbox_audiostream_start(struct avbox_audiostream * const stream)
 		goto end;
 	}
 
+	/* set this before the thread starts so that format
+	 * changes get queued from now on */
+	stream->started = 1;
+
 	if (pthread_create(&stream->thread, NULL, avbox_audiostream_output, stream) != 0) {
 		LOG_PRINT_ERROR("Could not start IO thread");
 		abort();
@@ -1036,8 +1395,6 @@ avbox_audiostream_start(struct avbox_audiostream * const stream)
 
 	pthread_cond_wait(&stream->io_wake, &stream->io_lock);
 
-	stream->started = 1;
-
 	if (!stream->running) {
 		LOG_PRINT_ERROR("Audio thread initialization failed");
 		goto end;
@@ -1120,7 +1477,7 @@ avbox_audiostream_new(int max_frames,
 
 	/* initialize stream object */
 	memset(stream, 0, sizeof(struct avbox_audiostream));
-	stream->packets = avbox_queue_new(0);
+	stream->packets = avbox_queue_new(0, AVBOX_QUEUEFLAGS_NONE);
 	if (stream->packets == NULL) {
 		free(stream);
 		return NULL;
@@ -1142,8 +1499,15 @@ avbox_audiostream_new(int max_frames,
 	stream->queued_frames = 0;
 	stream->callback = callback;
 	stream->callback_context = callback_context;
-	stream->last_audio_time = -1;
+	stream->format.format = AVBOX_AUDIO_FORMAT_S16;
+	stream->format.rate = stream->framerate = 48000;
+	stream->format.channels = 2;
+	stream->framesize = 4;
 	LIST_INIT(&stream->packet_pool);
+
+	/* find out what formats the device can play */
+	avbox_audiostream_probe(stream);
+
 	return stream;
 }
 
@@ -9,6 +9,26 @@
 #define AVBOX_AUDIOSTREAM_PACKET_RELEASED	(3)
 
 
+/* output sample formats */
+#define AVBOX_AUDIO_FORMAT_S16			(0)
+#define AVBOX_AUDIO_FORMAT_S32			(1)
+#define AVBOX_AUDIO_FORMAT_IEC61937		(2)
+
+
+/**
+ * Describes the format of the samples written to
+ * an audio stream. Samples are always interleaved and
+ * multichannel frames use ALSA's channel order. IEC 61937
+ * bursts are written as 16-bit stereo frames.
+ */
+struct avbox_audio_format
+{
+	int format;
+	unsigned int rate;
+	unsigned int channels;
+};
+
+
 /**
  * Opaque stream structure
  */
@@ -37,6 +57,27 @@ avbox_audiostream_setclock(struct avbox_audiostream * const inst,
 	const int64_t time);
 
 
+/**
+ * Picks the output format that best matches the wanted
+ * format given the capabilities of the device. Returns 0
+ * on success or -1 if the wanted format cannot be used at
+ * all (ie. passthrough is not available).
+ */
+int
+avbox_audiostream_negotiate(struct avbox_audiostream * const inst,
+	const struct avbox_audio_format * const want,
+	struct avbox_audio_format * const got);
+
+
+/**
+ * Changes the format of the stream. The change takes
+ * effect after all the frames queued before it are played.
+ */
+int
+avbox_audiostream_setformat(struct avbox_audiostream * const inst,
+	const struct avbox_audio_format * const format);
+
+
 /**
  * Flush an audio stream.
  */
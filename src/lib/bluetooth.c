@@ -304,7 +304,7 @@ avbox_bluetooth_getdevices(const char * uuid)
 	}
 
 	/* create a queue to temporarily store the devices */
-	if ((queue = avbox_queue_new(0)) == NULL) {
+	if ((queue = avbox_queue_new(0, AVBOX_QUEUEFLAGS_NONE)) == NULL) {
 		LOG_VPRINT_ERROR("Could not create queue: %s",
 			strerror(errno));
 		return NULL;
@@ -40,6 +40,7 @@
 #include "dispatch.h"
 #include "compiler.h"
 #include "timers.h"
+#include "pool.h"
 
 
 #define AVBOX_MESSAGE_POOL_SIZE		(10)
@@ -48,10 +49,11 @@
 /**
  * Represents a dispatch queue.
  */
-LISTABLE_STRUCT(avbox_dispatch_queue,
+struct avbox_dispatch_queue
+{
 	pid_t tid;
 	struct avbox_queue *queue;
-);
+};
 
 
 /**
@@ -85,51 +87,33 @@ LISTABLE_STRUCT(avbox_dest_header,
 );
 
 
-static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
 static int initialized = 0;
-static LIST queues;
-
-static LIST message_pool;
-static pthread_mutex_t message_pool_lock;
-static int pools_primed = 0;
+static __thread struct avbox_dispatch_queue *thread_queue = NULL;
+static struct avbox_pool *message_pool = NULL;
 #if 0
 static LIST dest_pool;
 static pthread_mutex_t dest_pool_lock;;
 #endif
 
 
-static struct avbox_message *
+static void
+avbox_dispatch_initonce(void);
+
+
+static inline struct avbox_message *
 acquire_message()
 {
-	static int allocs = 0;
-	struct avbox_message *msg;
-	pthread_mutex_lock(&message_pool_lock);
-	msg = LIST_TAIL(struct avbox_message*, &message_pool);
-	if (UNLIKELY(msg == NULL)) {
-		if ((msg = malloc(sizeof(struct avbox_message))) == NULL) {
-			ASSERT(errno == ENOMEM);
-			pthread_mutex_unlock(&message_pool_lock);
-			return NULL;
-		}
-		allocs++;
-		if (pools_primed) {
-			LOG_VPRINT_INFO("Allocated message structure (total_allocs=%i)",
-				allocs);
-		}
-	} else {
-		LIST_REMOVE(msg);
-	}
-	pthread_mutex_unlock(&message_pool_lock);
-	return msg;
+	/* threads that don't own a queue may still send messages */
+	pthread_once(&init_once, avbox_dispatch_initonce);
+	return avbox_pool_acquire(message_pool);
 }
 
 
-static void
+static inline void
 release_message(struct avbox_message * const msg)
 {
-	pthread_mutex_lock(&message_pool_lock);
-	LIST_ADD(&message_pool, msg);
-	pthread_mutex_unlock(&message_pool_lock);
+	avbox_pool_release(message_pool, msg);
 }
 
 
@@ -166,28 +150,15 @@ release_dest_header(struct avbox_dest_header * const hdr)
 
 
 /**
- * Get the queue for a thread.
+ * Get the queue for the calling thread.
  */
-static struct avbox_dispatch_queue *
-avbox_dispatch_getqueue(const pid_t tid)
+static inline struct avbox_dispatch_queue *
+avbox_dispatch_thisqueue(void)
 {
-	pid_t _tid;
-	struct avbox_dispatch_queue *q = NULL, *queue;
-	if ((_tid = tid) == -1) {
-		_tid = getpid();
-	}
-	pthread_mutex_lock(&queue_lock);
-	LIST_FOREACH(struct avbox_dispatch_queue*, queue, &queues) {
-		if (queue->tid == _tid) {
-			q = queue;
-			break;
-		}
-	}
-	pthread_mutex_unlock(&queue_lock);
-	if (q == NULL) {
+	if (UNLIKELY(thread_queue == NULL)) {
 		errno = ENOENT;
 	}
-	return q;
+	return thread_queue;
 }
 
 
@@ -465,7 +436,7 @@ avbox_object_new(avbox_message_handler handler, void * const context)
 	struct avbox_dispatch_queue *q;
 	pthread_mutexattr_t lockattr;
 
-	if ((q = avbox_dispatch_getqueue(avbox_gettid())) == NULL) {
+	if ((q = avbox_dispatch_thisqueue()) == NULL) {
 		assert(errno == ENOENT);
 		return NULL;
 	}
@@ -513,6 +484,40 @@ avbox_object_destroy(struct avbox_object * const object)
 }
 
 
+/**
+ * Frees the message pool when the process exits. Messages
+ * may outlive every queue so it cannot be freed any sooner.
+ */
+static void
+avbox_dispatch_freepool(void)
+{
+	avbox_pool_destroy(message_pool);
+	message_pool = NULL;
+}
+
+
+/**
+ * Initializes the message pool. This runs only once
+ * for the whole process.
+ */
+static void
+avbox_dispatch_initonce(void)
+{
+	if ((message_pool = avbox_pool_new("message",
+		sizeof(struct avbox_message), NULL, NULL)) == NULL) {
+		ABORT("Could not create message pool");
+	}
+	if (avbox_pool_prime(message_pool, AVBOX_MESSAGE_POOL_SIZE) == -1) {
+		LOG_PRINT_ERROR("Could not prime message pool!");
+	}
+	if (atexit(avbox_dispatch_freepool) != 0) {
+		LOG_PRINT_ERROR("Could not register message pool destructor!");
+	}
+
+	initialized = 1;
+}
+
+
 /**
  * Initialized a dispatch queue for the current thread.
  */
@@ -524,24 +529,15 @@ avbox_dispatch_init()
 	void *pointers[AVBOX_STACK_TOUCH_BYTES];
 	struct avbox_dispatch_queue *q;
 
-	if (!initialized) {
-		pthread_mutexattr_t prio_inherit;
-		pthread_mutexattr_init(&prio_inherit);
-		pthread_mutexattr_setprotocol(&prio_inherit, PTHREAD_PRIO_INHERIT);
-		if (pthread_mutex_init(&message_pool_lock, &prio_inherit) != 0) {
-			ABORT("Could not initialize mutex");
-		}
-		pthread_mutexattr_destroy(&prio_inherit);
-
-		LIST_INIT(&queues);
-		LIST_INIT(&message_pool);
-		initialized = 1;
-	}
+	pthread_once(&init_once, avbox_dispatch_initonce);
 
 
-	/* if a queue for this thread already exists then
-	 * abort() */
-	if (avbox_dispatch_getqueue(avbox_gettid()) != NULL) {
+	/* Each thread finds it's own queue through thread_queue
+	 * and objects keep a pointer to the queue of the thread
+	 * that created them, so nothing ever needs to look up
+	 * another thread's queue and there's no global table
+	 * (or lock) to keep them in */
+	if (thread_queue != NULL) {
 		LOG_PRINT_ERROR("Queue for this thread already created!");
 		errno = EALREADY;
 		return NULL;
@@ -552,7 +548,7 @@ avbox_dispatch_init()
 		assert(errno == ENOMEM);
 		return NULL;
 	}
-	if ((q->queue = avbox_queue_new(10)) == NULL) {
+	if ((q->queue = avbox_queue_new(10, AVBOX_QUEUEFLAGS_NONE)) == NULL) {
 		assert(errno == ENOMEM || errno == EPERM);
 		free(q);
 		return NULL;
@@ -565,17 +561,18 @@ avbox_dispatch_init()
 	avbox_queue_setname(q->queue, qname);
 	avbox_queue_setsize(q->queue, 0);
 
-	pthread_mutex_lock(&queue_lock);
-	LIST_ADD(&queues, q);
-	pthread_mutex_unlock(&queue_lock);
+	thread_queue = q;
 
-	/* touch the stack and prime the message pool */
+	/* touch the stack and fill this thread's
+	 * message magazine */
 	memset(pointers, 0, sizeof(pointers));
 	for (i = 0; i < AVBOX_MESSAGE_POOL_SIZE; i++) {
 		pointers[i] = acquire_message();
 	}
 	for (i = 0; i < AVBOX_MESSAGE_POOL_SIZE; i++) {
-		release_message(pointers[i]);
+		if (pointers[i] != NULL) {
+			release_message(pointers[i]);
+		}
 	}
 
 	return q->queue;
@@ -590,7 +587,7 @@ avbox_dispatch_close(void)
 {
 	struct avbox_dispatch_queue *q;
 	/* get the thread's queue */
-	if ((q = avbox_dispatch_getqueue(avbox_gettid())) == NULL) {
+	if ((q = avbox_dispatch_thisqueue()) == NULL) {
 		LOG_PRINT_ERROR("Queue not initialized!");
 		abort();
 	}
@@ -615,7 +612,7 @@ avbox_dispatch_shutdown(void)
 #endif
 
 	/* get the thread's queue */
-	if ((q = avbox_dispatch_getqueue(avbox_gettid())) == NULL) {
+	if ((q = avbox_dispatch_thisqueue()) == NULL) {
 		LOG_PRINT_ERROR("Queue not initialized!");
 		abort();
 	}
@@ -631,16 +628,8 @@ avbox_dispatch_shutdown(void)
 	}
 	avbox_queue_destroy(q->queue);
 
-	/* remove queue from list and free it */
-	pthread_mutex_lock(&queue_lock);
-	LIST_REMOVE(q);
-	pthread_mutex_unlock(&queue_lock);
+	thread_queue = NULL;
 	free(q);
-
-	LIST_FOREACH_SAFE(struct avbox_message*, msg, &message_pool, {
-		LIST_REMOVE(msg);
-		free(msg);
-	});
 }
 
 
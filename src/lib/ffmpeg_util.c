@@ -26,12 +26,113 @@
 #	include <dvdnav/dvdnav.h>
 #endif
 
+#include <unistd.h>
+
 #define LOG_MODULE "ffmpegutil"
 
 #include "log.h"
 #include "debug.h"
+#include "settings.h"
 #include "ffmpeg_util.h"
 
+
+/* maximum number of decoder threads. This is the same limit
+ * that libavcodec uses when auto-detecting */
+#define AVBOX_DECODER_MAX_THREADS	(16)
+
+
+/* values for the decoder_skip_loop_filter setting */
+#define AVBOX_SKIP_LOOP_FILTER_AUTO	(-1)
+#define AVBOX_SKIP_LOOP_FILTER_NONE	(0)
+#define AVBOX_SKIP_LOOP_FILTER_NONREF	(1)
+#define AVBOX_SKIP_LOOP_FILTER_ALL	(2)
+
+
+/**
+ * Gets the number of decoder threads to use. The
+ * decoder_threads setting overrides the number of
+ * online cores when it's set.
+ */
+static int
+avbox_ffmpegutil_decoderthreads(void)
+{
+	int n_threads = avbox_settings_getint("decoder_threads", 0);
+	if (n_threads <= 0) {
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (n_threads < 1) {
+		n_threads = 1;
+	} else if (n_threads > AVBOX_DECODER_MAX_THREADS) {
+		n_threads = AVBOX_DECODER_MAX_THREADS;
+	}
+	return n_threads;
+}
+
+
+/**
+ * Configures the decoder context before it is opened.
+ */
+static void
+avbox_ffmpegutil_configdecoder(AVCodecContext * const dec_ctx,
+	const AVCodec * const dec, AVDictionary ** const opts)
+{
+	int skip_loop_filter;
+	const int n_threads = avbox_ffmpegutil_decoderthreads();
+
+	/* motion vectors are only useful for debugging
+	 * (ie. with the codecview filter) */
+	if (avbox_settings_getint("decoder_export_mvs", 0)) {
+		DEBUG_PRINT(LOG_MODULE, "Exporting motion vectors");
+		av_dict_set(opts, "flags2", "+export_mvs", 0);
+	}
+
+	if (dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO) {
+		return;
+	}
+
+	/* use frame and slice threading when the decoder supports
+	 * it. Either one can be disabled from the settings database */
+	dec_ctx->thread_count = n_threads;
+	dec_ctx->thread_type = 0;
+	if ((dec->capabilities & AV_CODEC_CAP_FRAME_THREADS) &&
+		avbox_settings_getint("decoder_frame_threads", 1)) {
+		dec_ctx->thread_type |= FF_THREAD_FRAME;
+	}
+	if ((dec->capabilities & AV_CODEC_CAP_SLICE_THREADS) &&
+		avbox_settings_getint("decoder_slice_threads", 1)) {
+		dec_ctx->thread_type |= FF_THREAD_SLICE;
+	}
+	if (dec_ctx->thread_type == 0) {
+		dec_ctx->thread_count = 1;
+	}
+
+	/* skipping the loop filter on non-reference frames is almost
+	 * free visually and saves a lot of work for H.264 and HEVC. By
+	 * default we only start with it on when we have less than two
+	 * cores for every 1080p worth of pixels. Either way the player
+	 * turns it on at runtime when the renderer falls behind */
+	skip_loop_filter = avbox_settings_getint("decoder_skip_loop_filter",
+		AVBOX_SKIP_LOOP_FILTER_AUTO);
+	if (skip_loop_filter == AVBOX_SKIP_LOOP_FILTER_AUTO) {
+		skip_loop_filter = AVBOX_SKIP_LOOP_FILTER_NONE;
+		if ((dec->id == AV_CODEC_ID_H264 || dec->id == AV_CODEC_ID_HEVC) &&
+			(dec_ctx->width * dec_ctx->height * 2) > (1920 * 1088 * dec_ctx->thread_count)) {
+			skip_loop_filter = AVBOX_SKIP_LOOP_FILTER_NONREF;
+		}
+	}
+	switch (skip_loop_filter) {
+	case AVBOX_SKIP_LOOP_FILTER_NONREF: dec_ctx->skip_loop_filter = AVDISCARD_NONREF; break;
+	case AVBOX_SKIP_LOOP_FILTER_ALL: dec_ctx->skip_loop_filter = AVDISCARD_ALL; break;
+	default: dec_ctx->skip_loop_filter = AVDISCARD_DEFAULT; break;
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Decoder '%s': threads=%d frame_threads=%d slice_threads=%d skip_loop_filter=%d",
+		dec->name, dec_ctx->thread_count,
+		!!(dec_ctx->thread_type & FF_THREAD_FRAME),
+		!!(dec_ctx->thread_type & FF_THREAD_SLICE),
+		skip_loop_filter);
+}
+
 /**
  * Initialize ffmpeg's filter graph
  */
@@ -146,7 +247,10 @@ avbox_ffmpegutil_initaudiofilters(
 	int sample_rate,
 	AVRational time_base,
 	uint64_t channel_layout,
-	const char *sample_fmt_name)
+	const char *sample_fmt_name,
+	int out_sample_rate,
+	uint64_t out_channel_layout,
+	enum AVSampleFormat out_sample_fmt)
 {
 	char args[512];
 	int ret = 0;
@@ -154,9 +258,9 @@ avbox_ffmpegutil_initaudiofilters(
 	AVFilter *abuffersink = avfilter_get_by_name("abuffersink");
 	AVFilterInOut *outputs = avfilter_inout_alloc();
 	AVFilterInOut *inputs  = avfilter_inout_alloc();
-	static const enum AVSampleFormat out_sample_fmts[] = { AV_SAMPLE_FMT_S16, -1 };
-	static const int64_t out_channel_layouts[] = { AV_CH_LAYOUT_STEREO, -1 };
-	static const int out_sample_rates[] = { 48000, -1 };
+	const enum AVSampleFormat out_sample_fmts[] = { out_sample_fmt, -1 };
+	const int64_t out_channel_layouts[] = { out_channel_layout, -1 };
+	const int out_sample_rates[] = { out_sample_rate, -1 };
 	const AVFilterLink *outlink;
 
 	DEBUG_PRINT("player", "Initializing audio filters");
@@ -315,8 +419,10 @@ avbox_ffmpegutil_opencodeccontext(int *stream_idx,
 	}
 
 	/* Init the video decoder */
-	av_dict_set(&opts, "flags2", "+export_mvs", 0);
-	if ((ret = avcodec_open2(dec_ctx, dec, &opts)) < 0) {
+	avbox_ffmpegutil_configdecoder(dec_ctx, dec, &opts);
+	ret = avcodec_open2(dec_ctx, dec, &opts);
+	av_dict_free(&opts);
+	if (ret < 0) {
 		LOG_VPRINT_ERROR("Failed to open '%s' codec!",
 			av_get_media_type_string(type));
 		return NULL;
@@ -324,3 +430,99 @@ avbox_ffmpegutil_opencodeccontext(int *stream_idx,
 
 	return dec_ctx;
 }
+
+
+/**
+ * Opens an IEC 61937 muxer for an AC-3 or DTS stream. The
+ * muxer writes to a dynamic buffer that gets reopened for
+ * every packet.
+ */
+INTERNAL AVFormatContext *
+avbox_ffmpegutil_openspdif(const AVStream * const in)
+{
+	int ret;
+	uint8_t *buf;
+	AVStream *st;
+	AVFormatContext *ctx = NULL;
+
+	if (avformat_alloc_output_context2(&ctx, NULL, "spdif", NULL) < 0) {
+		LOG_PRINT_ERROR("Could not allocate spdif muxer!");
+		return NULL;
+	}
+	if ((st = avformat_new_stream(ctx, NULL)) == NULL) {
+		LOG_PRINT_ERROR("Could not create spdif stream!");
+		goto err;
+	}
+	if (avcodec_parameters_copy(st->codecpar, in->codecpar) < 0) {
+		LOG_PRINT_ERROR("Could not copy codec parameters!");
+		goto err;
+	}
+	st->time_base = in->time_base;
+
+	if (avio_open_dyn_buf(&ctx->pb) < 0) {
+		goto err;
+	}
+	ret = avformat_write_header(ctx, NULL);
+	avio_close_dyn_buf(ctx->pb, &buf);
+	av_free(buf);
+	ctx->pb = NULL;
+	if (ret < 0) {
+		LOG_PRINT_ERROR("Could not initialize spdif muxer!");
+		goto err;
+	}
+
+	return ctx;
+err:
+	avformat_free_context(ctx);
+	return NULL;
+}
+
+
+/**
+ * Wraps a packet on an IEC 61937 burst. Returns the size of the
+ * burst (which may be 0 if the muxer needs more packets) or a
+ * negative error code. The burst must be freed with av_free().
+ */
+INTERNAL int
+avbox_ffmpegutil_spdifwrite(AVFormatContext * const ctx,
+	const AVPacket * const pkt, uint8_t ** const buf)
+{
+	int ret, len;
+	AVPacket burst;
+
+	av_init_packet(&burst);
+	burst.data = pkt->data;
+	burst.size = pkt->size;
+	burst.stream_index = 0;
+
+	*buf = NULL;
+	if ((ret = avio_open_dyn_buf(&ctx->pb)) < 0) {
+		return ret;
+	}
+	ret = av_write_frame(ctx, &burst);
+	len = avio_close_dyn_buf(ctx->pb, buf);
+	ctx->pb = NULL;
+	if (ret < 0) {
+		av_free(*buf);
+		*buf = NULL;
+		return ret;
+	}
+	return len;
+}
+
+
+/**
+ * Closes the IEC 61937 muxer.
+ */
+INTERNAL void
+avbox_ffmpegutil_closespdif(AVFormatContext * const ctx)
+{
+	uint8_t *buf;
+	if (avio_open_dyn_buf(&ctx->pb) == 0) {
+		av_write_trailer(ctx);
+		avio_close_dyn_buf(ctx->pb, &buf);
+		av_free(buf);
+		ctx->pb = NULL;
+	}
+	avformat_free_context(ctx);
+}
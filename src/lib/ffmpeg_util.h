@@ -92,11 +92,38 @@ avbox_ffmpegutil_initaudiofilters(
 	int sample_rate,
 	AVRational time_base,
 	uint64_t channel_layout,
-	const char *sample_fmt_name);
+	const char *sample_fmt_name,
+	int out_sample_rate,
+	uint64_t out_channel_layout,
+	enum AVSampleFormat out_sample_fmt);
 
 
 AVCodecContext *
 avbox_ffmpegutil_opencodeccontext(int *stream_idx,
 	AVFormatContext *fmt_ctx, enum AVMediaType type);
 
+
+/**
+ * Opens an IEC 61937 muxer for an AC-3 or DTS stream.
+ */
+AVFormatContext *
+avbox_ffmpegutil_openspdif(const AVStream * const in);
+
+
+/**
+ * Wraps a packet on an IEC 61937 burst. Returns the size of the
+ * burst (which may be 0 if the muxer needs more packets) or a
+ * negative error code. The burst must be freed with av_free().
+ */
+int
+avbox_ffmpegutil_spdifwrite(AVFormatContext * const ctx,
+	const AVPacket * const pkt, uint8_t ** const buf);
+
+
+/**
+ * Closes the IEC 61937 muxer.
+ */
+void
+avbox_ffmpegutil_closespdif(AVFormatContext * const ctx);
+
 #endif
@@ -0,0 +1,420 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#	include "../config.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define LOG_MODULE "pool"
+
+#include "log.h"
+#include "debug.h"
+#include "compiler.h"
+#include "linkedlist.h"
+#include "pool.h"
+
+
+/*
+ * Each thread keeps a magazine (a small stack of free objects) for
+ * every pool that it uses so most acquire/release operations don't
+ * need to take any locks. When a magazine runs empty it's refilled
+ * with half a magazine from the shared depot, and when it becomes full
+ * half of it is spilled back to the depot.
+ */
+#define AVBOX_POOL_MAGAZINE_SIZE	(16)
+#define AVBOX_POOL_DEPOT_SIZE		(32)
+
+
+/**
+ * Per-thread magazine.
+ */
+LISTABLE_STRUCT(avbox_pool_magazine,
+	struct avbox_pool *pool;
+	size_t rounds;
+	void *objs[AVBOX_POOL_MAGAZINE_SIZE];
+);
+
+
+/**
+ * Object pool.
+ */
+struct avbox_pool
+{
+	pthread_mutex_t lock;
+	pthread_key_t key;
+	char *name;
+	size_t objsz;
+	avbox_pool_init_fn init;
+	avbox_pool_fini_fn fini;
+	void **depot;
+	size_t depot_len;
+	size_t depot_cap;
+	LIST magazines;
+	int primed;
+
+#ifdef DEBUG_MEMORY_POOLS
+	unsigned int allocs;
+	unsigned int acquires;
+	unsigned int refills;
+	unsigned int spills;
+	int in_use;
+#endif
+};
+
+
+/**
+ * Allocates a new object.
+ */
+static void *
+avbox_pool_alloc(struct avbox_pool * const inst)
+{
+	void *obj;
+	if ((obj = malloc(inst->objsz)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return NULL;
+	}
+	if (inst->init != NULL && inst->init(obj) == -1) {
+		free(obj);
+		errno = ENOMEM;
+		return NULL;
+	}
+#ifdef DEBUG_MEMORY_POOLS
+	ATOMIC_INC(&inst->allocs);
+	if (inst->primed) {
+		LOG_VPRINT_INFO("Allocated %s object (total_allocs=%u)",
+			inst->name, inst->allocs);
+	}
+#endif
+	return obj;
+}
+
+
+/**
+ * Frees an object.
+ */
+static void
+avbox_pool_free(struct avbox_pool * const inst, void * const obj)
+{
+	if (inst->fini != NULL) {
+		inst->fini(obj);
+	}
+	free(obj);
+}
+
+
+/**
+ * Pushes an object to the depot. If we cannot grow
+ * the depot the object is freed. Must be called with
+ * the pool locked.
+ */
+static void
+avbox_pool_depot_push(struct avbox_pool * const inst, void * const obj)
+{
+	if (UNLIKELY(inst->depot_len == inst->depot_cap)) {
+		const size_t cap = (inst->depot_cap == 0) ?
+			AVBOX_POOL_DEPOT_SIZE : inst->depot_cap * 2;
+		void ** const depot = realloc(inst->depot, sizeof(void*) * cap);
+		if (depot == NULL) {
+			LOG_VPRINT_ERROR("Could not grow '%s' depot. Freeing object.",
+				inst->name);
+			avbox_pool_free(inst, obj);
+			return;
+		}
+		inst->depot = depot;
+		inst->depot_cap = cap;
+	}
+	inst->depot[inst->depot_len++] = obj;
+}
+
+
+/**
+ * Called when a thread exits to return the contents
+ * of it's magazine to the depot.
+ */
+static void
+avbox_pool_magazine_destructor(void *arg)
+{
+	struct avbox_pool_magazine * const mag = arg;
+	struct avbox_pool * const inst = mag->pool;
+
+	pthread_mutex_lock(&inst->lock);
+	while (mag->rounds > 0) {
+		avbox_pool_depot_push(inst, mag->objs[--mag->rounds]);
+	}
+	LIST_REMOVE(mag);
+	pthread_mutex_unlock(&inst->lock);
+	free(mag);
+}
+
+
+/**
+ * Gets the calling thread's magazine.
+ */
+static inline struct avbox_pool_magazine *
+avbox_pool_getmagazine(struct avbox_pool * const inst)
+{
+	struct avbox_pool_magazine *mag;
+	if (LIKELY((mag = pthread_getspecific(inst->key)) != NULL)) {
+		return mag;
+	}
+
+	if ((mag = malloc(sizeof(struct avbox_pool_magazine))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return NULL;
+	}
+	mag->pool = inst;
+	mag->rounds = 0;
+
+	if (pthread_setspecific(inst->key, mag) != 0) {
+		free(mag);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&inst->lock);
+	LIST_ADD(&inst->magazines, mag);
+	pthread_mutex_unlock(&inst->lock);
+
+	return mag;
+}
+
+
+/**
+ * Gets an object from the pool. If the pool is empty
+ * a new object is allocated.
+ */
+INTERNAL void *
+avbox_pool_acquire(struct avbox_pool * const inst)
+{
+	void *obj = NULL;
+	struct avbox_pool_magazine * const mag = avbox_pool_getmagazine(inst);
+
+	if (LIKELY(mag != NULL && mag->rounds > 0)) {
+		obj = mag->objs[--mag->rounds];
+	} else {
+		/* refill the magazine from the depot */
+		pthread_mutex_lock(&inst->lock);
+		if (mag != NULL) {
+			while (inst->depot_len > 0 && mag->rounds < (AVBOX_POOL_MAGAZINE_SIZE / 2)) {
+				mag->objs[mag->rounds++] = inst->depot[--inst->depot_len];
+			}
+			if (mag->rounds > 0) {
+				obj = mag->objs[--mag->rounds];
+			}
+#ifdef DEBUG_MEMORY_POOLS
+			inst->refills++;
+#endif
+		} else if (inst->depot_len > 0) {
+			obj = inst->depot[--inst->depot_len];
+		}
+		pthread_mutex_unlock(&inst->lock);
+
+		/* if the depot is empty allocate a new object */
+		if (obj == NULL && (obj = avbox_pool_alloc(inst)) == NULL) {
+			return NULL;
+		}
+	}
+
+#ifdef DEBUG_MEMORY_POOLS
+	ATOMIC_INC(&inst->acquires);
+	ATOMIC_INC(&inst->in_use);
+#endif
+	return obj;
+}
+
+
+/**
+ * Returns an object to the pool.
+ */
+INTERNAL void
+avbox_pool_release(struct avbox_pool * const inst, void * const obj)
+{
+	struct avbox_pool_magazine * const mag = avbox_pool_getmagazine(inst);
+
+	ASSERT(obj != NULL);
+
+#ifdef DEBUG_MEMORY_POOLS
+	ATOMIC_DEC(&inst->in_use);
+#endif
+
+	if (UNLIKELY(mag == NULL)) {
+		pthread_mutex_lock(&inst->lock);
+		avbox_pool_depot_push(inst, obj);
+		pthread_mutex_unlock(&inst->lock);
+		return;
+	}
+
+	/* if the magazine is full spill half of
+	 * it to the depot */
+	if (UNLIKELY(mag->rounds == AVBOX_POOL_MAGAZINE_SIZE)) {
+		pthread_mutex_lock(&inst->lock);
+		while (mag->rounds > (AVBOX_POOL_MAGAZINE_SIZE / 2)) {
+			avbox_pool_depot_push(inst, mag->objs[--mag->rounds]);
+		}
+#ifdef DEBUG_MEMORY_POOLS
+		inst->spills++;
+#endif
+		pthread_mutex_unlock(&inst->lock);
+	}
+
+	mag->objs[mag->rounds++] = obj;
+}
+
+
+/**
+ * Preallocates objects. Once the pool is primed every new
+ * allocation gets logged when DEBUG_MEMORY_POOLS is defined.
+ */
+INTERNAL int
+avbox_pool_prime(struct avbox_pool * const inst, const size_t count)
+{
+	size_t i;
+	void *obj;
+
+	for (i = 0; i < count; i++) {
+		if ((obj = avbox_pool_alloc(inst)) == NULL) {
+			return -1;
+		}
+		pthread_mutex_lock(&inst->lock);
+		avbox_pool_depot_push(inst, obj);
+		pthread_mutex_unlock(&inst->lock);
+	}
+
+	inst->primed = 1;
+	return 0;
+}
+
+
+/**
+ * Prints the pool statistics to the log. This is a no-op
+ * unless DEBUG_MEMORY_POOLS is defined.
+ */
+INTERNAL void
+avbox_pool_dumpstats(struct avbox_pool * const inst)
+{
+#ifdef DEBUG_MEMORY_POOLS
+	LOG_VPRINT_INFO("Pool '%s': allocs=%u acquires=%u refills=%u spills=%u in_use=%i",
+		inst->name, inst->allocs, inst->acquires, inst->refills,
+		inst->spills, inst->in_use);
+#else
+	(void) inst;
+#endif
+}
+
+
+/**
+ * Creates a new pool.
+ */
+INTERNAL struct avbox_pool *
+avbox_pool_new(const char * const name, const size_t objsz,
+	avbox_pool_init_fn init, avbox_pool_fini_fn fini)
+{
+	int res;
+	struct avbox_pool *inst;
+	pthread_mutexattr_t prio_inherit;
+
+	ASSERT(name != NULL);
+	ASSERT(objsz > 0);
+
+	if ((inst = malloc(sizeof(struct avbox_pool))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return NULL;
+	}
+
+	memset(inst, 0, sizeof(struct avbox_pool));
+	LIST_INIT(&inst->magazines);
+	inst->objsz = objsz;
+	inst->init = init;
+	inst->fini = fini;
+
+	if ((inst->name = strdup(name)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		free(inst);
+		return NULL;
+	}
+
+	if ((res = pthread_key_create(&inst->key, avbox_pool_magazine_destructor)) != 0) {
+		LOG_VPRINT_ERROR("Could not create pool key: %s",
+			strerror(res));
+		free(inst->name);
+		free(inst);
+		errno = res;
+		return NULL;
+	}
+
+	pthread_mutexattr_init(&prio_inherit);
+	pthread_mutexattr_setprotocol(&prio_inherit, PTHREAD_PRIO_INHERIT);
+	if ((res = pthread_mutex_init(&inst->lock, &prio_inherit)) != 0) {
+		LOG_VPRINT_ERROR("Could not initialize pool mutex: %s",
+			strerror(res));
+		pthread_mutexattr_destroy(&prio_inherit);
+		pthread_key_delete(inst->key);
+		free(inst->name);
+		free(inst);
+		errno = res;
+		return NULL;
+	}
+	pthread_mutexattr_destroy(&prio_inherit);
+
+	return inst;
+}
+
+
+/**
+ * Destroys the pool and frees all the objects that have
+ * been returned to it.
+ */
+INTERNAL void
+avbox_pool_destroy(struct avbox_pool * const inst)
+{
+	struct avbox_pool_magazine *mag;
+
+	ASSERT(inst != NULL);
+
+	/* deleting the key first makes sure that the
+	 * destructor won't run for any thread that exits
+	 * after this point */
+	pthread_key_delete(inst->key);
+
+	avbox_pool_dumpstats(inst);
+
+	pthread_mutex_lock(&inst->lock);
+	LIST_FOREACH_SAFE(struct avbox_pool_magazine*, mag, &inst->magazines, {
+		LIST_REMOVE(mag);
+		while (mag->rounds > 0) {
+			avbox_pool_free(inst, mag->objs[--mag->rounds]);
+		}
+		free(mag);
+	});
+	while (inst->depot_len > 0) {
+		avbox_pool_free(inst, inst->depot[--inst->depot_len]);
+	}
+	pthread_mutex_unlock(&inst->lock);
+
+	pthread_mutex_destroy(&inst->lock);
+	if (inst->depot != NULL) {
+		free(inst->depot);
+	}
+	free(inst->name);
+	free(inst);
+}
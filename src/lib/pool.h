@@ -0,0 +1,97 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __AVBOX_POOL_H__
+#define __AVBOX_POOL_H__
+
+#include <stddef.h>
+
+
+/**
+ * Represents a pool of fixed size objects.
+ */
+struct avbox_pool;
+
+
+/**
+ * Called when a new object is allocated by the pool.
+ * Returns 0 on success or -1 on failure.
+ */
+typedef int (*avbox_pool_init_fn)(void * const obj);
+
+
+/**
+ * Called when an object is freed by the pool.
+ */
+typedef void (*avbox_pool_fini_fn)(void * const obj);
+
+
+/**
+ * Gets an object from the pool. If the pool is empty
+ * a new object is allocated.
+ */
+void *
+avbox_pool_acquire(struct avbox_pool * const inst);
+
+
+/**
+ * Returns an object to the pool.
+ */
+void
+avbox_pool_release(struct avbox_pool * const inst, void * const obj);
+
+
+/**
+ * Preallocates objects. Once the pool is primed every new
+ * allocation gets logged when DEBUG_MEMORY_POOLS is defined.
+ */
+int
+avbox_pool_prime(struct avbox_pool * const inst, const size_t count);
+
+
+/**
+ * Prints the pool statistics to the log. This is a no-op
+ * unless DEBUG_MEMORY_POOLS is defined.
+ */
+void
+avbox_pool_dumpstats(struct avbox_pool * const inst);
+
+
+/**
+ * Creates a new pool.
+ *
+ * \param name The name of the pool as displayed on the log.
+ * \param objsz The size of the objects.
+ * \param init Function called when an object is allocated (may be NULL).
+ * \param fini Function called when an object is freed (may be NULL).
+ */
+struct avbox_pool *
+avbox_pool_new(const char * const name, const size_t objsz,
+	avbox_pool_init_fn init, avbox_pool_fini_fn fini);
+
+
+/**
+ * Destroys the pool and frees all the objects that have
+ * been returned to it.
+ */
+void
+avbox_pool_destroy(struct avbox_pool * const inst);
+
+#endif
@@ -33,6 +33,10 @@
 #include "debug.h"
 #include "linkedlist.h"
 #include "time_util.h"
+#include "queue.h"
+
+
+#define CACHELINE_SIZE	(64)
 
 
 /**
@@ -44,6 +48,7 @@ struct avbox_queue
 	pthread_mutex_t pool_lock;
 	pthread_cond_t cond;
 	int closed;
+	int notified;
 	int nodes_alloc;
 	size_t cnt;
 	size_t sz;
@@ -51,6 +56,14 @@ struct avbox_queue
 	LIST items;
 	LIST nodes_pool;
 	char *name;
+	unsigned int flags;
+
+	/* SPSC ring buffer. The head index is only written
+	 * by the consumer and the tail index only by the producer */
+	void **ring;
+	size_t ring_mask;
+	size_t head __attribute__((aligned(CACHELINE_SIZE)));
+	size_t tail __attribute__((aligned(CACHELINE_SIZE)));
 };
 
 
@@ -96,6 +109,168 @@ release_node(struct avbox_queue * const inst, struct avbox_queue_node * const no
 }
 
 
+/**
+ * Gets the number of items on an SPSC queue.
+ */
+static inline size_t
+spsc_count(struct avbox_queue * const inst)
+{
+	const size_t head = __atomic_load_n(&inst->head, __ATOMIC_ACQUIRE);
+	const size_t tail = __atomic_load_n(&inst->tail, __ATOMIC_ACQUIRE);
+	return tail - head;
+}
+
+
+/**
+ * Gets the effective capacity of an SPSC queue.
+ */
+static inline size_t
+spsc_limit(struct avbox_queue * const inst)
+{
+	const size_t sz = inst->sz;
+	return (sz > 0 && sz <= inst->ring_mask) ? sz : inst->ring_mask + 1;
+}
+
+
+/**
+ * Wakes the other end of an SPSC queue if it's sleeping. The
+ * full barrier pairs with the one on spsc_sleep() so that either
+ * we see the waiter or the waiter sees our update.
+ */
+static inline void
+spsc_signal(struct avbox_queue * const inst)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (UNLIKELY(__atomic_load_n(&inst->waiters, __ATOMIC_RELAXED) > 0)) {
+		pthread_mutex_lock(&inst->lock);
+		pthread_cond_broadcast(&inst->cond);
+		pthread_mutex_unlock(&inst->lock);
+	}
+}
+
+
+static int
+spsc_isempty(struct avbox_queue * const inst);
+
+
+/**
+ * Sleep on an SPSC queue until the other end signals us. The
+ * condition is checked again after registering as a waiter so
+ * that we never miss a wakeup.
+ */
+static void
+spsc_sleep(struct avbox_queue * const inst,
+	int (*cond)(struct avbox_queue * const inst), const int64_t timeout)
+{
+	/* only the consumer side gets notifications */
+	const int consumer = (cond == spsc_isempty);
+
+	pthread_mutex_lock(&inst->lock);
+	__atomic_add_fetch(&inst->waiters, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (cond(inst) && !inst->closed && !(consumer && inst->notified)) {
+		if (timeout == 0) {
+			pthread_cond_wait(&inst->cond, &inst->lock);
+		} else {
+			struct timespec tv;
+			tv.tv_sec = 0;
+			tv.tv_nsec = timeout * 1000L;
+			delay2abstime(&tv);
+			pthread_cond_timedwait(&inst->cond, &inst->lock, &tv);
+		}
+	}
+	if (consumer) {
+		inst->notified = 0;
+	}
+	__atomic_sub_fetch(&inst->waiters, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&inst->lock);
+}
+
+
+static int
+spsc_isempty(struct avbox_queue * const inst)
+{
+	return spsc_count(inst) == 0;
+}
+
+
+static int
+spsc_isfull(struct avbox_queue * const inst)
+{
+	return spsc_count(inst) >= spsc_limit(inst);
+}
+
+
+/**
+ * Gets the next item on an SPSC queue without dequeueing it.
+ */
+static void *
+spsc_peek(struct avbox_queue * const inst, const int block, const int64_t timeout)
+{
+	const size_t head = inst->head;
+
+	if (UNLIKELY(head == __atomic_load_n(&inst->tail, __ATOMIC_ACQUIRE))) {
+		if (inst->closed) {
+			errno = ESHUTDOWN;
+			return NULL;
+		}
+		if (!block) {
+			errno = EAGAIN;
+			return NULL;
+		}
+		spsc_sleep(inst, spsc_isempty, timeout);
+		if (UNLIKELY(head == __atomic_load_n(&inst->tail, __ATOMIC_ACQUIRE))) {
+			errno = EAGAIN;
+			return NULL;
+		}
+	}
+
+	return inst->ring[head & inst->ring_mask];
+}
+
+
+/**
+ * Dequeues the next item on an SPSC queue.
+ */
+static void *
+spsc_get(struct avbox_queue * const inst)
+{
+	void * const ret = spsc_peek(inst, 1, 0);
+	if (LIKELY(ret != NULL)) {
+		__atomic_store_n(&inst->head, inst->head + 1, __ATOMIC_RELEASE);
+		spsc_signal(inst);
+	}
+	return ret;
+}
+
+
+/**
+ * Puts an item on an SPSC queue.
+ */
+static int
+spsc_put(struct avbox_queue * const inst, void * const item)
+{
+	const size_t tail = inst->tail;
+
+	if (UNLIKELY(spsc_isfull(inst))) {
+		if (inst->closed) {
+			errno = ESHUTDOWN;
+			return -1;
+		}
+		spsc_sleep(inst, spsc_isfull, 0);
+		if (spsc_isfull(inst)) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	inst->ring[tail & inst->ring_mask] = item;
+	__atomic_store_n(&inst->tail, tail + 1, __ATOMIC_RELEASE);
+	spsc_signal(inst);
+	return 0;
+}
+
+
 /**
  * Wake all threads waiting on queue.
  */
@@ -108,6 +283,22 @@ avbox_queue_wake(struct avbox_queue * inst)
 }
 
 
+/**
+ * Wakes the thread waiting for items on the queue. Unlike
+ * avbox_queue_wake() the notification is not lost if the
+ * consumer is not sleeping yet. Instead it's next blocking
+ * wait on an empty queue returns immediately with EAGAIN.
+ */
+void
+avbox_queue_notify(struct avbox_queue * const inst)
+{
+	pthread_mutex_lock(&inst->lock);
+	inst->notified = 1;
+	pthread_cond_broadcast(&inst->cond);
+	pthread_mutex_unlock(&inst->lock);
+}
+
+
 /**
  * Locks the queue.
  */
@@ -137,6 +328,9 @@ size_t
 avbox_queue_count(struct avbox_queue * const inst)
 {
 	assert(inst != NULL);
+	if (inst->flags & AVBOX_QUEUEFLAGS_SPSC) {
+		return spsc_count(inst);
+	}
 	return inst->cnt;
 }
 
@@ -163,15 +357,18 @@ avbox_queue_getnode(struct avbox_queue * const inst, const int block, const int6
 			errno = EAGAIN;
 			goto end;
 		}
-		if (timeout == 0) {
-			pthread_cond_wait(&inst->cond, &inst->lock);
-		} else {
-			struct timespec tv;
-			tv.tv_sec = 0;
-			tv.tv_nsec = timeout * 1000L;
-			delay2abstime(&tv);
-			pthread_cond_timedwait(&inst->cond, &inst->lock, &tv);
+		if (!inst->notified) {
+			if (timeout == 0) {
+				pthread_cond_wait(&inst->cond, &inst->lock);
+			} else {
+				struct timespec tv;
+				tv.tv_sec = 0;
+				tv.tv_nsec = timeout * 1000L;
+				delay2abstime(&tv);
+				pthread_cond_timedwait(&inst->cond, &inst->lock, &tv);
+			}
 		}
+		inst->notified = 0;
 		if (UNLIKELY((node = LIST_TAIL(struct avbox_queue_node*, &inst->items)) == NULL)) {
 			errno = EAGAIN;
 			goto end;
@@ -194,6 +391,9 @@ avbox_queue_peek(struct avbox_queue * const inst, const int block)
 {
 	void *ret = NULL;
 	struct avbox_queue_node *node;
+	if (inst->flags & AVBOX_QUEUEFLAGS_SPSC) {
+		return spsc_peek(inst, block, 0);
+	}
 	pthread_mutex_lock(&inst->lock);
 	if (UNLIKELY((node = avbox_queue_getnode(inst, block, 0)) == NULL)) {
 		goto end;
@@ -213,6 +413,9 @@ avbox_queue_timedpeek(struct avbox_queue * const inst, const int64_t timeout)
 {
 	void *ret = NULL;
 	struct avbox_queue_node *node;
+	if (inst->flags & AVBOX_QUEUEFLAGS_SPSC) {
+		return spsc_peek(inst, 1, timeout);
+	}
 	pthread_mutex_lock(&inst->lock);
 	if (UNLIKELY((node = avbox_queue_getnode(inst, 1, timeout)) == NULL)) {
 		goto end;
@@ -245,6 +448,10 @@ avbox_queue_get(struct avbox_queue *inst)
 	struct avbox_queue_node *node;
 	assert(inst != NULL);
 
+	if (inst->flags & AVBOX_QUEUEFLAGS_SPSC) {
+		return spsc_get(inst);
+	}
+
 	pthread_mutex_lock(&inst->lock);
 
 	if (UNLIKELY((node = avbox_queue_getnode(inst, 1, 0)) == NULL)) {
@@ -280,6 +487,10 @@ avbox_queue_put(struct avbox_queue *inst, void *item)
 	assert(inst != NULL);
 	assert(item != NULL);
 
+	if (inst->flags & AVBOX_QUEUEFLAGS_SPSC) {
+		return spsc_put(inst, item);
+	}
+
 	/* allocate memory for a queue node */
 	if (UNLIKELY((node = acquire_node(inst)) == NULL)) {
 		LOG_VPRINT_ERROR("Could not allocate node: %s",
@@ -341,7 +552,14 @@ avbox_queue_isclosed(struct avbox_queue * const inst)
 void
 avbox_queue_setsize(struct avbox_queue * const inst, size_t sz)
 {
+	if ((inst->flags & AVBOX_QUEUEFLAGS_SPSC) && (sz == 0 || sz > inst->ring_mask + 1)) {
+		LOG_VPRINT_WARN("Queue '%s' size limited to %zu items",
+			inst->name, inst->ring_mask + 1);
+		sz = inst->ring_mask + 1;
+	}
 	inst->sz = sz;
+	MEMORY_BARRIER();
+	avbox_queue_wake(inst);
 }
 
 
@@ -373,9 +591,13 @@ avbox_queue_setname(struct avbox_queue * const inst, const char * const name)
 
 /**
  * Creates a new queue object.
+ *
+ * If the AVBOX_QUEUEFLAGS_SPSC flag is set the queue is backed by a
+ * bounded ring buffer that can hold at least sz items. Such queue must
+ * have at most one producer and one consumer thread at any given time.
  */
 struct avbox_queue *
-avbox_queue_new(const size_t sz)
+avbox_queue_new(const size_t sz, const unsigned int flags)
 {
 	int res;
 	struct avbox_queue *inst;
@@ -393,6 +615,7 @@ avbox_queue_new(const size_t sz)
 	LIST_INIT(&inst->nodes_pool);
 	LIST_INIT(&inst->items);
 	inst->sz = sz;
+	inst->flags = flags;
 
 	if ((inst->name = strdup("unnamed")) == NULL) {
 		ASSERT(errno == ENOMEM);
@@ -400,8 +623,28 @@ avbox_queue_new(const size_t sz)
 		return NULL;
 	}
 
-	/* initialize pre-allocated node pool */
-	if (sz) {
+	if (flags & AVBOX_QUEUEFLAGS_SPSC) {
+		/* allocate a power of 2 sized ring buffer */
+		size_t ring_sz = 1;
+		if (sz == 0) {
+			LOG_PRINT_ERROR("SPSC queues must be bounded!");
+			free(inst->name);
+			free(inst);
+			errno = EINVAL;
+			return NULL;
+		}
+		while (ring_sz < sz) {
+			ring_sz <<= 1;
+		}
+		if ((inst->ring = malloc(sizeof(void*) * ring_sz)) == NULL) {
+			ASSERT(errno == ENOMEM);
+			free(inst->name);
+			free(inst);
+			return NULL;
+		}
+		inst->ring_mask = ring_sz - 1;
+	} else if (sz) {
+		/* initialize pre-allocated node pool */
 		size_t i;
 		for (i = 0; i < sz; i++) {
 			struct avbox_queue_node * const node =
@@ -423,6 +666,10 @@ avbox_queue_new(const size_t sz)
 			strerror(errno));
 		assert(res == ENOMEM || res == EPERM);
 		errno = res;
+		if (inst->ring != NULL) {
+			free(inst->ring);
+		}
+		free(inst->name);
 		free(inst);
 		return NULL;
 	}
@@ -468,7 +715,13 @@ avbox_queue_destroy(struct avbox_queue *inst)
 
 	/* if the queue still has any items in it
 	 * print a warning */
-	if (LIST_SIZE(&inst->items) > 0) {
+	if (inst->flags & AVBOX_QUEUEFLAGS_SPSC) {
+		if (spsc_count(inst) > 0) {
+			LOG_VPRINT_ERROR("LEAK!: Destroying queue with %zu items!",
+				spsc_count(inst));
+		}
+		free(inst->ring);
+	} else if (LIST_SIZE(&inst->items) > 0) {
 		LOG_VPRINT_ERROR("LEAK!: Destroying queue with %d items!",
 			LIST_SIZE(&inst->items));
 	}
@@ -21,6 +21,13 @@
 #ifndef __AVBOX_QUEUE_H__
 #define __AVBOX_QUEUE_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define AVBOX_QUEUEFLAGS_NONE	(0x0)
+#define AVBOX_QUEUEFLAGS_SPSC	(0x1)
+
 
 /**
  * Represents a queue object.
@@ -35,6 +42,15 @@ void
 avbox_queue_wake(struct avbox_queue * inst);
 
 
+/**
+ * Wakes the thread waiting for items on the queue. Unlike
+ * avbox_queue_wake() the notification is not lost if the
+ * consumer is not sleeping yet.
+ */
+void
+avbox_queue_notify(struct avbox_queue * const inst);
+
+
 /**
  * Wait for any IO events on the queue
  */
@@ -118,9 +134,13 @@ avbox_queue_setname(struct avbox_queue * const inst, const char * const name);
 
 /**
  * Creates a new queue object.
+ *
+ * If the AVBOX_QUEUEFLAGS_SPSC flag is set the queue is backed by a
+ * bounded ring buffer that can hold at least sz items. Such queue must
+ * have at most one producer and one consumer thread at any given time.
  */
 struct avbox_queue *
-avbox_queue_new(size_t sz);
+avbox_queue_new(size_t sz, unsigned int flags);
 
 
 /**
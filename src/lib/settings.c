@@ -37,92 +37,241 @@
 
 #include "log.h"
 #include "debug.h"
+#include "linkedlist.h"
+#include "compiler.h"
 #include "file_util.h"
 #include "db_util.h"
+#include "settings.h"
 
 #define DEFAULT_HOSTNAME	("mediabox-v0")
 
+/* number of buckets on the settings cache. Must be a power of 2 */
+#define AVBOX_SETTINGS_CACHE_SIZE	(32)
+
+
+/**
+ * Cached setting. A NULL value means that the
+ * key is not set on the database.
+ */
+LISTABLE_STRUCT(avbox_settings_entry,
+	char *key;
+	char *value;
+);
+
 
 static pthread_mutex_t dblock;
+static sqlite3 *db = NULL;
+static sqlite3_stmt *stmt_select = NULL;
+static sqlite3_stmt *stmt_insert = NULL;
+static sqlite3_stmt *stmt_update = NULL;
+static sqlite3_stmt *stmt_delete = NULL;
+static LIST cache[AVBOX_SETTINGS_CACHE_SIZE];
 
 
-#define SQLBUFLEN	(1024)
+/**
+ * Gets the cache bucket for a key.
+ */
+static inline LIST *
+avbox_settings_bucket(const char *key)
+{
+	unsigned int hash = 5381;
+	while (*key != '\0') {
+		hash = ((hash << 5) + hash) + (unsigned char) *key++;
+	}
+	return &cache[hash & (AVBOX_SETTINGS_CACHE_SIZE - 1)];
+}
 
 
 /**
- * Callback function to get getstring() result.
+ * Finds a cached setting. Must be called with
+ * dblock held.
  */
-static int
-avbox_settings_getstring_callback(void *data,
-	int argc, char **argv, char **azColName)
+static struct avbox_settings_entry *
+avbox_settings_cachefind(const char * const key)
 {
-	char **value = (char**) data;
-	ASSERT(argc <= 1);
-	ASSERT(data != NULL);
+	struct avbox_settings_entry *entry;
+	LIST_FOREACH(struct avbox_settings_entry*, entry, avbox_settings_bucket(key)) {
+		if (!strcmp(entry->key, key)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
 
-	if ((*value = strdup(argv[0])) == NULL) {
-		LOG_VPRINT_ERROR("Could not strdup() query result '%s'",
-			argv[0]);
+/**
+ * Frees a cache entry.
+ */
+static void
+avbox_settings_freeentry(struct avbox_settings_entry * const entry)
+{
+	LIST_REMOVE(entry);
+	if (entry->value != NULL) {
+		free(entry->value);
 	}
-	return 0;
+	free(entry->key);
+	free(entry);
 }
 
 
 /**
- * Gets the value of a setting. The result must
- * be freed with free().
+ * Removes a setting from the cache. Must be called
+ * with dblock held.
  */
-char *
-avbox_settings_getstring(const char * const key)
+static void
+avbox_settings_cachedrop(const char * const key)
 {
-	int res;
-	char *value = NULL, sql[SQLBUFLEN];
-	sqlite3 *db = NULL;
-	char *safekey, *filename = NULL;
+	struct avbox_settings_entry *entry;
+	if ((entry = avbox_settings_cachefind(key)) != NULL) {
+		avbox_settings_freeentry(entry);
+	}
+}
 
-	DEBUG_VPRINT(LOG_MODULE, "Entering settings_getstring(\"%s\")",
-		key);
 
-	ASSERT(key != NULL);
+/**
+ * Updates or adds a cached setting. Must be called
+ * with dblock held. On failure the key is removed
+ * from the cache.
+ */
+static void
+avbox_settings_cacheset(const char * const key, const char * const value)
+{
+	char *dup = NULL;
+	struct avbox_settings_entry *entry;
 
-	if ((safekey = avbox_dbutil_escapesql(key)) == NULL) {
-		errno = ENOMEM;
-		return NULL;
+	if (value != NULL && (dup = strdup(value)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		goto fail;
 	}
 
-	if ((filename = avbox_dbutil_getdbfile("settings.db")) == NULL) {
-		ASSERT(errno == ENOMEM);
-		free(safekey);
-		return NULL;
+	if ((entry = avbox_settings_cachefind(key)) == NULL) {
+		if ((entry = malloc(sizeof(struct avbox_settings_entry))) == NULL) {
+			ASSERT(errno == ENOMEM);
+			goto fail;
+		}
+		if ((entry->key = strdup(key)) == NULL) {
+			ASSERT(errno == ENOMEM);
+			free(entry);
+			goto fail;
+		}
+		entry->value = NULL;
+		LIST_ADD(avbox_settings_bucket(key), entry);
 	}
 
-	/* build sql statement */
-	snprintf(sql, SQLBUFLEN, "SELECT value FROM settings WHERE key = '%s' LIMIT 1;",
-		safekey);
+	if (entry->value != NULL) {
+		free(entry->value);
+	}
+	entry->value = dup;
+	return;
 
-	/* open db and exec statement */
-	if ((res = sqlite3_open_v2(filename,
-		&db, SQLITE_OPEN_READONLY, NULL)) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Could not open database '%s': %s (%d)",
-			filename, sqlite3_errmsg(db), res);
-		goto end;
+fail:
+	if (dup != NULL) {
+		free(dup);
 	}
-	if ((res = sqlite3_exec(db, sql,
-		&avbox_settings_getstring_callback, &value, NULL)) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Query '%s' failed (%d)",
-			sql, res);
-		goto end;
+	avbox_settings_cachedrop(key);
+}
+
+
+/**
+ * Runs a prepared statement that doesn't return
+ * any rows.
+ */
+static int
+avbox_settings_exec(sqlite3_stmt * const stmt, const char * const a,
+	const char * const b)
+{
+	int ret = 0, res;
+
+	if ((a != NULL && sqlite3_bind_text(stmt, 1, a, -1, SQLITE_STATIC) != SQLITE_OK) ||
+		(b != NULL && sqlite3_bind_text(stmt, 2, b, -1, SQLITE_STATIC) != SQLITE_OK)) {
+		LOG_VPRINT_ERROR("Could not bind parameters: %s",
+			sqlite3_errmsg(db));
+		ret = -1;
+	} else if ((res = sqlite3_step(stmt)) != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Query '%s' failed: %s (%d)",
+			sqlite3_sql(stmt), sqlite3_errmsg(db), res);
+		ret = -1;
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return ret;
+}
+
+
+/**
+ * Reads a setting from the database or from the cache. On
+ * success *value is set to a copy of the value, or to NULL
+ * if the key is not set. Must be called with dblock held.
+ */
+static int
+avbox_settings_read(const char * const key, char ** const value)
+{
+	int ret = -1, res;
+	struct avbox_settings_entry *entry;
+
+	*value = NULL;
+
+	if (UNLIKELY(db == NULL)) {
+		LOG_VPRINT_ERROR("Settings database not open (key='%s')", key);
+		errno = ESHUTDOWN;
+		return -1;
 	}
-end:
-	if (safekey != NULL) {
-		free(safekey);
+
+	/* if it's on the cache we're done */
+	if ((entry = avbox_settings_cachefind(key)) != NULL) {
+		if (entry->value != NULL && (*value = strdup(entry->value)) == NULL) {
+			ASSERT(errno == ENOMEM);
+			return -1;
+		}
+		return 0;
 	}
-	if (filename != NULL) {
-		free(filename);
+
+	if (sqlite3_bind_text(stmt_select, 1, key, -1, SQLITE_STATIC) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not bind key: %s",
+			sqlite3_errmsg(db));
+		goto end;
 	}
-	if (db != NULL) {
-		sqlite3_close(db);
+
+	if ((res = sqlite3_step(stmt_select)) == SQLITE_ROW) {
+		const char * const text = (const char*) sqlite3_column_text(stmt_select, 0);
+		if (text != NULL && (*value = strdup(text)) == NULL) {
+			LOG_VPRINT_ERROR("Could not strdup() query result '%s'",
+				text);
+			goto end;
+		}
+	} else if (res != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Query '%s' failed: %s (%d)",
+			sqlite3_sql(stmt_select), sqlite3_errmsg(db), res);
+		goto end;
 	}
+
+	avbox_settings_cacheset(key, *value);
+	ret = 0;
+end:
+	sqlite3_reset(stmt_select);
+	sqlite3_clear_bindings(stmt_select);
+	return ret;
+}
+
+
+/**
+ * Gets the value of a setting. The result must
+ * be freed with free().
+ */
+char *
+avbox_settings_getstring(const char * const key)
+{
+	char *value;
+
+	DEBUG_VPRINT(LOG_MODULE, "Entering settings_getstring(\"%s\")",
+		key);
+
+	ASSERT(key != NULL);
+
+	pthread_mutex_lock(&dblock);
+	(void) avbox_settings_read(key, &value);
+	pthread_mutex_unlock(&dblock);
+
 	return value;
 }
 
@@ -134,81 +283,45 @@ int
 avbox_settings_setstring(const char * const key,
 	const char * const value)
 {
-	int ret = -1, res;
-	sqlite3 *db = NULL;
-	char *existing = NULL, *filename = NULL;
-	char sql[SQLBUFLEN];
+	int ret = -1;
+	char *existing = NULL;
 
 	DEBUG_VPRINT(LOG_MODULE, "Entering settings_setstring(\"%s\", \"%s\")",
 		key, value);
 
 	ASSERT(key != NULL);
 
-	char * const safekey = avbox_dbutil_escapesql(key);
-	char * const safevalue = avbox_dbutil_escapesql(value);
-	if (safekey == NULL || safevalue == NULL) {
-		errno = ENOMEM;
-		goto end;
-	}
-
 	pthread_mutex_lock(&dblock);
 
-	existing = avbox_settings_getstring(key);
+	if (avbox_settings_read(key, &existing) == -1) {
+		goto end;
+	}
 
 	if (existing == NULL) {
 		/* doesn't exist and value is NULL */
 		if (value == NULL) {
 			goto end;
 		}
-		snprintf(sql, SQLBUFLEN,
-			"INSERT INTO settings (key, value) VALUES ('%s', '%s');",
-			safekey, safevalue);
+		ret = avbox_settings_exec(stmt_insert, key, value);
 	} else {
 		if (value == NULL) {
-			snprintf(sql, SQLBUFLEN,
-				"DELETE FROM settings WHERE key = '%s';",
-				safekey);
+			ret = avbox_settings_exec(stmt_delete, key, NULL);
 		} else {
-			snprintf(sql, SQLBUFLEN,
-				"UPDATE settings SET value = '%s' WHERE key = '%s';",
-				safevalue, safekey);
+			ret = avbox_settings_exec(stmt_update, value, key);
 		}
 	}
 
-	if ((filename = avbox_dbutil_getdbfile("settings.db")) == NULL) {
-		ASSERT(errno == ENOMEM);
-		goto end;
-	}
-
-	/* open db and exec query */
-	if ((res = sqlite3_open_v2(filename, &db,
-		SQLITE_OPEN_READWRITE, NULL)) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Could not open database '%s': %s (%d)",
-			filename, sqlite3_errmsg(db), res);
-	}
-	if ((res = sqlite3_exec(db, sql, NULL, NULL, NULL)) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Could not exec query '%s' (%d)",
-			sql, res);
-		goto end;
+	/* update the cache. If the write failed drop the key from
+	 * the cache so the next read goes to the database */
+	if (ret == 0) {
+		avbox_settings_cacheset(key, value);
+	} else {
+		avbox_settings_cachedrop(key);
 	}
-
-	ret = 0;
 end:
-	if (safekey != NULL) {
-		free(safekey);
-	}
-	if (safevalue != NULL) {
-		free(safevalue);
-	}
 	if (existing != NULL) {
 		free(existing);
 	}
-	if (db != NULL) {
-		sqlite3_close(db);
-	}
-	if (filename != NULL) {
-		free(filename);
-	}
 	pthread_mutex_unlock(&dblock);
 	return ret;
 }
@@ -296,14 +409,12 @@ avbox_settings_getint(const char * key, const int defvalue)
 
 
 /**
- * Creates the settings database.
+ * Creates the settings table and sets the defaults.
  */
 static int
 avbox_settings_createdb()
 {
-	int ret = -1, res;
-	sqlite3 *db = NULL;
-	char *filename = NULL;
+	int res;
 	const char *sql =
 		"CREATE TABLE settings ("
 		"key TEXT,"
@@ -312,25 +423,20 @@ avbox_settings_createdb()
 
 	DEBUG_PRINT("settings", "Creating settings database");
 
-	pthread_mutex_lock(&dblock);
-
-	if ((filename = avbox_dbutil_getdbfile("settings.db")) == NULL) {
-		ASSERT(errno == ENOMEM);
-		goto end;
-	}
-
-	if (sqlite3_open_v2(filename, &db,
-		SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Could not open database '%s': %s",
-			filename, sqlite3_errmsg(db));
-		goto end;
-	}
 	if ((res = sqlite3_exec(db, sql, NULL, NULL, NULL)) != SQLITE_OK) {
 		LOG_VPRINT_ERROR("SQL Query: '%s' failed (%d)!", sql, res);
-		goto end;
+		return -1;
 	}
+	return 0;
+}
 
-	/* set some defaults */
+
+/**
+ * Sets the default settings.
+ */
+static void
+avbox_settings_setdefaults()
+{
 	if (avbox_settings_setstring("hostname", DEFAULT_HOSTNAME) == -1) {
 		LOG_VPRINT_ERROR("settings_setstring() failed: %s",
 			strerror(errno));
@@ -339,17 +445,6 @@ avbox_settings_createdb()
 		LOG_VPRINT_ERROR("settings_setbool() failed: %s",
 			strerror(errno));
 	}
-
-	ret = 0;
-end:
-	if (db != NULL) {
-		sqlite3_close(db);
-	}
-	if (filename != NULL) {
-		free(filename);
-	}
-	pthread_mutex_unlock(&dblock);
-	return ret;
 }
 
 
@@ -359,6 +454,7 @@ end:
 int
 avbox_settings_init()
 {
+	int i, res, create;
 	struct stat st;
 	char *filename;
 	pthread_mutexattr_t lockattr;
@@ -371,6 +467,11 @@ avbox_settings_init()
 	if (pthread_mutex_init(&dblock, &lockattr) != 0) {
 		LOG_PRINT_ERROR("Could not initialize mutex!");
 	}
+	pthread_mutexattr_destroy(&lockattr);
+
+	for (i = 0; i < AVBOX_SETTINGS_CACHE_SIZE; i++) {
+		LIST_INIT(&cache[i]);
+	}
 
 	if ((filename = avbox_dbutil_getdbfile("settings.db")) == NULL) {
 		LOG_VPRINT_ERROR("Could not create db filename: %s",
@@ -378,21 +479,50 @@ avbox_settings_init()
 		return -1;
 	}
 
-	/* check that the database exists and we can
-	 * access it. If it's not try to create it */
-	while (stat(filename, &st) == -1 ||
-		access(filename, R_OK|W_OK) == -1) {
-		if (avbox_settings_createdb() == -1) {
-			LOG_VPRINT_ERROR("Could not create database: %s (%d)",
-				strerror(errno), errno);
-			free(filename);
-			return -1;
-		}
+	/* if the database doesn't exist we need to create it */
+	create = (stat(filename, &st) == -1);
+
+	/* open the database. The connection is kept open until
+	 * shutdown and access to it is serialized by dblock */
+	if ((res = sqlite3_open_v2(filename, &db,
+		SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not open database '%s': %s (%d)",
+			filename, sqlite3_errmsg(db), res);
+		goto fail;
+	}
+
+	if (create && avbox_settings_createdb() == -1) {
+		LOG_VPRINT_ERROR("Could not create database: %s (%d)",
+			strerror(errno), errno);
+		goto fail;
+	}
+
+	/* prepare statements */
+	if (sqlite3_prepare_v2(db, "SELECT value FROM settings WHERE key = ? LIMIT 1;",
+			-1, &stmt_select, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT INTO settings (key, value) VALUES (?, ?);",
+			-1, &stmt_insert, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "UPDATE settings SET value = ? WHERE key = ?;",
+			-1, &stmt_update, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "DELETE FROM settings WHERE key = ?;",
+			-1, &stmt_delete, NULL) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not prepare statements: %s",
+			sqlite3_errmsg(db));
+		goto fail;
+	}
+
+	if (create) {
+		avbox_settings_setdefaults();
 	}
 
 	free(filename);
 
 	return 0;
+
+fail:
+	avbox_settings_shutdown();
+	free(filename);
+	return -1;
 }
 
 
@@ -402,4 +532,30 @@ avbox_settings_init()
 void
 avbox_settings_shutdown()
 {
+	int i;
+	struct avbox_settings_entry *entry;
+
+	DEBUG_PRINT("settings", "Shutting down settings database");
+
+	pthread_mutex_lock(&dblock);
+
+	/* sqlite3_finalize() is a no-op on NULL */
+	sqlite3_finalize(stmt_select);
+	sqlite3_finalize(stmt_insert);
+	sqlite3_finalize(stmt_update);
+	sqlite3_finalize(stmt_delete);
+	stmt_select = stmt_insert = stmt_update = stmt_delete = NULL;
+
+	if (db != NULL) {
+		sqlite3_close(db);
+		db = NULL;
+	}
+
+	for (i = 0; i < AVBOX_SETTINGS_CACHE_SIZE; i++) {
+		LIST_FOREACH_SAFE(struct avbox_settings_entry*, entry, &cache[i], {
+			avbox_settings_freeentry(entry);
+		});
+	}
+
+	pthread_mutex_unlock(&dblock);
 }
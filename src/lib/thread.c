@@ -22,10 +22,14 @@
 #	include "../config.h"
 #endif
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
 #include <sys/time.h>
 
 
@@ -42,7 +46,13 @@
 #include "queue.h"
 
 
-#define N_THREADS (3)
+/* the work queue runs one worker per online CPU
+ * within these limits */
+#define AVBOX_WORKQUEUE_MIN_THREADS	(2)
+#define AVBOX_WORKQUEUE_MAX_THREADS	(16)
+
+/* initial capacity of a worker's deque. Must be a power of 2 */
+#define AVBOX_WORKQUEUE_DEQUE_SIZE	(16)
 
 
 LISTABLE_STRUCT(avbox_thread,
@@ -65,8 +75,39 @@ LISTABLE_STRUCT(avbox_thread,
 );
 
 
-static LIST workqueue_threads;
+/**
+ * Work queue worker. Each worker owns a deque of pending
+ * delegates. The owner pops jobs from the tail while idle
+ * workers steal them from the head.
+ */
+struct avbox_workqueue_worker
+{
+	int no;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct avbox_delegate **jobs;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int cap;
+#ifndef NDEBUG
+	int64_t executed;
+	int64_t stolen;
+#endif
+};
+
+
+static struct avbox_workqueue_worker *workers = NULL;
+static int n_workers = 0;
+static unsigned int next_worker = 0;
+static __thread struct avbox_workqueue_worker *this_worker = NULL;
+
+/* pending is the number of jobs sitting on the deques that
+ * have not been claimed by a worker yet */
 static pthread_mutex_t workqueue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workqueue_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int workqueue_pending = 0;
+static unsigned int workqueue_idle = 0;
+static int workqueue_quit = 0;
 
 
 /**
@@ -315,34 +356,191 @@ avbox_thread_destroy(struct avbox_thread * const thread)
 
 
 /**
- * Pick the least busy thread.
+ * Push a job to the tail of a worker's deque.
  */
-static struct avbox_thread *
-avbox_thread_pick(void)
+static int
+avbox_workqueue_push(struct avbox_workqueue_worker * const worker,
+	struct avbox_delegate * const del)
 {
-	struct avbox_thread *thread;
-	struct avbox_thread *best_thread = NULL;
-	struct timespec best_time = { 0xFFFFFF, 999L * 1000L * 1000L };
-
-	/* Pick the first free thread. If one cannot be found
-	 * pick the one with the shortest runtime */
-	LIST_FOREACH(struct avbox_thread*, thread, &workqueue_threads) {
-		struct timespec now, runtime;
-		if (timegte(&thread->stop_time, &thread->start_time)) {
-			best_thread = thread;
+	pthread_mutex_lock(&worker->lock);
+	if (UNLIKELY((worker->tail - worker->head) == worker->cap)) {
+		unsigned int i;
+		const unsigned int cap = worker->cap * 2;
+		struct avbox_delegate ** const jobs =
+			malloc(sizeof(struct avbox_delegate*) * cap);
+		if (jobs == NULL) {
+			ASSERT(errno == ENOMEM);
+			pthread_mutex_unlock(&worker->lock);
+			return -1;
+		}
+		for (i = 0; i < worker->cap; i++) {
+			jobs[i] = worker->jobs[(worker->head + i) & (worker->cap - 1)];
+		}
+		free(worker->jobs);
+		worker->jobs = jobs;
+		worker->head = 0;
+		worker->tail = i;
+		worker->cap = cap;
+	}
+	worker->jobs[worker->tail++ & (worker->cap - 1)] = del;
+	pthread_mutex_unlock(&worker->lock);
+	return 0;
+}
+
+
+/**
+ * Pop a job from the tail of a worker's deque.
+ */
+static struct avbox_delegate *
+avbox_workqueue_pop(struct avbox_workqueue_worker * const worker)
+{
+	struct avbox_delegate *del = NULL;
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail != worker->head) {
+		del = worker->jobs[--worker->tail & (worker->cap - 1)];
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return del;
+}
+
+
+/**
+ * Steal a job from the head of a worker's deque.
+ */
+static struct avbox_delegate *
+avbox_workqueue_steal(struct avbox_workqueue_worker * const worker)
+{
+	struct avbox_delegate *del = NULL;
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail != worker->head) {
+		del = worker->jobs[worker->head++ & (worker->cap - 1)];
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return del;
+}
+
+
+/**
+ * Find a job for a worker. The caller must have claimed
+ * a job from workqueue_pending so there is at least one
+ * job on the deques for it.
+ */
+static struct avbox_delegate *
+avbox_workqueue_find(struct avbox_workqueue_worker * const worker)
+{
+	int i;
+	struct avbox_delegate *del;
+
+	while (1) {
+		/* try our own deque first */
+		if ((del = avbox_workqueue_pop(worker)) != NULL) {
+			return del;
+		}
+
+		/* steal from the others starting with
+		 * our neighbour */
+		for (i = 1; i < n_workers; i++) {
+			if ((del = avbox_workqueue_steal(&workers[(worker->no + i) % n_workers])) != NULL) {
+#ifndef NDEBUG
+				worker->stolen++;
+#endif
+				return del;
+			}
+		}
+
+		/* the job is still being pushed */
+		sched_yield();
+	}
+}
+
+
+/**
+ * Dispatch any messages waiting on a worker's queue.
+ */
+static void
+avbox_workqueue_dispatch(struct avbox_queue * const queue)
+{
+	struct avbox_message *msg;
+	while (avbox_queue_peek(queue, 0) != NULL) {
+		if ((msg = avbox_queue_get(queue)) != NULL) {
+			avbox_message_dispatch(msg);
+		}
+	}
+}
+
+
+/**
+ * Work queue worker entry point.
+ *
+ * Like any other avbox thread each worker owns a dispatch
+ * queue so jobs can create objects and send messages. Since
+ * the worker sleeps on the work queue and not on it's dispatch
+ * queue messages for objects created by a job are only
+ * dispatched between jobs, so long lived objects should be
+ * created on an avbox_thread instead.
+ */
+static void *
+avbox_workqueue_run(void *arg)
+{
+	struct avbox_workqueue_worker * const worker = arg;
+	struct avbox_delegate *del;
+	struct avbox_queue *queue;
+
+	DEBUG_SET_THREAD_NAME("avbox-worker");
+	DEBUG_VPRINT("thread", "Thread #%i started", worker->no);
+
+#ifdef ENABLE_REALTIME
+	struct sched_param parms;
+	parms.sched_priority = 0;
+	if (pthread_setschedparam(pthread_self(), SCHED_OTHER, &parms) != 0) {
+		LOG_PRINT_ERROR("Could not set the priority of normal thread!");
+	}
+#endif
+
+	if ((queue = avbox_dispatch_init()) == NULL) {
+		LOG_VPRINT_ERROR("Could not initialize dispatch for worker #%i: %s",
+			worker->no, strerror(errno));
+	}
+
+	this_worker = worker;
+
+	while (1) {
+		/* wait for a job and claim it */
+		pthread_mutex_lock(&workqueue_mutex);
+		while (workqueue_pending == 0 && !workqueue_quit) {
+			workqueue_idle++;
+			pthread_cond_wait(&workqueue_cond, &workqueue_mutex);
+			workqueue_idle--;
+		}
+		if (workqueue_pending == 0) {
+			pthread_mutex_unlock(&workqueue_mutex);
 			break;
 		}
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		runtime = timediff(&now, &thread->start_time);
-		if (timelt(&runtime, &best_time)) {
-			best_time = runtime;
-			best_thread = thread;
+		workqueue_pending--;
+		pthread_mutex_unlock(&workqueue_mutex);
+
+		/* run it */
+		del = avbox_workqueue_find(worker);
+		avbox_delegate_execute(del);
+#ifndef NDEBUG
+		worker->executed++;
+#endif
+		if (queue != NULL) {
+			avbox_workqueue_dispatch(queue);
 		}
 	}
 
-	assert(best_thread != NULL);
+	this_worker = NULL;
 
-	return best_thread;
+	if (queue != NULL) {
+		avbox_workqueue_dispatch(queue);
+		avbox_dispatch_shutdown();
+	}
+
+	DEBUG_VPRINT("thread", "Thread #%i exited after %" PRIi64 " jobs (%" PRIi64 " stolen)",
+		worker->no, worker->executed, worker->stolen);
+
+	return NULL;
 }
 
 
@@ -353,41 +551,63 @@ struct avbox_delegate *
 avbox_workqueue_delegate(avbox_delegate_fn func, void * arg)
 {
 	struct avbox_delegate *del;
-	struct avbox_thread *thread = NULL;
+	struct avbox_workqueue_worker *worker;
 
-	pthread_mutex_lock(&workqueue_mutex);
+	ASSERT(n_workers > 0);
 
-	/* pick the best thread */
-	if ((thread = avbox_thread_pick()) == NULL) {
-		DEBUG_VABORT("thread", "Could not pick thread: %s",
-			strerror(errno));
+	if ((del = avbox_delegate_new(func, arg, 0)) == NULL) {
+		assert(errno == ENOMEM);
+		return NULL;
 	}
 
-	/* create a new delegate */
-	if ((del = avbox_thread_delegate(thread, func, arg)) == NULL) {
-		goto end;
+	/* jobs queued from a worker go to it's own deque,
+	 * otherwise spread them across all workers */
+	if ((worker = this_worker) == NULL) {
+		worker = &workers[ATOMIC_INC(&next_worker) % n_workers];
+	}
+
+	if (avbox_workqueue_push(worker, del) == -1) {
+		avbox_delegate_destroy(del);
+		return NULL;
+	}
+
+	/* wake an idle worker */
+	pthread_mutex_lock(&workqueue_mutex);
+	workqueue_pending++;
+	if (workqueue_idle > 0) {
+		pthread_cond_signal(&workqueue_cond);
 	}
-end:
 	pthread_mutex_unlock(&workqueue_mutex);
+
 	return del;
 }
 
 
 /**
- * Initialize a workqueue thread.
+ * Stop all running workers and free the pool.
  */
-static void *
-avbox_workqueue_thread_init(void *arg)
+static void
+avbox_workqueue_stop(const int count)
 {
-	struct avbox_thread * const thread = arg;
-	DEBUG_SET_THREAD_NAME("avbox-worker");
-	DEBUG_VPRINT("thread", "Thread #%i started", thread->no);
+	int i;
 
-#ifndef NDEBUG
-	static int thread_no = 0;
-	thread->no = thread_no++;
-#endif
-	return thread;
+	pthread_mutex_lock(&workqueue_mutex);
+	workqueue_quit = 1;
+	pthread_cond_broadcast(&workqueue_cond);
+	pthread_mutex_unlock(&workqueue_mutex);
+
+	for (i = 0; i < count; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	for (i = 0; i < n_workers; i++) {
+		ASSERT(workers[i].head == workers[i].tail);
+		pthread_mutex_destroy(&workers[i].lock);
+		free(workers[i].jobs);
+	}
+
+	free(workers);
+	workers = NULL;
+	n_workers = 0;
 }
 
 
@@ -397,34 +617,67 @@ avbox_workqueue_thread_init(void *arg)
 int
 avbox_workqueue_init(void)
 {
-	int i;
-	struct avbox_thread *thread, *thread_check;
-	struct avbox_delegate *initfunc;
-	LIST_INIT(&workqueue_threads);
-
-	for (i = 0; i < N_THREADS; i++) {
-		if ((thread = avbox_thread_new(NULL, NULL, 0, 0)) == NULL ||
-			(initfunc = avbox_thread_delegate(thread, avbox_workqueue_thread_init, thread)) == NULL) {
-			if (thread != NULL) {
-				LOG_VPRINT_ERROR("Could not start thread #%i: %s",
-					i, strerror(errno));
-				avbox_thread_destroy(thread);
-			} else {
-				LOG_VPRINT_ERROR("Could not create thread #%i: %s",
-					i, strerror(errno));
+	int i, ret;
+	long ncpus;
+
+	ASSERT(workers == NULL);
+
+	/* one worker per online CPU */
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) == -1) {
+		LOG_VPRINT_ERROR("Could not get number of CPUs: %s",
+			strerror(errno));
+		ncpus = AVBOX_WORKQUEUE_MIN_THREADS;
+	}
+	if (ncpus < AVBOX_WORKQUEUE_MIN_THREADS) {
+		ncpus = AVBOX_WORKQUEUE_MIN_THREADS;
+	} else if (ncpus > AVBOX_WORKQUEUE_MAX_THREADS) {
+		ncpus = AVBOX_WORKQUEUE_MAX_THREADS;
+	}
+
+	if ((workers = malloc(sizeof(struct avbox_workqueue_worker) * ncpus)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+
+	/* initialize all deques before starting any threads
+	 * since they may steal from each other */
+	memset(workers, 0, sizeof(struct avbox_workqueue_worker) * ncpus);
+	for (i = 0; i < ncpus; i++) {
+		if ((workers[i].jobs = malloc(sizeof(struct avbox_delegate*) *
+			AVBOX_WORKQUEUE_DEQUE_SIZE)) == NULL) {
+			ASSERT(errno == ENOMEM);
+			while (i--) {
+				free(workers[i].jobs);
 			}
-			LIST_FOREACH_SAFE(struct avbox_thread*, thread, &workqueue_threads, {
-				avbox_thread_destroy(thread);
-			});
+			free(workers);
+			workers = NULL;
 			return -1;
 		}
-		avbox_delegate_wait(initfunc, (void**) &thread_check);
-		if (thread_check != thread) {
+		if (pthread_mutex_init(&workers[i].lock, NULL) != 0) {
 			abort();
 		}
-		LIST_APPEND(&workqueue_threads, thread);
+		workers[i].no = i;
+		workers[i].cap = AVBOX_WORKQUEUE_DEQUE_SIZE;
 	}
 
+	n_workers = ncpus;
+	workqueue_quit = 0;
+	workqueue_pending = 0;
+
+	for (i = 0; i < n_workers; i++) {
+		if ((ret = pthread_create(&workers[i].thread, NULL,
+			avbox_workqueue_run, &workers[i])) != 0) {
+			LOG_VPRINT_ERROR("Could not create thread #%i: %s",
+				i, strerror(ret));
+			avbox_workqueue_stop(i);
+			errno = ret;
+			return -1;
+		}
+	}
+
+	DEBUG_VPRINT("thread", "Work queue started with %i threads",
+		n_workers);
+
 	return 0;
 }
 
@@ -435,12 +688,9 @@ avbox_workqueue_init(void)
 void
 avbox_workqueue_shutdown(void)
 {
-	struct avbox_thread *thread;
-
 	DEBUG_PRINT("thread", "Shutting down thread pool");
 
-	while ((thread = LIST_TAIL(struct avbox_thread*, &workqueue_threads)) != NULL) {
-		LIST_REMOVE(thread);
-		avbox_thread_destroy(thread);
-	}
+	/* workers drain their deques before exiting so
+	 * anyone waiting on a delegate will be woken */
+	avbox_workqueue_stop(n_workers);
 }
@@ -38,91 +38,210 @@
 #include "debug.h"
 #include "input.h"
 #include "dispatch.h"
+#include "pool.h"
+
+
+/* number of buckets on the timer id hash table. Must be a power of 2 */
+#define AVBOX_TIMERS_HASH_SIZE		(64)
+
+/* initial capacity of the timers heap */
+#define AVBOX_TIMERS_HEAP_SIZE		(32)
 
 
 /**
- * Timer structure
+ * Timer structure. While a timer is active it's list
+ * head links it to it's hash bucket.
  */
 LISTABLE_STRUCT(avbox_timer_state,
 	struct avbox_timer_data public;
 	struct timespec interval;
-	struct timespec value;
+	struct timespec deadline;
 	enum avbox_timer_flags flags;
 	struct avbox_object *message_object;
 	avbox_timer_callback callback;
+	size_t heap_index;
 );
 
 
-static LIST timers;
+/* active timers are kept on a binary min-heap ordered
+ * by absolute (CLOCK_MONOTONIC) deadline */
+static struct avbox_timer_state **heap = NULL;
+static size_t heap_len = 0;
+static size_t heap_cap = 0;
+static LIST timers_hash[AVBOX_TIMERS_HASH_SIZE];
+
 static int quit = 0;
 static pthread_mutex_t timers_lock;
-static pthread_cond_t timers_signal = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t timers_signal;
 static pthread_t timers_thread;
 static int nextid = 1;
 
-static LIST timer_pool;
-static LIST timer_data_pool;
-static pthread_mutex_t timer_pool_lock;
-static pthread_mutex_t timer_data_pool_lock;
+static struct avbox_pool *timer_pool = NULL;
+static struct avbox_pool *timer_data_pool = NULL;
 
 
-static struct avbox_timer_state*
+static inline struct avbox_timer_state*
 acquire_timer()
 {
-	struct avbox_timer_state *tmr;
-	pthread_mutex_lock(&timer_pool_lock);
-	tmr = LIST_TAIL(struct avbox_timer_state*, &timer_pool);
-	if (UNLIKELY(tmr == NULL)) {
-		if ((tmr = malloc(sizeof(struct avbox_timer_state))) == NULL) {
-			ASSERT(errno == ENOMEM);
-			pthread_mutex_unlock(&timer_pool_lock);
-			return NULL;
+	return avbox_pool_acquire(timer_pool);
+}
+
+
+static inline void
+release_timer(struct avbox_timer_state * const tmr)
+{
+	avbox_pool_release(timer_pool, tmr);
+}
+
+
+static inline struct avbox_timer_data*
+acquire_payload()
+{
+	return avbox_pool_acquire(timer_data_pool);
+}
+
+
+EXPORT void
+avbox_timers_releasepayload(struct avbox_timer_data * const td)
+{
+	struct avbox_pool * const pool =
+		__atomic_load_n(&timer_data_pool, __ATOMIC_ACQUIRE);
+
+	/* payloads that were still queued when the timers
+	 * system shut down are freed directly */
+	if (pool == NULL) {
+		free(td);
+		return;
+	}
+	avbox_pool_release(pool, td);
+}
+
+
+/**
+ * Swap two timers on the heap.
+ */
+static inline void
+heap_swap(const size_t a, const size_t b)
+{
+	struct avbox_timer_state * const tmp = heap[a];
+	heap[a] = heap[b];
+	heap[b] = tmp;
+	heap[a]->heap_index = a;
+	heap[b]->heap_index = b;
+}
+
+
+/**
+ * Move a timer up the heap until it's parent
+ * expires before it.
+ */
+static void
+heap_siftup(size_t i)
+{
+	while (i > 0) {
+		const size_t parent = (i - 1) / 2;
+		if (!timelt(&heap[i]->deadline, &heap[parent]->deadline)) {
+			break;
 		}
-		LOG_PRINT_INFO("Allocated timer state!");
-	} else {
-		LIST_REMOVE(tmr);
+		heap_swap(i, parent);
+		i = parent;
 	}
-	pthread_mutex_unlock(&timer_pool_lock);
-	return tmr;
 }
 
 
+/**
+ * Move a timer down the heap until both it's
+ * children expire after it.
+ */
 static void
-release_timer(struct avbox_timer_state * const tmr)
+heap_siftdown(size_t i)
 {
-	pthread_mutex_lock(&timer_pool_lock);
-	LIST_ADD(&timer_pool, tmr);
-	pthread_mutex_unlock(&timer_pool_lock);
+	while (1) {
+		size_t min = i;
+		const size_t left = (i * 2) + 1;
+		const size_t right = left + 1;
+		if (left < heap_len && timelt(&heap[left]->deadline, &heap[min]->deadline)) {
+			min = left;
+		}
+		if (right < heap_len && timelt(&heap[right]->deadline, &heap[min]->deadline)) {
+			min = right;
+		}
+		if (min == i) {
+			break;
+		}
+		heap_swap(i, min);
+		i = min;
+	}
 }
 
 
-static struct avbox_timer_data*
-acquire_payload()
+/**
+ * Add a timer to the heap.
+ */
+static int
+heap_push(struct avbox_timer_state * const tmr)
 {
-	struct avbox_timer_data *td;
-	pthread_mutex_lock(&timer_data_pool_lock);
-	td = LIST_TAIL(struct avbox_timer_data*, &timer_data_pool);
-	if (UNLIKELY(td == NULL)) {
-		if ((td = malloc(sizeof(struct avbox_timer_data))) == NULL) {
+	if (UNLIKELY(heap_len == heap_cap)) {
+		const size_t cap = (heap_cap == 0) ? AVBOX_TIMERS_HEAP_SIZE : heap_cap * 2;
+		struct avbox_timer_state ** const newheap =
+			realloc(heap, sizeof(struct avbox_timer_state*) * cap);
+		if (newheap == NULL) {
 			ASSERT(errno == ENOMEM);
-			pthread_mutex_unlock(&timer_data_pool_lock);
-			return NULL;
+			return -1;
 		}
-		LOG_PRINT_INFO("Allocated AVPacket!");
-	} else {
-		LIST_REMOVE(td);
+		heap = newheap;
+		heap_cap = cap;
 	}
-	pthread_mutex_unlock(&timer_data_pool_lock);
-	return td;
+	tmr->heap_index = heap_len;
+	heap[heap_len++] = tmr;
+	heap_siftup(tmr->heap_index);
+	return 0;
 }
 
 
-EXPORT void
-avbox_timers_releasepayload(struct avbox_timer_data * const td)
+/**
+ * Remove a timer from the heap.
+ */
+static void
+heap_remove(struct avbox_timer_state * const tmr)
+{
+	const size_t i = tmr->heap_index;
+	ASSERT(i < heap_len && heap[i] == tmr);
+	if (i != --heap_len) {
+		heap_swap(i, heap_len);
+		heap_siftdown(i);
+		heap_siftup(i);
+	}
+}
+
+
+/**
+ * Find an active timer by id.
+ */
+static struct avbox_timer_state *
+avbox_timers_find(const int timer_id)
 {
-	pthread_mutex_lock(&timer_data_pool_lock);
-	LIST_ADD(&timer_data_pool, td);
-	pthread_mutex_unlock(&timer_data_pool_lock);
+	struct avbox_timer_state *tmr;
+	LIST_FOREACH(struct avbox_timer_state*, tmr,
+		&timers_hash[timer_id & (AVBOX_TIMERS_HASH_SIZE - 1)]) {
+		if (tmr->public.id == timer_id) {
+			return tmr;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Remove a timer from the heap and hash table
+ * and return it to the pool.
+ */
+static void
+avbox_timers_remove(struct avbox_timer_state * const tmr)
+{
+	heap_remove(tmr);
+	LIST_REMOVE(tmr);
+	release_timer(tmr);
 }
 
 
@@ -133,7 +252,7 @@ avbox_timers_releasepayload(struct avbox_timer_data * const td)
 static void *
 avbox_timers_thread(void *arg)
 {
-	struct timespec last_sleep, elapsed, now, sleeptime;
+	struct timespec now, sleeptime;
 	struct avbox_timer_state *tmr;
 	enum avbox_timer_result ret;
 
@@ -154,72 +273,63 @@ avbox_timers_thread(void *arg)
 	}
 #endif
 
-	clock_gettime(CLOCK_MONOTONIC, &last_sleep);
-
 	pthread_mutex_lock(&timers_lock);
 
 	while (!quit) {
 
-		/* this is the maximum time that we're allowed to sleep */
-		sleeptime.tv_sec = 10;
-		sleeptime.tv_nsec = 0;
-
-		/* calculate time elapsed since last sleep */
 		clock_gettime(CLOCK_MONOTONIC, &now);
-		elapsed = timediff(&last_sleep, &now);
-
-		/* iterate through all timers */
-		LIST_FOREACH_SAFE(struct avbox_timer_state*, tmr, &timers, {
-			if (timelte(&tmr->value, &elapsed)) {
-				/* the timer has elapsed so invoke the callback */
-				if (tmr->callback != NULL) {
-					ret = tmr->callback(tmr->public.id, tmr->public.data);
-				} else {
-					ret = AVBOX_TIMER_CALLBACK_RESULT_CONTINUE;
-				}
-				if (tmr->flags & AVBOX_TIMER_MESSAGE) {
-					if (tmr->message_object != NULL) {
-						struct avbox_timer_data *payload;
-						if ((payload = acquire_payload()) == NULL) {
-							LOG_PRINT_ERROR("Could not send TIMER message: Out of memory");
-						} else {
-							memcpy(payload, &tmr->public, sizeof(struct avbox_timer_data));
-							if (avbox_object_sendmsg(&tmr->message_object,
-								AVBOX_MESSAGETYPE_TIMER, AVBOX_DISPATCH_UNICAST, payload) == NULL) {
-								LOG_VPRINT_ERROR("Could not send notification message: %s",
-									strerror(errno));
-								avbox_timers_releasepayload(payload);
-							}
+
+		/* fire all the timers that have expired */
+		while (heap_len > 0 && timelte(&heap[0]->deadline, &now)) {
+			tmr = heap[0];
+
+			/* the timer has elapsed so invoke the callback */
+			if (tmr->callback != NULL) {
+				ret = tmr->callback(tmr->public.id, tmr->public.data);
+			} else {
+				ret = AVBOX_TIMER_CALLBACK_RESULT_CONTINUE;
+			}
+			if (tmr->flags & AVBOX_TIMER_MESSAGE) {
+				if (tmr->message_object != NULL) {
+					struct avbox_timer_data *payload;
+					if ((payload = acquire_payload()) == NULL) {
+						LOG_PRINT_ERROR("Could not send TIMER message: Out of memory");
+					} else {
+						memcpy(payload, &tmr->public, sizeof(struct avbox_timer_data));
+						if (avbox_object_sendmsg(&tmr->message_object,
+							AVBOX_MESSAGETYPE_TIMER, AVBOX_DISPATCH_UNICAST, payload) == NULL) {
+							LOG_VPRINT_ERROR("Could not send notification message: %s",
+								strerror(errno));
+							avbox_timers_releasepayload(payload);
 						}
 					}
 				}
-				if (tmr->flags & AVBOX_TIMER_TYPE_AUTORELOAD) {
-					/* if this is an autoreload timer reload it */
-					if (ret == AVBOX_TIMER_CALLBACK_RESULT_CONTINUE) {
-						tmr->value = tmr->interval;
-						if (timelt(&tmr->value, &sleeptime)) {
-							sleeptime = tmr->interval;
-						}
-					} else {
-						LIST_REMOVE(tmr);
-						release_timer(tmr);
-					}
-				} else {
-					/* remove the timer */
-					LIST_REMOVE(tmr);
-					release_timer(tmr);
+			}
+
+			if ((tmr->flags & AVBOX_TIMER_TYPE_AUTORELOAD) &&
+				ret == AVBOX_TIMER_CALLBACK_RESULT_CONTINUE) {
+				/* if this is an autoreload timer reload it. The new
+				 * deadline is relative to the last one so that we don't
+				 * drift, unless we've fallen a whole interval behind */
+				tmr->deadline = timeadd(&tmr->deadline, &tmr->interval);
+				if (timelt(&tmr->deadline, &now)) {
+					tmr->deadline = timeadd(&now, &tmr->interval);
 				}
+				heap_siftdown(0);
 			} else {
-				/* decrement the timer */
-				tmr->value = timediff(&elapsed, &tmr->value);
-				if (timelt(&tmr->value, &sleeptime)) {
-					sleeptime = tmr->value;
-				}
+				/* remove the timer */
+				avbox_timers_remove(tmr);
 			}
-		});
+		}
 
-		delay2abstime(&sleeptime);
-		last_sleep = now;
+		/* sleep until the next timer expires */
+		if (heap_len > 0) {
+			sleeptime = heap[0]->deadline;
+		} else {
+			sleeptime.tv_sec = 10;
+			sleeptime.tv_nsec = 0;
+			sleeptime = timeadd(&now, &sleeptime);
+		}
 		pthread_cond_timedwait(&timers_signal, &timers_lock, &sleeptime);
 	}
 
@@ -251,14 +361,10 @@ avbox_timer_cancel(int timer_id)
 
 	pthread_mutex_lock(&timers_lock);
 
-	LIST_FOREACH_SAFE(struct avbox_timer_state*, tmr, &timers, {
-		if (tmr->public.id == timer_id) {
-			LIST_REMOVE(tmr);
-			release_timer(tmr);
-			ret = 0;
-			break;
-		}
-	});
+	if ((tmr = avbox_timers_find(timer_id)) != NULL) {
+		avbox_timers_remove(tmr);
+		ret = 0;
+	}
 
 	pthread_mutex_unlock(&timers_lock);
 
@@ -274,6 +380,7 @@ avbox_timer_register(struct timespec *interval,
 	enum avbox_timer_flags flags, struct avbox_object *msgobj, avbox_timer_callback func, void *data)
 {
 	int ret = -1;
+	struct timespec now;
 	struct avbox_timer_state *timer;
 
 	/* DEBUG_PRINT("timers", "Registering timer"); */
@@ -284,8 +391,9 @@ avbox_timer_register(struct timespec *interval,
 		return -1;
 	}
 	memset(timer, 0, sizeof(struct avbox_timer_state));
+	clock_gettime(CLOCK_MONOTONIC, &now);
 	timer->interval = *interval;
-	timer->value = *interval;
+	timer->deadline = timeadd(&now, interval);
 	timer->message_object = msgobj;
 	timer->callback = func;
 	timer->public.data = data;
@@ -294,14 +402,23 @@ avbox_timer_register(struct timespec *interval,
 	/* DEBUG_VPRINT("timers", "Adding timer (%lis%linsecs)",
 		timer->value.tv_sec, timer->value.tv_nsec); */
 
-	/* add entry to list */
+	/* add entry to the heap */
 	pthread_mutex_lock(&timers_lock);
+	if (heap_push(timer) == -1) {
+		pthread_mutex_unlock(&timers_lock);
+		LOG_PRINT_ERROR("Could not register timer. Out of memory!");
+		release_timer(timer);
+		return -1;
+	}
 	ret = timer->public.id = avbox_timers_getnextid();
-	LIST_ADD(&timers, timer);
-	pthread_mutex_unlock(&timers_lock);
+	LIST_ADD(&timers_hash[ret & (AVBOX_TIMERS_HASH_SIZE - 1)], timer);
 
-	/* wake the timers thread */
-	pthread_cond_signal(&timers_signal);
+	/* wake the timers thread if this is now the
+	 * next timer to expire */
+	if (timer->heap_index == 0) {
+		pthread_cond_signal(&timers_signal);
+	}
+	pthread_mutex_unlock(&timers_lock);
 
 	return ret;
 }
@@ -313,23 +430,38 @@ avbox_timer_register(struct timespec *interval,
 INTERNAL int
 avbox_timers_init(void)
 {
+	int i;
 	pthread_mutexattr_t prio_inherit;
+	pthread_condattr_t monotonic;
 
 	DEBUG_PRINT("timers", "Initializing timers system");
 
-	LIST_INIT(&timers);
-	LIST_INIT(&timer_pool);
-	LIST_INIT(&timer_data_pool);
+	for (i = 0; i < AVBOX_TIMERS_HASH_SIZE; i++) {
+		LIST_INIT(&timers_hash[i]);
+	}
+
+	if ((timer_pool = avbox_pool_new("timer",
+		sizeof(struct avbox_timer_state), NULL, NULL)) == NULL ||
+		(timer_data_pool = avbox_pool_new("timer_data",
+		sizeof(struct avbox_timer_data), NULL, NULL)) == NULL) {
+		ABORT("Could not create timer pools!");
+	}
 
 	pthread_mutexattr_init(&prio_inherit);
 	pthread_mutexattr_setprotocol(&prio_inherit, PTHREAD_PRIO_INHERIT);
-	if (pthread_mutex_init(&timers_lock, &prio_inherit) != 0 ||
-		pthread_mutex_init(&timer_pool_lock, &prio_inherit) != 0 ||
-		pthread_mutex_init(&timer_data_pool_lock, &prio_inherit) != 0) {
+	if (pthread_mutex_init(&timers_lock, &prio_inherit) != 0) {
 		ABORT("Could not initialize mutexes!");
 	}
 	pthread_mutexattr_destroy(&prio_inherit);
 
+	/* timer deadlines are absolute CLOCK_MONOTONIC times */
+	pthread_condattr_init(&monotonic);
+	pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+	if (pthread_cond_init(&timers_signal, &monotonic) != 0) {
+		ABORT("Could not initialize condition variable!");
+	}
+	pthread_condattr_destroy(&monotonic);
+
 	if (pthread_create(&timers_thread, NULL, avbox_timers_thread, NULL) != 0) {
 		fprintf(stderr, "timers: Could not start thread\n");
 		return -1;
@@ -346,15 +478,31 @@ INTERNAL void
 avbox_timers_shutdown(void)
 {
 	struct avbox_timer_state *tmr;
+	struct avbox_pool *pool;
 
 	DEBUG_PRINT("timers", "Shutting down timers system");
 
+	pthread_mutex_lock(&timers_lock);
 	quit = 1;
 	pthread_cond_signal(&timers_signal);
+	pthread_mutex_unlock(&timers_lock);
 	pthread_join(timers_thread, NULL);
 
-	LIST_FOREACH_SAFE(struct avbox_timer_state*, tmr, &timers, {
-		LIST_REMOVE(tmr);
-		release_timer(tmr);
-	});
+	while (heap_len > 0) {
+		tmr = heap[heap_len - 1];
+		avbox_timers_remove(tmr);
+	}
+	free(heap);
+	heap = NULL;
+	heap_cap = 0;
+
+	avbox_pool_destroy(timer_pool);
+	timer_pool = NULL;
+
+	/* payloads may still be sitting on dispatch queues. Once
+	 * the pool is gone avbox_timers_releasepayload() frees
+	 * them directly */
+	pool = timer_data_pool;
+	__atomic_store_n(&timer_data_pool, NULL, __ATOMIC_RELEASE);
+	avbox_pool_destroy(pool);
 }
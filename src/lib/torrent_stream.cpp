@@ -2,7 +2,9 @@
 #	include "../config.h"
 #endif
 
-#include <queue>
+#include <list>
+#include <vector>
+#include <unordered_map>
 #include <libtorrent/session.hpp>
 #include <libtorrent/add_torrent_params.hpp>
 #include <libtorrent/torrent_handle.hpp>
@@ -34,6 +36,9 @@ extern "C" {
 
 #define READAHEAD_TAIL	(1024 * 1024 * 5)	/* bytes to read from end of file during warmup */
 #define READAHEAD_MIN	(1024 * 1024 * 15)	/* bytes to try to keep on readahead */
+#define READAHEAD_CACHE	(1024 * 1024 * 32)	/* bytes of already played pieces to keep cached */
+#define DEADLINE_WINDOW	(20)			/* seconds of stream to keep on piece deadlines */
+#define DEADLINE_WINDOW_MIN	(4)		/* minimum number of pieces on the deadline window */
 
 #define AVBOX_TORRENTMSG_METADATA_RECEIVED	(AVBOX_MESSAGETYPE_USER)
 
@@ -51,8 +56,9 @@ struct alerts_observer_plugin : lt::plugin
 
 struct piece_header
 {
-	boost::shared_array<char> buffer;
-	int size;
+	char *buffer;
+	int start;	/* offset of the first byte of the file on the piece */
+	int end;	/* offset of the last byte read + 1 */
 	int index;
 };
 
@@ -65,7 +71,8 @@ struct piece_status
 };
 
 
-typedef std::queue<boost::shared_ptr<struct piece_header> > piece_queue_t;
+typedef std::list<struct piece_header*> piece_lru_t;
+typedef std::unordered_map<int, piece_lru_t::iterator> piece_map_t;
 
 
 LISTABLE_STRUCT(avbox_torrent,
@@ -89,12 +96,21 @@ LISTABLE_STRUCT(avbox_torrent,
 	int warmed;				/* this flag is set to true after the stream has warmed up */
 	int n_avail_pieces;			/* the number of pieces downloaded */
 	int bitrate;				/* bitrate hint */
+	int window_first;			/* the first piece on the deadline window */
+	int window_last;			/* the last piece on the deadline window */
+	int rate;				/* measured download rate (bytes/sec) */
+	int rate_pieces;			/* n_avail_pieces when the rate was last sampled */
+	struct timespec rate_time;		/* the time when the rate was last sampled */
 	unsigned int flags;			/* flags */
 
 	pthread_cond_t readahead_cond;		/* used for waking the readahead thread */
 	pthread_cond_t user_cond;		/* used for waking the user thread */
 	std::vector<piece_status> avail_pieces;	/* list of downloaded pieces */
-	piece_queue_t readahead_pieces;		/* the readahead queue */
+	piece_lru_t cache_lru;			/* cached pieces, most recently used first */
+	piece_map_t cache_map;			/* cached pieces by index */
+	std::vector<struct piece_header*> cache_free;	/* unused piece buffers */
+	int cache_count;			/* the number of piece buffers allocated */
+	int cache_max;				/* the maximum number of piece buffers */
 	struct avbox_thread *readahead_thread;	/* the readahead thread */
 	struct avbox_delegate *readahead_fn;	/* the readahead worker */
 	struct avbox_object *object;		/* our own object */
@@ -312,6 +328,86 @@ warmed(struct avbox_torrent * const inst)
 }
 
 
+/**
+ * Samples the download rate. Must be called with the lock held.
+ */
+static void
+update_download_rate(struct avbox_torrent * const inst)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	const int64_t elapsed = utimediff(&now, &inst->rate_time);
+	if (elapsed < 1000LL * 1000LL) {
+		return;
+	}
+
+	const int64_t bytes = ((int64_t) (inst->n_avail_pieces - inst->rate_pieces)) * inst->piece_size;
+	const int rate = (bytes * 1000LL * 1000LL) / elapsed;
+
+	/* smooth it out a bit */
+	inst->rate = (inst->rate == 0) ? rate : ((inst->rate * 3) + rate) / 4;
+	inst->rate_pieces = inst->n_avail_pieces;
+	inst->rate_time = now;
+}
+
+
+/**
+ * Slides the deadline window to the current position. Pieces
+ * that we've played past lose their deadlines and the ones that
+ * enter the window get a deadline based on when they will be
+ * played. The window covers DEADLINE_WINDOW seconds of stream at
+ * the bitrate or at the download rate, whichever is faster, so
+ * that we keep requesting enough pieces to use all the bandwidth.
+ * Pieces outside the window are left to libtorrent's piece picker.
+ * Must be called with the lock held.
+ */
+static void
+slide_window(struct avbox_torrent * const inst)
+{
+	ASSERT(inst->have_metadata);
+	ASSERT(inst->handle.is_valid());
+
+	update_download_rate(inst);
+
+	const int64_t bytes_per_sec = MAX((int64_t) inst->bitrate / 8, (int64_t) inst->rate);
+	const int64_t playback_bytes_per_sec = MAX((int64_t) inst->bitrate / 8, 1LL);
+	const int stream_n_pieces = offset_to_piece_index(inst, inst->filesize - 1) + 1;
+	const int window_size = MAX(DEADLINE_WINDOW_MIN,
+		(int) ((bytes_per_sec * DEADLINE_WINDOW) / inst->piece_size) + 1);
+	const int first = offset_to_piece_index(inst, MIN(inst->pos, inst->filesize - 1));
+	const int last = MIN(stream_n_pieces - 1, first + window_size - 1);
+	int piece_index;
+
+	/* drop the pieces that we've played past */
+	for (piece_index = inst->window_first;
+		piece_index < first && piece_index <= inst->window_last; piece_index++) {
+		if (!have_piece(inst, piece_index)) {
+			inst->handle.reset_piece_deadline(piece_index);
+		}
+	}
+
+	/* add the pieces entering the window */
+	for (piece_index = MAX(first, inst->window_last + 1); piece_index <= last; piece_index++) {
+		if (!have_piece(inst, piece_index)) {
+			const int64_t distance = MAX(0LL, (((int64_t) piece_index) * inst->piece_size) -
+				inst->file_offset - inst->pos);
+			inst->handle.set_piece_deadline(piece_index,
+				(int) ((distance * 1000LL) / playback_bytes_per_sec), 0);
+		}
+	}
+
+	inst->window_first = first;
+	inst->window_last = MAX(last, inst->window_last);
+}
+
+
+/**
+ * Resets all piece deadlines. The tail of the file is
+ * prioritized first because most containers need it to
+ * start playback, then the window at the current position.
+ * Must be called with the lock held.
+ */
 static void
 adjust_priorities(struct avbox_torrent * const inst)
 {
@@ -326,11 +422,11 @@ adjust_priorities(struct avbox_torrent * const inst)
 	DEBUG_VPRINT(LOG_MODULE, "Adjusting piece priorities (piece_duration=%i)",
 		piece_duration);
 
+	inst->handle.clear_piece_deadlines();
+
 	/* prioritize pieces at the end */
 	first_piece = MAX(0, stream_n_pieces -
 		((READAHEAD_TAIL + inst->piece_size - 1) / inst->piece_size) - 1);
-	DEBUG_VPRINT(LOG_MODULE, "Prioritizing pieces %d to %d",
-		first_piece, stream_n_pieces - 1);
 	for (piece_index = first_piece;
 		piece_index >= 0 && piece_index < stream_n_pieces; piece_index++) {
 		if (!have_piece(inst, piece_index)) {
@@ -339,31 +435,13 @@ adjust_priorities(struct avbox_torrent * const inst)
 		}
 	}
 
-	/* next prioritize pieces starting at the current stream position */
-	if (inst->pos < inst->filesize) {
-		const int last_piece = first_piece;
-		DEBUG_VPRINT(LOG_MODULE, "Prioritizing pieces %d to %d",
-			offset_to_piece_index(inst, inst->pos), last_piece - 1);
-		for (piece_index = first_piece = offset_to_piece_index(inst, inst->pos);
-			piece_index < last_piece; piece_index++) {
-			if (!have_piece(inst, piece_index)) {
-				inst->handle.set_piece_deadline(piece_index, deadline, 0);
-				deadline += piece_duration;
-			}
-		}
-	}
+	/* then the window at the current stream position */
+	inst->window_first = offset_to_piece_index(inst, MIN(inst->pos, inst->filesize - 1));
+	inst->window_last = inst->window_first - 1;
+	slide_window(inst);
 
-	/* finally prioritize any remaining pieces */
-	if (first_piece > 0) {
-		DEBUG_VPRINT(LOG_MODULE, "Prioritizing pieces 0 to %d",
-			first_piece - 1);
-		for (piece_index = 0; piece_index < first_piece; piece_index++) {
-			if (!have_piece(inst, piece_index)) {
-				inst->handle.set_piece_deadline(piece_index, deadline, 0);
-				deadline += piece_duration;
-			}
-		}
-	}
+	DEBUG_VPRINT(LOG_MODULE, "Deadline window: %d to %d (rate=%i)",
+		inst->window_first, inst->window_last, inst->rate);
 }
 
 
@@ -474,6 +552,7 @@ metadata_received(struct avbox_torrent * const inst)
 	inst->file_offset = fs.file_offset(index);
 	inst->filesize = fs.file_size(index);
 	inst->readahead_min = READAHEAD_MIN;
+	inst->cache_max = ((READAHEAD_MIN + READAHEAD_CACHE) / inst->piece_size) + 3;
 	inst->block_size = inst->handle.status().block_size;
 	inst->blocks_per_piece = (inst->piece_size + inst->block_size - 1) / inst->block_size;
 	inst->name = ti->name();
@@ -503,6 +582,10 @@ metadata_received(struct avbox_torrent * const inst)
 		check_and_signal_piece_ready(inst, i);
 	}
 
+	/* start measuring the download rate from here */
+	inst->rate_pieces = inst->n_avail_pieces;
+	clock_gettime(CLOCK_MONOTONIC, &inst->rate_time);
+
 	adjust_priorities(inst);
 
 	pthread_cond_signal(&inst->readahead_cond);
@@ -672,6 +755,96 @@ alerts_observer_plugin::on_alert(lt::alert const * a)
 }
 
 
+/**
+ * Looks up a piece on the cache and marks it as the
+ * most recently used. Must be called with the lock held.
+ */
+static struct piece_header *
+cache_lookup(struct avbox_torrent * const inst, const int index)
+{
+	const piece_map_t::iterator it = inst->cache_map.find(index);
+	if (it == inst->cache_map.end()) {
+		return nullptr;
+	}
+	inst->cache_lru.splice(inst->cache_lru.begin(), inst->cache_lru, it->second);
+	return *it->second;
+}
+
+
+/**
+ * Gets a piece buffer. When all the buffers are in use the least
+ * recently used piece that is not between the stream position and
+ * the readahead position gets evicted. Returns nullptr if there are
+ * no buffers available. Must be called with the lock held.
+ */
+static struct piece_header *
+cache_alloc(struct avbox_torrent * const inst)
+{
+	struct piece_header *piece;
+
+	if (!inst->cache_free.empty()) {
+		piece = inst->cache_free.back();
+		inst->cache_free.pop_back();
+		return piece;
+	}
+
+	if (inst->cache_count < inst->cache_max) {
+		piece = new struct piece_header();
+		ASSERT(piece != nullptr);
+		piece->buffer = new char[inst->piece_size];
+		ASSERT(piece->buffer != nullptr);
+		inst->cache_count++;
+		return piece;
+	}
+
+	const int first = offset_to_piece_index(inst, inst->pos);
+	const int last = (inst->ra_pos > inst->pos) ?
+		offset_to_piece_index(inst, inst->ra_pos - 1) : (first - 1);
+	for (piece_lru_t::reverse_iterator it = inst->cache_lru.rbegin();
+		it != inst->cache_lru.rend(); it++) {
+		piece = *it;
+		if (piece->index < first || piece->index > last) {
+			inst->cache_map.erase(piece->index);
+			inst->cache_lru.erase(std::next(it).base());
+			return piece;
+		}
+	}
+
+	return nullptr;
+}
+
+
+/**
+ * Adds a piece to the cache. Must be called with the lock held.
+ */
+static void
+cache_insert(struct avbox_torrent * const inst, struct piece_header * const piece)
+{
+	ASSERT(inst->cache_map.find(piece->index) == inst->cache_map.end());
+	inst->cache_map[piece->index] = inst->cache_lru.insert(inst->cache_lru.begin(), piece);
+}
+
+
+/**
+ * Frees all the piece buffers.
+ */
+static void
+cache_destroy(struct avbox_torrent * const inst)
+{
+	for (piece_lru_t::iterator it = inst->cache_lru.begin(); it != inst->cache_lru.end(); it++) {
+		inst->cache_free.push_back(*it);
+	}
+	inst->cache_lru.clear();
+	inst->cache_map.clear();
+	while (!inst->cache_free.empty()) {
+		delete[] inst->cache_free.back()->buffer;
+		delete inst->cache_free.back();
+		inst->cache_free.pop_back();
+	}
+	inst->cache_count = 0;
+}
+
+
 static void*
 readahead(void *arg)
 {
@@ -711,26 +884,50 @@ readahead(void *arg)
 			continue;
 		}
 
+		/* if the next piece is cached then there's no need to
+		 * read it again. This is what makes seeking back cheap */
+		if (inst->have_metadata && inst->ra_pos < inst->filesize) {
+			struct piece_header * const piece =
+				cache_lookup(inst, offset_to_piece_index(inst, inst->ra_pos));
+			if (piece != nullptr) {
+				const int64_t piece_pos = ((int64_t) piece->index) * inst->piece_size - inst->file_offset;
+				inst->ra_pos = MIN(inst->filesize, piece_pos + piece->end);
+				if (inst->user_waiting && inst->warmed) {
+					pthread_cond_signal(&inst->user_cond);
+				}
+				pthread_mutex_unlock(&inst->lock);
+				continue;
+			}
+		}
+
 		if (inst->have_metadata && inst->ra_pos < inst->filesize &&
 			have_piece(inst, (inst->next_piece = offset_to_piece_index(inst, inst->ra_pos)))) {
 
-			const int64_t old_ra_pos = inst->ra_pos;
-			const int real_sz = piece_size(inst, inst->next_piece);
-			int sz = real_sz, buffer_offset = 0;
+			const int index = inst->next_piece;
+			const int64_t piece_pos = ((int64_t) index) * inst->piece_size - inst->file_offset;
+			const int64_t next_pos = piece_pos + inst->piece_size;
+			const int hint_next = (index + 1 < inst->n_pieces && next_pos < inst->filesize &&
+				have_piece(inst, index + 1) && inst->cache_map.find(index + 1) == inst->cache_map.end());
+			struct piece_header *piece;
+			int sz = piece_size(inst, index), start = 0;
 			ssize_t bytes_read;
 
-			ASSERT(inst->ra_pos + inst->file_offset >= ((int64_t) inst->next_piece) * inst->piece_size);
-
-			/* we're not reading the whole piece because we're only interested
-			 * in the bytes starting at the current ra_pos and they may even be
-			 * on another file in the case that (ra_pos == 0). This elimitanes
-			 * the possibility of still using the piece if we seek within the
-			 * same piece while reading, but that's very unlikely so for the sake
-			 * of simplicity only read what we need */
-			if (inst->ra_pos + inst->file_offset > (((int64_t) inst->next_piece) * inst->piece_size)) {
-				const int64_t diff = inst->ra_pos + inst->file_offset - (((int64_t) inst->next_piece) * inst->piece_size);
-				buffer_offset += diff;
-				sz -= diff;
+			ASSERT(inst->ra_pos + inst->file_offset >= ((int64_t) index) * inst->piece_size);
+
+			/* we always read the whole piece (or the part of it that
+			 * belongs to our file) so that it can be reused from the
+			 * cache if we seek anywhere within it */
+			if (piece_pos < 0) {
+				start = -piece_pos;
+				sz -= start;
+			}
+
+			/* get a buffer for the piece. If they're all holding
+			 * readahead data wait for the user to read some */
+			if ((piece = cache_alloc(inst)) == nullptr) {
+				pthread_cond_wait(&inst->readahead_cond, &inst->lock);
+				pthread_mutex_unlock(&inst->lock);
+				continue;
 			}
 
 			/* don't perform IO while owning the mutex */
@@ -745,6 +942,9 @@ readahead(void *arg)
 				if (stat(filename.c_str(), &st) == -1) {
 					LOG_VPRINT_ERROR("Could not stat file '%s': %s",
 						filename.c_str(), strerror(errno));
+					pthread_mutex_lock(&inst->lock);
+					inst->cache_free.push_back(piece);
+					pthread_mutex_unlock(&inst->lock);
 					usleep(10LL * 1000LL); /* throttle RT */
 					continue;
 				}
@@ -755,24 +955,26 @@ readahead(void *arg)
 				if ((fd = open(filename.c_str(), O_CLOEXEC)) == -1) {
 					LOG_VPRINT_ERROR("Could not open file '%s': %s",
 						filename.c_str(), strerror(errno));
+					pthread_mutex_lock(&inst->lock);
+					inst->cache_free.push_back(piece);
+					pthread_mutex_unlock(&inst->lock);
 					usleep(10LL * 1000LL); /* throttle RT */
 					continue;
 				}
 			}
 
-			/* allocate a buffer for the piece */
-			boost::shared_array<char> buffer(new char[inst->piece_size]);
-			ASSERT(buffer != nullptr);
+			/* let the kernel start fetching the next piece
+			 * while we read this one */
+			if (hint_next) {
+				(void) posix_fadvise(fd, next_pos,
+					MIN(inst->filesize - next_pos, (int64_t) inst->piece_size),
+					POSIX_FADV_WILLNEED);
+			}
 
 			/* read the piece */
-			if ((bytes_read = pread(fd, &buffer[buffer_offset], sz, inst->ra_pos)) < sz) {
-				if (bytes_read == -1) {
-					LOG_VPRINT_INFO("Could not read piece from file (piece_index=%i offset=%" PRIi64 "): %s",
-						inst->next_piece, inst->ra_pos, strerror(errno));
-					usleep(10LL * 1000LL);	/* throttle RT */
-					continue;
-				} else if (inst->next_piece == offset_to_piece_index(inst, inst->filesize - 1) &&
-					bytes_read >= (inst->filesize - inst->ra_pos)) {
+			if ((bytes_read = pread(fd, &piece->buffer[start], sz, piece_pos + start)) < sz) {
+				if (bytes_read != -1 && index == offset_to_piece_index(inst, inst->filesize - 1) &&
+					bytes_read >= (inst->filesize - (piece_pos + start))) {
 
 					/* This is our last piece and we have read AT LEAST until what
 					 * we think the end-of-file should be. However we may have read
@@ -780,12 +982,20 @@ readahead(void *arg)
 					 * done by libtorrent). So adjust the result in case of over-read
 					 * to ensure that we don't set ra_pos beyond the end-of-file when
 					 * incrementing bellow. */
-					bytes_read = inst->filesize - inst->ra_pos;
+					bytes_read = inst->filesize - (piece_pos + start);
 
 				} else {
-					DEBUG_VPRINT(LOG_MODULE, "pread() returned %d while expecting %d."
-						"(ra_pos=%" PRIi64 " filesize=%" PRIi64 " to_eof=%" PRIi64 ") Will keep trying.",
-						(int) bytes_read, (int) sz, inst->ra_pos, inst->filesize, inst->filesize - inst->ra_pos);
+					if (bytes_read == -1) {
+						LOG_VPRINT_INFO("Could not read piece from file (piece_index=%i offset=%" PRIi64 "): %s",
+							index, piece_pos + start, strerror(errno));
+					} else {
+						DEBUG_VPRINT(LOG_MODULE, "pread() returned %d while expecting %d."
+							"(ra_pos=%" PRIi64 " filesize=%" PRIi64 " to_eof=%" PRIi64 ") Will keep trying.",
+							(int) bytes_read, (int) sz, inst->ra_pos, inst->filesize, inst->filesize - inst->ra_pos);
+					}
+					pthread_mutex_lock(&inst->lock);
+					inst->cache_free.push_back(piece);
+					pthread_mutex_unlock(&inst->lock);
 					usleep(10LL * 1000LL);	/* throttle RT */
 					continue;
 				}
@@ -795,26 +1005,23 @@ readahead(void *arg)
 
 			pthread_mutex_lock(&inst->lock);
 
+			/* save the piece on the cache. Even if a seek() happened
+			 * while we were reading the piece is still good */
+			piece->index = index;
+			piece->start = start;
+			piece->end = start + bytes_read;
+			cache_insert(inst, piece);
+
 			/* if a seek() happened while we were reading then
-			 * we can no longer use this piece */
-			if (inst->ra_pos != old_ra_pos) {
-				DEBUG_VPRINT(LOG_MODULE, "Dropping read piece %i after seek",
-					inst->next_piece);
-				ASSERT(inst->readahead_pieces.size() == 0);
+			 * the piece is not the next one anymore */
+			if (offset_to_piece_index(inst, inst->ra_pos) != index) {
+				DEBUG_VPRINT(LOG_MODULE, "Piece %i no longer needed after seek",
+					index);
 				pthread_mutex_unlock(&inst->lock);
 				continue;
 			}
 
-			/* save the piece in the queue */
-			boost::shared_ptr<struct piece_header> const piece(new struct piece_header());
-			ASSERT(piece != nullptr);
-			piece->buffer = buffer;
-			piece->size = real_sz;
-			piece->index = inst->next_piece;
-			inst->readahead_pieces.push(piece);
-			inst->ra_pos += bytes_read;
-
-			ASSERT(inst->ra_pos <= inst->filesize);
+			inst->ra_pos = MIN(inst->filesize, piece_pos + piece->end);
 
 			/* if the user thread is waiting for a piece then
 			 * wake it up */
@@ -913,9 +1120,7 @@ avbox_torrent_close(struct avbox_torrent * const inst)
 		avbox_thread_destroy(inst->readahead_thread);
 
 		/* delete all cached pieces */
-		while (!inst->readahead_pieces.empty()) {
-			inst->readahead_pieces.pop();
-		}
+		cache_destroy(inst);
 	}
 
 	/* remove the torrent */
@@ -991,22 +1196,17 @@ avbox_torrent_read(struct avbox_torrent * const inst,
 		return 0;
 	}
 
+	/* everything between pos and ra_pos is on the cache */
 	const int piece_index = offset_to_piece_index(inst, inst->pos);
-	ASSERT(!inst->readahead_pieces.empty());
-
-	/* if we're done with the front piece then pop it */
-	if (inst->readahead_pieces.front()->index != piece_index) {
-		inst->readahead_pieces.pop();
-		ASSERT(!inst->readahead_pieces.empty());
-		ASSERT(inst->readahead_pieces.front()->index == piece_index);
-	}
+	const struct piece_header * const piece = cache_lookup(inst, piece_index);
+	ASSERT(piece != nullptr);
 
 	/* copy the bytes requested */
 	const int offset = (inst->pos + inst->file_offset) - (((int64_t) piece_index) * inst->piece_size);
-	const int bytes_to_read = (piece_index == offset_to_piece_index(inst, inst->filesize - 1)) ?
-		MIN(sz, inst->filesize - inst->pos) : MIN(sz, inst->readahead_pieces.front()->size - offset);
+	const int bytes_to_read = MIN(MIN(sz, inst->filesize - inst->pos), piece->end - offset);
+	ASSERT(offset >= piece->start && offset < piece->end);
 	ASSERT(bytes_to_read <= sz);
-	memcpy(buf, &inst->readahead_pieces.front()->buffer[offset], bytes_to_read);
+	memcpy(buf, &piece->buffer[offset], bytes_to_read);
 
 	/* signal the readahead thread if it may be waiting
 	 * for us */
@@ -1018,6 +1218,11 @@ avbox_torrent_read(struct avbox_torrent * const inst,
 	inst->pos += bytes_to_read;
 	ASSERT(inst->pos <= inst->filesize);
 
+	/* if we moved to another piece slide the deadline window */
+	if (offset_to_piece_index(inst, MIN(inst->pos, inst->filesize - 1)) != inst->window_first) {
+		slide_window(inst);
+	}
+
 	/* DEBUG_VPRINT(LOG_MODULE, "Read %i bytes from piece %i at offset %i (pos=%" PRIi64 " offset=%" PRIi64 " piece_size=%" PRIi64
 		"ra_pos=%" PRIi64 " count=%" PRIi64 ")",
 		bytes_to_read, piece_index, offset, inst->pos - bytes_to_read, inst->file_offset, inst->piece_size,
@@ -1133,12 +1338,8 @@ avbox_torrent_seek(struct avbox_torrent * const inst,
 		return -1;
 	}
 
-	/* delete all cached pieces */
-	while (!inst->readahead_pieces.empty()) {
-		inst->readahead_pieces.pop();
-	}
-
-	/* update the position and priorities */
+	/* update the position and priorities. The cached
+	 * pieces are kept so seeking back doesn't need IO */
 	inst->pos = inst->ra_pos = pos;
 	if (inst->have_metadata) {
 		adjust_priorities(inst);
@@ -1325,6 +1526,11 @@ avbox_torrent_open(const char * const uri, const char * const file,
 	inst->flags = flags;
 	inst->notify_object = notify_object;
 	inst->ra_pos = 0;
+	inst->cache_count = 0;
+	inst->cache_max = 0;
+	inst->window_first = 0;
+	inst->window_last = -1;
+	inst->rate = 0;
 	inst->readahead_fn = nullptr;
 	inst->bitrate = 12000000; /* about 12 Mbps for h264 1080p at 60Hz */
 
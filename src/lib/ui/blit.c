@@ -0,0 +1,620 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as 
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#	include "../../config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#	define HAVE_X86_KERNELS
+#	include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#	define HAVE_NEON_KERNELS
+#	include <arm_neon.h>
+#endif
+
+#define LOG_MODULE "blit"
+
+#include "../log.h"
+#include "../debug.h"
+#include "../compiler.h"
+#include "blit.h"
+
+
+/*
+ * All pixels are premultiplied BGRA (cairo's native ARGB32 on little
+ * endian machines). Blending is src OVER dst:
+ *
+ *	dst = src + dst * (255 - src.a) / 255
+ *
+ * The division is done with the same rounding on every implementation
+ * so all kernels produce exactly the same output as the scalar one.
+ */
+
+
+typedef void (*avbox_blit_blend_fn)(uint32_t * const dst,
+	const uint32_t * const src, const int n);
+typedef void (*avbox_blit_fill_fn)(uint32_t * const dst,
+	const uint32_t color, const int n);
+typedef void (*avbox_blit_copy_fn)(uint32_t * const dst,
+	const uint32_t * const src, const int n);
+
+
+/**
+ * A set of kernels for one instruction set.
+ */
+struct avbox_blit_kernels
+{
+	const char *name;
+	int (*supported)(void);
+	avbox_blit_blend_fn blend;
+	avbox_blit_fill_fn fill;
+	avbox_blit_copy_fn copy;
+	avbox_blit_copy_fn swaprb;
+};
+
+
+/**
+ * Blends a single pixel.
+ */
+static inline uint32_t
+avbox_blit_blendpixel(const uint32_t s, const uint32_t d)
+{
+	const uint32_t ia = 255 - (s >> 24);
+	uint32_t rb = (d & 0x00ff00ff) * ia + 0x00800080;
+	uint32_t ag = ((d >> 8) & 0x00ff00ff) * ia + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+	return s + (rb | ag);
+}
+
+
+/**
+ * Scalar blend kernel.
+ */
+static void
+avbox_blit_blend_c(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		const uint32_t s = src[i];
+		if (s >= 0xff000000) {
+			dst[i] = s;
+		} else if (s != 0) {
+			dst[i] = avbox_blit_blendpixel(s, dst[i]);
+		}
+	}
+}
+
+
+/**
+ * Scalar fill kernel.
+ */
+static void
+avbox_blit_fill_c(uint32_t * const dst, const uint32_t color, const int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[i] = color;
+	}
+}
+
+
+/**
+ * Scalar copy kernel.
+ */
+static void
+avbox_blit_copy_c(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	memcpy(dst, src, n * sizeof(uint32_t));
+}
+
+
+/**
+ * Scalar BGRA <-> RGBA conversion kernel.
+ */
+static void
+avbox_blit_swaprb_c(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		const uint32_t p = src[i];
+		dst[i] = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+	}
+}
+
+
+/**
+ * The scalar kernels run everywhere.
+ */
+static int
+avbox_blit_supported_c(void)
+{
+	return 1;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+/**
+ * SSE2 blend kernel. Blends 4 pixels per iteration.
+ */
+static void __attribute__((target("sse2")))
+avbox_blit_blend_sse2(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ff = _mm_set1_epi16(0xff);
+	const __m128i round = _mm_set1_epi16(0x80);
+	const __m128i amask = _mm_set1_epi32(0xff000000);
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i s, d, a, ia_lo, ia_hi, d_lo, d_hi;
+
+		s = _mm_loadu_si128((const __m128i*) (src + i));
+
+		/* all opaque or all transparent */
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, amask), amask)) == 0xffff) {
+			_mm_storeu_si128((__m128i*) (dst + i), s);
+			continue;
+		} else if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff) {
+			continue;
+		}
+
+		/* 255 - alpha on every 16-bit lane of each pixel */
+		a = _mm_srli_epi32(s, 24);
+		a = _mm_xor_si128(_mm_or_si128(a, _mm_slli_epi32(a, 16)), ff);
+		ia_lo = _mm_unpacklo_epi32(a, a);
+		ia_hi = _mm_unpackhi_epi32(a, a);
+
+		d = _mm_loadu_si128((const __m128i*) (dst + i));
+		d_lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia_lo), round);
+		d_hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia_hi), round);
+		d_lo = _mm_srli_epi16(_mm_add_epi16(d_lo, _mm_srli_epi16(d_lo, 8)), 8);
+		d_hi = _mm_srli_epi16(_mm_add_epi16(d_hi, _mm_srli_epi16(d_hi, 8)), 8);
+		d = _mm_adds_epu8(_mm_packus_epi16(d_lo, d_hi), s);
+
+		_mm_storeu_si128((__m128i*) (dst + i), d);
+	}
+
+	avbox_blit_blend_c(dst + i, src + i, n - i);
+}
+
+
+/**
+ * SSE2 fill kernel.
+ */
+static void __attribute__((target("sse2")))
+avbox_blit_fill_sse2(uint32_t * const dst, const uint32_t color, const int n)
+{
+	int i;
+	const __m128i c = _mm_set1_epi32(color);
+	for (i = 0; i + 4 <= n; i += 4) {
+		_mm_storeu_si128((__m128i*) (dst + i), c);
+	}
+	avbox_blit_fill_c(dst + i, color, n - i);
+}
+
+
+/**
+ * SSE2 copy kernel. Copies 16 pixels per iteration. The
+ * destination is aligned first so no store splits a cache
+ * line.
+ */
+static void __attribute__((target("sse2")))
+avbox_blit_copy_sse2(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	for (i = 0; i < n && (((uintptr_t) (dst + i)) & 15); i++) {
+		dst[i] = src[i];
+	}
+	for (; i + 16 <= n; i += 16) {
+		const __m128i a = _mm_loadu_si128((const __m128i*) (src + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*) (src + i + 4));
+		const __m128i c = _mm_loadu_si128((const __m128i*) (src + i + 8));
+		const __m128i d = _mm_loadu_si128((const __m128i*) (src + i + 12));
+		_mm_store_si128((__m128i*) (dst + i), a);
+		_mm_store_si128((__m128i*) (dst + i + 4), b);
+		_mm_store_si128((__m128i*) (dst + i + 8), c);
+		_mm_store_si128((__m128i*) (dst + i + 12), d);
+	}
+	for (; i < n; i++) {
+		dst[i] = src[i];
+	}
+}
+
+
+/**
+ * SSE2 BGRA <-> RGBA conversion kernel. There's no byte
+ * shuffle on SSE2 so we rotate each pixel by 16 bits and
+ * take red and blue from the rotated copy.
+ */
+static void __attribute__((target("sse2")))
+avbox_blit_swaprb_sse2(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	const __m128i ag = _mm_set1_epi32(0xff00ff00);
+	const __m128i rb = _mm_set1_epi32(0x00ff00ff);
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		const __m128i p = _mm_loadu_si128((const __m128i*) (src + i));
+		const __m128i r = _mm_or_si128(_mm_srli_epi32(p, 16), _mm_slli_epi32(p, 16));
+		_mm_storeu_si128((__m128i*) (dst + i),
+			_mm_or_si128(_mm_and_si128(p, ag), _mm_and_si128(r, rb)));
+	}
+	avbox_blit_swaprb_c(dst + i, src + i, n - i);
+}
+
+
+static int
+avbox_blit_supported_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+
+/**
+ * AVX2 blend kernel. Same as the SSE2 one but on 8 pixels
+ * per iteration. All the unpack/pack operations work within
+ * 128-bit lanes so the pixel order is preserved.
+ */
+static void __attribute__((target("avx2")))
+avbox_blit_blend_avx2(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ff = _mm256_set1_epi16(0xff);
+	const __m256i round = _mm256_set1_epi16(0x80);
+	const __m256i amask = _mm256_set1_epi32(0xff000000);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i s, d, a, ia_lo, ia_hi, d_lo, d_hi;
+
+		s = _mm256_loadu_si256((const __m256i*) (src + i));
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(s, amask), amask)) == -1) {
+			_mm256_storeu_si256((__m256i*) (dst + i), s);
+			continue;
+		} else if (_mm256_testz_si256(s, s)) {
+			continue;
+		}
+
+		a = _mm256_srli_epi32(s, 24);
+		a = _mm256_xor_si256(_mm256_or_si256(a, _mm256_slli_epi32(a, 16)), ff);
+		ia_lo = _mm256_unpacklo_epi32(a, a);
+		ia_hi = _mm256_unpackhi_epi32(a, a);
+
+		d = _mm256_loadu_si256((const __m256i*) (dst + i));
+		d_lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ia_lo), round);
+		d_hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), ia_hi), round);
+		d_lo = _mm256_srli_epi16(_mm256_add_epi16(d_lo, _mm256_srli_epi16(d_lo, 8)), 8);
+		d_hi = _mm256_srli_epi16(_mm256_add_epi16(d_hi, _mm256_srli_epi16(d_hi, 8)), 8);
+		d = _mm256_adds_epu8(_mm256_packus_epi16(d_lo, d_hi), s);
+
+		_mm256_storeu_si256((__m256i*) (dst + i), d);
+	}
+
+	avbox_blit_blend_sse2(dst + i, src + i, n - i);
+}
+
+
+/**
+ * AVX2 fill kernel.
+ */
+static void __attribute__((target("avx2")))
+avbox_blit_fill_avx2(uint32_t * const dst, const uint32_t color, const int n)
+{
+	int i;
+	const __m256i c = _mm256_set1_epi32(color);
+	for (i = 0; i + 8 <= n; i += 8) {
+		_mm256_storeu_si256((__m256i*) (dst + i), c);
+	}
+	avbox_blit_fill_c(dst + i, color, n - i);
+}
+
+
+/**
+ * AVX2 copy kernel. Copies 32 pixels per iteration into
+ * an aligned destination.
+ */
+static void __attribute__((target("avx2")))
+avbox_blit_copy_avx2(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	for (i = 0; i < n && (((uintptr_t) (dst + i)) & 31); i++) {
+		dst[i] = src[i];
+	}
+	for (; i + 32 <= n; i += 32) {
+		const __m256i a = _mm256_loadu_si256((const __m256i*) (src + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i*) (src + i + 8));
+		const __m256i c = _mm256_loadu_si256((const __m256i*) (src + i + 16));
+		const __m256i d = _mm256_loadu_si256((const __m256i*) (src + i + 24));
+		_mm256_store_si256((__m256i*) (dst + i), a);
+		_mm256_store_si256((__m256i*) (dst + i + 8), b);
+		_mm256_store_si256((__m256i*) (dst + i + 16), c);
+		_mm256_store_si256((__m256i*) (dst + i + 24), d);
+	}
+	avbox_blit_copy_sse2(dst + i, src + i, n - i);
+}
+
+
+/**
+ * AVX2 BGRA <-> RGBA conversion kernel. Swaps bytes 0 and 2
+ * of every pixel with a single shuffle.
+ */
+static void __attribute__((target("avx2")))
+avbox_blit_swaprb_avx2(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	const __m256i mask = _mm256_setr_epi8(
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		const __m256i p = _mm256_loadu_si256((const __m256i*) (src + i));
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_shuffle_epi8(p, mask));
+	}
+	avbox_blit_swaprb_sse2(dst + i, src + i, n - i);
+}
+
+
+static int
+avbox_blit_supported_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif	/* HAVE_X86_KERNELS */
+
+
+#ifdef HAVE_NEON_KERNELS
+
+/**
+ * NEON blend kernel. Works on 8 deinterleaved pixels
+ * per iteration.
+ */
+static void
+avbox_blit_blend_neon(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i, c;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint8x8x4_t s, d;
+		uint8x8_t ia;
+
+		s = vld4_u8((const uint8_t*) (src + i));
+		ia = vmvn_u8(s.val[3]);
+
+		/* all opaque or all transparent */
+		if (vget_lane_u64(vreinterpret_u64_u8(ia), 0) == 0) {
+			vst1q_u32(dst + i, vld1q_u32(src + i));
+			vst1q_u32(dst + i + 4, vld1q_u32(src + i + 4));
+			continue;
+		} else if ((vget_lane_u64(vreinterpret_u64_u8(vorr_u8(
+			vorr_u8(s.val[0], s.val[1]), vorr_u8(s.val[2], s.val[3]))), 0)) == 0) {
+			continue;
+		}
+
+		d = vld4_u8((const uint8_t*) (dst + i));
+		for (c = 0; c < 4; c++) {
+			const uint16x8_t t = vmull_u8(d.val[c], ia);
+			d.val[c] = vqadd_u8(s.val[c], vraddhn_u16(t, vrshrq_n_u16(t, 8)));
+		}
+		vst4_u8((uint8_t*) (dst + i), d);
+	}
+
+	avbox_blit_blend_c(dst + i, src + i, n - i);
+}
+
+
+/**
+ * NEON fill kernel.
+ */
+static void
+avbox_blit_fill_neon(uint32_t * const dst, const uint32_t color, const int n)
+{
+	int i;
+	const uint32x4_t c = vdupq_n_u32(color);
+	for (i = 0; i + 4 <= n; i += 4) {
+		vst1q_u32(dst + i, c);
+	}
+	avbox_blit_fill_c(dst + i, color, n - i);
+}
+
+
+/**
+ * NEON copy kernel. Copies 16 pixels per iteration.
+ */
+static void
+avbox_blit_copy_neon(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		const uint32x4_t a = vld1q_u32(src + i);
+		const uint32x4_t b = vld1q_u32(src + i + 4);
+		const uint32x4_t c = vld1q_u32(src + i + 8);
+		const uint32x4_t d = vld1q_u32(src + i + 12);
+		vst1q_u32(dst + i, a);
+		vst1q_u32(dst + i + 4, b);
+		vst1q_u32(dst + i + 8, c);
+		vst1q_u32(dst + i + 12, d);
+	}
+	avbox_blit_copy_c(dst + i, src + i, n - i);
+}
+
+
+/**
+ * NEON BGRA <-> RGBA conversion kernel. Deinterleaves 16
+ * pixels and stores them back with the blue and red
+ * planes swapped.
+ */
+static void
+avbox_blit_swaprb_neon(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x4_t p = vld4q_u8((const uint8_t*) (src + i));
+		const uint8x16_t b = p.val[0];
+		p.val[0] = p.val[2];
+		p.val[2] = b;
+		vst4q_u8((uint8_t*) (dst + i), p);
+	}
+	avbox_blit_swaprb_c(dst + i, src + i, n - i);
+}
+
+
+static int
+avbox_blit_supported_neon(void)
+{
+	return 1;
+}
+
+#endif	/* HAVE_NEON_KERNELS */
+
+
+/* fastest first. The scalar kernels must be the last entry */
+static const struct avbox_blit_kernels avbox_blit_kernels[] =
+{
+#ifdef HAVE_X86_KERNELS
+	{ "avx2", avbox_blit_supported_avx2, avbox_blit_blend_avx2,
+		avbox_blit_fill_avx2, avbox_blit_copy_avx2, avbox_blit_swaprb_avx2 },
+	{ "sse2", avbox_blit_supported_sse2, avbox_blit_blend_sse2,
+		avbox_blit_fill_sse2, avbox_blit_copy_sse2, avbox_blit_swaprb_sse2 },
+#endif
+#ifdef HAVE_NEON_KERNELS
+	{ "neon", avbox_blit_supported_neon, avbox_blit_blend_neon,
+		avbox_blit_fill_neon, avbox_blit_copy_neon, avbox_blit_swaprb_neon },
+#endif
+	{ "c", avbox_blit_supported_c, avbox_blit_blend_c,
+		avbox_blit_fill_c, avbox_blit_copy_c, avbox_blit_swaprb_c },
+	{ NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+
+/* until avbox_blit_init() is called use the scalar kernels */
+static const struct avbox_blit_kernels *kernels =
+	&avbox_blit_kernels[(sizeof(avbox_blit_kernels) / sizeof(avbox_blit_kernels[0])) - 2];
+
+
+/**
+ * Blends a row of premultiplied BGRA pixels over
+ * another one (src OVER dst).
+ */
+void
+avbox_blit_blend(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	kernels->blend(dst, src, n);
+}
+
+
+/**
+ * Fills a row of pixels with a color.
+ */
+void
+avbox_blit_fill(uint32_t * const dst, const uint32_t color, const int n)
+{
+	kernels->fill(dst, color, n);
+}
+
+
+/**
+ * Copies a row of pixels.
+ */
+void
+avbox_blit_copy(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	kernels->copy(dst, src, n);
+}
+
+
+/**
+ * Converts a row of BGRA pixels to RGBA or the other
+ * way around. dst may be the same as src.
+ */
+void
+avbox_blit_swaprb(uint32_t * const dst, const uint32_t * const src, const int n)
+{
+	kernels->swaprb(dst, src, n);
+}
+
+
+/**
+ * Selects a set of kernels by name. Returns -1 if they're
+ * not compiled in or not supported by the CPU.
+ */
+int
+avbox_blit_usekernels(const char * const name)
+{
+	const struct avbox_blit_kernels *k;
+
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+#endif
+
+	for (k = avbox_blit_kernels; k->name != NULL; k++) {
+		if (!strcmp(k->name, name)) {
+			if (!k->supported()) {
+				break;
+			}
+			kernels = k;
+			return 0;
+		}
+	}
+	errno = ENOTSUP;
+	return -1;
+}
+
+
+/**
+ * Gets the name of the kernels in use.
+ */
+const char *
+avbox_blit_kernels_name(void)
+{
+	return kernels->name;
+}
+
+
+/**
+ * Selects the fastest kernels supported by the CPU.
+ */
+void
+avbox_blit_init(void)
+{
+	const struct avbox_blit_kernels *k;
+
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+#endif
+
+	for (k = avbox_blit_kernels; k->name != NULL; k++) {
+		if (k->supported()) {
+			kernels = k;
+			break;
+		}
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Using '%s' blit kernels", kernels->name);
+}
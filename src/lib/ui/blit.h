@@ -0,0 +1,79 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as 
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#ifndef __AVBOX_BLIT_H__
+#define __AVBOX_BLIT_H__
+
+#include <stdint.h>
+
+
+/**
+ * Blends a row of premultiplied BGRA pixels over
+ * another one (src OVER dst).
+ */
+void
+avbox_blit_blend(uint32_t * const dst, const uint32_t * const src, const int n);
+
+
+/**
+ * Fills a row of pixels with a color.
+ */
+void
+avbox_blit_fill(uint32_t * const dst, const uint32_t color, const int n);
+
+
+/**
+ * Copies a row of pixels.
+ */
+void
+avbox_blit_copy(uint32_t * const dst, const uint32_t * const src, const int n);
+
+
+/**
+ * Converts a row of BGRA pixels to RGBA or the other
+ * way around. dst may be the same as src.
+ */
+void
+avbox_blit_swaprb(uint32_t * const dst, const uint32_t * const src, const int n);
+
+
+/**
+ * Selects a set of kernels by name ("avx2", "sse2", "neon"
+ * or "c"). Returns -1 if they're not available.
+ */
+int
+avbox_blit_usekernels(const char * const name);
+
+
+/**
+ * Gets the name of the kernels in use.
+ */
+const char *
+avbox_blit_kernels_name(void);
+
+
+/**
+ * Selects the fastest kernels supported by the CPU.
+ */
+void
+avbox_blit_init(void);
+
+#endif
@@ -26,14 +26,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
-#include <assert.h>
-#include <pthread.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
-#include <netinet/in.h>
-#include <fcntl.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
@@ -44,143 +39,90 @@
 
 #include "input.h"
 #include "input-socket.h"
-#include "../linkedlist.h"
 #include "../debug.h"
 #include "../log.h"
-#include "../process.h"
 #include "../bluetooth.h"
+#include "../timers.h"
 
 
-static int sockfd = -1;
-static int newsockfd = -1;
-static int server_quit = 0;
-static pthread_t thread;
-LIST sockets;
+#define AVBOX_INPUT_BLUETOOTH_BACKLOG	(4)
+#define AVBOX_INPUT_BLUETOOTH_RETRY	(5)
 
 
-static void
-avbox_input_bluetooth_socket_closed(struct socket_context * const ctx)
-{
-	DEBUG_VPRINT("input-bluetooth", "Connection closed (fd=%i)", ctx->fd);
-	LIST_REMOVE(ctx);
-	free(ctx);
-}
+static int retry_timer = -1;
 
 
-static void *
-avbox_input_bluetooth_listener(void *arg)
+/**
+ * Open the listening socket, hand it to the remote
+ * control server and register the bluetooth service.
+ */
+static int
+mbi_bluetooth_listen(void)
 {
-	int channelno;
-	unsigned int clilen;
-	struct sockaddr_rc serv_addr, cli_addr;
-	struct timeval tv;
-	struct socket_context *ctx = NULL;
-	fd_set fds;
-	int n;
-	pthread_attr_t attr;
-
-	DEBUG_SET_THREAD_NAME("input-bluetooth");
-	DEBUG_PRINT(LOG_MODULE, "Bluetooth input server starting");
-
-	while (!server_quit) {
-		channelno = 1;
-		sockfd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-		if (sockfd < 0) {
-			LOG_VPRINT_ERROR("Could not open socket: %s",
-				strerror(errno));
-			sleep(1);
-			continue;
-		}
-rebind:
+	int sockfd, channelno;
+	struct sockaddr_rc serv_addr;
+
+	if ((sockfd = socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_CLOEXEC, BTPROTO_RFCOMM)) < 0) {
+		LOG_VPRINT_ERROR("Could not open socket: %s",
+			strerror(errno));
+		return -1;
+	}
+
+	/* find a free RFCOMM channel */
+	for (channelno = 1; channelno <= 30; channelno++) {
 		bzero((char *) &serv_addr, sizeof(serv_addr));
 		serv_addr.rc_family = AF_BLUETOOTH;
 		serv_addr.rc_channel = channelno;
 		serv_addr.rc_bdaddr = *BDADDR_ANY;
-
-		if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-			LOG_VPRINT_ERROR("Could not bind() socket to channel %d: %s",
-				channelno, strerror(errno));
-			if (channelno < 30) {
-				channelno++;
-				goto rebind;
-			}
-			close(sockfd);
-			sleep(5);
-			continue;
+		if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) == 0) {
+			break;
 		}
+		LOG_VPRINT_ERROR("Could not bind() socket to channel %d: %s",
+			channelno, strerror(errno));
+	}
+	if (channelno > 30) {
+		close(sockfd);
+		return -1;
+	}
 
-		if (listen(sockfd, 1) == -1) {
-			LOG_VPRINT_ERROR("Could not listen() on socket: %s",
-				strerror(errno));
-			close(sockfd);
-			sleep(5);
-			continue;
-		}
-		clilen = sizeof(cli_addr);
-
-		/* register the bluetooth service */
-		avbox_bluetooth_register_service(channelno);
-
-		DEBUG_VPRINT("input-bluetooth", "Listening for connections on RFCOMM channel %i",
-			channelno);
-
-		while(!server_quit) {
-
-			FD_ZERO(&fds);
-			FD_SET(sockfd, &fds);
-
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			if ((n = select(sockfd + 1, &fds, NULL, NULL, &tv)) == 0) {
-				continue;
-			} else if (n < 0) {
-				if (errno == EINTR) {
-					continue;
-				}
-				LOG_VPRINT_ERROR("select() error: %s",
-					strerror(errno));
-				break;
-			}
-
-			if (!FD_ISSET(sockfd, &fds)) {
-				continue;
-			}
-
-			if ((newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen)) <= 0) {
-				LOG_VPRINT_ERROR("Could no accept() socket (fd=%d): %s",
-					newsockfd, strerror(errno));
-				continue;
-			}
-
-			DEBUG_VPRINT("input-bluetooth", "Incoming connection accepted (fd=%i)", newsockfd);
-
-			if ((ctx = malloc(sizeof(struct socket_context))) == NULL) {
-				LOG_PRINT_ERROR("Could not allocate connection context");
-				close(newsockfd);
-				continue;
-			}
-
-			ctx->fd = newsockfd;
-			ctx->quit = 0;
-			ctx->closed_callback = avbox_input_bluetooth_socket_closed;
-
-			LIST_ADD(&sockets, ctx);
-
-			if (pthread_create(&ctx->thread, &attr, &avbox_input_bluetooth_listener, ctx) != 0) {
-				LOG_PRINT_ERROR("Could not create bluetooth socket thread");
-				LIST_REMOVE(ctx);
-				close(newsockfd);
-				free(ctx);
-				continue;
-			}
-		}
+	if (listen(sockfd, AVBOX_INPUT_BLUETOOTH_BACKLOG) == -1) {
+		LOG_VPRINT_ERROR("Could not listen() on socket: %s",
+			strerror(errno));
 		close(sockfd);
-		sockfd = -1;
+		return -1;
+	}
+
+	/* the remote control server owns the socket from now on */
+	if (avbox_input_socket_listen(sockfd, "bluetooth") == -1) {
+		close(sockfd);
+		return -1;
 	}
 
-	DEBUG_PRINT("input-bluetooth", "TCP input server exiting");
+	/* register the bluetooth service */
+	avbox_bluetooth_register_service(channelno);
 
-	return NULL;
+	DEBUG_VPRINT(LOG_MODULE, "Listening for connections on RFCOMM channel %i",
+		channelno);
+
+	return 0;
+}
+
+
+/**
+ * Retry opening the listening socket until it succeeds.
+ */
+static enum avbox_timer_result
+mbi_bluetooth_retry(int id, void *data)
+{
+	(void) id;
+	(void) data;
+
+	if (mbi_bluetooth_listen() == -1) {
+		return AVBOX_TIMER_CALLBACK_RESULT_CONTINUE;
+	}
+
+	__atomic_store_n(&retry_timer, -1, __ATOMIC_SEQ_CST);
+	return AVBOX_TIMER_CALLBACK_RESULT_STOP;
 }
 
 
@@ -190,37 +132,46 @@ rebind:
 int
 mbi_bluetooth_init(void)
 {
-	DEBUG_PRINT("input-bluetooth", "Initializing bluetooth input server");
-	LIST_INIT(&sockets);
+	int timer_id;
+	struct timespec tv;
+
+	DEBUG_PRINT(LOG_MODULE, "Initializing bluetooth input server");
+
+	if (mbi_bluetooth_listen() == 0) {
+		return 0;
+	}
+
+	LOG_PRINT_ERROR("Will keep trying.");
 
-	if (pthread_create(&thread, NULL, avbox_input_bluetooth_listener, NULL) != 0) {
-		LOG_PRINT_ERROR("Could not create bluetooth listener thread");
+	tv.tv_sec = AVBOX_INPUT_BLUETOOTH_RETRY;
+	tv.tv_nsec = 0;
+	if ((timer_id = avbox_timer_register(&tv, AVBOX_TIMER_TYPE_AUTORELOAD,
+		NULL, mbi_bluetooth_retry, NULL)) == -1) {
+		LOG_PRINT_ERROR("Could not register retry timer");
 		return -1;
 	}
+	__atomic_store_n(&retry_timer, timer_id, __ATOMIC_SEQ_CST);
+
 	return 0;
 }
 
 
+/**
+ * Shutdown the bluetooth input server. The listening socket and
+ * all connections are closed by avbox_input_socket_shutdown().
+ */
 void
 mbi_bluetooth_destroy(void)
 {
-	struct socket_context *socket;
+	int timer_id;
 
-	DEBUG_PRINT("input-bluetooth", "Exiting (give me 2 secs)");
-
-	/* Close all connections */
-	DEBUG_PRINT("input-bluetooth", "Closing all open sockets");
-	LIST_FOREACH(struct socket_context*, socket, &sockets) {
-		socket->quit = 1;
-		/* pthread_join(socket->thread, NULL); */
-	}
+	DEBUG_PRINT(LOG_MODULE, "Bluetooth input server exiting");
 
-	server_quit = 1;
-	if (newsockfd != -1) {
-		close(newsockfd);
+	/* the timer callback runs on the timers thread so
+	 * take the id atomically */
+	if ((timer_id = __atomic_exchange_n(&retry_timer, -1, __ATOMIC_SEQ_CST)) != -1) {
+		avbox_timer_cancel(timer_id);
 	}
-	close(sockfd);
-	pthread_join(thread, NULL);
 }
 
 #endif
@@ -27,14 +27,21 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 
 #define LOG_MODULE "input-socket"
 
 #include "input.h"
 #include "input-socket.h"
+#include "../linkedlist.h"
+#include "../thread.h"
+#include "../delegate.h"
 #include "../debug.h"
 #include "../log.h"
 
@@ -43,181 +50,502 @@
 #define STRINGIZE(x) STRINGIZE2(x)
 
 
-void *
-avbox_input_socket_connect(void *arg)
-{
-	struct socket_context *ctx = (struct socket_context*) arg;
-	int fd = ctx->fd;
-	int n;
-	ssize_t ret;
-	struct timeval tv;
-	char buffer[4096], *pbuf;
-	fd_set fds;
+/*
+ * All remote control connections (tcp, bluetooth, etc) are
+ * served by a single thread that multiplexes them with epoll.
+ * Connections beyond AVBOX_INPUT_SOCKET_MAX_CONNECTIONS are
+ * closed as soon as they're accepted.
+ */
+#define AVBOX_INPUT_SOCKET_MAX_CONNECTIONS	(16)
+#define AVBOX_INPUT_SOCKET_MAX_EVENTS		(8)
+#define AVBOX_INPUT_SOCKET_BUFSZ		(4096)
 
-	ASSERT(arg != NULL);
-	ASSERT(((struct socket_context*) arg)->fd > 0);
+#define AVBOX_INPUT_SOCKET_LISTENER		(0)
+#define AVBOX_INPUT_SOCKET_CONNECTION		(1)
 
-	DEBUG_SET_THREAD_NAME("input-socket");
-	DEBUG_PRINT("input-socket", "Connection handler running");
 
-	pthread_detach(pthread_self());
+/**
+ * A listening socket or a client connection.
+ */
+LISTABLE_STRUCT(avbox_input_socket,
+	int type;
+	int fd;
+	int discard;
+	size_t len;
+	const char *name;
+	char *buf;
+);
 
-	/* clear the buffer */
-	bzero(buffer, sizeof(buffer));
 
-	while (!ctx->quit) {
+static int epollfd = -1;
+static int wakefd = -1;
+static int server_quit = 0;
+static int nconnections = 0;
+static struct avbox_thread *thread = NULL;
+static struct avbox_delegate *worker = NULL;
+static pthread_mutex_t sockets_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST sockets;
 
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
 
-		/* check if the connection is still good */
-		if (fcntl(fd, F_GETFD) == -1) {
-			LOG_VPRINT_ERROR("Connection broken (fd=%i)", fd);
-			break;
+/**
+ * Puts a file descriptor in nonblocking mode.
+ */
+static int
+avbox_input_socket_nonblock(const int fd)
+{
+	int flags;
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Parses a command and sends the corresponding event.
+ */
+static void
+avbox_input_socket_command(const char * const buffer)
+{
+	if (!strncmp("DOWNLOAD:", buffer, 9)) {
+		char *url;
+		if ((url = strdup(buffer + 9)) == NULL) {
+			LOG_PRINT_ERROR("Could not allocate memory for DOWNLOAD link");
+		} else {
+			avbox_input_sendevent(MBI_EVENT_DOWNLOAD, url);
 		}
+	} else if (!strncmp("MENU_LONG", buffer, 9)) {
+		avbox_input_sendevent(MBI_EVENT_CONTEXT, NULL);
+	} else if (!strncmp("MENU", buffer, 4)) {
+		avbox_input_sendevent(MBI_EVENT_MENU, NULL);
+	} else if (!strncmp("LEFT", buffer, 4)) {
+		avbox_input_sendevent(MBI_EVENT_ARROW_LEFT, NULL);
+	} else if (!strncmp("RIGHT", buffer, 5)) {
+		avbox_input_sendevent(MBI_EVENT_ARROW_RIGHT, NULL);
+	} else if (!strncmp("UP", buffer, 2)) {
+		avbox_input_sendevent(MBI_EVENT_ARROW_UP, NULL);
+	} else if (!strncmp("DOWN", buffer, 4)) {
+		avbox_input_sendevent(MBI_EVENT_ARROW_DOWN, NULL);
+	} else if (!strncmp("ENTER", buffer, 5)) {
+		avbox_input_sendevent(MBI_EVENT_ENTER, NULL);
+	} else if (!strncmp("BACK", buffer, 4)) {
+		avbox_input_sendevent(MBI_EVENT_BACK, NULL);
+	} else if (!strncmp("PLAY", buffer, 4)) {
+		avbox_input_sendevent(MBI_EVENT_PLAY, NULL);
+	} else if (!strncmp("STOP", buffer, 4)) {
+		avbox_input_sendevent(MBI_EVENT_STOP, NULL);
+	} else if (!strncmp("CLEAR", buffer, 5)) {
+		avbox_input_sendevent(MBI_EVENT_CLEAR, NULL);
+	} else if (!strncmp("PREV", buffer, 4)) {
+		avbox_input_sendevent(MBI_EVENT_PREV, NULL);
+	} else if (!strncmp("NEXT", buffer, 4)) {
+		avbox_input_sendevent(MBI_EVENT_NEXT, NULL);
+	} else if (!strncmp("INFO", buffer, 4)) {
+		avbox_input_sendevent(MBI_EVENT_INFO, NULL);
+	} else if (!strncmp("VOLUP", buffer, 5)) {
+		avbox_input_sendevent(MBI_EVENT_VOLUME_UP, NULL);
+	} else if (!strncmp("VOLDOWN", buffer, 7)) {
+		avbox_input_sendevent(MBI_EVENT_VOLUME_DOWN, NULL);
+	} else if (!strncmp("KEY:", buffer, 4)) {
+#define ELIF_KEY(x) \
+else if (!strncmp(buffer + 4, STRINGIZE(x), 1)) { \
+	avbox_input_sendevent(MBI_EVENT_KBD_ ##x, NULL); \
+}
 
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-		if ((n = select(fd + 1, &fds, NULL, NULL, &tv)) == 0) {
-			continue;
-		} else if (n < 0) {
+		if (!strncmp(buffer + 4, " ", 1)) {
+			avbox_input_sendevent(MBI_EVENT_KBD_SPACE, NULL);
+		}
+		ELIF_KEY(A)
+		ELIF_KEY(B)
+		ELIF_KEY(C)
+		ELIF_KEY(D)
+		ELIF_KEY(E)
+		ELIF_KEY(F)
+		ELIF_KEY(G)
+		ELIF_KEY(H)
+		ELIF_KEY(I)
+		ELIF_KEY(J)
+		ELIF_KEY(K)
+		ELIF_KEY(L)
+		ELIF_KEY(M)
+		ELIF_KEY(N)
+		ELIF_KEY(O)
+		ELIF_KEY(P)
+		ELIF_KEY(Q)
+		ELIF_KEY(R)
+		ELIF_KEY(S)
+		ELIF_KEY(T)
+		ELIF_KEY(U)
+		ELIF_KEY(V)
+		ELIF_KEY(W)
+		ELIF_KEY(X)
+		ELIF_KEY(Y)
+		ELIF_KEY(Z)
+#undef ELIF_KEY
+	} else if (!strncmp("URL:", buffer, 4)) {
+		char *url;
+		if ((url = strdup(buffer + 4)) == NULL) {
+			LOG_PRINT_ERROR("Could not allocate memory for URL");
+		} else {
+			avbox_input_sendevent(MBI_EVENT_URL, url);
+		}
+	} else if (!strncmp("TRACK", buffer, 5)) {
+		avbox_input_sendevent(MBI_EVENT_TRACK, NULL);
+	} else if (!strncmp("TRACK_LONG", buffer, 10)) {
+		avbox_input_sendevent(MBI_EVENT_TRACK_LONG, NULL);
+	} else {
+		DEBUG_VPRINT(LOG_MODULE, "Unknown command '%s'", buffer);
+	}
+}
+
+
+/**
+ * Closes a socket and frees it's context. Must be
+ * called with the sockets list locked.
+ */
+static void
+avbox_input_socket_close(struct avbox_input_socket * const sock)
+{
+	DEBUG_VPRINT(LOG_MODULE, "Closing %s socket (fd=%i)",
+		sock->name, sock->fd);
+
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, sock->fd, NULL);
+	close(sock->fd);
+	LIST_REMOVE(sock);
+
+	if (sock->type == AVBOX_INPUT_SOCKET_CONNECTION) {
+		nconnections--;
+		free(sock->buf);
+	}
+	free(sock);
+}
+
+
+/**
+ * Accepts all pending connections on a listening socket.
+ */
+static void
+avbox_input_socket_accept(struct avbox_input_socket * const listener)
+{
+	int fd;
+	struct epoll_event ev;
+	struct avbox_input_socket *conn;
+
+	while (1) {
+		if ((fd = accept(listener->fd, NULL, NULL)) == -1) {
 			if (errno == EINTR) {
 				continue;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				LOG_VPRINT_ERROR("Could not accept %s connection: %s",
+					listener->name, strerror(errno));
 			}
-			LOG_VPRINT_ERROR("select() returned %i", n);
-			break;
+			return;
 		}
 
-		/* if there's no data continue waiting */
-		if (!FD_ISSET(fd, &fds)) {
+		if (nconnections >= AVBOX_INPUT_SOCKET_MAX_CONNECTIONS) {
+			LOG_VPRINT_ERROR("Too many connections. Rejecting %s connection (fd=%i)",
+				listener->name, fd);
+			close(fd);
 			continue;
 		}
 
-		/* read the next line one char at the time for now */
-		n = 0;
-		pbuf = buffer;
-		while (n < sizeof(buffer) - 1) {
-			if (ctx->quit) {
-				goto end;
-			}
-			if ((ret = read(fd, pbuf, 1)) == -1) {
-				if (errno == EAGAIN || errno == EINTR) {
-					continue;
-				} else {
-					LOG_VPRINT_ERROR("Unable to read() from socket: %s",
-						strerror(errno));
-					goto end;
-				}
-			} else if (ret == 0) {
-				goto end; /* eof */
-			}
-			if (*pbuf == '\n') {
-				*pbuf = '\0';
-				break;
+		if (avbox_input_socket_nonblock(fd) == -1) {
+			LOG_VPRINT_ERROR("Could not set %s connection nonblocking: %s",
+				listener->name, strerror(errno));
+			close(fd);
+			continue;
+		}
+
+		if ((conn = malloc(sizeof(struct avbox_input_socket))) == NULL) {
+			ASSERT(errno == ENOMEM);
+			LOG_PRINT_ERROR("Could not accept connection. Out of memory");
+			close(fd);
+			continue;
+		}
+		if ((conn->buf = malloc(AVBOX_INPUT_SOCKET_BUFSZ)) == NULL) {
+			ASSERT(errno == ENOMEM);
+			LOG_PRINT_ERROR("Could not accept connection. Out of memory");
+			free(conn);
+			close(fd);
+			continue;
+		}
+
+		conn->type = AVBOX_INPUT_SOCKET_CONNECTION;
+		conn->fd = fd;
+		conn->discard = 0;
+		conn->len = 0;
+		conn->name = listener->name;
+
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			LOG_VPRINT_ERROR("Could not register %s connection: %s",
+				listener->name, strerror(errno));
+			free(conn->buf);
+			free(conn);
+			close(fd);
+			continue;
+		}
+
+		LIST_ADD(&sockets, conn);
+		nconnections++;
+
+		DEBUG_VPRINT(LOG_MODULE, "Incoming %s connection accepted (fd=%i)",
+			listener->name, fd);
+	}
+}
+
+
+/**
+ * Reads all available data from a connection and
+ * processes every complete line. Returns -1 if the
+ * connection needs to be closed.
+ */
+static int
+avbox_input_socket_read(struct avbox_input_socket * const conn)
+{
+	ssize_t ret;
+	char *line, *eol, *end;
+
+	while (1) {
+		if ((ret = read(conn->fd, conn->buf + conn->len,
+			AVBOX_INPUT_SOCKET_BUFSZ - conn->len - 1)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
 			}
-			n++;
-			pbuf++;
+			LOG_VPRINT_ERROR("Unable to read() from socket: %s",
+				strerror(errno));
+			return -1;
+		} else if (ret == 0) {
+			return -1; /* eof */
 		}
 
-		/* process the command */
-		if (!strncmp("DOWNLOAD:", buffer, 9)) {
-			char *url;
-			if ((url = strdup(buffer + 9)) == NULL) {
-				LOG_PRINT_ERROR("Could not allocate memory for DOWNLOAD link");
+		conn->len += ret;
+		conn->buf[conn->len] = '\0';
+		end = conn->buf + conn->len;
+		line = conn->buf;
+
+		while ((eol = memchr(line, '\n', end - line)) != NULL) {
+			*eol = '\0';
+			if (eol > line && eol[-1] == '\r') {
+				eol[-1] = '\0';
+			}
+			if (conn->discard) {
+				conn->discard = 0;
 			} else {
-				avbox_input_sendevent(MBI_EVENT_DOWNLOAD, url);
+				avbox_input_socket_command(line);
 			}
-		} else if (!strncmp("MENU_LONG", buffer, 9)) {
-			avbox_input_sendevent(MBI_EVENT_CONTEXT, NULL);
-		} else if (!strncmp("MENU", buffer, 4)) {
-			avbox_input_sendevent(MBI_EVENT_MENU, NULL);
-		} else if (!strncmp("LEFT", buffer, 4)) {
-			avbox_input_sendevent(MBI_EVENT_ARROW_LEFT, NULL);
-		} else if (!strncmp("RIGHT", buffer, 5)) {
-			avbox_input_sendevent(MBI_EVENT_ARROW_RIGHT, NULL);
-		} else if (!strncmp("UP", buffer, 2)) {
-			avbox_input_sendevent(MBI_EVENT_ARROW_UP, NULL);
-		} else if (!strncmp("DOWN", buffer, 4)) {
-			avbox_input_sendevent(MBI_EVENT_ARROW_DOWN, NULL);
-		} else if (!strncmp("ENTER", buffer, 5)) {
-			avbox_input_sendevent(MBI_EVENT_ENTER, NULL);
-		} else if (!strncmp("BACK", buffer, 4)) {
-			avbox_input_sendevent(MBI_EVENT_BACK, NULL);
-		} else if (!strncmp("PLAY", buffer, 4)) {
-			avbox_input_sendevent(MBI_EVENT_PLAY, NULL);
-		} else if (!strncmp("STOP", buffer, 4)) {
-			avbox_input_sendevent(MBI_EVENT_STOP, NULL);
-		} else if (!strncmp("CLEAR", buffer, 5)) {
-			avbox_input_sendevent(MBI_EVENT_CLEAR, NULL);
-		} else if (!strncmp("PREV", buffer, 4)) {
-			avbox_input_sendevent(MBI_EVENT_PREV, NULL);
-		} else if (!strncmp("NEXT", buffer, 4)) {
-			avbox_input_sendevent(MBI_EVENT_NEXT, NULL);
-		} else if (!strncmp("INFO", buffer, 4)) {
-			avbox_input_sendevent(MBI_EVENT_INFO, NULL);
-		} else if (!strncmp("VOLUP", buffer, 5)) {
-			avbox_input_sendevent(MBI_EVENT_VOLUME_UP, NULL);
-		} else if (!strncmp("VOLDOWN", buffer, 7)) {
-			avbox_input_sendevent(MBI_EVENT_VOLUME_DOWN, NULL);
-		} else if (!strncmp("KEY:", buffer, 4)) {
-#define ELIF_KEY(x) \
-	else if (!strncmp(buffer + 4, STRINGIZE(x), 1)) { \
-		avbox_input_sendevent(MBI_EVENT_KBD_ ##x, NULL); \
+			line = eol + 1;
+		}
+
+		/* keep the incomplete line at the start of the
+		 * buffer. If it doesn't fit drop it and skip the
+		 * rest of it */
+		conn->len = end - line;
+		if (conn->len == AVBOX_INPUT_SOCKET_BUFSZ - 1) {
+			LOG_VPRINT_ERROR("Command too long. Discarding (fd=%i)",
+				conn->fd);
+			conn->discard = 1;
+			conn->len = 0;
+		} else if (line != conn->buf) {
+			memmove(conn->buf, line, conn->len);
+		}
 	}
+}
+
+
+/**
+ * Remote control server thread.
+ */
+static void *
+avbox_input_socket_server(void *arg)
+{
+	int i, n;
+	struct epoll_event events[AVBOX_INPUT_SOCKET_MAX_EVENTS];
+	struct avbox_input_socket *sock;
 
-			if (!strncmp(buffer + 4, " ", 1)) {
-				avbox_input_sendevent(MBI_EVENT_KBD_SPACE, NULL);
+	DEBUG_SET_THREAD_NAME("input-socket");
+	DEBUG_PRINT(LOG_MODULE, "Remote control server running");
+
+	while (!server_quit) {
+		if ((n = epoll_wait(epollfd, events, AVBOX_INPUT_SOCKET_MAX_EVENTS, -1)) == -1) {
+			if (errno == EINTR) {
+				continue;
 			}
-			ELIF_KEY(A)
-			ELIF_KEY(B)
-			ELIF_KEY(C)
-			ELIF_KEY(D)
-			ELIF_KEY(E)
-			ELIF_KEY(F)
-			ELIF_KEY(G)
-			ELIF_KEY(H)
-			ELIF_KEY(I)
-			ELIF_KEY(J)
-			ELIF_KEY(K)
-			ELIF_KEY(L)
-			ELIF_KEY(M)
-			ELIF_KEY(N)
-			ELIF_KEY(O)
-			ELIF_KEY(P)
-			ELIF_KEY(Q)
-			ELIF_KEY(R)
-			ELIF_KEY(S)
-			ELIF_KEY(T)
-			ELIF_KEY(U)
-			ELIF_KEY(V)
-			ELIF_KEY(W)
-			ELIF_KEY(X)
-			ELIF_KEY(Y)
-			ELIF_KEY(Z)
-#undef ELIF_KEY
-		} else if (!strncmp("URL:", buffer, 4)) {
-			char *url;
-			if ((url = strdup(buffer + 4)) == NULL) {
-				LOG_PRINT_ERROR("Could not allocate memory for URL");
-			} else {
-				avbox_input_sendevent(MBI_EVENT_URL, url);
+			LOG_VPRINT_ERROR("epoll_wait() error: %s",
+				strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&sockets_lock);
+		for (i = 0; i < n; i++) {
+			if ((sock = events[i].data.ptr) == NULL) {
+				/* woken up by avbox_input_socket_shutdown() */
+				continue;
+			}
+			if (sock->type == AVBOX_INPUT_SOCKET_LISTENER) {
+				avbox_input_socket_accept(sock);
+			} else if ((events[i].events & EPOLLIN) &&
+				avbox_input_socket_read(sock) == -1) {
+				avbox_input_socket_close(sock);
+			} else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				avbox_input_socket_close(sock);
 			}
-		} else if (!strncmp("TRACK", buffer, 5)) {
-			avbox_input_sendevent(MBI_EVENT_TRACK, NULL);
-		} else if (!strncmp("TRACK_LONG", buffer, 10)) {
-			avbox_input_sendevent(MBI_EVENT_TRACK_LONG, NULL);
-		} else {
-			DEBUG_VPRINT(LOG_MODULE, "Unknown command '%s'", buffer);
 		}
+		pthread_mutex_unlock(&sockets_lock);
 	}
-end:
-	DEBUG_VPRINT(LOG_MODULE, "Closing connection (fd=%i)", fd);
 
-	close(fd);
+	DEBUG_PRINT(LOG_MODULE, "Remote control server exiting");
+
+	return NULL;
+}
+
 
-	if (ctx->closed_callback != NULL) {
-		ctx->closed_callback(ctx);
+/**
+ * Registers a listening socket with the remote control
+ * server. The server takes ownership of the file descriptor
+ * and accepts and serves connections on it until it is
+ * shutdown.
+ */
+int
+avbox_input_socket_listen(int fd, const char * const name)
+{
+	struct epoll_event ev;
+	struct avbox_input_socket *sock;
+
+	ASSERT(fd >= 0);
+	ASSERT(name != NULL);
+	ASSERT(epollfd != -1);
+
+	if (avbox_input_socket_nonblock(fd) == -1) {
+		LOG_VPRINT_ERROR("Could not set %s socket nonblocking: %s",
+			name, strerror(errno));
+		return -1;
 	}
 
-	return NULL;
+	if ((sock = malloc(sizeof(struct avbox_input_socket))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+
+	sock->type = AVBOX_INPUT_SOCKET_LISTENER;
+	sock->fd = fd;
+	sock->discard = 0;
+	sock->len = 0;
+	sock->name = name;
+	sock->buf = NULL;
+
+	pthread_mutex_lock(&sockets_lock);
+	ev.events = EPOLLIN;
+	ev.data.ptr = sock;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		const int err = errno;
+		LOG_VPRINT_ERROR("Could not register %s socket: %s",
+			name, strerror(err));
+		pthread_mutex_unlock(&sockets_lock);
+		free(sock);
+		errno = err;
+		return -1;
+	}
+	LIST_ADD(&sockets, sock);
+	pthread_mutex_unlock(&sockets_lock);
+
+	return 0;
+}
+
+
+/**
+ * Starts the remote control server.
+ */
+int
+avbox_input_socket_init(void)
+{
+	struct epoll_event ev;
+
+	DEBUG_PRINT(LOG_MODULE, "Starting remote control server");
+
+	LIST_INIT(&sockets);
+	server_quit = 0;
+	nconnections = 0;
+
+	if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		LOG_VPRINT_ERROR("Could not create epoll instance: %s",
+			strerror(errno));
+		return -1;
+	}
+
+	if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		LOG_VPRINT_ERROR("Could not create eventfd: %s",
+			strerror(errno));
+		goto err;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &ev) == -1) {
+		LOG_VPRINT_ERROR("Could not register eventfd: %s",
+			strerror(errno));
+		goto err;
+	}
+
+	if ((thread = avbox_thread_new(NULL, NULL, AVBOX_THREAD_REALTIME, -5)) == NULL) {
+		LOG_VPRINT_ERROR("Could not create remote control server thread: %s",
+			strerror(errno));
+		goto err;
+	}
+	if ((worker = avbox_thread_delegate(thread, avbox_input_socket_server, NULL)) == NULL) {
+		LOG_VPRINT_ERROR("Could not delegate remote control server: %s",
+			strerror(errno));
+		avbox_thread_destroy(thread);
+		thread = NULL;
+		goto err;
+	}
+
+	return 0;
+err:
+	if (wakefd != -1) {
+		close(wakefd);
+		wakefd = -1;
+	}
+	close(epollfd);
+	epollfd = -1;
+	return -1;
+}
+
+
+/**
+ * Stops the remote control server and closes all
+ * listening sockets and connections.
+ */
+void
+avbox_input_socket_shutdown(void)
+{
+	struct avbox_input_socket *sock;
+	const uint64_t one = 1;
+
+	DEBUG_PRINT(LOG_MODULE, "Shutting down remote control server");
+
+	ASSERT(epollfd != -1);
+
+	server_quit = 1;
+	if (write(wakefd, &one, sizeof(one)) != sizeof(one)) {
+		LOG_VPRINT_ERROR("Could not wake remote control server: %s",
+			strerror(errno));
+	}
+	avbox_delegate_wait(worker, NULL);
+	avbox_thread_destroy(thread);
+	worker = NULL;
+	thread = NULL;
+
+	LIST_FOREACH_SAFE(struct avbox_input_socket*, sock, &sockets, {
+		avbox_input_socket_close(sock);
+	});
+
+	close(wakefd);
+	close(epollfd);
+	wakefd = -1;
+	epollfd = -1;
 }
@@ -21,25 +21,29 @@
 #ifndef __INPUT_SOCKET_H__
 #define __INPUT_SOCKET_H__
 
-#include <pthread.h>
 
-#include "../linkedlist.h"
-
-struct socket_context;
-
-
-typedef void (*socket_closed_callback)(struct socket_context *ctx);
+/**
+ * Registers a listening socket with the remote control
+ * server. The server takes ownership of the file descriptor
+ * and accepts and serves connections on it until it is
+ * shutdown.
+ */
+int
+avbox_input_socket_listen(int fd, const char * const name);
 
 
-LISTABLE_STRUCT(socket_context,
-	int fd;
-	int quit;
-	pthread_t thread;
-	socket_closed_callback closed_callback;
-);
+/**
+ * Starts the remote control server.
+ */
+int
+avbox_input_socket_init(void);
 
 
-void *
-avbox_input_socket_connect(void *arg);
+/**
+ * Stops the remote control server and closes all
+ * listening sockets and connections.
+ */
+void
+avbox_input_socket_shutdown(void);
 
 #endif
@@ -25,145 +25,93 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
-#include <assert.h>
-#include <pthread.h>
 #include <unistd.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <fcntl.h>
 
 #define LOG_MODULE "input-tcp"
 
 #include "input.h"
 #include "input-socket.h"
-#include "../linkedlist.h"
 #include "../debug.h"
-#include "../avbox.h"
+#include "../log.h"
+#include "../timers.h"
 
 
-static int sockfd = -1;
-static int newsockfd = -1;
-static int server_quit = 0;
-static struct avbox_thread *thread = NULL;
-static struct avbox_delegate *worker = NULL;
+#define AVBOX_INPUT_TCP_PORT	(2048)
+#define AVBOX_INPUT_TCP_BACKLOG	(8)
+#define AVBOX_INPUT_TCP_RETRY	(5)
 
 
-LIST_DECLARE_STATIC(sockets);
+static int retry_timer = -1;
 
 
-static void
-avbox_tcp_socket_closed(struct socket_context *ctx)
+/**
+ * Open the listening socket and hand it to the
+ * remote control server.
+ */
+static int
+mbi_tcp_listen(void)
 {
-	DEBUG_VPRINT(LOG_MODULE, "Connection closed (fd=%i)", ctx->fd);
-	LIST_REMOVE(ctx);
-	free(ctx);
-}
+	int sockfd;
+	struct sockaddr_in serv_addr;
+	const int reuse_addr = 1;
 
+	if ((sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		LOG_VPRINT_ERROR("Could not open socket: %s",
+			strerror(errno));
+		return -1;
+	}
 
-static void *
-avbox_tcp_listener(void *arg)
-{
-	int portno;
-	unsigned int clilen;
-	struct sockaddr_in serv_addr, cli_addr;
-	struct timeval tv;
-	struct socket_context *ctx = NULL;
-	fd_set fds;
-	int n;
-
-	DEBUG_SET_THREAD_NAME("input-tcp");
-	DEBUG_PRINT("input-tcp", "TCP input server starting");
-
-	while (!server_quit) {
-
-		sockfd = socket(AF_INET, SOCK_STREAM, 0);
-		if (sockfd < 0) {
-			LOG_VPRINT_ERROR("Could not open socket: %s. Will keep trying.",
-				strerror(errno));
-			sleep(1);
-			continue;
-		}
-
-		const int reuse_addr = 1;
-		setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void*) &reuse_addr,
-			sizeof(reuse_addr));
-		bzero((char *) &serv_addr, sizeof(serv_addr));
-		portno = 2048;
-		serv_addr.sin_family = AF_INET;
-		serv_addr.sin_addr.s_addr = INADDR_ANY;
-		serv_addr.sin_port = htons(portno);
-		if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-			LOG_VPRINT_ERROR("Could not bind socket: %s",
-				strerror(errno));
-			close(sockfd);
-			sockfd = -1;
-			sleep(5);
-			continue;
-		}
-
-		listen(sockfd, 1);
-		clilen = sizeof(cli_addr);
-
-		DEBUG_VPRINT(LOG_MODULE, "Listening for connections on port %i",
-			portno);
-
-		while(!server_quit) {
-
-			FD_ZERO(&fds);
-			FD_SET(sockfd, &fds);
-
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			if ((n = select(sockfd + 1, &fds, NULL, NULL, &tv)) == 0) {
-				continue;
-			} else if (n < 0) {
-				if (errno == EINTR) {
-					continue;
-				}
-				LOG_VPRINT_ERROR(LOG_MODULE, "select() error: %s",
-					strerror(errno));
-				break;
-			}
-			
-			if (!FD_ISSET(sockfd, &fds)) {
-				continue;
-			}
-
-			if ((newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen)) <= 0) {
-				LOG_VPRINT_ERROR("accept() error: %s",
-					strerror(errno));
-				continue;
-			}
-
-			DEBUG_VPRINT(LOG_MODULE, "Incoming connection accepted (fd=%i)", newsockfd);
-
-			if ((ctx = malloc(sizeof(struct socket_context))) == NULL) {
-				LOG_PRINT_ERROR("Could not accept connection. Out of memory");
-				close(newsockfd);
-				continue;
-			}
-
-			ctx->fd = newsockfd;
-			ctx->quit = 0;
-			ctx->closed_callback = avbox_tcp_socket_closed;
-
-			LIST_ADD(&sockets, ctx);
-
-			if (pthread_create(&ctx->thread, NULL, &avbox_input_socket_connect, ctx) != 0) {
-				LOG_PRINT_ERROR("Could not accept connection. Thread creation failed");
-				close(newsockfd);
-				free(ctx);
-				continue;
-			}
-		}
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void*) &reuse_addr,
+		sizeof(reuse_addr));
+	bzero((char *) &serv_addr, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = INADDR_ANY;
+	serv_addr.sin_port = htons(AVBOX_INPUT_TCP_PORT);
+	if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+		LOG_VPRINT_ERROR("Could not bind socket: %s",
+			strerror(errno));
 		close(sockfd);
-		sockfd = -1;
+		return -1;
 	}
 
-	DEBUG_PRINT(LOG_MODULE, "TCP input server exiting");
+	if (listen(sockfd, AVBOX_INPUT_TCP_BACKLOG) == -1) {
+		LOG_VPRINT_ERROR("Could not listen() on socket: %s",
+			strerror(errno));
+		close(sockfd);
+		return -1;
+	}
 
-	return NULL;
+	/* the remote control server owns the socket from now on */
+	if (avbox_input_socket_listen(sockfd, "tcp") == -1) {
+		close(sockfd);
+		return -1;
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Listening for connections on port %i",
+		AVBOX_INPUT_TCP_PORT);
+
+	return 0;
+}
+
+
+/**
+ * Retry opening the listening socket until it succeeds.
+ */
+static enum avbox_timer_result
+mbi_tcp_retry(int id, void *data)
+{
+	(void) id;
+	(void) data;
+
+	if (mbi_tcp_listen() == -1) {
+		return AVBOX_TIMER_CALLBACK_RESULT_CONTINUE;
+	}
+
+	__atomic_store_n(&retry_timer, -1, __ATOMIC_SEQ_CST);
+	return AVBOX_TIMER_CALLBACK_RESULT_STOP;
 }
 
 
@@ -173,46 +121,44 @@ avbox_tcp_listener(void *arg)
 int
 mbi_tcp_init(void)
 {
-	LIST_INIT(&sockets);
+	int timer_id;
+	struct timespec tv;
 
-	if ((thread = avbox_thread_new(NULL, NULL, AVBOX_THREAD_REALTIME, -5)) == NULL) {
-		LOG_VPRINT_ERROR("Could not create TCP listener thread: %s",
-			strerror(errno));
-		return -1;
+	DEBUG_PRINT(LOG_MODULE, "TCP input server starting");
+
+	if (mbi_tcp_listen() == 0) {
+		return 0;
 	}
-	if ((worker = avbox_thread_delegate(thread, avbox_tcp_listener, NULL)) == NULL) {
-		LOG_VPRINT_ERROR("Could not delegate TCP listener worker: %s",
-			strerror(errno));
-		avbox_thread_destroy(thread);
-		thread = NULL;
+
+	LOG_PRINT_ERROR("Will keep trying.");
+
+	tv.tv_sec = AVBOX_INPUT_TCP_RETRY;
+	tv.tv_nsec = 0;
+	if ((timer_id = avbox_timer_register(&tv, AVBOX_TIMER_TYPE_AUTORELOAD,
+		NULL, mbi_tcp_retry, NULL)) == -1) {
+		LOG_PRINT_ERROR("Could not register retry timer");
 		return -1;
 	}
+	__atomic_store_n(&retry_timer, timer_id, __ATOMIC_SEQ_CST);
+
 	return 0;
 }
 
 
+/**
+ * Shutdown the tcp input server. The listening socket and
+ * all connections are closed by avbox_input_socket_shutdown().
+ */
 void
 mbi_tcp_destroy(void)
 {
-	struct socket_context *ctx;
+	int timer_id;
 
-	DEBUG_PRINT("input-tcp", "Exiting (give me 2 secs)");
-
-	/* Close all connections */
-	DEBUG_PRINT("input-tcp", "Closing all open sockets");
-	LIST_FOREACH(struct socket_context*, ctx, &sockets) {
-		ctx->quit = 1;
-		pthread_join(ctx->thread, NULL);
-	}
+	DEBUG_PRINT(LOG_MODULE, "TCP input server exiting");
 
-	server_quit = 1;
-	if (newsockfd != -1) {
-		close(newsockfd);
+	/* the timer callback runs on the timers thread so
+	 * take the id atomically */
+	if ((timer_id = __atomic_exchange_n(&retry_timer, -1, __ATOMIC_SEQ_CST)) != -1) {
+		avbox_timer_cancel(timer_id);
 	}
-	close(sockfd);
-
-	avbox_delegate_wait(worker, NULL);
-	avbox_thread_destroy(thread);
-	thread = NULL;
-
 }
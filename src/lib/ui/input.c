@@ -32,6 +32,7 @@
 #define LOG_MODULE "input"
 
 #include "input.h"
+#include "input-socket.h"
 #include "input-tcp.h"
 #include "../linkedlist.h"
 #include "../debug.h"
@@ -65,6 +66,7 @@ static int using_directfb = 0;
 #ifdef ENABLE_LIBINPUT
 static int using_libinput = 0;
 #endif
+static int using_sockets = 0;
 static int using_tcp = 0;
 #ifdef ENABLE_BLUETOOTH
 static int using_bluetooth = 0;
@@ -319,15 +321,24 @@ avbox_input_init(int argc, char **argv)
 #endif
 #endif
 
-	/* initialize the tcp remote input provider */
-	if (mbi_tcp_init() == -1) {
-		LOG_PRINT(MB_LOGLEVEL_ERROR, "input", "Could not start TCP provider");
+	/* start the remote control server */
+	if (avbox_input_socket_init() == -1) {
+		LOG_PRINT_ERROR("Could not start remote control server");
 	} else {
-		using_tcp = 1;
+		using_sockets = 1;
+	}
+
+	/* initialize the tcp remote input provider */
+	if (using_sockets) {
+		if (mbi_tcp_init() == -1) {
+			LOG_PRINT(MB_LOGLEVEL_ERROR, "input", "Could not start TCP provider");
+		} else {
+			using_tcp = 1;
+		}
 	}
 
 #ifdef ENABLE_BLUETOOTH
-	if (avbox_bluetooth_ready()) {
+	if (using_sockets && avbox_bluetooth_ready()) {
 		/* initialize the bluetooth input provider */
 		if (mbi_bluetooth_init() == -1) {
 			LOG_PRINT(MB_LOGLEVEL_ERROR, "input", "Could not start Bluetooth provider");
@@ -368,6 +379,10 @@ avbox_input_shutdown(void)
 		using_bluetooth = 0;
 	}
 #endif
+	if (using_sockets) {
+		avbox_input_socket_shutdown();
+		using_sockets = 0;
+	}
 #ifdef ENABLE_LIBINPUT
 	if (using_libinput) {
 		mbi_libinput_destroy();
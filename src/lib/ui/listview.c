@@ -29,7 +29,7 @@
 
 #include "../debug.h"
 #include "../log.h"
-#include "../linkedlist.h"
+#include "../math_util.h"
 #include "../dispatch.h"
 #include "video.h"
 #include "input.h"
@@ -37,15 +37,16 @@
 
 
 #define FONT_PADDING (3)
+#define AVBOX_LISTVIEW_MIN_CAPACITY	(32)
 
 
-/* Listable type for storing menuitem objects */
-LISTABLE_STRUCT(avbox_listitem,
-	struct avbox_window *window;
+/* Type for storing menuitem objects */
+struct avbox_listitem
+{
 	char *name;
 	int dirty;
 	void *data;
-);
+};
 
 
 /**
@@ -57,32 +58,97 @@ struct avbox_listview
 	struct avbox_window **item_windows;
 	struct avbox_object *notify_object;
 	struct avbox_object *dispatch_object;
-	struct avbox_listitem *selected;
+	struct avbox_listitem *items;
+	int selected;
 	int visible_items;
 	int visible_window_offset;
 	int dirty;
 	int count;
+	int capacity;
 	void *selection_changed_callback;
 	void *eol_callback_context;
 	avbox_listview_eol_fn end_of_list_callback;
-	LIST_DECLARE(items);
 };
 
 
 /**
- * Gets the menuitem instance that corresponds to
- * a window
+ * Gets the index of the menuitem that corresponds to
+ * a window or -1 if the window is not showing any item.
  */
-static struct avbox_listitem *
+static int
 avbox_listview_getwindowitem(struct avbox_listview *inst, struct avbox_window *window)
 {
-	struct avbox_listitem *item;
-	LIST_FOREACH(struct avbox_listitem*, item, &inst->items) {
-		if (item->window == window) {
-			return item;
+	int i;
+	for (i = 0; i < inst->visible_items; i++) {
+		if (inst->item_windows[i] == window) {
+			i += inst->visible_window_offset;
+			return (i < inst->count) ? i : -1;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * Gets the window that is showing an item or NULL
+ * if the item is not visible.
+ */
+static struct avbox_window *
+avbox_listview_getitemwindow(struct avbox_listview *inst, const int index)
+{
+	const int i = index - inst->visible_window_offset;
+	if (i < 0 || i >= inst->visible_items) {
+		return NULL;
+	}
+	return inst->item_windows[i];
+}
+
+
+/**
+ * Gets the index of the item with the given data
+ * or -1 if not found.
+ */
+static int
+avbox_listview_finditem(struct avbox_listview *inst, const void * const data)
+{
+	int i;
+	for (i = 0; i < inst->count; i++) {
+		if (inst->items[i].data == data) {
+			return i;
 		}
 	}
-	return NULL;
+	return -1;
+}
+
+
+/**
+ * Makes sure there's room for count more items.
+ */
+static int
+avbox_listview_reserve(struct avbox_listview *inst, const int count)
+{
+	int capacity = inst->capacity;
+	struct avbox_listitem *items;
+
+	if (inst->count + count <= capacity) {
+		return 0;
+	}
+
+	if (capacity == 0) {
+		capacity = AVBOX_LISTVIEW_MIN_CAPACITY;
+	}
+	while (capacity < inst->count + count) {
+		capacity *= 2;
+	}
+
+	if ((items = realloc(inst->items, sizeof(struct avbox_listitem) * capacity)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+
+	inst->items = items;
+	inst->capacity = capacity;
+	return 0;
 }
 
 
@@ -93,8 +159,8 @@ static int
 avbox_listitem_paint(struct avbox_window * const window, void * const ctx)
 {
 	struct avbox_listview * const inst = (struct avbox_listview*) ctx;
-	struct avbox_listitem * const item = (struct avbox_listitem*)
-		avbox_listview_getwindowitem(inst, window);
+	const int index = avbox_listview_getwindowitem(inst, window);
+	struct avbox_listitem * const item = (index != -1) ? &inst->items[index] : NULL;
 	struct avbox_rect rect;
 
 	assert(inst != NULL);
@@ -112,21 +178,21 @@ avbox_listitem_paint(struct avbox_window * const window, void * const ctx)
 	/* get canvas size */
 	rect.x = 0;
 	rect.y = 0;
-	avbox_window_getcanvassize(item->window,
+	avbox_window_getcanvassize(window,
 		&rect.w, &rect.h);
-	avbox_window_setbgcolor(item->window, MBV_DEFAULT_BACKGROUND);
-	avbox_window_clear(item->window);
+	avbox_window_setbgcolor(window, MBV_DEFAULT_BACKGROUND);
+	avbox_window_clear(window);
 
-	if (inst->selected == item) {
-		avbox_window_setbgcolor(item->window, AVBOX_COLOR(0xffffffff));
-		avbox_window_roundrectangle(item->window, &rect, 0, 2);
-		avbox_window_setcolor(item->window, AVBOX_COLOR(0x000000ff));
+	if (inst->selected == index) {
+		avbox_window_setbgcolor(window, AVBOX_COLOR(0xffffffff));
+		avbox_window_roundrectangle(window, &rect, 0, 2);
+		avbox_window_setcolor(window, AVBOX_COLOR(0x000000ff));
 	} else {
-		avbox_window_setcolor(item->window, MBV_DEFAULT_FOREGROUND);
+		avbox_window_setcolor(window, MBV_DEFAULT_FOREGROUND);
 	}
 
 	/* paint the item and clear the dirty flag */
-	avbox_window_drawstring(item->window, item->name, rect.w / 2, 5);
+	avbox_window_drawstring(window, item->name, rect.w / 2, 5);
 	item->dirty = 0;
 	return 1;
 }
@@ -136,23 +202,23 @@ avbox_listitem_paint(struct avbox_window * const window, void * const ctx)
  * Changes the currently selected item.
  */
 static int
-avbox_listview_setselected(struct avbox_listview *inst, struct avbox_listitem *item)
+avbox_listview_setselected(struct avbox_listview *inst, const int index)
 {
 	assert(inst != NULL);
-	assert(item != NULL);
+	assert(index >= 0 && index < inst->count);
 
 	/* check if already selected/nothing to do */
-	if (inst->selected == item) {
+	if (inst->selected == index) {
 		return 0;
 	}
 
-	if (inst->selected != NULL) {
-		inst->selected->dirty = 1;
+	if (inst->selected != -1) {
+		inst->items[inst->selected].dirty = 1;
 	}
 
 	/* select the new item */
-	inst->selected = item;
-	inst->selected->dirty = 1;
+	inst->selected = index;
+	inst->items[index].dirty = 1;
 
 	/* this is where we invoke the callback function. For now
 	 * we just SIGABRT if it's set since it's not implemented yet. */
@@ -167,42 +233,42 @@ avbox_listview_setselected(struct avbox_listview *inst, struct avbox_listitem *i
 int
 avbox_listview_setitemtext(struct avbox_listview *inst, void *item, char *text)
 {
-	struct avbox_listitem *menuitem;
+	int i;
+	char *name;
 
 	assert(inst != NULL);
 	assert(item != NULL);
 	assert(text != NULL);
 
-	LIST_FOREACH(struct avbox_listitem*, menuitem, &inst->items) {
-		if (menuitem->data == item) {
-			assert(menuitem->name != NULL);
-			free(menuitem->name);
-			menuitem->name = strdup(text);
-			menuitem->dirty = 1;
-			if (menuitem->name == NULL) {
-				fprintf(stderr, "downloads: Out of memory\n");
-				return -1;
-			}
-			return 0;
-		}
+	if ((i = avbox_listview_finditem(inst, item)) == -1) {
+		return -1;
 	}
-	return -1;
+	if ((name = strdup(text)) == NULL) {
+		fprintf(stderr, "downloads: Out of memory\n");
+		return -1;
+	}
+
+	assert(inst->items[i].name != NULL);
+	free(inst->items[i].name);
+	inst->items[i].name = name;
+	inst->items[i].dirty = 1;
+	return 0;
 }
 
 
 void
 avbox_listview_enumitems(struct avbox_listview *inst, avbox_listview_enumitems_fn callback, void *callback_data)
 {
-	struct avbox_listitem *item;
+	int i;
 
 	assert(inst != NULL);
 	assert(callback != NULL);
 
-	LIST_FOREACH_SAFE(struct avbox_listitem*, item, &inst->items, {
-		if (callback(item->data, callback_data)) {
+	for (i = 0; i < inst->count; i++) {
+		if (callback(inst->items[i].data, callback_data)) {
 			break;
 		}
-	});
+	}
 }
 
 
@@ -211,10 +277,10 @@ avbox_listview_getselected(struct avbox_listview *inst)
 {
 	assert(inst != NULL);
 
-	if (inst->selected == NULL) {
+	if (inst->selected == -1) {
 		return (void*) NULL;
 	} else {
-		return inst->selected->data;
+		return inst->items[inst->selected].data;
 	}
 }
 
@@ -224,11 +290,14 @@ avbox_listview_getselected(struct avbox_listview *inst)
 #define MB_UI_DIRECTION_DOWN	(2)
 
 
+/**
+ * Scrolls the visible window one item up or down
+ * and marks all the visible items dirty.
+ */
 static void
 avbox_listview_scrollitems(struct avbox_listview *inst, int direction)
 {
-	int i, j;
-	struct avbox_listitem *item;
+	int i, end;
 
 	if (direction == MB_UI_DIRECTION_DOWN) {
 		inst->visible_window_offset++;
@@ -236,117 +305,142 @@ avbox_listview_scrollitems(struct avbox_listview *inst, int direction)
 		assert(inst->visible_window_offset > 0);
 		inst->visible_window_offset--;
 	}
-	i = j = 0;
-	LIST_FOREACH(struct avbox_listitem*, item, &inst->items) {
-		if (i++ < inst->visible_window_offset) {
-			item->window = NULL;
-		} else if (j < inst->visible_items) {
-			if (item->window != inst->item_windows[j]) {
-				item->dirty = 1;
-			}
-			item->window = inst->item_windows[j++];
-		} else {
-			item->window = NULL;
-		}
+
+	end = MIN(inst->count, inst->visible_window_offset + inst->visible_items);
+	for (i = inst->visible_window_offset; i < end; i++) {
+		inst->items[i].dirty = 1;
 	}
 }
 
 
 /**
- * Adds a new item to a menu widget.
+ * Adds several items to a menu widget at once. If any
+ * of the items cannot be added none of them are.
  */
 int
-avbox_listview_additem(struct avbox_listview *inst, char *name, void *data)
+avbox_listview_additems(struct avbox_listview *inst,
+	const struct avbox_listview_entry * const entries, const int count)
 {
+	int i;
 	struct avbox_listitem *item;
 
 	assert(inst != NULL);
-	assert(name != NULL);
+	assert(entries != NULL || count == 0);
 
-	item = malloc(sizeof(struct avbox_listitem));
-	if (item == NULL) {
+	if (avbox_listview_reserve(inst, count) == -1) {
 		fprintf(stderr, "avbox_listview: Add item failed: Out of memory\n");
 		return -1;
 	}
 
-	if (inst->count < inst->visible_items) {
-		/* grab a preallocated subwindow */
-		item->window = inst->item_windows[inst->count];
-		assert(item->window != NULL);
-
-		/* if there's no selected item make this one it */
-		if (inst->selected == NULL) {
-			inst->selected = item;
+	for (i = 0; i < count; i++) {
+		assert(entries[i].name != NULL);
+		item = &inst->items[inst->count + i];
+		item->data = entries[i].data;
+		item->dirty = 1;
+		if ((item->name = strdup(entries[i].name)) == NULL) {
+			fprintf(stderr, "avbox_listview: Out of memory\n");
+			while (i-- > 0) {
+				free(inst->items[inst->count + i].name);
+			}
+			return -1;
 		}
-	} else {
-		item->window = NULL;
 	}
 
-	item->name = strdup(name);
-	item->data = data;
-	item->dirty = 1;
-
-	if (item->name == NULL) {
-		fprintf(stderr, "avbox_listview: Out of memory\n");
-		free(item);
-		return -1;
+	/* if there's no selected item and the first new
+	 * item is visible select it */
+	if (inst->selected == -1 && count > 0 &&
+		avbox_listview_getitemwindow(inst, inst->count) != NULL) {
+		inst->selected = inst->count;
 	}
 
-	LIST_APPEND(&inst->items, item);
-
-	inst->count++;
+	inst->count += count;
 
 	return 0;
 }
 
 
+/**
+ * Adds a new item to a menu widget.
+ */
+int
+avbox_listview_additem(struct avbox_listview *inst, char *name, void *data)
+{
+	struct avbox_listview_entry entry;
+
+	assert(inst != NULL);
+	assert(name != NULL);
+
+	entry.name = name;
+	entry.data = data;
+	return avbox_listview_additems(inst, &entry, 1);
+}
+
+
 void
 avbox_listview_removeitem(struct avbox_listview *inst, void *item)
 {
-	int next = 0;
-	struct avbox_listitem *menuitem, *prev = NULL;
-	LIST_FOREACH_SAFE(struct avbox_listitem*, menuitem, &inst->items, {
-		if (menuitem->data == item) {
-			LIST_REMOVE(menuitem);
-			if (menuitem->window != NULL) {
-				avbox_window_setbgcolor(menuitem->window, MBV_DEFAULT_BACKGROUND);
-				avbox_window_clear(menuitem->window);
-			}
-			free(menuitem->name);
-			free(menuitem);
-			inst->count--;
-			if (inst->selected == item) {
-				if (prev != NULL) {
-					inst->selected = prev->data;
-				} else {
-					inst->selected = NULL;
-					next = 1;
-				}
-			}
-		} else if (next) {
-			inst->selected = menuitem->data;
-			break;
+	int i, end;
+	struct avbox_window *window;
+
+	if ((i = avbox_listview_finditem(inst, item)) == -1) {
+		return;
+	}
+
+	free(inst->items[i].name);
+	memmove(&inst->items[i], &inst->items[i + 1],
+		sizeof(struct avbox_listitem) * (inst->count - i - 1));
+	inst->count--;
+
+	/* select the previous item or the next one if we
+	 * removed the first item */
+	if (inst->selected > i) {
+		inst->selected--;
+	} else if (inst->selected == i) {
+		if (i > 0) {
+			inst->selected = i - 1;
+		} else if (inst->count == 0) {
+			inst->selected = -1;
+		}
+		if (inst->selected != -1) {
+			inst->items[inst->selected].dirty = 1;
 		}
-		prev = menuitem;
-	});
+	}
+
+	/* keep the selected item visible */
+	if (inst->selected != -1 && inst->selected < inst->visible_window_offset) {
+		inst->visible_window_offset = inst->selected;
+		i = inst->selected;
+	}
+
+	/* all items after the removed one moved up one window
+	 * so repaint them and clear the window that's left empty */
+	end = MIN(inst->count, inst->visible_window_offset + inst->visible_items);
+	for (i = MAX(i, inst->visible_window_offset); i < end; i++) {
+		inst->items[i].dirty = 1;
+	}
+	if ((window = avbox_listview_getitemwindow(inst, inst->count)) != NULL) {
+		avbox_window_setbgcolor(window, MBV_DEFAULT_BACKGROUND);
+		avbox_window_clear(window);
+	}
 }
 
 
 void
 avbox_listview_clearitems(struct avbox_listview * const inst)
 {
-	struct avbox_listitem* item;
-	LIST_FOREACH_SAFE(struct avbox_listitem*, item, &inst->items, {
-		LIST_REMOVE(item);
-		if (item->window != NULL) {
-			avbox_window_setbgcolor(item->window, MBV_DEFAULT_BACKGROUND);
-			avbox_window_clear(item->window);
+	int i;
+	struct avbox_window *window;
+
+	for (i = 0; i < inst->count; i++) {
+		if ((window = avbox_listview_getitemwindow(inst, i)) != NULL) {
+			avbox_window_setbgcolor(window, MBV_DEFAULT_BACKGROUND);
+			avbox_window_clear(window);
 		}
-		free(item->name);
-		free(item);
-	});
+		free(inst->items[i].name);
+	}
 	inst->count = 0;
-	inst->selected = NULL;
+	inst->selected = -1;
+	inst->visible_window_offset = 0;
 }
 
 
@@ -412,7 +506,7 @@ avbox_listview_messagehandler(void *context, struct avbox_message *msg)
 		}
 		case MBI_EVENT_ENTER:
 		{
-			if (inst->selected != NULL) {
+			if (inst->selected != -1) {
 				/* send SELECTED message to parent */
 				if (avbox_object_sendmsg(&inst->notify_object,
 					AVBOX_MESSAGETYPE_SELECTED, AVBOX_DISPATCH_UNICAST, inst) == NULL) {
@@ -424,16 +518,9 @@ avbox_listview_messagehandler(void *context, struct avbox_message *msg)
 		}
 		case MBI_EVENT_ARROW_UP:
 		{
-			struct avbox_listitem *item, *prev = NULL, *selected = NULL;
-			LIST_FOREACH(struct avbox_listitem*, item, &inst->items) {
-				if (inst->selected == item) {
-					selected = prev;
-				} else {
-					prev = item;
-				}
-			}
-			if (selected != NULL) {
-				if (selected->window == NULL) {
+			const int selected = inst->selected - 1;
+			if (inst->selected > 0) {
+				if (selected < inst->visible_window_offset) {
 					avbox_listview_scrollitems(inst, MB_UI_DIRECTION_UP);
 				}
 				avbox_listview_setselected(inst, selected);
@@ -443,23 +530,11 @@ avbox_listview_messagehandler(void *context, struct avbox_message *msg)
 		}
 		case MBI_EVENT_ARROW_DOWN:
 		{
-			struct avbox_listitem *item, *selected;
-			int select_next;
+			int selected;
 start:
-			selected = NULL;
-			select_next = 0;
-			LIST_FOREACH(struct avbox_listitem*, item, &inst->items) {
-				if (select_next) {
-					selected = item;
-					select_next = 0;
-				} else {
-					if (inst->selected == item) {
-						select_next = 1;
-					}
-				}
-			}
-			if (selected != NULL) {
-				if (selected->window == NULL) {
+			selected = inst->selected + 1;
+			if (inst->selected != -1 && selected < inst->count) {
+				if (selected >= inst->visible_window_offset + inst->visible_items) {
 					avbox_listview_scrollitems(inst, MB_UI_DIRECTION_DOWN);
 				}
 				avbox_listview_setselected(inst, selected);
@@ -497,6 +572,9 @@ start:
 	case AVBOX_MESSAGETYPE_CLEANUP:
 		DEBUG_VPRINT("ui-menu", "Cleaning up listview %p", inst);
 		free(inst->item_windows);
+		if (inst->items != NULL) {
+			free(inst->items);
+		}
 		free(inst);
 		break;
 	default:
@@ -534,11 +612,12 @@ avbox_listview_new(struct avbox_window *window, struct avbox_object *notify_obje
 	}
 
 	/* initialize menu object */
-	LIST_INIT(&inst->items);
+	inst->items = NULL;
+	inst->capacity = 0;
 	inst->notify_object = notify_object;
 	inst->window = window;
 	inst->visible_window_offset = 0;
-	inst->selected = NULL;
+	inst->selected = -1;
 	inst->selection_changed_callback = NULL;
 	inst->end_of_list_callback = NULL;
 	inst->count = 0;
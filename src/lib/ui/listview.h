@@ -27,6 +27,16 @@
 struct avbox_listview;
 
 
+/**
+ * An item as passed to avbox_listview_additems().
+ */
+struct avbox_listview_entry
+{
+	const char *name;
+	void *data;
+};
+
+
 typedef int (*avbox_listview_enumitems_fn)(void *item, void *data);
 typedef int (*avbox_listview_eol_fn)(struct avbox_listview *inst, void * context);
 
@@ -65,6 +75,15 @@ avbox_listview_clearitems(struct avbox_listview *inst);
 int
 avbox_listview_additem(struct avbox_listview *inst, char *name, void *data);
 
+
+/**
+ * Adds several items to a menu widget at once. If any
+ * of the items cannot be added none of them are.
+ */
+int
+avbox_listview_additems(struct avbox_listview *inst,
+	const struct avbox_listview_entry * const entries, const int count);
+
 int
 avbox_listview_focus(struct avbox_listview *inst);
 
@@ -32,6 +32,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
@@ -62,6 +63,22 @@
 #define AVBOX_MIN_FRAME_WAIT_US		(5000LL)
 #define AVBOX_SKIP_FRAME_THRESHOLD	(400LL * 1000LL)
 #define AVBOX_SKIP_FRAME_MAX		(3)
+
+/* thresholds for the decoder side frame skipping. When the
+ * renderer reports that it's running later than these the
+ * decoder first stops running the loop filter on non-reference
+ * frames, then starts discarding non-reference frames and then
+ * everything but keyframes. It steps back down one level at a
+ * time once the lateness falls under AVBOX_SKIP_RECOVER_THRESHOLD */
+#define AVBOX_SKIP_LOOPFILTER_THRESHOLD	(40LL * 1000LL)
+#define AVBOX_SKIP_NONREF_THRESHOLD	(100LL * 1000LL)
+#define AVBOX_SKIP_NONKEY_THRESHOLD	(800LL * 1000LL)
+#define AVBOX_SKIP_RECOVER_THRESHOLD	(20LL * 1000LL)
+
+#define AVBOX_SKIP_LEVEL_NONE		(0)
+#define AVBOX_SKIP_LEVEL_LOOPFILTER	(1)
+#define AVBOX_SKIP_LEVEL_NONREF		(2)
+#define AVBOX_SKIP_LEVEL_NONKEY		(3)
 #define AVBOX_BUFFER_MSECS		(300)
 #define AVBOX_BUFFER_VIDEO		(30 / (1000 / decode_cache_size))
 #define AVBOX_BUFFER_AUDIO		(48000 / (1000 / decode_cache_size))
@@ -109,213 +126,118 @@ struct avbox_player_seekargs
 static int decode_cache_size = AVBOX_BUFFER_MSECS;
 
 
+/**
+ * Initializes a pooled AVPacket.
+ */
+static int
+av_packet_pool_init(void * const obj)
+{
+	struct avbox_av_packet * const packet = obj;
+	if ((packet->avpacket = av_packet_alloc()) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+
+static void
+av_packet_pool_fini(void * const obj)
+{
+	struct avbox_av_packet * const packet = obj;
+	av_packet_free(&packet->avpacket);
+}
+
+
+/**
+ * Initializes a pooled AVFrame.
+ */
+static int
+av_frame_pool_init(void * const obj)
+{
+	struct avbox_av_frame * const frame = obj;
+	if ((frame->avframe = av_frame_alloc()) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+
+static void
+av_frame_pool_fini(void * const obj)
+{
+	struct avbox_av_frame * const frame = obj;
+	av_frame_free(&frame->avframe);
+}
+
+
 static struct avbox_av_packet*
 acquire_av_packet(struct avbox_player * const inst)
 {
-	struct avbox_av_packet *packet;
-	pthread_mutex_lock(&inst->av_packet_pool_lock);
-	packet = LIST_TAIL(struct avbox_av_packet*, &inst->av_packet_pool);
-	if (UNLIKELY(packet == NULL)) {
-		if ((packet = malloc(sizeof(struct avbox_av_packet))) == NULL) {
-			ASSERT(errno == ENOMEM);
-			pthread_mutex_unlock(&inst->av_packet_pool_lock);
-			return NULL;
-		}
-		if ((packet->avpacket = av_packet_alloc()) == NULL) {
-			pthread_mutex_unlock(&inst->av_packet_pool_lock);
-			free(packet);
-			errno = ENOMEM;
-			return NULL;
-		}
-#ifdef DEBUG_MEMORY_POOLS
-		inst->av_packet_pool_allocs++;
-		if (inst->pools_primed) {
-			LOG_VPRINT_INFO("Allocated AVPacket (total_allocs=%i)!",
-				inst->av_packet_pool_allocs);
-		}
-#endif
-	} else {
-		LIST_REMOVE(packet);
-	}
-	pthread_mutex_unlock(&inst->av_packet_pool_lock);
-	return packet;
+	return avbox_pool_acquire(inst->av_packet_pool);
 }
 
 
 INTERNAL void
 release_av_packet(struct avbox_player * const inst, struct avbox_av_packet * const packet)
 {
-	pthread_mutex_lock(&inst->av_packet_pool_lock);
-	LIST_ADD(&inst->av_packet_pool, packet);
-	pthread_mutex_unlock(&inst->av_packet_pool_lock);
+	avbox_pool_release(inst->av_packet_pool, packet);
 }
 
 
 INTERNAL struct avbox_av_frame*
 acquire_av_frame(struct avbox_player * const inst)
 {
-	struct avbox_av_frame *frame;
-	pthread_mutex_lock(&inst->frame_pool_lock);
-	frame = LIST_TAIL(struct avbox_av_frame*, &inst->frame_pool);
-	if (UNLIKELY(frame == NULL)) {
-		if ((frame = malloc(sizeof(struct avbox_av_frame))) == NULL) {
-			ASSERT(errno == ENOMEM);
-			pthread_mutex_unlock(&inst->frame_pool_lock);
-			return NULL;
-		}
-		if ((frame->avframe = av_frame_alloc()) == NULL) {
-			pthread_mutex_unlock(&inst->frame_pool_lock);
-			free(frame);
-			errno = ENOMEM;
-			return NULL;
-		}
-#ifdef DEBUG_MEMORY_POOLS
-		inst->frame_pool_allocs++;
-		if (inst->pools_primed) {
-			LOG_VPRINT_INFO("Allocated AVFrame (total_allocs=%i)",
-				inst->frame_pool_allocs);
-		}
-#endif
-	} else {
-		LIST_REMOVE(frame);
-	}
-	pthread_mutex_unlock(&inst->frame_pool_lock);
-	return frame;
+	return avbox_pool_acquire(inst->frame_pool);
 }
 
 
 INTERNAL void
 release_av_frame(struct avbox_player * const inst, struct avbox_av_frame * const frame)
 {
-	pthread_mutex_lock(&inst->frame_pool_lock);
-	LIST_ADD(&inst->frame_pool, frame);
-	pthread_mutex_unlock(&inst->frame_pool_lock);
+	avbox_pool_release(inst->frame_pool, frame);
 }
 
 
 INTERNAL struct avbox_player_packet*
 acquire_packet(struct avbox_player * const inst)
 {
-	struct avbox_player_packet *packet;
-	pthread_mutex_lock(&inst->packet_pool_lock);
-	packet = LIST_TAIL(struct avbox_player_packet*, &inst->packet_pool);
-	if (UNLIKELY(packet == NULL)) {
-		if ((packet = malloc(sizeof(struct avbox_player_packet))) == NULL) {
-			ASSERT(errno == ENOMEM);
-			pthread_mutex_unlock(&inst->packet_pool_lock);
-			return NULL;
-		}
-#ifdef DEBUG_MEMORY_POOLS
-		inst->packet_pool_allocs++;
-		if (inst->pools_primed) {
-			LOG_VPRINT_INFO("Allocated video packet (total_allocs=%i)",
-				inst->packet_pool_allocs);
-		}
-#endif
-	} else {
-		LIST_REMOVE(packet);
-	}
-	pthread_mutex_unlock(&inst->packet_pool_lock);
-	return packet;
+	return avbox_pool_acquire(inst->packet_pool);
 }
 
 
 INTERNAL void
 release_packet(struct avbox_player * const inst, struct avbox_player_packet * const packet)
 {
-	pthread_mutex_lock(&inst->packet_pool_lock);
-	LIST_ADD(&inst->packet_pool, packet);
-	pthread_mutex_unlock(&inst->packet_pool_lock);
+	avbox_pool_release(inst->packet_pool, packet);
 }
 
 
 static struct avbox_player_ctlmsg*
 acquire_ctlmsg(struct avbox_player * const inst)
 {
-	struct avbox_player_ctlmsg *msg;
-	pthread_mutex_lock(&inst->ctlmsg_pool_lock);
-	msg = LIST_TAIL(struct avbox_player_ctlmsg*, &inst->ctlmsg_pool);
-	if (UNLIKELY(msg == NULL)) {
-		if (UNLIKELY((msg = malloc(sizeof(struct avbox_player_ctlmsg))) == NULL)) {
-			ASSERT(errno == ENOMEM);
-			pthread_mutex_unlock(&inst->ctlmsg_pool_lock);
-			return NULL;
-		}
-#ifdef DEBUG_MEMORY_POOLS
-		inst->ctlmsg_pool_allocs++;
-		if (inst->pools_primed) {
-			LOG_VPRINT_INFO("Allocated video packet (total_allocs=%i)",
-				inst->ctlmsg_pool_allocs);
-		}
-#endif
-	} else {
-		LIST_REMOVE(msg);
-	}
-	pthread_mutex_unlock(&inst->ctlmsg_pool_lock);
-	return msg;
+	return avbox_pool_acquire(inst->ctlmsg_pool);
 }
 
 
 static void
 release_ctlmsg(struct avbox_player * const inst, struct avbox_player_ctlmsg * const msg)
 {
-	pthread_mutex_lock(&inst->ctlmsg_pool_lock);
-	LIST_ADD(&inst->ctlmsg_pool, msg);
-	pthread_mutex_unlock(&inst->ctlmsg_pool_lock);
+	avbox_pool_release(inst->ctlmsg_pool, msg);
 }
 
 
 static void
 prime_pools(struct avbox_player * const inst)
 {
-	int i;
-	void *pointers[1024];
-
 	DEBUG_PRINT(LOG_MODULE, "Priming memory pools");
 
-	/* prime AVFrame pool */
-	for (i = 0; i < AVBOX_AVFRAME_POOL_SIZE; i++) {
-		if ((pointers[i] = acquire_av_frame(inst)) == NULL) {
-			ABORT("Ran out of memory while priming pools!");
-		}
-	}
-	for (i = 0; i < AVBOX_AVFRAME_POOL_SIZE; i++) {
-		release_av_frame(inst, pointers[i]);
-	}
-
-	/* prime AVPacket pool */
-	for (i = 0; i < AVBOX_AVPACKET_POOL_SIZE; i++) {
-		if ((pointers[i] = acquire_av_packet(inst)) == NULL) {
-			ABORT("Ran out of memory while priming pools!");
-		}
-	}
-	for (i = 0; i < AVBOX_AVPACKET_POOL_SIZE; i++) {
-		release_av_packet(inst, pointers[i]);
-	}
-
-	/* prime video packet pool */
-	for (i = 0; i < AVBOX_VIDEO_PACKET_POOL_SIZE; i++) {
-		if ((pointers[i] = acquire_packet(inst)) == NULL) {
-			ABORT("Ran out of memory while priming pools!");
-		}
-	}
-	for (i = 0; i < AVBOX_VIDEO_PACKET_POOL_SIZE; i++) {
-		release_packet(inst, pointers[i]);
+	if (avbox_pool_prime(inst->frame_pool, AVBOX_AVFRAME_POOL_SIZE) == -1 ||
+		avbox_pool_prime(inst->av_packet_pool, AVBOX_AVPACKET_POOL_SIZE) == -1 ||
+		avbox_pool_prime(inst->packet_pool, AVBOX_VIDEO_PACKET_POOL_SIZE) == -1 ||
+		avbox_pool_prime(inst->ctlmsg_pool, AVBOX_CTLMSG_POOL_SIZE) == -1) {
+		ABORT("Ran out of memory while priming pools!");
 	}
 
-	/* priming the ctlmsg pool */
-	for (i = 0; i < AVBOX_CTLMSG_POOL_SIZE; i++) {
-		if ((pointers[i] = acquire_ctlmsg(inst)) == NULL) {
-			ABORT("Ran out of memory while priming pools!");
-		}
-	}
-	for (i = 0; i < AVBOX_CTLMSG_POOL_SIZE; i++) {
-		release_ctlmsg(inst, pointers[i]);
-	}
-
-#ifdef DEBUG_MEMORY_POOLS
-	inst->pools_primed = 1;
-#endif
 	DEBUG_PRINT(LOG_MODULE, "Memory pools primed");
 }
 
@@ -450,7 +372,7 @@ avbox_player_getsystemtime(struct avbox_player *inst)
 static int
 avbox_player_draw(struct avbox_window * const window, void * const context)
 {
-	int target_width, target_height;
+	int target_width, target_height, presented = 0;
 	struct avbox_player * const inst = context;
 
 	if (inst->video_window == NULL) {
@@ -473,9 +395,34 @@ avbox_player_draw(struct avbox_window * const window, void * const context)
 			0, 0, target_width, y);
 	}
 
+	/* if the driver supports it convert and scale the frame
+	 * straight into the window. Otherwise (or if it fails) upload
+	 * it to the offscreen window and scale from there */
+	if (LIKELY(inst->direct_present && inst->last_video_frame != NULL)) {
+		struct AVFrame * const avframe = inst->last_video_frame->avframe;
+		if (LIKELY(avbox_window_present(window, inst->state_info.pix_fmt,
+			(void**) avframe->data, avframe->linesize,
+			inst->state_info.video_res.w, inst->state_info.video_res.h,
+			x, y, inst->state_info.scaled_res.w, inst->state_info.scaled_res.h) == 0)) {
+			presented = 1;
+		} else {
+			LOG_VPRINT_ERROR("Could not present frame directly: %s",
+				strerror(errno));
+			inst->direct_present = 0;
+			avbox_window_blitbuf(inst->video_window,
+				inst->state_info.pix_fmt,
+				(void**) avframe->data, avframe->linesize,
+				inst->state_info.video_res.w,
+				inst->state_info.video_res.h,
+				0, 0);
+		}
+	}
+
 	/* scale and show the frame */
-	avbox_window_scaleblit(window, inst->video_window, MBV_BLITFLAGS_NONE,
-		x, y, inst->state_info.scaled_res.w, inst->state_info.scaled_res.h);
+	if (!presented) {
+		avbox_window_scaleblit(window, inst->video_window, MBV_BLITFLAGS_NONE,
+			x, y, inst->state_info.scaled_res.w, inst->state_info.scaled_res.h);
+	}
 
 #ifdef ENABLE_DVD
 	if (UNLIKELY(inst->stream.self != NULL && inst->stream.highlight != NULL)) {
@@ -528,14 +475,24 @@ avbox_player_doupdate(void *arg)
 				frame_time, current_time, current_time - frame_time);
 		}
 #endif
-		/* upload the frame to the window surface */
-		avbox_window_blitbuf(inst->video_window,
-			inst->state_info.pix_fmt,
-			(void**) frame->avframe->data,
-			frame->avframe->linesize,
-			inst->state_info.video_res.w,
-			inst->state_info.video_res.h,
-			0, 0);
+		/* upload the frame to the window surface. When the
+		 * driver can present frames directly this is done
+		 * by the draw handler */
+		if (!inst->direct_present) {
+			avbox_window_blitbuf(inst->video_window,
+				inst->state_info.pix_fmt,
+				(void**) frame->avframe->data,
+				frame->avframe->linesize,
+				inst->state_info.video_res.w,
+				inst->state_info.video_res.h,
+				0, 0);
+		}
+
+		struct avbox_av_frame * const last_frame = inst->last_video_frame;
+
+		/* the draw handler presents last_video_frame
+		 * directly so it must be set before we update */
+		inst->last_video_frame = frame;
 
 		avbox_window_update(inst->window);
 
@@ -550,11 +507,10 @@ avbox_player_doupdate(void *arg)
 		 * the case of MMAL this causes blinking (black frames whenever
 		 * the blitting doesn't happen fast enough). So we delay the
 		 * freeing of the frame until the next frame. */
-		if (LIKELY(inst->last_video_frame != NULL)) {
-			av_frame_unref(inst->last_video_frame->avframe);
-			release_av_frame(inst, inst->last_video_frame);
+		if (LIKELY(last_frame != NULL)) {
+			av_frame_unref(last_frame->avframe);
+			release_av_frame(inst, last_frame);
 		}
-		inst->last_video_frame = frame;
 	} else {
 		avbox_window_update(inst->window);
 	}
@@ -583,6 +539,7 @@ avbox_player_createwindow(void *arg)
 	 * for the target window */
 	avbox_window_setbgcolor(inst->video_window, AVBOX_COLOR(0x000000ff));
 	avbox_window_clear(inst->video_window);
+	inst->direct_present = avbox_window_canpresent();
 	return NULL;
 }
 
@@ -789,12 +746,18 @@ avbox_player_video(void *arg)
 			}
 			#endif
 
-			/* if we're running late skip this frame */
+			/* let the decoder know how late we're running so
+			 * it can start skipping frames before decoding them */
 			last_latency = MAX(0, current_time - frame_time);
+			__atomic_store_n(&inst->video_lateness,
+				(int) MIN(last_latency, INT_MAX), __ATOMIC_RELAXED);
+
+			/* if we're running late skip this frame */
 			if (UNLIKELY(last_latency > AVBOX_SKIP_FRAME_THRESHOLD)) {
 				if (++skip_frame <= AVBOX_SKIP_FRAME_MAX) {
 					av_frame_unref(frame->avframe);
 					release_av_frame(inst, frame);
+					ATOMIC_INC(&inst->frames_dropped);
 					goto next_frame;
 				}
 				skip_frame = 0;
@@ -908,13 +871,93 @@ avbox_player_destroy_filter_graph(AVFilterGraph *filter_graph,
 }
 
 
+/**
+ * Adjusts the decoder's frame skipping based on how
+ * late the renderer is running.
+ */
+static void
+avbox_player_video_skipcontrol(struct avbox_player * const inst,
+	AVCodecContext * const dec_ctx)
+{
+	int level = inst->video_skip_level;
+	const int lateness = __atomic_load_n(&inst->video_lateness, __ATOMIC_RELAXED);
+	int expected = lateness;
+
+	if (lateness > AVBOX_SKIP_NONKEY_THRESHOLD) {
+		level = AVBOX_SKIP_LEVEL_NONKEY;
+	} else if (lateness > AVBOX_SKIP_NONREF_THRESHOLD) {
+		level = MAX(level, AVBOX_SKIP_LEVEL_NONREF);
+	} else if (lateness > AVBOX_SKIP_LOOPFILTER_THRESHOLD) {
+		level = MAX(level, AVBOX_SKIP_LEVEL_LOOPFILTER);
+	} else if (lateness < AVBOX_SKIP_RECOVER_THRESHOLD && level > AVBOX_SKIP_LEVEL_NONE) {
+		level--;
+		/* wait for the next report before stepping down again. If the
+		 * renderer has already posted a new one we leave it alone */
+		__atomic_compare_exchange_n(&inst->video_lateness, &expected,
+			AVBOX_SKIP_RECOVER_THRESHOLD, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+
+	if (LIKELY(level == inst->video_skip_level)) {
+		return;
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Changing video skip level from %d to %d (lateness=%d)",
+		inst->video_skip_level, level, lateness);
+
+	/* the decoder threads pick up both fields on the
+	 * next packet. The loop filter is never skipped less
+	 * than the decoder_skip_loop_filter setting asks for */
+	switch (level) {
+	case AVBOX_SKIP_LEVEL_NONE:
+		dec_ctx->skip_frame = AVDISCARD_DEFAULT;
+		dec_ctx->skip_loop_filter = inst->video_skip_loop_filter;
+		break;
+	case AVBOX_SKIP_LEVEL_LOOPFILTER:
+		dec_ctx->skip_frame = AVDISCARD_DEFAULT;
+		dec_ctx->skip_loop_filter = MAX(inst->video_skip_loop_filter, AVDISCARD_NONREF);
+		break;
+	case AVBOX_SKIP_LEVEL_NONREF:
+		dec_ctx->skip_frame = AVDISCARD_NONREF;
+		dec_ctx->skip_loop_filter = MAX(inst->video_skip_loop_filter, AVDISCARD_NONREF);
+		break;
+	case AVBOX_SKIP_LEVEL_NONKEY:
+		dec_ctx->skip_frame = AVDISCARD_NONKEY;
+		dec_ctx->skip_loop_filter = AVDISCARD_ALL;
+		break;
+	default: abort();
+	}
+	inst->video_skip_level = level;
+}
+
+
+/**
+ * Checks if a decoded frame is already too late to be
+ * shown so we can drop it before running it through the
+ * filtergraph.
+ */
+static inline int
+avbox_player_video_toolate(struct avbox_player * const inst, AVFrame * const frame)
+{
+	int64_t pts;
+	if (LIKELY(inst->video_skip_level < AVBOX_SKIP_LEVEL_NONREF)) {
+		return 0;
+	}
+	if ((pts = av_frame_get_best_effort_timestamp(frame)) == AV_NOPTS_VALUE) {
+		return 0;
+	}
+	pts = av_rescale_q(pts, inst->fmt_ctx->streams[inst->video_stream_index]->time_base,
+		AV_TIME_BASE_Q);
+	return inst->getmastertime(inst) > (pts + AVBOX_SKIP_FRAME_THRESHOLD);
+}
+
+
 /**
  * Decodes video frames in the background.
  */
 static void *
 avbox_player_video_decode(void *arg)
 {
-	int ret, just_flushed = 0, keep_going, time_set = 0, flush_graph = 0;
+	int ret, just_flushed = 0, keep_going, time_set = 0, flush_graph = 0, flushing;
 	struct avbox_player *inst = (struct avbox_player*) arg;
 	struct avbox_player_packet *v_packet;
 	struct avbox_av_packet *av_packet = NULL;
@@ -959,6 +1002,14 @@ avbox_player_video_decode(void *arg)
 	inst->state_info.time_base.num = inst->fmt_ctx->streams[inst->video_stream_index]->time_base.num;
 	inst->state_info.time_base.den = inst->fmt_ctx->streams[inst->video_stream_index]->time_base.den;
 
+	/* reset the frame skipping state. The loop filter setting
+	 * chosen when opening the codec is the baseline */
+	__atomic_store_n(&inst->video_lateness, 0, __ATOMIC_RELAXED);
+	inst->video_skip_level = AVBOX_SKIP_LEVEL_NONE;
+	inst->video_skip_loop_filter = dec_ctx->skip_loop_filter;
+	inst->frames_dropped = 0;
+	inst->frames_skipped = 0;
+
 	/* allocate video frames */
 	video_frame_nat = av_frame_alloc(); /* native */
 	if (video_frame_nat == NULL) {
@@ -978,12 +1029,15 @@ avbox_player_video_decode(void *arg)
 
 		avbox_checkpoint_here(&inst->video_decoder_checkpoint);
 
+		/* if we're flushing and there's still data on the
+		 * codec we cannot block. Otherwise sleep until we get a
+		 * packet, the flushing state changes, or the queue is
+		 * closed or woken up to reach the checkpoint */
+		flushing = inst->flushing & AVBOX_PLAYER_FLUSH_VIDEO;
 		if ((av_packet = avbox_queue_peek(inst->video_packets_q,
-			!(inst->flushing & AVBOX_PLAYER_FLUSH_VIDEO))) == NULL) {
+			!flushing || inst->video_decoder_flushed)) == NULL) {
 			if (errno == EAGAIN) {
-				if (inst->video_decoder_flushed ||
-					!(inst->flushing & AVBOX_PLAYER_FLUSH_VIDEO)) {
-					usleep(50L * 1000L);
+				if (inst->video_decoder_flushed || !flushing) {
 					continue;
 				}
 
@@ -1015,6 +1069,9 @@ avbox_player_video_decode(void *arg)
 				break;
 			}
 		} else {
+			/* skip frames if the renderer is falling behind */
+			avbox_player_video_skipcontrol(inst, dec_ctx);
+
 			/* send packet to codec for decoding */
 			if (UNLIKELY((ret  = avcodec_send_packet(dec_ctx, av_packet->avpacket)) < 0)) {
 				if (ret == AVERROR(EAGAIN)) {
@@ -1065,6 +1122,14 @@ avbox_player_video_decode(void *arg)
 				keep_going = 0;
 
 			} else {
+				/* if we're catching up and this frame is already too
+				 * late don't waste time filtering it */
+				if (UNLIKELY(time_set && avbox_player_video_toolate(inst, video_frame_nat))) {
+					ATOMIC_INC(&inst->frames_skipped);
+					av_frame_unref(video_frame_nat);
+					continue;
+				}
+
 				if (video_frame_nat->pkt_dts == AV_NOPTS_VALUE) {
 					video_frame_nat->pts = 0;
 				} else {
@@ -1232,6 +1297,10 @@ avbox_player_video_decode(void *arg)
 		if (just_flushed) {
 			DEBUG_PRINT(LOG_MODULE, "Video decoder flushed");
 			avcodec_flush_buffers(dec_ctx);
+			dec_ctx->skip_frame = AVDISCARD_DEFAULT;
+			dec_ctx->skip_loop_filter = inst->video_skip_loop_filter;
+			inst->video_skip_level = AVBOX_SKIP_LEVEL_NONE;
+			__atomic_store_n(&inst->video_lateness, 0, __ATOMIC_RELAXED);
 			if (video_filter_graph != NULL) {
 				avbox_player_destroy_filter_graph(video_filter_graph,
 					video_buffersrc_ctx, video_buffersink_ctx, video_frame_nat);
@@ -1278,23 +1347,143 @@ decoder_exit:
 }
 
 
+/**
+ * Builds the audio filter chain that converts the decoded audio
+ * to the output format and returns the output channel layout.
+ * ffmpeg and ALSA disagree on the order of the surround channels
+ * so multichannel output is remapped to ALSA's order.
+ */
+static uint64_t
+avbox_player_audio_filters(char * const buf, const size_t bufsz,
+	const struct avbox_audio_format * const format)
+{
+	uint64_t channel_layout;
+	const char *layout, *map;
+
+	switch (format->channels) {
+	case 8:
+		layout = "7.1";
+		map = ",channelmap=map=0|1|4|5|2|3|6|7:channel_layout=7.1";
+		channel_layout = AV_CH_LAYOUT_7POINT1;
+		break;
+	case 6:
+		layout = "5.1";
+		map = ",channelmap=map=0|1|4|5|2|3:channel_layout=5.1";
+		/* ffmpeg's "5.1" has back (not side) surrounds */
+		channel_layout = AV_CH_LAYOUT_5POINT1_BACK;
+		break;
+	default:
+		layout = "stereo";
+		map = "";
+		channel_layout = AV_CH_LAYOUT_STEREO;
+		break;
+	}
+
+	snprintf(buf, bufsz, "aresample=%u,aformat=sample_fmts=%s:channel_layouts=%s%s",
+		format->rate, (format->format == AVBOX_AUDIO_FORMAT_S32) ? "s32" : "s16",
+		layout, map);
+	return channel_layout;
+}
+
+
+/**
+ * Wraps an AC-3 or DTS packet on an IEC 61937 burst and
+ * writes it to the audio stream.
+ */
+static int
+avbox_player_audio_passthrough(struct avbox_player * const inst,
+	AVFormatContext * const spdif_ctx, const AVPacket * const pkt,
+	const struct avbox_audio_format * const format, int * const time_set)
+{
+	int len;
+	uint8_t *buf;
+	struct avbox_av_frame *frame;
+
+	if ((len = avbox_ffmpegutil_spdifwrite(spdif_ctx, pkt, &buf)) <= 0) {
+		if (len < 0) {
+			/* drop the packet and keep going */
+			LOG_PRINT_ERROR("Could not wrap audio packet for passthrough!");
+		}
+		return 0;
+	}
+
+	/* if this is the first burst after a flush make sure the
+	 * stream is on passthrough mode and set the clock */
+	if (UNLIKELY(!*time_set)) {
+		int64_t pts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+		if (pts == AV_NOPTS_VALUE) {
+			av_free(buf);
+			return 0;
+		}
+		if (avbox_audiostream_setformat(inst->audio_stream, format) == -1) {
+			LOG_PRINT_ERROR("Could not set passthrough format!");
+			av_free(buf);
+			return -1;
+		}
+		pts = av_rescale_q(pts,
+			inst->fmt_ctx->streams[inst->audio_stream_index]->time_base,
+			AV_TIME_BASE_Q);
+		avbox_audiostream_setclock(inst->audio_stream, pts);
+		inst->getmastertime = avbox_player_getaudiotime;
+		*time_set = 1;
+	}
+
+	if ((frame = acquire_av_frame(inst)) == NULL) {
+		LOG_PRINT_ERROR("Could not allocate avframe!");
+		av_free(buf);
+		return -1;
+	}
+
+	/* the bursts are played as 16-bit stereo frames */
+	frame->avframe->format = AV_SAMPLE_FMT_S16;
+	frame->avframe->channel_layout = AV_CH_LAYOUT_STEREO;
+	frame->avframe->channels = 2;
+	frame->avframe->sample_rate = format->rate;
+	frame->avframe->nb_samples = len / 4;
+	if (av_frame_get_buffer(frame->avframe, 0) < 0) {
+		LOG_PRINT_ERROR("Could not allocate burst buffer!");
+		release_av_frame(inst, frame);
+		av_free(buf);
+		return -1;
+	}
+	memcpy(frame->avframe->data[0], buf, frame->avframe->nb_samples * 4);
+	av_free(buf);
+
+	while (avbox_audiostream_write(inst->audio_stream,
+		frame->avframe->data[0], frame->avframe->nb_samples, frame) == -1) {
+		if (errno != EAGAIN) {
+			LOG_VPRINT_ERROR("Could not write audio frames: %s",
+				strerror(errno));
+			av_frame_unref(frame->avframe);
+			release_av_frame(inst, frame);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
 /**
  * Decodes the audio stream.
  */
 static void *
 avbox_player_audio_decode(void * arg)
 {
-	int ret, keep_going, just_flushed = 0, time_set = 0, flush_graph = 0;
+	int ret, keep_going, just_flushed = 0, time_set = 0, flush_graph = 0, flushing;
 	int stream_index = -1;
 	struct avbox_syncarg * const syncarg = arg;
 	struct avbox_player * const inst = avbox_syncarg_data(syncarg);
 	struct avbox_av_packet * av_packet = NULL;
-	const char *audio_filters ="aresample=48000,aformat=sample_fmts=s16:channel_layouts=stereo";
+	struct avbox_audio_format want_format, out_format;
+	char audio_filters[256];
+	uint64_t out_channel_layout;
 	AVCodecContext *dec_ctx = NULL;
+	AVFormatContext *spdif_ctx = NULL;
 	AVFrame *audio_frame_nat = NULL;
 	AVFilterGraph *filter_graph = NULL;
 	AVFilterContext *audio_buffersink_ctx = NULL;
-	AVFilterContext *audio_buffersrc_ctx;
+	AVFilterContext *audio_buffersrc_ctx = NULL;
 	const char *sample_fmt_name;
 
 	DEBUG_SET_THREAD_NAME("audio_decoder");
@@ -1314,9 +1503,6 @@ avbox_player_audio_decode(void * arg)
 		goto end;
 	}
 
-	/* initialize audio filter graph */
-	DEBUG_VPRINT("player", "Audio filters: %s", audio_filters);
-
 	avbox_checkpoint_enable(&inst->audio_decoder_checkpoint);
 	avbox_syncarg_return(syncarg, NULL);
 
@@ -1333,12 +1519,11 @@ avbox_player_audio_decode(void * arg)
 		avbox_checkpoint_here(&inst->audio_decoder_checkpoint);
 
 		/* wait for the stream decoder to give us some packets */
+		flushing = inst->flushing & AVBOX_PLAYER_FLUSH_AUDIO;
 		if ((av_packet = avbox_queue_peek(inst->audio_packets_q,
-			!(inst->flushing & AVBOX_PLAYER_FLUSH_AUDIO))) == NULL) {
+			!flushing || inst->audio_decoder_flushed)) == NULL) {
 			if (errno == EAGAIN) {
-				if (inst->audio_decoder_flushed ||
-					!(inst->flushing & AVBOX_PLAYER_FLUSH_AUDIO)) {
-					usleep(50L * 1000L);
+				if (inst->audio_decoder_flushed || !flushing) {
 					continue;
 				} else {
 					ret = avcodec_send_packet(dec_ctx, NULL);
@@ -1372,6 +1557,10 @@ avbox_player_audio_decode(void * arg)
 						DEBUG_PRINT(LOG_MODULE, "Closing audio decoder");
 						avcodec_close(dec_ctx);
 						avcodec_free_context(&dec_ctx);
+						if (spdif_ctx != NULL) {
+							avbox_ffmpegutil_closespdif(spdif_ctx);
+							spdif_ctx = NULL;
+						}
 					} else {
 						if ((ret = avcodec_send_packet(dec_ctx, NULL)) < 0) {
 							LOG_PRINT_ERROR("Error sending flush packet to audio decoder!");
@@ -1392,10 +1581,32 @@ avbox_player_audio_decode(void * arg)
 					}
 					stream_index = av_packet->avpacket->stream_index;
 					time_set = 0;
+
+					/* if this is an AC-3 or DTS stream and the output
+					 * supports passthrough send it to the receiver without
+					 * decoding it. The decoder is kept open but we don't
+					 * feed it so the flush logic stays the same */
+					want_format.format = AVBOX_AUDIO_FORMAT_IEC61937;
+					want_format.rate = dec_ctx->sample_rate;
+					want_format.channels = 2;
+					if ((dec_ctx->codec_id == AV_CODEC_ID_AC3 || dec_ctx->codec_id == AV_CODEC_ID_DTS) &&
+						avbox_audiostream_negotiate(inst->audio_stream, &want_format, &out_format) == 0 &&
+						(spdif_ctx = avbox_ffmpegutil_openspdif(
+							inst->fmt_ctx->streams[inst->audio_stream_index])) != NULL) {
+						DEBUG_VPRINT(LOG_MODULE, "Using %s passthrough",
+							avcodec_get_name(dec_ctx->codec_id));
+					}
 				}
 			}
 
-			if (av_packet != NULL) {
+			if (av_packet != NULL && spdif_ctx != NULL) {
+				if (avbox_player_audio_passthrough(inst, spdif_ctx,
+					av_packet->avpacket, &out_format, &time_set) == -1) {
+					avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
+					goto end;
+				}
+				inst->audio_decoder_flushed = 0;
+			} else if (av_packet != NULL) {
 				/* send packets to codec for decoding */
 				if ((ret = avcodec_send_packet(dec_ctx, av_packet->avpacket)) < 0) {
 					if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
@@ -1472,13 +1683,35 @@ avbox_player_audio_decode(void * arg)
 						sample_fmt_name = "fltp";
 					}
 
-					DEBUG_PRINT(LOG_MODULE, "Initializing filtergraph");
+					/* pick the output format closest to the decoded
+					 * audio and switch the audio stream to it. Lossy
+					 * decoders output float samples but don't set
+					 * bits_per_raw_sample so they get S16 */
+					want_format.format = (dec_ctx->bits_per_raw_sample > 16) ?
+						AVBOX_AUDIO_FORMAT_S32 : AVBOX_AUDIO_FORMAT_S16;
+					want_format.rate = dec_ctx->sample_rate;
+					want_format.channels = dec_ctx->channels;
+					if (avbox_audiostream_negotiate(inst->audio_stream, &want_format, &out_format) == -1 ||
+						avbox_audiostream_setformat(inst->audio_stream, &out_format) == -1) {
+						LOG_PRINT_ERROR("Could not set audio output format!");
+						avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
+						av_frame_unref(audio_frame_nat);
+						goto end;
+					}
+					out_channel_layout = avbox_player_audio_filters(
+						audio_filters, sizeof(audio_filters), &out_format);
+
+					DEBUG_VPRINT(LOG_MODULE, "Initializing filtergraph: %s",
+						audio_filters);
 
 					/* initialize audio filtergraph */
 					if (avbox_ffmpegutil_initaudiofilters(
 						&audio_buffersink_ctx, &audio_buffersrc_ctx,
 						&filter_graph, 	audio_filters, dec_ctx->sample_rate,
-						dec_ctx->time_base, dec_ctx->channel_layout, sample_fmt_name) < 0) {
+						dec_ctx->time_base, dec_ctx->channel_layout, sample_fmt_name,
+						out_format.rate, out_channel_layout,
+						(out_format.format == AVBOX_AUDIO_FORMAT_S32) ?
+							AV_SAMPLE_FMT_S32 : AV_SAMPLE_FMT_S16) < 0) {
 						LOG_PRINT_ERROR("Could not init filter graph!");
 						avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
 						av_frame_unref(audio_frame_nat);
@@ -1589,6 +1822,8 @@ avbox_player_audio_decode(void * arg)
 			}
 			inst->audio_decoder_flushed = 1;
 			filter_graph = NULL;
+			audio_buffersrc_ctx = NULL;
+			audio_buffersink_ctx = NULL;
 			just_flushed = 0;
 			time_set = 0;
 		}
@@ -1619,6 +1854,9 @@ end:
 		avcodec_close(dec_ctx);
 		avcodec_free_context(&dec_ctx);
 	}
+	if (spdif_ctx != NULL) {
+		avbox_ffmpegutil_closespdif(spdif_ctx);
+	}
 
 	DEBUG_PRINT("player", "Audio decoder bailing out");
 
@@ -1772,7 +2010,7 @@ avbox_player_stream_parse(void *arg)
 		goto decoder_exit;
 	}
 
-	if ((inst->audio_packets_q = avbox_queue_new(MB_AUDIO_BUFFER_PACKETS)) == NULL) {
+	if ((inst->audio_packets_q = avbox_queue_new(MB_AUDIO_BUFFER_PACKETS, AVBOX_QUEUEFLAGS_SPSC)) == NULL) {
 		LOG_VPRINT_ERROR("Could not create audio packets queue: %s!",
 			strerror(errno));
 		goto decoder_exit;
@@ -1801,14 +2039,16 @@ avbox_player_stream_parse(void *arg)
 		}
 
 		/* create a video packets queue */
-		if ((inst->video_packets_q = avbox_queue_new(MB_VIDEO_BUFFER_PACKETS)) == NULL) {
+		if ((inst->video_packets_q = avbox_queue_new(MB_VIDEO_BUFFER_PACKETS, AVBOX_QUEUEFLAGS_SPSC)) == NULL) {
 			LOG_VPRINT_ERROR("Could not create video packets queue: %s!",
 				strerror(errno));
 			goto decoder_exit;
 		}
 
-		/* create a decoded frames queue */
-		if ((inst->video_frames_q = avbox_queue_new(AVBOX_BUFFER_VIDEO)) == NULL) {
+		/* create a decoded frames queue. The ring is sized for the
+		 * largest limit that we set while buffering */
+		if ((inst->video_frames_q = avbox_queue_new(AVBOX_BUFFER_VIDEO * 2,
+			AVBOX_QUEUEFLAGS_SPSC)) == NULL) {
 			LOG_VPRINT_ERROR("Could not create frames queue: %s!",
 				strerror(errno));
 			goto decoder_exit;
@@ -1816,12 +2056,7 @@ avbox_player_stream_parse(void *arg)
 
 		avbox_queue_setname(inst->video_frames_q, "video_frames");
 		avbox_queue_setname(inst->video_packets_q, "video_packets");
-
-		/* if the audio is running the show then set the
-		 * video queue to unlimited size */
-		if (inst->audio_stream_index != -1) {
-			avbox_queue_setsize(inst->video_frames_q, AVBOX_BUFFER_VIDEO);
-		}
+		avbox_queue_setsize(inst->video_frames_q, AVBOX_BUFFER_VIDEO);
 
 		DEBUG_VPRINT("player", "Video stream %i selected",
 			inst->video_stream_index);
@@ -2466,10 +2701,10 @@ avbox_player_drop(struct avbox_player * const inst)
 	 * decoders are aware */
 	inst->flushing = AVBOX_PLAYER_FLUSH_ALL;
 	if (inst->video_packets_q != NULL) {
-		avbox_queue_wake(inst->video_packets_q);
+		avbox_queue_notify(inst->video_packets_q);
 	}
 	if (inst->audio_packets_q != NULL) {
-		avbox_queue_wake(inst->audio_packets_q);
+		avbox_queue_notify(inst->audio_packets_q);
 	}
 
 	avbox_player_halt(inst);
@@ -2497,8 +2732,9 @@ avbox_player_drop(struct avbox_player * const inst)
 				}
 				release_packet(inst, v_packet);
 			} else {
+				/* let the decoder run until it outputs a frame */
 				avbox_checkpoint_continue(&inst->video_decoder_checkpoint);
-				usleep(50LL * 1000LL);
+				avbox_queue_timedpeek(inst->video_frames_q, 50LL * 1000LL);
 				avbox_checkpoint_halt(&inst->video_decoder_checkpoint);
 				avbox_queue_wake(inst->video_packets_q);
 			}
@@ -2914,10 +3150,10 @@ avbox_player_flush(struct avbox_player * const inst, const int flags)
 			 * decoders are ware */
 			inst->flushing = flags;
 			if (inst->video_packets_q != NULL && (flags & AVBOX_PLAYER_FLUSH_VIDEO)) {
-				avbox_queue_wake(inst->video_packets_q);
+				avbox_queue_notify(inst->video_packets_q);
 			}
 			if (inst->audio_packets_q != NULL && (flags & AVBOX_PLAYER_FLUSH_AUDIO)) {
-				avbox_queue_wake(inst->audio_packets_q);
+				avbox_queue_notify(inst->audio_packets_q);
 			}
 		}
 
@@ -3292,12 +3528,15 @@ avbox_player_control(void * context, struct avbox_message * msg)
 
 			DEBUG_PRINT(LOG_MODULE, "Player stopped");
 
-#ifdef DEBUG_MEMORY_POOLS
-			LOG_VPRINT_INFO("Video packets leaked: %i", inst->packet_pool_allocs - LIST_SIZE(&inst->packet_pool));
-			LOG_VPRINT_INFO("AVFrames leaked: %i", inst->frame_pool_allocs - LIST_SIZE(&inst->frame_pool));
-			LOG_VPRINT_INFO("AVPackets leaked: %i", inst->av_packet_pool_allocs - LIST_SIZE(&inst->av_packet_pool));
-			LOG_VPRINT_INFO("Control messages leaked: %i (1 is ok)", inst->ctlmsg_pool_allocs - LIST_SIZE(&inst->ctlmsg_pool));
-#endif
+			/* in_use should be 0 for all pools except
+			 * ctlmsg (1 is ok) */
+			avbox_pool_dumpstats(inst->packet_pool);
+			avbox_pool_dumpstats(inst->frame_pool);
+			avbox_pool_dumpstats(inst->av_packet_pool);
+			avbox_pool_dumpstats(inst->ctlmsg_pool);
+
+			DEBUG_VPRINT(LOG_MODULE, "Video frames dropped=%u skipped=%u",
+				inst->frames_dropped, inst->frames_skipped);
 			break;
 		}
 		case AVBOX_PLAYERCTL_PAUSE:
@@ -3913,6 +4152,25 @@ avbox_player_getduration(struct avbox_player * const inst, int64_t *duration)
 }
 
 
+/**
+ * Gets the number of video frames that have been dropped
+ * by the renderer and skipped by the decoder because playback
+ * was running late.
+ */
+void
+avbox_player_getframestats(struct avbox_player * const inst,
+	unsigned int * const dropped, unsigned int * const skipped)
+{
+	ASSERT(inst != NULL);
+	if (dropped != NULL) {
+		*dropped = inst->frames_dropped;
+	}
+	if (skipped != NULL) {
+		*skipped = inst->frames_skipped;
+	}
+}
+
+
 /**
  * Get the media position in microseconds.
  */
@@ -3984,33 +4242,14 @@ avbox_player_handler(void * const context, struct avbox_message * const msg)
 	}
 	case AVBOX_MESSAGETYPE_CLEANUP:
 	{
-		struct avbox_av_packet *av_packet;
-		struct avbox_av_frame *frame;
-		struct avbox_player_packet *packet;
-		struct avbox_player_ctlmsg *msg;
-
 		DEBUG_PRINT("player", "Cleaning up after player");
 		ASSERT(inst != NULL);
 
 		/* free the pools */
-		LIST_FOREACH_SAFE(struct avbox_av_packet*, av_packet, &inst->av_packet_pool, {
-			LIST_REMOVE(av_packet);
-			av_packet_free(&av_packet->avpacket);
-			free(av_packet);
-		});
-		LIST_FOREACH_SAFE(struct avbox_av_frame*, frame, &inst->frame_pool, {
-			LIST_REMOVE(frame);
-			av_frame_free(&frame->avframe);
-			free(frame);
-		});
-		LIST_FOREACH_SAFE(struct avbox_player_packet*, packet, &inst->packet_pool, {
-			LIST_REMOVE(packet);
-			free(packet);
-		});
-		LIST_FOREACH_SAFE(struct avbox_player_ctlmsg*, msg, &inst->ctlmsg_pool, {
-			LIST_REMOVE(msg);
-			free(msg);
-		});
+		avbox_pool_destroy(inst->av_packet_pool);
+		avbox_pool_destroy(inst->frame_pool);
+		avbox_pool_destroy(inst->packet_pool);
+		avbox_pool_destroy(inst->ctlmsg_pool);
 
 		free(inst);
 		break;
@@ -4108,9 +4347,7 @@ avbox_player_new(struct avbox_window *window)
 		(inst->control_thread = avbox_thread_new(avbox_player_control, inst, AVBOX_THREAD_REALTIME, -5)) == NULL) {
 		LOG_VPRINT_ERROR("Could not create threads: %s",
 			strerror(errno));
-		free(inst);
-		abort();	/* until we cleanup */
-		return NULL;
+		goto err;
 	} else {
 		struct avbox_delegate *del;
 		if ((del = avbox_thread_delegate(inst->control_thread,
@@ -4123,15 +4360,7 @@ avbox_player_new(struct avbox_window *window)
 
 	if ((inst->video_time = avbox_stopwatch_new()) == NULL) {
 		LOG_PRINT_ERROR("Could not create stopwatch. Out of memory");
-		free(inst);
-		return NULL;
-	}
-
-	/* create a dispatch object */
-	if ((inst->object = avbox_object_new(avbox_player_handler, inst)) == NULL) {
-		LOG_PRINT_ERROR("Could not create dispatch object");
-		free(inst);
-		return NULL;
+		goto err;
 	}
 
 	inst->window = window;
@@ -4143,37 +4372,47 @@ avbox_player_new(struct avbox_window *window)
 	inst->status = MB_PLAYER_STATUS_READY;
 	inst->aspect_ratio.num = 16;
 	inst->aspect_ratio.den = 9;
-	inst->state_info.title = strdup("NONE");
 
-	if (inst->state_info.title == NULL) {
-		avbox_object_destroy(inst->object);
-		free(inst);
-		return NULL;
+	if ((inst->state_info.title = strdup("NONE")) == NULL) {
+		ASSERT(errno == ENOMEM);
+		goto err;
 	}
 
 	LIST_INIT(&inst->playlist);
 	LIST_INIT(&inst->subscribers);
-	LIST_INIT(&inst->frame_pool);
-	LIST_INIT(&inst->packet_pool);
-	LIST_INIT(&inst->av_packet_pool);
-	LIST_INIT(&inst->ctlmsg_pool);
+
+	/* create memory pools */
+	if ((inst->frame_pool = avbox_pool_new("AVFrame", sizeof(struct avbox_av_frame),
+			av_frame_pool_init, av_frame_pool_fini)) == NULL ||
+		(inst->av_packet_pool = avbox_pool_new("AVPacket", sizeof(struct avbox_av_packet),
+			av_packet_pool_init, av_packet_pool_fini)) == NULL ||
+		(inst->packet_pool = avbox_pool_new("player_packet",
+			sizeof(struct avbox_player_packet), NULL, NULL)) == NULL ||
+		(inst->ctlmsg_pool = avbox_pool_new("player_ctlmsg",
+			sizeof(struct avbox_player_ctlmsg), NULL, NULL)) == NULL) {
+		LOG_PRINT_ERROR("Could not create player memory pools!");
+		goto err;
+	}
 
 	/* initialize pthreads primitives */
 	pthread_mutexattr_init(&prio_inherit);
 	pthread_mutexattr_setprotocol(&prio_inherit, PTHREAD_PRIO_INHERIT);
-	if (pthread_mutex_init(&inst->state_lock, &prio_inherit) != 0 ||
-		pthread_mutex_init(&inst->av_packet_pool_lock, &prio_inherit) != 0 ||
-		pthread_mutex_init(&inst->packet_pool_lock, &prio_inherit) != 0 ||
-		pthread_mutex_init(&inst->ctlmsg_pool_lock, &prio_inherit) != 0 ||
-		pthread_mutex_init(&inst->frame_pool_lock, &prio_inherit) != 0) {
+	if (pthread_mutex_init(&inst->state_lock, &prio_inherit) != 0) {
 		LOG_PRINT_ERROR("Cannot create player instance. Pthreads error");
-		avbox_object_destroy(inst->object);
-		free(inst->state_info.title);
-		free(inst);
-		return NULL;
+		pthread_mutexattr_destroy(&prio_inherit);
+		goto err;
 	}
 	pthread_mutexattr_destroy(&prio_inherit);
 
+	/* create a dispatch object. This must be the last step
+	 * since once it exists the DESTROY and CLEANUP handlers
+	 * own everything above */
+	if ((inst->object = avbox_object_new(avbox_player_handler, inst)) == NULL) {
+		LOG_PRINT_ERROR("Could not create dispatch object");
+		pthread_mutex_destroy(&inst->state_lock);
+		goto err;
+	}
+
 	prime_pools(inst);
 
 	/* initialize checkpoints */
@@ -4185,4 +4424,41 @@ avbox_player_new(struct avbox_window *window)
 	avbox_window_setdrawfunc(inst->window, avbox_player_draw, inst);
 
 	return inst;
+
+err:
+	if (inst->ctlmsg_pool != NULL) {
+		avbox_pool_destroy(inst->ctlmsg_pool);
+	}
+	if (inst->packet_pool != NULL) {
+		avbox_pool_destroy(inst->packet_pool);
+	}
+	if (inst->av_packet_pool != NULL) {
+		avbox_pool_destroy(inst->av_packet_pool);
+	}
+	if (inst->frame_pool != NULL) {
+		avbox_pool_destroy(inst->frame_pool);
+	}
+	if (inst->state_info.title != NULL) {
+		free(inst->state_info.title);
+	}
+	if (inst->video_time != NULL) {
+		avbox_stopwatch_destroy(inst->video_time);
+	}
+	if (inst->control_thread != NULL) {
+		avbox_thread_destroy(inst->control_thread);
+	}
+	if (inst->stream_input_thread != NULL) {
+		avbox_thread_destroy(inst->stream_input_thread);
+	}
+	if (inst->video_output_thread != NULL) {
+		avbox_thread_destroy(inst->video_output_thread);
+	}
+	if (inst->video_decoder_thread != NULL) {
+		avbox_thread_destroy(inst->video_decoder_thread);
+	}
+	if (inst->audio_decoder_thread != NULL) {
+		avbox_thread_destroy(inst->audio_decoder_thread);
+	}
+	free(inst);
+	return NULL;
 }
@@ -219,6 +219,16 @@ void
 avbox_player_gettime(struct avbox_player * const inst, int64_t *time);
 
 
+/**
+ * Gets the number of video frames that have been dropped
+ * by the renderer and skipped by the decoder because playback
+ * was running late.
+ */
+void
+avbox_player_getframestats(struct avbox_player * const inst,
+	unsigned int * const dropped, unsigned int * const skipped);
+
+
 /**
  * Get the state of the stream buffer
  */
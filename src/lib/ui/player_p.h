@@ -2,6 +2,7 @@
 #define __AVBOX_PLAYER_PRIVATE__
 
 #include "../avbox.h"
+#include "../pool.h"
 
 
 /* flush flags */
@@ -91,29 +92,23 @@ struct avbox_player
 	int underrun;
 	int stopping;
 	int paused;
-	int pools_primed;
 
 	avbox_player_time_fn getmastertime;
 	AVFormatContext *fmt_ctx;
 	struct avbox_av_frame *last_video_frame;
+	int direct_present;
+	int video_lateness;
+	int video_skip_level;
+	enum AVDiscard video_skip_loop_filter;
+	unsigned int frames_dropped;
+	unsigned int frames_skipped;
 	pthread_mutex_t state_lock;
 	LIST subscribers;
 
-	LIST frame_pool;
-	LIST av_packet_pool;
-	LIST packet_pool;
-	LIST ctlmsg_pool;
-	pthread_mutex_t frame_pool_lock;
-	pthread_mutex_t packet_pool_lock;
-	pthread_mutex_t av_packet_pool_lock;
-	pthread_mutex_t ctlmsg_pool_lock;
-
-#ifdef DEBUG_MEMORY_POOLS
-	unsigned int frame_pool_allocs;
-	unsigned int packet_pool_allocs;
-	unsigned int av_packet_pool_allocs;
-	unsigned int ctlmsg_pool_allocs;
-#endif
+	struct avbox_pool *frame_pool;
+	struct avbox_pool *av_packet_pool;
+	struct avbox_pool *packet_pool;
+	struct avbox_pool *ctlmsg_pool;
 
 	/* playlist stuff */
 	/* TODO: this belongs in the application code */
@@ -0,0 +1,433 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as 
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#	include "../../config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <pango/pangocairo.h>
+
+#define LOG_MODULE "textcache"
+
+#include "textcache.h"
+#include "../debug.h"
+#include "../log.h"
+#include "../compiler.h"
+#include "../linkedlist.h"
+
+
+/*
+ * Shaping a string with pango is by far the most expensive part
+ * of drawing text so we keep the rasterized text of the most
+ * recently drawn strings as alpha masks. Drawing a cached string
+ * is a single cairo_mask_surface() call with whatever source is
+ * set on the context. The cache is bounded by the total size of
+ * the masks and the least recently used entries are dropped first.
+ */
+#define AVBOX_TEXTCACHE_MAX_BYTES	(2 * 1024 * 1024)
+
+/* number of hash buckets. Must be a power of 2 */
+#define AVBOX_TEXTCACHE_BUCKETS		(256)
+
+
+/**
+ * Hash bucket node.
+ */
+LISTABLE_STRUCT(avbox_textcache_node,
+	struct avbox_textcache_entry *entry;
+);
+
+
+/**
+ * Cached text entry. The entry itself is linked on the LRU
+ * list and it's bucket_node on it's hash bucket.
+ */
+LISTABLE_STRUCT(avbox_textcache_entry,
+	struct avbox_textcache_node bucket_node;
+	uint32_t hash;
+	char *text;
+	PangoFontDescription *font;
+	int w;
+	int h;
+	PangoAlignment alignment;
+	PangoEllipsizeMode ellipsize;
+	int x_offset;
+	int y_offset;
+	int advance;
+	size_t size;
+	cairo_surface_t *mask;
+);
+
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST cache;
+static LIST buckets[AVBOX_TEXTCACHE_BUCKETS];
+static size_t cache_size = 0;
+
+
+/**
+ * Hashes the cache key.
+ */
+static uint32_t
+avbox_textcache_hash(const char *text, const int w, const int h,
+	const PangoAlignment alignment, const PangoEllipsizeMode ellipsize)
+{
+	uint32_t hash = 2166136261U;
+	while (*text != '\0') {
+		hash ^= (unsigned char) *text++;
+		hash *= 16777619U;
+	}
+	hash ^= (uint32_t) w;
+	hash *= 16777619U;
+	hash ^= (uint32_t) h;
+	hash *= 16777619U;
+	hash ^= (uint32_t) alignment;
+	hash *= 16777619U;
+	hash ^= (uint32_t) ellipsize;
+	hash *= 16777619U;
+	return hash;
+}
+
+
+/**
+ * Get the hash bucket for a key hash.
+ */
+static inline LIST *
+avbox_textcache_bucket(const uint32_t hash)
+{
+	return &buckets[hash & (AVBOX_TEXTCACHE_BUCKETS - 1)];
+}
+
+
+/**
+ * Frees a cache entry. Must be called with the cache locked.
+ */
+static void
+avbox_textcache_free(struct avbox_textcache_entry * const entry)
+{
+	LIST_REMOVE(entry);
+	LIST_REMOVE(&entry->bucket_node);
+	cache_size -= entry->size;
+	if (entry->mask != NULL) {
+		cairo_surface_destroy(entry->mask);
+	}
+	pango_font_description_free(entry->font);
+	free(entry->text);
+	free(entry);
+}
+
+
+/**
+ * Shapes and rasterizes the text into a new cache entry.
+ */
+static struct avbox_textcache_entry *
+avbox_textcache_render(const char * const text, const uint32_t hash,
+	const PangoFontDescription * const font,
+	const int w, const int h, const PangoAlignment alignment,
+	const PangoEllipsizeMode ellipsize)
+{
+	struct avbox_textcache_entry *entry;
+	PangoLayout *layout;
+	PangoRectangle ink, logical;
+	cairo_surface_t *surface;
+	cairo_t *context;
+
+	if ((surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1)) == NULL ||
+		cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		LOG_PRINT_ERROR("Could not create surface");
+		return NULL;
+	}
+	if ((context = cairo_create(surface)) == NULL) {
+		LOG_PRINT_ERROR("Could not create cairo context");
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+	cairo_surface_destroy(surface);
+
+	/* shape the text */
+	if ((layout = pango_cairo_create_layout(context)) == NULL) {
+		LOG_PRINT_ERROR("Could not create layout");
+		cairo_destroy(context);
+		return NULL;
+	}
+	pango_layout_set_font_description(layout, font);
+	if (w != -1) {
+		pango_layout_set_width(layout, w * PANGO_SCALE);
+	}
+	if (h != -1) {
+		pango_layout_set_height(layout, h * PANGO_SCALE);
+	}
+	pango_layout_set_alignment(layout, alignment);
+	pango_layout_set_ellipsize(layout, ellipsize);
+	pango_layout_set_text(layout, text, -1);
+	pango_layout_get_pixel_extents(layout, &ink, &logical);
+	cairo_destroy(context);
+
+	if ((entry = malloc(sizeof(struct avbox_textcache_entry))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		g_object_unref(layout);
+		return NULL;
+	}
+	if ((entry->text = strdup(text)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		g_object_unref(layout);
+		free(entry);
+		return NULL;
+	}
+
+	entry->bucket_node.entry = entry;
+	entry->hash = hash;
+	entry->font = pango_font_description_copy(font);
+	entry->w = w;
+	entry->h = h;
+	entry->alignment = alignment;
+	entry->ellipsize = ellipsize;
+	entry->x_offset = ink.x;
+	entry->y_offset = ink.y;
+	entry->advance = logical.width;
+	entry->mask = NULL;
+	entry->size = sizeof(struct avbox_textcache_entry);
+
+	/* rasterize it to an alpha mask. An empty string
+	 * gets an entry without a mask */
+	if (ink.width > 0 && ink.height > 0) {
+		entry->mask = cairo_image_surface_create(CAIRO_FORMAT_A8,
+			ink.width, ink.height);
+		if (cairo_surface_status(entry->mask) != CAIRO_STATUS_SUCCESS ||
+			(context = cairo_create(entry->mask)) == NULL) {
+			LOG_PRINT_ERROR("Could not create text mask");
+			cairo_surface_destroy(entry->mask);
+			pango_font_description_free(entry->font);
+			g_object_unref(layout);
+			free(entry->text);
+			free(entry);
+			return NULL;
+		}
+		cairo_translate(context, -ink.x, -ink.y);
+		cairo_set_source_rgba(context, 0, 0, 0, 1.0);
+		pango_cairo_update_layout(context, layout);
+		pango_cairo_show_layout(context, layout);
+		cairo_destroy(context);
+		cairo_surface_flush(entry->mask);
+
+		entry->size += cairo_image_surface_get_stride(entry->mask) * ink.height;
+	}
+
+	g_object_unref(layout);
+	return entry;
+}
+
+
+/**
+ * Gets the cache entry for a string, shaping and rasterizing
+ * it if it is not cached. The entry is moved to the front of
+ * the LRU list. Must be called with the cache locked.
+ */
+static struct avbox_textcache_entry *
+avbox_textcache_get(const char * const text,
+	const PangoFontDescription * const font, const int w, const int h,
+	const PangoAlignment alignment, const PangoEllipsizeMode ellipsize)
+{
+	struct avbox_textcache_node *node;
+	struct avbox_textcache_entry *entry;
+	const uint32_t hash = avbox_textcache_hash(text, w, h, alignment, ellipsize);
+
+	LIST_FOREACH(struct avbox_textcache_node*, node, avbox_textcache_bucket(hash)) {
+		entry = node->entry;
+		if (entry->hash == hash && entry->w == w && entry->h == h &&
+			entry->alignment == alignment && entry->ellipsize == ellipsize &&
+			!strcmp(entry->text, text) &&
+			pango_font_description_equal(entry->font, font)) {
+			/* move it to the front of the list */
+			LIST_REMOVE(entry);
+			LIST_ADD(&cache, entry);
+			return entry;
+		}
+	}
+
+	if ((entry = avbox_textcache_render(text, hash, font, w, h,
+		alignment, ellipsize)) == NULL) {
+		return NULL;
+	}
+
+	/* make room for the new entry */
+	while (!LIST_EMPTY(&cache) &&
+		cache_size + entry->size > AVBOX_TEXTCACHE_MAX_BYTES) {
+		avbox_textcache_free(LIST_TAIL(struct avbox_textcache_entry*, &cache));
+	}
+
+	LIST_ADD(&cache, entry);
+	LIST_ADD(avbox_textcache_bucket(hash), &entry->bucket_node);
+	cache_size += entry->size;
+	return entry;
+}
+
+
+/**
+ * Draws text at position (x, y) of a cairo context using
+ * the context's current source. The text is shaped and
+ * rasterized only the first time it is drawn with a given
+ * font, width, height, alignment and ellipsization. After
+ * that it is drawn from a cached alpha mask.
+ */
+int
+avbox_textcache_draw(cairo_t * const context, const char * const text,
+	const PangoFontDescription * const font, const int x, const int y,
+	const int w, const int h, const PangoAlignment alignment,
+	const PangoEllipsizeMode ellipsize)
+{
+	struct avbox_textcache_entry *entry;
+
+	ASSERT(context != NULL);
+	ASSERT(text != NULL);
+	ASSERT(font != NULL);
+
+	pthread_mutex_lock(&cache_lock);
+
+	if ((entry = avbox_textcache_get(text, font, w, h, alignment, ellipsize)) == NULL) {
+		pthread_mutex_unlock(&cache_lock);
+		return -1;
+	}
+
+	if (entry->mask != NULL) {
+		cairo_mask_surface(context, entry->mask,
+			x + entry->x_offset, y + entry->y_offset);
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+	return 0;
+}
+
+
+/**
+ * Draws a single line of text one character at a time. Each
+ * character is cached on it's own so strings that change often
+ * but are made of a few characters, like a clock, don't miss
+ * the cache every time they change. Kerning between characters
+ * is lost so this is only meant for short labels.
+ */
+int
+avbox_textcache_drawchars(cairo_t * const context, const char * const text,
+	const PangoFontDescription * const font, const int x, const int y,
+	const int w, const PangoAlignment alignment)
+{
+	int width = 0, pen;
+	const char *p, *next;
+	char ch[8];
+	struct avbox_textcache_entry *entry;
+
+	ASSERT(context != NULL);
+	ASSERT(text != NULL);
+	ASSERT(font != NULL);
+
+	pthread_mutex_lock(&cache_lock);
+
+	/* measure the line. We look the characters up again when
+	 * drawing them since adding one may evict another */
+	for (p = text; *p != '\0'; p = next) {
+		next = g_utf8_next_char(p);
+		if ((size_t) (next - p) >= sizeof(ch)) {
+			goto err;
+		}
+		memcpy(ch, p, next - p);
+		ch[next - p] = '\0';
+		if ((entry = avbox_textcache_get(ch, font, -1, -1,
+			PANGO_ALIGN_LEFT, PANGO_ELLIPSIZE_NONE)) == NULL) {
+			goto err;
+		}
+		width += entry->advance;
+	}
+
+	switch (alignment) {
+	case PANGO_ALIGN_CENTER: pen = x + ((w - width) / 2); break;
+	case PANGO_ALIGN_RIGHT: pen = x + (w - width); break;
+	default: pen = x; break;
+	}
+
+	for (p = text; *p != '\0'; p = next) {
+		next = g_utf8_next_char(p);
+		memcpy(ch, p, next - p);
+		ch[next - p] = '\0';
+		if ((entry = avbox_textcache_get(ch, font, -1, -1,
+			PANGO_ALIGN_LEFT, PANGO_ELLIPSIZE_NONE)) == NULL) {
+			goto err;
+		}
+		if (entry->mask != NULL) {
+			cairo_mask_surface(context, entry->mask,
+				pen + entry->x_offset, y + entry->y_offset);
+		}
+		pen += entry->advance;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+	return 0;
+err:
+	pthread_mutex_unlock(&cache_lock);
+	return -1;
+}
+
+
+/**
+ * Drops all cached text.
+ */
+void
+avbox_textcache_flush(void)
+{
+	struct avbox_textcache_entry *entry;
+	pthread_mutex_lock(&cache_lock);
+	LIST_FOREACH_SAFE(struct avbox_textcache_entry*, entry, &cache, {
+		avbox_textcache_free(entry);
+	});
+	ASSERT(cache_size == 0);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+/**
+ * Initialize the text cache.
+ */
+int
+avbox_textcache_init(void)
+{
+	int i;
+	DEBUG_PRINT(LOG_MODULE, "Initializing text cache");
+	LIST_INIT(&cache);
+	for (i = 0; i < AVBOX_TEXTCACHE_BUCKETS; i++) {
+		LIST_INIT(&buckets[i]);
+	}
+	cache_size = 0;
+	return 0;
+}
+
+
+/**
+ * Shutdown the text cache.
+ */
+void
+avbox_textcache_shutdown(void)
+{
+	DEBUG_PRINT(LOG_MODULE, "Shutting down text cache");
+	avbox_textcache_flush();
+}
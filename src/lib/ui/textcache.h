@@ -0,0 +1,82 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as 
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#ifndef __AVBOX_TEXTCACHE_H__
+#define __AVBOX_TEXTCACHE_H__
+
+#include <pango/pangocairo.h>
+
+
+/**
+ * Draws text at position (x, y) of a cairo context using
+ * the context's current source. The text is shaped and
+ * rasterized only the first time it is drawn with a given
+ * font, width, height, alignment and ellipsization. After
+ * that it is drawn from a cached alpha mask.
+ *
+ * \param context The cairo context.
+ * \param text The text to draw.
+ * \param font The font description.
+ * \param w The layout width in pixels.
+ * \param h The layout height in pixels or -1.
+ * \param alignment The text alignment.
+ * \param ellipsize The ellipsization mode.
+ */
+int
+avbox_textcache_draw(cairo_t * const context, const char * const text,
+	const PangoFontDescription * const font, const int x, const int y,
+	const int w, const int h, const PangoAlignment alignment,
+	const PangoEllipsizeMode ellipsize);
+
+
+/**
+ * Draws a single line of text aligned within w pixels, caching
+ * each character separately. Use it for short labels that
+ * change often, like clocks, where caching the whole string
+ * would miss every time.
+ */
+int
+avbox_textcache_drawchars(cairo_t * const context, const char * const text,
+	const PangoFontDescription * const font, const int x, const int y,
+	const int w, const PangoAlignment alignment);
+
+
+/**
+ * Drops all cached text.
+ */
+void
+avbox_textcache_flush(void);
+
+
+/**
+ * Initialize the text cache.
+ */
+int
+avbox_textcache_init(void);
+
+
+/**
+ * Shutdown the text cache.
+ */
+void
+avbox_textcache_shutdown(void);
+
+#endif
@@ -26,6 +26,7 @@
 #define LOG_MODULE "textview"
 
 #include "video.h"
+#include "textcache.h"
 #include "../log.h"
 #include "../debug.h"
 
@@ -42,7 +43,6 @@ mb_ui_textview_repaint(struct avbox_window *window, void * const ctx)
 {
 	int w, h;
 	cairo_t *context;
-	PangoLayout *layout;
 	struct mb_ui_textview * const inst = (struct mb_ui_textview*) ctx;
 
 	/* if there's nothing to draw return success */
@@ -62,29 +62,13 @@ mb_ui_textview_repaint(struct avbox_window *window, void * const ctx)
 		return -1;
 	}
 
-	/* create a PangoLayout object */
-	if ((layout = pango_cairo_create_layout(context)) == NULL) {
-		LOG_PRINT_ERROR("Could not create pango layout");
-		goto end;
-	}
-
-	/* initialize layout */
-	pango_layout_set_font_description(layout, mbv_getdefaultfont());
-	pango_layout_set_width(layout, w * PANGO_SCALE);
-	pango_layout_set_height(layout, h * PANGO_SCALE);
-	pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
-	pango_layout_set_text(layout, inst->text, -1);
-
-	/* render the layout */
-	cairo_move_to(context, 0, 0);
+	/* render the text */
 	cairo_set_source_rgba(context, CAIRO_COLOR_RGBA(avbox_window_getcolor(inst->window)));
-	pango_cairo_update_layout(context, layout);
-	pango_cairo_show_layout(context, layout);
-
-	/* cleanup */
-	g_object_unref(layout);
+	if (avbox_textcache_draw(context, inst->text, mbv_getdefaultfont(),
+		0, 0, w, h, PANGO_ALIGN_CENTER, PANGO_ELLIPSIZE_NONE) == -1) {
+		LOG_PRINT_ERROR("Could not draw text");
+	}
 
-end:
 	avbox_window_cairo_end(inst->window);
 
 	return 1;
@@ -491,6 +491,8 @@ mbv_dfb_initft(struct mbv_drv_funcs * const funcs)
 	funcs->surface_blitbuf = &surface_blitbuf;
 	funcs->surface_blit = &surface_blit;
 	funcs->surface_scaleblit = NULL;
+	funcs->surface_present = NULL;
+	funcs->surface_damage = NULL;
 	funcs->surface_update = &surface_update;
 	funcs->surface_doublebuffered = &surface_doublebuffered;
 	funcs->surface_destroy = &surface_destroy;
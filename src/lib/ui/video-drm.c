@@ -35,14 +35,17 @@
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
 #define LOG_MODULE "video-drm"
 
 #include "../log.h"
 #include "../debug.h"
 #include "../linkedlist.h"
+#include "video.h"
 #include "video-drv.h"
 #include "video-software.h"
 
@@ -62,10 +65,65 @@ struct avbox_drm_surface
 	uint32_t dbo;
 	uint32_t fbo;
 	int pitch;
+	size_t size;
 	uint8_t *pixels;
 };
 
 
+/**
+ * Overlay plane property ids.
+ */
+enum avbox_drm_overlay_prop
+{
+	AVBOX_DRM_PROP_FB_ID = 0,
+	AVBOX_DRM_PROP_CRTC_ID,
+	AVBOX_DRM_PROP_SRC_X,
+	AVBOX_DRM_PROP_SRC_Y,
+	AVBOX_DRM_PROP_SRC_W,
+	AVBOX_DRM_PROP_SRC_H,
+	AVBOX_DRM_PROP_CRTC_X,
+	AVBOX_DRM_PROP_CRTC_Y,
+	AVBOX_DRM_PROP_CRTC_W,
+	AVBOX_DRM_PROP_CRTC_H,
+	AVBOX_DRM_PROP_MAX
+};
+
+
+/* number of overlay buffers. One is on the screen, one may
+ * still be scanned out until the last flip completes and the
+ * third is written by the next frame */
+#define AVBOX_DRM_OVERLAY_BUFFERS	(3)
+
+
+static const char * const overlay_props[AVBOX_DRM_PROP_MAX] =
+{
+	"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H"
+};
+
+
+/**
+ * Overlay plane used to scan out video frames under
+ * the framebuffer. The plane is updated on the same atomic
+ * commit that flips the framebuffer.
+ */
+struct avbox_drm_overlay
+{
+	uint32_t plane;
+	uint32_t primary;
+	uint32_t primary_fb_prop;
+	uint32_t props[AVBOX_DRM_PROP_MAX];
+	int w;
+	int h;
+	int dirty;
+	struct avbox_rect rect;
+	struct avbox_drm_surface *bufs[AVBOX_DRM_OVERLAY_BUFFERS];
+	struct avbox_drm_surface *front;
+	struct avbox_drm_surface *retiring;
+	struct avbox_drm_surface *pending;
+};
+
+
 LISTABLE_STRUCT(mbv_drm_dev,
 	int fd;
 	uint32_t conn;
@@ -76,6 +134,9 @@ LISTABLE_STRUCT(mbv_drm_dev,
 	drmModeCrtc *saved_crtc;
 	struct avbox_drm_surface *front;
 	struct avbox_drm_surface *back;
+	struct avbox_drm_overlay *overlay;
+	int flip_pending;
+	int flip_deferred;
 );
 
 
@@ -90,31 +151,41 @@ static EGLContext egl_ctx;
 static EGLSurface egl_surface;
 static struct gbm_surface *gbm_surface;
 static int egl_enabled = 0;
-static struct gbm_bo *bo = NULL;
-static int waiting_for_flip = 0;
-static fd_set flip_fds;
+static struct gbm_bo *bo = NULL;	/* on the screen */
+static struct gbm_bo *flip_bo = NULL;	/* being flipped in */
+static struct gbm_bo *next_bo = NULL;	/* waiting for the flip */
 #endif
 
 
 static void
-avbox_drm_free_framebuffer(struct mbv_drm_dev *dev)
+avbox_drm_wait_for_flip(void);
+
+
+/**
+ * Destroys a dumb buffer and it's framebuffer object.
+ */
+static void
+avbox_drm_destroy_buffer(struct mbv_drm_dev * const dev,
+	struct avbox_drm_surface * const surface)
 {
 	struct drm_mode_destroy_dumb dreq;
 
-	/* delete framebuffers */
-	drmModeRmFB(dev->fd, dev->front->fbo);
-	drmModeRmFB(dev->fd, dev->back->fbo);
+	munmap(surface->pixels, surface->size);
+	drmModeRmFB(dev->fd, surface->fbo);
 
-	/* delete dumb buffers */
 	memset(&dreq, 0, sizeof(dreq));
-	dreq.handle = dev->front->dbo;
-	drmIoctl(default_dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
-	memset(&dreq, 0, sizeof(dreq));
-	dreq.handle = dev->back->dbo;
-	drmIoctl(default_dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+	dreq.handle = surface->dbo;
+	drmIoctl(dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
 
-	free(dev->front);
-	free(dev->back);
+	free(surface);
+}
+
+
+static void
+avbox_drm_free_framebuffer(struct mbv_drm_dev *dev)
+{
+	avbox_drm_destroy_buffer(dev, dev->front);
+	avbox_drm_destroy_buffer(dev, dev->back);
 }
 
 
@@ -125,6 +196,7 @@ avbox_drm_create_framebuffer(struct mbv_drm_dev * const dev,
 	struct drm_mode_create_dumb creq;
 	struct drm_mode_map_dumb mreq = { 0 };
 	struct drm_mode_destroy_dumb dreq;
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
 	int sz;
 	int ret;
 
@@ -153,7 +225,7 @@ avbox_drm_create_framebuffer(struct mbv_drm_dev * const dev,
 	ASSERT(creq.pitch <= INT_MAX);
 	(*surface)->dbo = creq.handle;
 	(*surface)->pitch = creq.pitch;
-	sz = creq.size;
+	(*surface)->size = sz = creq.size;
 
 	DEBUG_VPRINT("video-drm", "Dumb buffer handle: 0x%x", (*surface)->dbo);
 	DEBUG_VPRINT("video-drm", "Dumb buffer pitch: %i", (*surface)->pitch);
@@ -161,8 +233,17 @@ avbox_drm_create_framebuffer(struct mbv_drm_dev * const dev,
 	
 	/* create framebuffer object */
 	DEBUG_PRINT("video-drm", "Creating framebuffer objects");
-	ret = drmModeAddFB(dev->fd, dev->w, dev->h, 24, 32,
-		(*surface)->pitch, (*surface)->dbo, &(*surface)->fbo);
+	if (dev->overlay != NULL) {
+		/* the video overlay is under the framebuffer so
+		 * we need an alpha channel to show it */
+		handles[0] = (*surface)->dbo;
+		pitches[0] = (*surface)->pitch;
+		ret = drmModeAddFB2(dev->fd, dev->w, dev->h, DRM_FORMAT_ARGB8888,
+			handles, pitches, offsets, &(*surface)->fbo, 0);
+	} else {
+		ret = drmModeAddFB(dev->fd, dev->w, dev->h, 24, 32,
+			(*surface)->pitch, (*surface)->dbo, &(*surface)->fbo);
+	}
 	if (ret) {
 		LOG_VPRINT_ERROR("Cannot create framebuffer (%d) %s",
 			errno, strerror(errno));
@@ -212,6 +293,449 @@ err_destroy:
 }
 
 
+/**
+ * Creates a YUV420 buffer for the video overlay.
+ */
+static int
+avbox_drm_create_yuvbuffer(struct mbv_drm_dev * const dev,
+	const int w, const int h, struct avbox_drm_surface **surface)
+{
+	struct drm_mode_create_dumb creq;
+	struct drm_mode_map_dumb mreq = { 0 };
+	struct drm_mode_destroy_dumb dreq;
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+
+	if (((*surface) = malloc(sizeof(struct avbox_drm_surface))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+
+	/* the three planes go on a single 8bpp buffer */
+	memset(&creq, 0, sizeof(struct drm_mode_create_dumb));
+	creq.width = w;
+	creq.height = h + (h / 2);
+	creq.bpp = 8;
+	if (drmIoctl(dev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0) {
+		LOG_VPRINT_ERROR("Cannot create YUV buffer: %s",
+			strerror(errno));
+		free(*surface);
+		return -1;
+	}
+
+	(*surface)->dbo = creq.handle;
+	(*surface)->pitch = creq.pitch;
+	(*surface)->size = creq.size;
+
+	handles[0] = handles[1] = handles[2] = creq.handle;
+	pitches[0] = creq.pitch;
+	pitches[1] = pitches[2] = creq.pitch / 2;
+	offsets[1] = creq.pitch * h;
+	offsets[2] = offsets[1] + (pitches[1] * (h / 2));
+
+	if (drmModeAddFB2(dev->fd, w, h, DRM_FORMAT_YUV420,
+		handles, pitches, offsets, &(*surface)->fbo, 0) != 0) {
+		LOG_VPRINT_ERROR("Cannot create YUV framebuffer: %s",
+			strerror(errno));
+		goto err_destroy;
+	}
+
+	mreq.handle = creq.handle;
+	if (drmIoctl(dev->fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq)) {
+		LOG_VPRINT_ERROR("Cannot map YUV buffer: %s",
+			strerror(errno));
+		goto err_fb;
+	}
+	if (((*surface)->pixels = mmap(0, creq.size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, dev->fd, mreq.offset)) == MAP_FAILED) {
+		LOG_VPRINT_ERROR("Cannot mmap YUV buffer: %s",
+			strerror(errno));
+		goto err_fb;
+	}
+
+	return 0;
+
+err_fb:
+	drmModeRmFB(dev->fd, (*surface)->fbo);
+err_destroy:
+	memset(&dreq, 0, sizeof(dreq));
+	dreq.handle = creq.handle;
+	drmIoctl(dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+	free(*surface);
+	return -1;
+}
+
+
+/**
+ * Gets the id and value of a plane property. Returns
+ * -1 if the plane doesn't have the property.
+ */
+static int
+avbox_drm_plane_getprop(const int fd, const uint32_t plane,
+	const char * const name, uint32_t * const id, uint64_t * const value,
+	drmModePropertyRes ** const info)
+{
+	uint32_t i;
+	int ret = -1;
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+
+	if ((props = drmModeObjectGetProperties(fd, plane, DRM_MODE_OBJECT_PLANE)) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < props->count_props; i++) {
+		if ((prop = drmModeGetProperty(fd, props->props[i])) == NULL) {
+			continue;
+		}
+		if (!strcmp(prop->name, name)) {
+			*id = prop->prop_id;
+			*value = props->prop_values[i];
+			if (info != NULL) {
+				*info = prop;
+			} else {
+				drmModeFreeProperty(prop);
+			}
+			ret = 0;
+			break;
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	return ret;
+}
+
+
+/**
+ * Checks if a plane supports a pixel format.
+ */
+static int
+avbox_drm_plane_hasformat(const drmModePlane * const plane,
+	const uint32_t format)
+{
+	uint32_t i;
+	for (i = 0; i < plane->count_formats; i++) {
+		if (plane->formats[i] == format) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Looks for a YUV420 overlay plane that can be placed under the
+ * primary plane of the device's CRTC. Since the overlay is under
+ * the framebuffer the primary plane must also support ARGB.
+ */
+static int
+avbox_drm_overlay_init(struct mbv_drm_dev * const dev)
+{
+	int crtc_index = -1, ret = -1;
+	uint32_t i, zpos_id, primary_zpos_id, type_id, props[AVBOX_DRM_PROP_MAX], primary_fb_prop;
+	uint64_t zpos, primary_zpos = 0, type, value;
+	drmModeRes *res;
+	drmModePlaneRes *planes;
+	drmModePlane *plane, *primary = NULL, *overlay = NULL;
+	drmModePropertyRes *zpos_info = NULL;
+
+	/* this also enables universal planes */
+	if (drmSetClientCap(dev->fd, DRM_CLIENT_CAP_ATOMIC, 1) != 0) {
+		LOG_PRINT_ERROR("Atomic modesetting not supported!");
+		return -1;
+	}
+
+	/* find the index of our crtc */
+	if ((res = drmModeGetResources(dev->fd)) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < res->count_crtcs; i++) {
+		if (res->crtcs[i] == dev->crtc) {
+			crtc_index = i;
+			break;
+		}
+	}
+	drmModeFreeResources(res);
+	if (crtc_index == -1) {
+		return -1;
+	}
+
+	if ((planes = drmModeGetPlaneResources(dev->fd)) == NULL) {
+		LOG_VPRINT_ERROR("Could not get planes: %s",
+			strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < planes->count_planes; i++) {
+		if ((plane = drmModeGetPlane(dev->fd, planes->planes[i])) == NULL) {
+			continue;
+		}
+		if (!(plane->possible_crtcs & (1 << crtc_index)) ||
+			avbox_drm_plane_getprop(dev->fd, plane->plane_id,
+				"type", &type_id, &type, NULL) == -1) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+		if (type == DRM_PLANE_TYPE_PRIMARY && primary == NULL &&
+			avbox_drm_plane_hasformat(plane, DRM_FORMAT_ARGB8888)) {
+			primary = plane;
+		} else if (type == DRM_PLANE_TYPE_OVERLAY && overlay == NULL &&
+			avbox_drm_plane_hasformat(plane, DRM_FORMAT_YUV420)) {
+			overlay = plane;
+		} else {
+			drmModeFreePlane(plane);
+		}
+	}
+	drmModeFreePlaneResources(planes);
+
+	if (primary == NULL || overlay == NULL) {
+		LOG_PRINT_ERROR("No suitable planes for video overlay");
+		goto end;
+	}
+
+	/* the overlay needs to go under the primary plane */
+	if (avbox_drm_plane_getprop(dev->fd, overlay->plane_id,
+		"zpos", &zpos_id, &zpos, &zpos_info) == -1 ||
+		avbox_drm_plane_getprop(dev->fd, primary->plane_id,
+		"zpos", &primary_zpos_id, &primary_zpos, NULL) == -1) {
+		LOG_PRINT_ERROR("Cannot set video overlay zpos");
+		goto end;
+	}
+	if (zpos >= primary_zpos) {
+		if ((zpos_info->flags & DRM_MODE_PROP_IMMUTABLE) ||
+			!(zpos_info->flags & DRM_MODE_PROP_RANGE) ||
+			zpos_info->count_values < 2 || zpos_info->values[0] >= primary_zpos ||
+			drmModeObjectSetProperty(dev->fd, overlay->plane_id,
+				DRM_MODE_OBJECT_PLANE, zpos_id, zpos_info->values[0]) != 0) {
+			LOG_PRINT_ERROR("Video overlay cannot be placed under the framebuffer");
+			goto end;
+		}
+	}
+
+	/* get the properties that we need to update on each frame */
+	for (i = 0; i < AVBOX_DRM_PROP_MAX; i++) {
+		if (avbox_drm_plane_getprop(dev->fd, overlay->plane_id,
+			overlay_props[i], &props[i], &value, NULL) == -1) {
+			LOG_VPRINT_ERROR("Video overlay has no %s property",
+				overlay_props[i]);
+			goto end;
+		}
+	}
+	if (avbox_drm_plane_getprop(dev->fd, primary->plane_id,
+		"FB_ID", &primary_fb_prop, &value, NULL) == -1) {
+		LOG_PRINT_ERROR("Primary plane has no FB_ID property");
+		goto end;
+	}
+
+	if ((dev->overlay = malloc(sizeof(struct avbox_drm_overlay))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		goto end;
+	}
+
+	memset(dev->overlay, 0, sizeof(struct avbox_drm_overlay));
+	dev->overlay->plane = overlay->plane_id;
+	dev->overlay->primary = primary->plane_id;
+	dev->overlay->primary_fb_prop = primary_fb_prop;
+	memcpy(dev->overlay->props, props, sizeof(props));
+
+	DEBUG_VPRINT(LOG_MODULE, "Using plane %u for video overlay",
+		overlay->plane_id);
+
+	ret = 0;
+end:
+	if (zpos_info != NULL) {
+		drmModeFreeProperty(zpos_info);
+	}
+	if (primary != NULL) {
+		drmModeFreePlane(primary);
+	}
+	if (overlay != NULL) {
+		drmModeFreePlane(overlay);
+	}
+	return ret;
+}
+
+
+/**
+ * Frees the video overlay buffers.
+ */
+static void
+avbox_drm_overlay_freebuffers(struct mbv_drm_dev * const dev)
+{
+	int i;
+	for (i = 0; i < AVBOX_DRM_OVERLAY_BUFFERS; i++) {
+		if (dev->overlay->bufs[i] != NULL) {
+			avbox_drm_destroy_buffer(dev, dev->overlay->bufs[i]);
+			dev->overlay->bufs[i] = NULL;
+		}
+	}
+	dev->overlay->front = NULL;
+	dev->overlay->retiring = NULL;
+	dev->overlay->pending = NULL;
+}
+
+
+/**
+ * Takes the overlay plane off the screen. This is a blocking
+ * commit so the buffers can be freed as soon as it returns.
+ * There must be no flip pending.
+ */
+static void
+avbox_drm_overlay_disable(struct mbv_drm_dev * const dev)
+{
+	drmModeAtomicReq *req;
+	struct avbox_drm_overlay * const overlay = dev->overlay;
+
+	if ((req = drmModeAtomicAlloc()) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return;
+	}
+
+	drmModeAtomicAddProperty(req, overlay->plane,
+		overlay->props[AVBOX_DRM_PROP_FB_ID], 0);
+	drmModeAtomicAddProperty(req, overlay->plane,
+		overlay->props[AVBOX_DRM_PROP_CRTC_ID], 0);
+
+	if (drmModeAtomicCommit(dev->fd, req, 0, NULL) != 0) {
+		LOG_VPRINT_ERROR("Could not disable video overlay: %s",
+			strerror(errno));
+	}
+	drmModeAtomicFree(req);
+}
+
+
+/**
+ * Scans out a video frame from the overlay plane. The frame is
+ * copied into an overlay buffer that is not on the screen and
+ * the plane gets pointed at it on the next page flip.
+ */
+static int
+avbox_drm_overlay_present(unsigned int pix_fmt, void **buf, int *pitch,
+	int src_w, int src_h, const struct avbox_rect * const rect)
+{
+	int i, y;
+	struct avbox_drm_overlay * const overlay = default_dev->overlay;
+	struct avbox_drm_surface *dst;
+	uint8_t *dst_buf;
+
+	ASSERT(overlay != NULL);
+
+	if (pix_fmt != AVBOX_PIXFMT_YUV420P) {
+		return -1;
+	}
+
+	src_w &= ~1;
+	src_h &= ~1;
+
+	/* (re)allocate the buffers if the frame size changed. The
+	 * last commit may still reference the old buffers so wait
+	 * for it and take the plane down before freeing them */
+	if (overlay->w != src_w || overlay->h != src_h) {
+		if (overlay->front != NULL) {
+			avbox_drm_wait_for_flip();
+			avbox_drm_overlay_disable(default_dev);
+		}
+		avbox_drm_overlay_freebuffers(default_dev);
+		overlay->w = overlay->h = 0;
+		for (i = 0; i < AVBOX_DRM_OVERLAY_BUFFERS; i++) {
+			if (avbox_drm_create_yuvbuffer(default_dev, src_w, src_h,
+				&overlay->bufs[i]) == -1) {
+				avbox_drm_overlay_freebuffers(default_dev);
+				return -1;
+			}
+		}
+		overlay->w = src_w;
+		overlay->h = src_h;
+	}
+
+	/* If a frame is already waiting for the next flip we just
+	 * overwrite it. Otherwise take the buffer that is neither on
+	 * the screen nor waiting for the last flip to release it */
+	if ((dst = overlay->pending) == NULL) {
+		for (i = 0; i < AVBOX_DRM_OVERLAY_BUFFERS; i++) {
+			if (overlay->bufs[i] != overlay->front &&
+				overlay->bufs[i] != overlay->retiring) {
+				dst = overlay->bufs[i];
+				break;
+			}
+		}
+	}
+	ASSERT(dst != NULL);
+
+	/* copy the planes */
+	dst_buf = dst->pixels;
+	for (i = 0; i < 3; i++) {
+		const int h = (i == 0) ? src_h : (src_h / 2);
+		const int w = (i == 0) ? src_w : (src_w / 2);
+		const int dst_pitch = (i == 0) ? dst->pitch : (dst->pitch / 2);
+		const uint8_t *src_buf = buf[i];
+		for (y = 0; y < h; y++, dst_buf += dst_pitch, src_buf += pitch[i]) {
+			memcpy(dst_buf, src_buf, w);
+		}
+	}
+
+	overlay->pending = dst;
+	overlay->rect = *rect;
+	overlay->dirty = 1;
+	return 0;
+}
+
+
+/**
+ * Flips the front buffer and the pending overlay frame
+ * in on a single nonblocking atomic commit.
+ */
+static int
+avbox_drm_overlay_flip(struct mbv_drm_dev * const dev)
+{
+	int ret;
+	drmModeAtomicReq *req;
+	struct avbox_drm_overlay * const overlay = dev->overlay;
+	const uint32_t * const props = overlay->props;
+
+	if ((req = drmModeAtomicAlloc()) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+
+	drmModeAtomicAddProperty(req, overlay->primary,
+		overlay->primary_fb_prop, dev->front->fbo);
+
+	if (overlay->dirty) {
+		const uint32_t plane = overlay->plane;
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_FB_ID], overlay->pending->fbo);
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_CRTC_ID], dev->crtc);
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_SRC_X], 0);
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_SRC_Y], 0);
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_SRC_W], ((uint64_t) overlay->w) << 16);
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_SRC_H], ((uint64_t) overlay->h) << 16);
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_CRTC_X], overlay->rect.x);
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_CRTC_Y], overlay->rect.y);
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_CRTC_W], overlay->rect.w);
+		drmModeAtomicAddProperty(req, plane, props[AVBOX_DRM_PROP_CRTC_H], overlay->rect.h);
+	}
+
+	ret = drmModeAtomicCommit(dev->fd, req,
+		DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, dev);
+	drmModeAtomicFree(req);
+
+	if (ret != 0) {
+		LOG_VPRINT_ERROR("Atomic commit failed: %s",
+			strerror(errno));
+		return -1;
+	}
+
+	/* the buffer that was on the screen is
+	 * free once the flip completes */
+	if (overlay->dirty) {
+		overlay->retiring = overlay->front;
+		overlay->front = overlay->pending;
+		overlay->pending = NULL;
+		overlay->dirty = 0;
+	}
+
+	return 0;
+}
+
+
 static int
 mbv_drm_findcrtc(struct mbv_drm_dev *dev,
 	drmModeRes *res, drmModeConnector *conn)
@@ -417,30 +941,26 @@ mbv_drm_prepare(int fd, int mode_index)
 }
 
 
+/**
+ * Queues a page flip for the front buffer. If the device
+ * cannot do it then set the crtc (and wait for it).
+ */
 static void
-avbox_drm_wait_for_vsync(void)
+avbox_drm_queue_flip(struct mbv_drm_dev * const dev)
 {
-	drmVBlank vb;
-	vb.request.type = DRM_VBLANK_RELATIVE;
-	vb.request.sequence = 1;
-	vb.request.signal = 0;
-	drmWaitVBlank(default_dev->fd, &vb);
-}
-
-
-static inline void
-avbox_drm_swap_buffers(void)
-{
-	struct avbox_drm_surface * const tmp = default_dev->front;
-	default_dev->front = default_dev->back;
-	default_dev->back = tmp;
-
-	/* swap the front buffer in */
-	if (drmModeSetCrtc(default_dev->fd, default_dev->crtc,
-		default_dev->front->fbo, 0, 0, &default_dev->conn, 1, &default_dev->mode)) {
+	if (dev->overlay != NULL) {
+		if (avbox_drm_overlay_flip(dev) == 0) {
+			dev->flip_pending = 1;
+			return;
+		}
+	}
+	if (drmModePageFlip(dev->fd, dev->crtc,
+		dev->front->fbo, DRM_MODE_PAGE_FLIP_EVENT, dev) == 0) {
+		dev->flip_pending = 1;
+	} else if (drmModeSetCrtc(dev->fd, dev->crtc,
+		dev->front->fbo, 0, 0, &dev->conn, 1, &dev->mode)) {
 		LOG_PRINT_ERROR("Could not swap buffers");
 	}
-	DEBUG_PRINT(LOG_MODULE, "Swapped buffers");
 }
 
 
@@ -489,54 +1009,190 @@ avbox_drm_egl_bo_framebuffer(struct gbm_bo * const bo, uint32_t *fbo)
 }
 
 
+/**
+ * Requests a page flip for a locked EGL buffer.
+ */
+static void
+avbox_drm_egl_flip(struct gbm_bo * const new_bo)
+{
+	uint32_t fbo;
+
+	/* get the bo's framebuffer */
+	if (avbox_drm_egl_bo_framebuffer(new_bo, &fbo) == -1) {
+		LOG_PRINT_ERROR("Could not get framebuffer object!");
+		gbm_surface_release_buffer(gbm_surface, new_bo);
+		return;
+	}
+
+	/* flip the new buffer in */
+	if (drmModePageFlip(default_dev->fd,
+		default_dev->crtc,
+		fbo, DRM_MODE_PAGE_FLIP_EVENT, default_dev) != 0) {
+		LOG_PRINT_ERROR("Could not set EGL framebuffer");
+		gbm_surface_release_buffer(gbm_surface, new_bo);
+		return;
+	}
+
+	flip_bo = new_bo;
+	default_dev->flip_pending = 1;
+}
+#endif
+
+
 static void
 avbox_drm_page_flip_handler(int fd, unsigned int frame,
-                  unsigned int sec, unsigned int usec, void *data)
+	unsigned int sec, unsigned int usec, void *data)
 {
-        (void)fd, (void)frame, (void)sec, (void)usec;
-        int *waiting_for_flip = data;
-        *waiting_for_flip = 0;
+	struct mbv_drm_dev * const dev = data;
+	(void) fd;
+	(void) frame;
+	(void) sec;
+	(void) usec;
+	dev->flip_pending = 0;
+
+	/* the overlay buffer that was on the screen
+	 * can be written again */
+	if (dev->overlay != NULL) {
+		dev->overlay->retiring = NULL;
+	}
+
+#ifdef ENABLE_OPENGL
+	if (egl_enabled) {
+		/* the buffer that was on the screen goes back
+		 * to the surface and the next one is flipped in */
+		if (flip_bo != NULL) {
+			if (bo != NULL) {
+				gbm_surface_release_buffer(gbm_surface, bo);
+			}
+			bo = flip_bo;
+			flip_bo = NULL;
+		}
+		if (next_bo != NULL) {
+			struct gbm_bo * const new_bo = next_bo;
+			next_bo = NULL;
+			avbox_drm_egl_flip(new_bo);
+		}
+		return;
+	}
+#endif
+
+	/* flip the frame that was swapped in while
+	 * this flip was pending */
+	if (dev->flip_deferred) {
+		dev->flip_deferred = 0;
+		avbox_drm_queue_flip(dev);
+	}
 }
 
 
+/**
+ * Handles page flip events. If block is set it waits until
+ * all pending and deferred flips complete, otherwise it only
+ * handles the events that have already arrived.
+ */
+static void
+avbox_drm_handle_flips(const int block)
+{
+	int ret;
+	struct pollfd pfd;
+	drmEventContext evctx;
+
+	memset(&evctx, 0, sizeof(evctx));
+	evctx.version = 2;
+	evctx.page_flip_handler = avbox_drm_page_flip_handler;
+
+	pfd.fd = default_dev->fd;
+	pfd.events = POLLIN;
+
+	while (default_dev->flip_pending) {
+		if ((ret = poll(&pfd, 1, block ? -1 : 0)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_VPRINT_ERROR("Could not wait for page flip: %s",
+				strerror(errno));
+			default_dev->flip_pending = 0;
+			break;
+		} else if (ret == 0) {
+			break;
+		}
+		drmHandleEvent(default_dev->fd, &evctx);
+	}
+}
+
+
+/**
+ * Waits until the last page flip completes.
+ */
+static void
+avbox_drm_wait_for_flip(void)
+{
+	avbox_drm_handle_flips(1);
+}
+
+
+/**
+ * Swaps the buffers and requests a page flip. This never
+ * waits for the screen. If the last flip is still pending the
+ * new one is deferred to it's flip event. The software renderer
+ * waits for the flips to complete before it touches the back
+ * buffer again.
+ */
+static void
+avbox_drm_swap_buffers(void)
+{
+	struct avbox_drm_surface * const tmp = default_dev->front;
+
+	default_dev->front = default_dev->back;
+	default_dev->back = tmp;
+
+	avbox_drm_handle_flips(0);
+	if (default_dev->flip_pending) {
+		default_dev->flip_deferred = 1;
+		return;
+	}
+
+	avbox_drm_queue_flip(default_dev);
+}
+
+
+#ifdef ENABLE_OPENGL
+
+
+/**
+ * Swaps the EGL buffers and requests a page flip. If the
+ * last flip is still pending the new frame is flipped in from
+ * it's flip event, replacing any frame that was already
+ * waiting for it.
+ */
 static void
 avbox_drm_egl_swap_buffers(void)
 {
-	uint32_t fbo;
+	struct gbm_bo *new_bo;
 
-	if (bo != NULL) {
-		gbm_surface_release_buffer(gbm_surface, bo);
+	/* if the screen holds all the buffers we need
+	 * to wait for it to release one */
+	avbox_drm_handle_flips(0);
+	if (!gbm_surface_has_free_buffers(gbm_surface)) {
+		avbox_drm_wait_for_flip();
 	}
 
 	/* get the buffer object for the front buffer */
 	eglSwapBuffers(egl_display, egl_surface);
-	if ((bo = gbm_surface_lock_front_buffer(gbm_surface)) == NULL) {
+	if ((new_bo = gbm_surface_lock_front_buffer(gbm_surface)) == NULL) {
 		LOG_PRINT_ERROR("Could not get the surface's buffer object");
 		return;
 	}
 
-	/* get the bo's framebuffer */
-	if (avbox_drm_egl_bo_framebuffer(bo, &fbo) == -1) {
-		LOG_PRINT_ERROR("Could not get framebuffer object!");
-		gbm_surface_release_buffer(gbm_surface, bo);
-		return;
-	}
-
-	/* wait until the last flip completes */
-	while (waiting_for_flip) {
-		drmEventContext evctx = { .version = 2, .page_flip_handler = avbox_drm_page_flip_handler };
-		if (select(default_dev->fd + 1, &flip_fds, NULL, NULL, NULL) > 0) {
-			drmHandleEvent(default_dev->fd, &evctx);
+	if (default_dev->flip_pending) {
+		if (next_bo != NULL) {
+			gbm_surface_release_buffer(gbm_surface, next_bo);
 		}
+		next_bo = new_bo;
+		return;
 	}
 
-	/* flip the new buffer in */
-	waiting_for_flip = 1;
-	if (drmModePageFlip(default_dev->fd,
-		default_dev->crtc,
-		fbo, DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip) != 0) {
-		LOG_PRINT_ERROR("Could not set EGL framebuffer");
-	}
+	avbox_drm_egl_flip(new_bo);
 }
 
 
@@ -552,9 +1208,6 @@ avbox_drm_create_egl_framebuffer(
 	};
 	uint32_t fbo;
 
-	FD_ZERO(&flip_fds);
-	FD_SET(default_dev->fd, &flip_fds);
-
 	gbm_surface = gbm_surface_create(gbm_dev, default_dev->w, default_dev->h,
 		GBM_FORMAT_XRGB8888, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
 	if (gbm_surface == NULL) {
@@ -588,7 +1241,6 @@ avbox_drm_create_egl_framebuffer(
 		return -1;
 	}
 
-	avbox_drm_egl_swap_buffers();
 	/* get the buffer object for the front buffer */
 	eglSwapBuffers(egl_display, egl_surface);
 	if ((bo = gbm_surface_lock_front_buffer(gbm_surface)) == NULL) {
@@ -713,7 +1365,7 @@ init(struct mbv_drv_funcs * const driver,
 	int argc, char **argv, int * const w, int * const h)
 {
 	int i, ret, fd = -1;
-	int mode_index = 0, accel = 1;
+	int mode_index = 0, accel = 1, overlay = 0;
 	const char *card = "/dev/dri/card0";
 	uint64_t has_dumb;
 	struct mbv_surface *root;
@@ -732,6 +1384,8 @@ init(struct mbv_drv_funcs * const driver,
 
 		} else if (!strncmp(argv[i], "--no-accel", 10)) {
 			accel = 0;
+		} else if (!strcmp(argv[i], "--video:overlay")) {
+			overlay = 1;
 		}
 	}
 
@@ -780,6 +1434,11 @@ init(struct mbv_drv_funcs * const driver,
 		goto end;
 	}
 
+	/* try to get a plane to scan out video from */
+	if (overlay && avbox_drm_overlay_init(default_dev) == -1) {
+		LOG_PRINT_ERROR("Could not initialize video overlay");
+	}
+
 	/* create a front buffer */
 	if ((ret = avbox_drm_create_framebuffer(default_dev, &default_dev->front)) != 0) {
 		LOG_VPRINT_ERROR("Cannot create framebuffers for connector %u",
@@ -805,7 +1464,8 @@ init(struct mbv_drv_funcs * const driver,
 	if ((root = avbox_video_softinit(driver,
 		default_dev->front->pixels, default_dev->back->pixels,
 		default_dev->w, default_dev->h, default_dev->front->pitch,
-		avbox_drm_wait_for_vsync, avbox_drm_swap_buffers)) == NULL) {
+		avbox_drm_wait_for_flip, avbox_drm_swap_buffers,
+		(default_dev->overlay != NULL) ? avbox_drm_overlay_present : NULL)) == NULL) {
 		LOG_PRINT_ERROR("Could not initialize software driver!");
 		goto end;
 	}
@@ -833,8 +1493,13 @@ shutdown()
 {
 	struct mbv_drm_dev *iter;
 
+	if (default_dev != NULL) {
+		avbox_drm_wait_for_flip();
+	}
+
 #ifdef ENABLE_OPENGL
 	if (egl_enabled) {
+		avbox_video_glshutdown();
 		gbm_surface_destroy(gbm_surface);
 		gbm_device_destroy(gbm_dev);
 		eglDestroyContext(egl_display, egl_ctx);
@@ -846,6 +1511,15 @@ shutdown()
 		/* remove from global list */
 		LIST_REMOVE(iter);
 
+		/* take down the video overlay */
+		if (iter->overlay != NULL) {
+			if (iter->overlay->front != NULL) {
+				avbox_drm_overlay_disable(iter);
+			}
+			avbox_drm_overlay_freebuffers(iter);
+			free(iter->overlay);
+		}
+
 		/* restore saved CRTC configuration */
 		drmModeSetCrtc(iter->fd,
 			       iter->saved_crtc->crtc_id,
@@ -27,6 +27,7 @@
 struct mbv_surface;
 struct mbv_window;
 struct mbv_drv_funcs;
+struct avbox_rect;
 
 #define MBV_BLITFLAGS_NONE		(0x0)
 #define MBV_BLITFLAGS_FRONT		(0x1)
@@ -93,6 +94,27 @@ typedef int (*mbv_drv_surface_scaleblit)(
 	struct mbv_surface * const src,
 	unsigned int flags, int x, int y, int w, int h);
 
+/**
+ * Convert and scale a decoded frame directly into a
+ * rectangle of the destination surface in a single pass.
+ */
+typedef int (*mbv_drv_surface_present)(
+	struct mbv_surface * const dst,
+	unsigned int pix_fmt, void **buf, int *pitch,
+	int src_w, int src_h, int x, int y, int w, int h);
+
+/**
+ * Tells the driver which regions of the root surface are
+ * about to be recomposed. When the root surface is updated
+ * the driver only needs to send those regions to the screen,
+ * but it must make sure that the rest of the back buffer holds
+ * what's currently on the screen. Drivers that don't implement
+ * this get the whole screen recomposed on every update.
+ */
+typedef int (*mbv_drv_surface_damage)(
+	struct mbv_surface * const surface,
+	const struct avbox_rect * const rects, const int count);
+
 /**
  * Update a surface.
  */
@@ -129,6 +151,8 @@ struct mbv_drv_funcs
 		int x, int y, int w, int h);
 	mbv_drv_surface_blit surface_blit;
 	mbv_drv_surface_scaleblit surface_scaleblit;
+	mbv_drv_surface_present surface_present;
+	mbv_drv_surface_damage surface_damage;
 	mbv_drv_surface_update surface_update;
 	mbv_drv_surface_destroy surface_destroy;
 	int (*surface_doublebuffered)(const struct mbv_surface * const);
@@ -34,6 +34,16 @@
  * fail on some systems? Do we need windows line breaks on shaders ? */
 #define GLSL(version, shader) #shader
 
+/* GLES2 only has this with GL_EXT_unpack_subimage */
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH	(0x0CF2)
+#endif
+
+/* number of YUV420P texture sets to rotate through. Using more
+ * than one allows the driver to keep drawing from the last frame
+ * while we upload the next one. */
+#define YUV420P_RING_SIZE	(2)
+
 
 struct mbv_surface
 {
@@ -54,6 +64,20 @@ struct mbv_surface
 };
 
 
+/**
+ * A set of plane textures for YUV420P frames. The textures
+ * are allocated once per stream and updated in place.
+ */
+struct yuv420p_texset
+{
+	GLuint planes[3];
+	int w;
+	int h;
+	int tex_w[3];
+	GLfloat texcoords[8];
+};
+
+
 /* GL driver */
 static GLuint bgra_program = 0, yuv420p_program = 0;
 static GLuint vertex_buffer;
@@ -68,6 +92,9 @@ static GLfloat texcoords_yuv[] = {
 	1.0f, 0.0f,
 };
 static void (*swap_buffers)(void);
+static struct yuv420p_texset yuv420p_ring[YUV420P_RING_SIZE];
+static int yuv420p_ring_next = 0;
+static int have_unpack_row_length = 0;
 
 #ifdef ENABLE_VC4
 static GLuint mmal_program;
@@ -134,6 +161,163 @@ avbox_glTexImage2D(GLenum target, GLint level,
 }
 
 
+/**
+ * Gets the next set of YUV420P plane textures from the ring,
+ * (re)allocating them if the frame geometry has changed.
+ */
+static struct yuv420p_texset *
+yuv420p_gettexset(const int w, const int h, const int * const pitch)
+{
+	int i, tex_w[3];
+	const int uv_w = w >> 1, uv_h = h >> 1;
+	struct yuv420p_texset * const set = &yuv420p_ring[yuv420p_ring_next];
+
+	yuv420p_ring_next = (yuv420p_ring_next + 1) % YUV420P_RING_SIZE;
+
+	/* If we cannot upload strided data then we try to allocate
+	 * the textures as wide as the pitch and sample only the
+	 * visible part. Since all planes share the same texture
+	 * coordinates this only works when they are padded in the
+	 * same proportion. Otherwise we fall back to uploading
+	 * one row at a time */
+	tex_w[0] = w;
+	tex_w[1] = tex_w[2] = uv_w;
+	if (!have_unpack_row_length && pitch[0] != w &&
+		pitch[1] == pitch[2] && (w * pitch[1]) == (uv_w * pitch[0])) {
+		tex_w[0] = pitch[0];
+		tex_w[1] = tex_w[2] = pitch[1];
+	}
+
+	if (set->planes[0] == 0) {
+		glGenTextures(3, set->planes);
+		for (i = 0; i < 3; i++) {
+			glBindTexture(GL_TEXTURE_2D, set->planes[i]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		}
+		DEBUG_ERROR_CHECK();
+	}
+
+	if (set->w != w || set->h != h ||
+		set->tex_w[0] != tex_w[0] || set->tex_w[1] != tex_w[1]) {
+		const GLfloat xmax = (GLfloat) w / (GLfloat) tex_w[0];
+
+		DEBUG_VPRINT(LOG_MODULE, "Allocating YUV420P textures (w=%d h=%d tex_w=%d)",
+			w, h, tex_w[0]);
+
+		glBindTexture(GL_TEXTURE_2D, set->planes[0]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, tex_w[0], h, 0,
+			GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
+		for (i = 1; i < 3; i++) {
+			glBindTexture(GL_TEXTURE_2D, set->planes[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, tex_w[i], uv_h, 0,
+				GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
+		}
+		DEBUG_ERROR_CHECK();
+
+		memcpy(set->texcoords, texcoords_yuv, sizeof(texcoords_yuv));
+		set->texcoords[2] = xmax;
+		set->texcoords[6] = xmax;
+		set->w = w;
+		set->h = h;
+		memcpy(set->tex_w, tex_w, sizeof(tex_w));
+	}
+
+	return set;
+}
+
+
+/**
+ * Deletes the YUV420P plane textures.
+ */
+static void
+yuv420p_ring_free(void)
+{
+	int i;
+	for (i = 0; i < YUV420P_RING_SIZE; i++) {
+		if (yuv420p_ring[i].planes[0] != 0) {
+			glDeleteTextures(3, yuv420p_ring[i].planes);
+		}
+	}
+	memset(yuv420p_ring, 0, sizeof(yuv420p_ring));
+	yuv420p_ring_next = 0;
+}
+
+
+/**
+ * Upload a single 8-bit plane to it's preallocated texture.
+ */
+static void
+yuv420p_upload_plane(const GLuint texture, const int tex_w,
+	const int w, const int h, const int pitch, const uint8_t *data)
+{
+	glBindTexture(GL_TEXTURE_2D, texture);
+	if (pitch == tex_w) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tex_w, h,
+			GL_ALPHA, GL_UNSIGNED_BYTE, data);
+	} else if (have_unpack_row_length) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h,
+			GL_ALPHA, GL_UNSIGNED_BYTE, data);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	} else {
+		int i;
+		for (i = 0; i < h; i++, data += pitch) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i, w, 1,
+				GL_ALPHA, GL_UNSIGNED_BYTE, data);
+		}
+	}
+}
+
+
+/**
+ * Uploads a YUV420P frame to the next texture set on the ring
+ * and prepares the conversion program to draw it.
+ */
+static int
+yuv420p_prepare(void **buf, int *pitch, const int w, const int h)
+{
+	const struct yuv420p_texset *texset;
+	const GLuint *planes;
+	const int uv_w = w >> 1, uv_h = h >> 1;
+
+	if ((texset = yuv420p_gettexset(w, h, pitch)) == NULL) {
+		return -1;
+	}
+	planes = texset->planes;
+
+	glVertexAttribPointer(yuv420p_texcoords, 2, GL_FLOAT, GL_FALSE, 0, texset->texcoords);
+	glEnableVertexAttribArray(yuv420p_texcoords);
+
+	/* upload each plane to it's texture */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	yuv420p_upload_plane(planes[0], texset->tex_w[0], w, h, pitch[0], buf[0]);
+	yuv420p_upload_plane(planes[1], texset->tex_w[1], uv_w, uv_h, pitch[1], buf[1]);
+	yuv420p_upload_plane(planes[2], texset->tex_w[2], uv_w, uv_h, pitch[2], buf[2]);
+	DEBUG_ERROR_CHECK();
+
+	/* prepare shaders */
+	glUseProgram(yuv420p_program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, planes[0]);
+	glUniform1i(yuv420p_y, 0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, planes[1]);
+	glUniform1i(yuv420p_u, 1);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, planes[2]);
+	glUniform1i(yuv420p_v, 2);
+	glActiveTexture(GL_TEXTURE0);
+
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	glVertexAttribPointer(yuv420p_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(yuv420p_pos);
+
+	return 0;
+}
+
+
 static int
 surface_doublebuffered(const struct mbv_surface * const surface)
 {
@@ -271,87 +455,10 @@ surface_blitbuf(
 	switch (pix_fmt) {
 	case AVBOX_PIXFMT_YUV420P:
 	{
-		GLuint planes[3];
-		const int uv_w = w >> 1, uv_h = h >> 1;
-
-		glVertexAttribPointer(yuv420p_texcoords, 2, GL_FLOAT, GL_FALSE, 0, texcoords_yuv);
-		glEnableVertexAttribArray(yuv420p_texcoords);
-
-		/* upload each plane to a texture */
-		glGenTextures(3, planes);
-		glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
-		glBindTexture(GL_TEXTURE_2D, planes[0]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		if (pitch[0] == w) {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, w, h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, buf[0]);
-		} else {
-			int i;
-			uint8_t *pbuf = buf[0];
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, w, h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
-			for (i = 0; i < h; i++) {
-				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i, w, 1,
-					GL_ALPHA, GL_UNSIGNED_BYTE, pbuf);
-				pbuf += pitch[0];
-			}
-		}
-		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-		glBindTexture(GL_TEXTURE_2D, planes[1]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		if (pitch[1] == uv_w) {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, uv_w, uv_h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, buf[1]);
-		} else {
-			int i;
-			uint8_t *pbuf = buf[1];
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, uv_w, uv_h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
-			for (i = 0; i < uv_h; i++) {
-				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i, uv_w, 1,
-					GL_ALPHA, GL_UNSIGNED_BYTE, pbuf);
-				pbuf += pitch[1];
-			}
-		}
-
-		DEBUG_ERROR_CHECK();
-
-		glBindTexture(GL_TEXTURE_2D, planes[2]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		if (pitch[2] == uv_w) {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, uv_w, uv_h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, buf[2]);
-		} else {
-			int i;
-			uint8_t *pbuf = buf[2];
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, uv_w, uv_h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
-			for (i = 0; i < uv_h; i++) {
-				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i, uv_w, 1,
-					GL_ALPHA, GL_UNSIGNED_BYTE, pbuf);
-				pbuf += pitch[2];
-			}
+		if (yuv420p_prepare(buf, pitch, w, h) == -1) {
+			return -1;
 		}
 
-		DEBUG_ERROR_CHECK();
-
-		/* prepare shaders */
-		glUseProgram(yuv420p_program);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, planes[0]);
-		glUniform1i(yuv420p_y, 0);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, planes[1]);
-		glUniform1i(yuv420p_u, 1);
-		glActiveTexture(GL_TEXTURE2);
-		glBindTexture(GL_TEXTURE_2D, planes[2]);
-		glUniform1i(yuv420p_v, 2);
-		glActiveTexture(GL_TEXTURE0);
-
-		glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-		glVertexAttribPointer(yuv420p_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
-		glEnableVertexAttribArray(yuv420p_pos);
-
 		/* convert and render to texture */
 		glBindFramebuffer(GL_FRAMEBUFFER, surface_framebuffer(inst));
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
@@ -359,7 +466,6 @@ surface_blitbuf(
 		glViewport(inst->x, inst->h - (y + h), inst->w, inst->h);
 		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glDeleteTextures(3, planes);
 		DEBUG_ERROR_CHECK();
 		return 0;
 	}
@@ -460,6 +566,42 @@ surface_scaleblit(
 }
 
 
+/**
+ * Converts and scales a frame into the destination surface
+ * in a single draw.
+ */
+static int
+surface_present(
+	struct mbv_surface * const dst,
+	unsigned int pix_fmt, void **buf, int *pitch,
+	int src_w, int src_h, int x, int y, int w, int h)
+{
+	DEBUG_THREAD_CHECK();
+
+	switch (pix_fmt) {
+	case AVBOX_PIXFMT_YUV420P:
+		if (yuv420p_prepare(buf, pitch, src_w, src_h) == -1) {
+			return -1;
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, surface_framebuffer(dst));
+		glViewport(x, dst->h - (y + h), w, h);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		DEBUG_ERROR_CHECK();
+		return 0;
+#ifdef ENABLE_VC4
+	case AVBOX_PIXFMT_MMAL:
+		/* the MMAL path already scales to the requested size */
+		return surface_blitbuf(dst, pix_fmt, buf, pitch,
+			MBV_BLITFLAGS_NONE, w, h, x, y);
+#endif
+	default:
+		errno = ENOTSUP;
+		return -1;
+	}
+}
+
+
 static inline int
 surface_blit(
 	struct mbv_surface * const dst,
@@ -553,6 +695,10 @@ surface_destroy(struct mbv_surface * const inst)
 		glDeleteFramebuffers(1, &inst->framebuffer);
 	}
 	glDeleteTextures(1, &inst->texture);
+	if (inst == root_surface) {
+		yuv420p_ring_free();
+		root_surface = NULL;
+	}
 	if (inst->bufsz != 0) {
 		free(inst->buf);
 	}
@@ -569,6 +715,8 @@ init_func_table(struct mbv_drv_funcs * const funcs)
 	funcs->surface_blitbuf = &surface_blitbuf;
 	funcs->surface_blit = &surface_blit;
 	funcs->surface_scaleblit = &surface_scaleblit;
+	funcs->surface_present = &surface_present;
+	funcs->surface_damage = NULL;
 	funcs->surface_update = &surface_update;
 	funcs->surface_doublebuffered = &surface_doublebuffered;
 	funcs->surface_destroy = &surface_destroy;
@@ -808,6 +956,22 @@ avbox_video_glinit(struct mbv_drv_funcs * const funcs, int width, const int heig
 	}
 #endif
 
+	/* check if we can upload strided buffers */
+#ifdef ENABLE_GLES2
+	{
+		const char * const version = (const char*) glGetString(GL_VERSION);
+		const char * const exts = (const char*) glGetString(GL_EXTENSIONS);
+		if ((version != NULL && !strncmp(version, "OpenGL ES 3", 11)) ||
+			(exts != NULL && strstr(exts, "GL_EXT_unpack_subimage") != NULL)) {
+			have_unpack_row_length = 1;
+		}
+	}
+#else
+	have_unpack_row_length = 1;
+#endif
+	DEBUG_VPRINT(LOG_MODULE, "Strided texture uploads: %s",
+		have_unpack_row_length ? "yes" : "no");
+
 	avbox_video_opengl_prepare_shaders();
 
 	/* upload surface vertices to buffer object */
@@ -826,3 +990,14 @@ avbox_video_glinit(struct mbv_drv_funcs * const funcs, int width, const int heig
 
 	return root_surface;
 }
+
+
+/**
+ * Free the GL driver resources. Must be called
+ * before the GL context is destroyed.
+ */
+void
+avbox_video_glshutdown(void)
+{
+	yuv420p_ring_free();
+}
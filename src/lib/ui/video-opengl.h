@@ -12,4 +12,11 @@ avbox_video_glinit(
 	int width, const int height,
 	void (*swap_buffers_fn)(void));
 
+
+/**
+ * Free the GL driver resources.
+ */
+void
+avbox_video_glshutdown(void);
+
 #endif
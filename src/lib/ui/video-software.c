@@ -42,13 +42,40 @@
 #include "../linkedlist.h"
 #include "../ffmpeg_util.h"
 #include "video-drv.h"
+#include "blit.h"
 #include "video.h"
+#include "video-software.h"
 
 
 /* define to 1 if swap_buffers will never
  * be NULL */
 #define ALWAYS_SWAP	1
 
+/* flags used for all colorspace conversions */
+#define SWSCALE_FLAGS	(SWS_FAST_BILINEAR)
+
+/* maximum number of damaged rectangles per update. If
+ * we get more the whole surface is updated */
+#define MAX_DAMAGE_RECTS	(8)
+
+
+/**
+ * Cached swscale context. We keep one per surface and
+ * only rebuild it when the conversion parameters change.
+ */
+struct mbv_swscale_cache
+{
+	struct SwsContext *ctx;
+	enum AVPixelFormat src_fmt;
+	int src_w;
+	int src_h;
+	int dst_w;
+	int dst_h;
+	int flags;
+	unsigned int hits;
+	unsigned int rebuilds;
+};
+
 
 struct mbv_surface
 {
@@ -62,14 +89,23 @@ struct mbv_surface
 	uint32_t y;
 	uint32_t realx;
 	uint32_t realy;
+	struct mbv_swscale_cache swscale;
 };
 
 
 /* software renderer */
 static struct mbv_surface *display_surface;
 static struct mbv_surface *root_surface;
-static void (*wait_for_vsync)(void);
+static void (*wait_for_flip)(void);
 static void (*swap_buffers)(void);
+static avbox_video_soft_overlay_fn overlay;
+
+/* damaged regions of the root surface for the current
+ * and last updates. A count of -1 means the whole surface */
+static struct avbox_rect damage[MAX_DAMAGE_RECTS];
+static struct avbox_rect last_damage[MAX_DAMAGE_RECTS];
+static int damage_count = -1;
+static int last_damage_count = -1;
 
 
 static int
@@ -79,6 +115,54 @@ surface_doublebuffered(const struct mbv_surface * const surface)
 }
 
 
+/**
+ * Gets an swscale context for the requested conversion. If the
+ * surface's cached context matches the parameters it is reused,
+ * otherwise it is rebuilt.
+ */
+static struct SwsContext *
+surface_getswscale(struct mbv_surface * const inst,
+	const enum AVPixelFormat src_fmt, const int src_w, const int src_h,
+	const int dst_w, const int dst_h, const int flags)
+{
+	struct mbv_swscale_cache * const cache = &inst->swscale;
+
+	if (LIKELY(cache->ctx != NULL &&
+		cache->src_fmt == src_fmt &&
+		cache->src_w == src_w && cache->src_h == src_h &&
+		cache->dst_w == dst_w && cache->dst_h == dst_h &&
+		cache->flags == flags)) {
+		cache->hits++;
+		return cache->ctx;
+	}
+
+	if (cache->ctx != NULL) {
+		sws_freeContext(cache->ctx);
+	}
+
+	if ((cache->ctx = sws_getContext(
+		src_w, src_h, src_fmt,
+		dst_w, dst_h, AV_PIX_FMT_BGRA,
+		flags, NULL, NULL, NULL)) == NULL) {
+		LOG_PRINT_ERROR("Could not create swscale context!");
+		return NULL;
+	}
+
+	cache->src_fmt = src_fmt;
+	cache->src_w = src_w;
+	cache->src_h = src_h;
+	cache->dst_w = dst_w;
+	cache->dst_h = dst_h;
+	cache->flags = flags;
+	cache->rebuilds++;
+
+	DEBUG_VPRINT(LOG_MODULE, "swscale context rebuilt for %dx%d -> %dx%d (hits=%u rebuilds=%u)",
+		src_w, src_h, dst_w, dst_h, cache->hits, cache->rebuilds);
+
+	return cache->ctx;
+}
+
+
 static struct mbv_surface *
 surface_new(struct mbv_surface *parent,
 	const int x, const int y, const int w, const int h)
@@ -94,6 +178,7 @@ surface_new(struct mbv_surface *parent,
 		return NULL;
 	}
 
+	memset(&inst->swscale, 0, sizeof(struct mbv_swscale_cache));
 	inst->w = w;
 	inst->h = h;
 	inst->x = x;
@@ -158,17 +243,12 @@ surface_blitbuf(struct mbv_surface * const surface,
 		uint8_t *surface_buf;
 		struct SwsContext *swscale;
 
-		if ((swscale = sws_getContext(
-			w, h, avbox_pixfmt_to_libav(pix_fmt),
-			w, h, AV_PIX_FMT_BGRA,
-			SWS_FAST_BILINEAR,
-			NULL, NULL, NULL)) == NULL) {
-			LOG_PRINT_ERROR("Could not create swscale context!");
+		if ((swscale = surface_getswscale(surface,
+			avbox_pixfmt_to_libav(pix_fmt), w, h, w, h, SWSCALE_FLAGS)) == NULL) {
 			return -1;
 		}
 
 		if ((surface_buf = surface_lock(surface, MBV_LOCKFLAGS_WRITE, &dstpitch)) == NULL) {
-			sws_freeContext(swscale);
 			return -1;
 		}
 
@@ -177,7 +257,6 @@ surface_blitbuf(struct mbv_surface * const surface,
 		sws_scale(swscale, (const uint8_t**) buf,
 			pitch, 0, h, &surface_buf, &dstpitch);
 		surface_unlock(surface);
-		sws_freeContext(swscale);
 		break;
 	}
 	case AVBOX_PIXFMT_BGRA:
@@ -199,16 +278,17 @@ surface_blitbuf(struct mbv_surface * const surface,
 
 		dst += y * dst_pitch;
 
-		if (0 && x == 0 && *pitch == dst_pitch && pitch[0] == (w * 4)) {
-			/* both surfaces are in contiguos memory so we
-			 * can just memcpy() the whole thing */
-			memcpy(dst, buf, *pitch * h);
+		if (flags & MBV_BLITFLAGS_ALPHABLEND) {
+			const uint8_t *src = *buf;
+			const uint8_t * const end = src + (pitch[0] * h);
+			for (dst += x * 4; src < end; dst += dst_pitch, src += pitch[0]) {
+				avbox_blit_blend((uint32_t*) dst, (const uint32_t*) src, w);
+			}
 		} else {
 			const uint8_t *src = *buf;
 			const uint8_t * const end = src + (pitch[0] * h);
-			const int stride_sz = w * 4;
 			for (dst += x * 4; src < end; dst += dst_pitch, src += pitch[0]) {
-				memcpy(dst, src, stride_sz);
+				avbox_blit_copy((uint32_t*) dst, (const uint32_t*) src, w);
 			}
 		}
 
@@ -223,6 +303,70 @@ surface_blitbuf(struct mbv_surface * const surface,
 }
 
 
+/**
+ * Converts and scales a frame directly into the destination
+ * surface. This saves the intermediate copy that we would
+ * need if we blitted the frame at it's native size and then
+ * scaled it.
+ */
+static int
+surface_present(struct mbv_surface * const dst,
+	unsigned int pix_fmt, void **buf, int *pitch,
+	int src_w, int src_h, int x, int y, int w, int h)
+{
+	int dstpitch, i;
+	uint8_t *surface_buf;
+	struct SwsContext *swscale;
+
+	if (pix_fmt != AVBOX_PIXFMT_YUV420P && pix_fmt != AVBOX_PIXFMT_BGRA) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* the frame is scaled to exactly w x h so we cannot
+	 * clip it, reject rects that don't fit the surface */
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+		x + w > (int) dst->w || y + h > (int) dst->h) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* if the driver can scan out the frame from a plane
+	 * under the framebuffer just punch a hole for it */
+	if (overlay != NULL && dst->real == root_surface) {
+		const struct avbox_rect rect = { dst->realx + x, dst->realy + y, w, h };
+		if (overlay(pix_fmt, buf, pitch, src_w, src_h, &rect) == 0) {
+			if ((surface_buf = surface_lock(dst, MBV_LOCKFLAGS_WRITE, &dstpitch)) == NULL) {
+				return -1;
+			}
+			surface_buf += dstpitch * y;
+			surface_buf += x * 4;
+			for (i = 0; i < h; i++, surface_buf += dstpitch) {
+				avbox_blit_fill((uint32_t*) surface_buf, 0, w);
+			}
+			surface_unlock(dst);
+			return 0;
+		}
+	}
+
+	if ((swscale = surface_getswscale(dst,
+		avbox_pixfmt_to_libav(pix_fmt), src_w, src_h, w, h, SWSCALE_FLAGS)) == NULL) {
+		return -1;
+	}
+
+	if ((surface_buf = surface_lock(dst, MBV_LOCKFLAGS_WRITE, &dstpitch)) == NULL) {
+		return -1;
+	}
+
+	surface_buf += dstpitch * y;
+	surface_buf += x * 4;
+	sws_scale(swscale, (const uint8_t**) buf,
+		pitch, 0, src_h, &surface_buf, &dstpitch);
+	surface_unlock(dst);
+	return 0;
+}
+
+
 static int
 surface_blit(struct mbv_surface * const dst,
 	struct mbv_surface * const src,
@@ -246,10 +390,79 @@ surface_blit(struct mbv_surface * const dst,
 }
 
 
+/**
+ * Copies a rectangle between two screen sized buffers. If
+ * rect is NULL the whole buffer is copied.
+ */
+static void
+surface_copyrect(struct mbv_surface * const dst,
+	const struct mbv_surface * const src, const struct avbox_rect * const rect)
+{
+	int y;
+	const int x0 = (rect != NULL) ? rect->x : 0;
+	const int y0 = (rect != NULL) ? rect->y : 0;
+	const int w = (rect != NULL) ? rect->w : (int) dst->w;
+	const int h = (rect != NULL) ? rect->h : (int) dst->h;
+	uint8_t *dstbuf = dst->pixels + (y0 * dst->pitch) + (x0 * 4);
+	const uint8_t *srcbuf = src->pixels + (y0 * src->pitch) + (x0 * 4);
+
+	if (rect == NULL && dst->pitch == src->pitch) {
+		memcpy(dstbuf, srcbuf, dst->pitch * h);
+		return;
+	}
+
+	for (y = 0; y < h; y++, dstbuf += dst->pitch, srcbuf += src->pitch) {
+		memcpy(dstbuf, srcbuf, w * 4);
+	}
+}
+
+
+static int
+surface_damage(struct mbv_surface * const surface,
+	const struct avbox_rect * const rects, const int count)
+{
+	int i;
+
+	ASSERT(surface == root_surface);
+
+	/* the last frame may still be waiting to be flipped
+	 * in, in which case the back buffer is still on the
+	 * screen */
+	wait_for_flip();
+
+	if (count <= 0 || count > MAX_DAMAGE_RECTS ||
+		(count == 1 && rects[0].x == 0 && rects[0].y == 0 &&
+		(uint32_t) rects[0].w == surface->w && (uint32_t) rects[0].h == surface->h)) {
+		damage_count = -1;
+	} else {
+		memcpy(damage, rects, sizeof(struct avbox_rect) * count);
+		damage_count = count;
+	}
+
+	/* when page flipping the back buffer holds the frame
+	 * before the one on the screen so unless the whole screen
+	 * is going to be recomposed we need to bring the regions
+	 * damaged by the last update up to date */
+	if ((ALWAYS_SWAP || swap_buffers != NULL) && damage_count != -1) {
+		if (last_damage_count == -1) {
+			surface_copyrect(root_surface, display_surface, NULL);
+		} else {
+			for (i = 0; i < last_damage_count; i++) {
+				surface_copyrect(root_surface, display_surface, &last_damage[i]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
 static void
 surface_update(struct mbv_surface * const surface,
 	int blitflags, const int update)
 {
+	int i;
+
 	ASSERT(surface != NULL);
 	(void) blitflags;
 
@@ -258,22 +471,31 @@ surface_update(struct mbv_surface * const surface,
 	}
 
 	if (surface == root_surface) {
-		if (surface == root_surface) {
-			wait_for_vsync();
-		}
 		if (ALWAYS_SWAP || swap_buffers != NULL) {
 			/* if the driver supports page flipping just
-			 * swap buffers and request a page flip */
+			 * swap buffers and request a page flip. We don't
+			 * wait for the flip here but before the back buffer
+			 * is written again */
 			uint8_t * const tmp = root_surface->pixels;
 			root_surface->pixels = display_surface->pixels;
 			display_surface->pixels = tmp;
 			swap_buffers();
-		} else {
+
+			/* remember what changed so we can bring the
+			 * new back buffer up to date */
+			memcpy(last_damage, damage, sizeof(damage));
+			last_damage_count = damage_count;
+		} else if (damage_count == -1) {
 			/* no page flipping support so we need to copy our
 			 * back buffer to the framebuffer manually */
-			memcpy(display_surface->pixels, root_surface->pixels,
-				display_surface->pitch * display_surface->h);
+			surface_copyrect(display_surface, root_surface, NULL);
+		} else {
+			/* copy only the damaged regions */
+			for (i = 0; i < damage_count; i++) {
+				surface_copyrect(display_surface, root_surface, &damage[i]);
+			}
 		}
+		damage_count = -1;
 	} else {
 		if (update) {
 			/* blit the surface directly to the screen */
@@ -293,6 +515,11 @@ surface_destroy(struct mbv_surface *inst)
 {
 	ASSERT(inst != NULL);
 	ASSERT(inst->pixels != NULL);
+	if (inst->swscale.ctx != NULL) {
+		DEBUG_VPRINT(LOG_MODULE, "Destroying surface swscale cache (hits=%u rebuilds=%u)",
+			inst->swscale.hits, inst->swscale.rebuilds);
+		sws_freeContext(inst->swscale.ctx);
+	}
 	if (inst->parent == NULL) {
 		free(inst->pixels);
 	}
@@ -306,7 +533,8 @@ surface_destroy(struct mbv_surface *inst)
 struct mbv_surface *
 avbox_video_softinit(struct mbv_drv_funcs * const funcs,
 	uint8_t *front_pixels, uint8_t *back_pixels, const int w, const int h, const int pitch,
-	void (*wait_for_vsync_fn)(void), void (*swap_buffers_fn)(void))
+	void (*wait_for_flip_fn)(void), void (*swap_buffers_fn)(void),
+	avbox_video_soft_overlay_fn overlay_fn)
 {
 	DEBUG_PRINT(LOG_MODULE, "Initializing software renderer");
 
@@ -356,12 +584,15 @@ avbox_video_softinit(struct mbv_drv_funcs * const funcs,
 	funcs->surface_blitbuf = &surface_blitbuf;
 	funcs->surface_blit = &surface_blit;
 	funcs->surface_scaleblit = NULL;
+	funcs->surface_present = &surface_present;
+	funcs->surface_damage = &surface_damage;
 	funcs->surface_update = &surface_update;
 	funcs->surface_doublebuffered = &surface_doublebuffered;
 	funcs->surface_destroy = &surface_destroy;
 
-	wait_for_vsync = wait_for_vsync_fn;
+	wait_for_flip = wait_for_flip_fn;
 	swap_buffers = swap_buffers_fn;
+	overlay = overlay_fn;
 
 	return root_surface;
 }
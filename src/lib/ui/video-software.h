@@ -2,13 +2,32 @@
 #define __AVBOX_VIDEO_SOFT
 
 
+/**
+ * Scans out a video frame from a hardware plane. The frame is
+ * shown on the rectangle of the screen given by rect wherever the
+ * framebuffer is transparent. Returns 0 on success or -1 if the
+ * frame needs to be converted into the framebuffer.
+ */
+typedef int (*avbox_video_soft_overlay_fn)(
+	unsigned int pix_fmt, void **buf, int *pitch,
+	int src_w, int src_h, const struct avbox_rect * const rect);
+
+
 /**
  * Initialize the software renderer
+ *
+ * \param wait_for_flip_fn Called before the back buffer is written
+ * to wait for the last swap to complete.
+ * \param swap_buffers_fn Called to request a page flip. It should not
+ * wait for the flip to complete.
+ * \param overlay_fn Called to scan out video frames from a plane (may
+ * be NULL).
  */
 struct mbv_surface *
 avbox_video_softinit(struct mbv_drv_funcs * const funcs,
 	uint8_t *front_pixels, uint8_t *back_pixels, const int w, const int h, const int pitch,
-	void (*wait_for_vsync_fn)(void), void (*swap_buffers_fn)(void));
+	void (*wait_for_flip_fn)(void), void (*swap_buffers_fn)(void),
+	avbox_video_soft_overlay_fn overlay_fn);
 
 
 #endif
@@ -143,6 +143,7 @@ static void
 shutdown(void)
 {
 	if (initialized) {
+		avbox_video_glshutdown();
 		glXMakeCurrent(xdisplay, None, NULL);
 		glXDestroyContext(xdisplay, xgl);
 		XDestroyWindow(xdisplay, xwindow);
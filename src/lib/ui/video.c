@@ -34,15 +34,21 @@
 
 #include "video.h"
 #include "video-drv.h"
+#include "textcache.h"
+#include "blit.h"
 #include "input.h"
 #include "../debug.h"
 #include "../linkedlist.h"
 #include "../log.h"
+#include "../math_util.h"
 #include "../dispatch.h"
 #include "../delegate.h"
 
 
-#define FORCE_FULL_SCREEN_REPAINTS 1
+/* maximum number of damaged rectangles tracked by the
+ * compositor. When more are needed they're merged into
+ * their bounding box */
+#define AVBOX_DAMAGE_MAX_RECTS	(8)
 
 #ifdef ENABLE_DIRECTFB
 #	include "video-directfb.h"
@@ -57,10 +63,6 @@
 #	include "video-x11.h"
 #endif
 
-#define ALIGNED(addr, bytes) \
-    (((uintptr_t)(const void *)(addr)) % (bytes) == 0)
-
-
 #define FONT_PADDING 	(3)
 
 
@@ -92,6 +94,10 @@ struct avbox_window
 	int damaged;
 	int decor_dirty;
 	int dirty;
+	int shown;
+	int saved;
+	int recompose;
+	uint8_t *saveunder;
 	uint32_t foreground_color;
 	uint32_t background_color;
 	void *user_context;
@@ -104,6 +110,9 @@ static struct mbv_drv_funcs driver;
 static struct avbox_window root_window;
 static PangoFontDescription *font_desc;
 static int default_font_height = 32;
+static struct SwsContext *scaleblit_swscale = NULL;
+static struct avbox_rect damage[AVBOX_DAMAGE_MAX_RECTS];
+static int damage_count = 0;
 
 LIST window_stack;
 
@@ -131,7 +140,42 @@ static int
 avbox_rect_overlaps(const struct avbox_rect * const rect1,
 	const struct avbox_rect * const rect2)
 {
-	return 1;
+	return rect1->x < (rect2->x + rect2->w) && rect2->x < (rect1->x + rect1->w) &&
+		rect1->y < (rect2->y + rect2->h) && rect2->y < (rect1->y + rect1->h);
+}
+
+
+/**
+ * Grows rect1 to the bounding box of both rectangles.
+ */
+static void
+avbox_rect_union(struct avbox_rect * const rect1,
+	const struct avbox_rect * const rect2)
+{
+	const int x2 = MAX(rect1->x + rect1->w, rect2->x + rect2->w);
+	const int y2 = MAX(rect1->y + rect1->h, rect2->y + rect2->h);
+	rect1->x = MIN(rect1->x, rect2->x);
+	rect1->y = MIN(rect1->y, rect2->y);
+	rect1->w = x2 - rect1->x;
+	rect1->h = y2 - rect1->y;
+}
+
+
+/**
+ * Clips a rectangle to another one. Returns 0 if
+ * the result is empty.
+ */
+static int
+avbox_rect_clip(struct avbox_rect * const rect,
+	const struct avbox_rect * const clip)
+{
+	const int x2 = MIN(rect->x + rect->w, clip->x + clip->w);
+	const int y2 = MIN(rect->y + rect->h, clip->y + clip->h);
+	rect->x = MAX(rect->x, clip->x);
+	rect->y = MAX(rect->y, clip->y);
+	rect->w = MAX(0, x2 - rect->x);
+	rect->h = MAX(0, y2 - rect->y);
+	return rect->w > 0 && rect->h > 0;
 }
 
 
@@ -228,27 +272,7 @@ clear:
 			strerror(errno));
 	} else {
 		for (int stride = 0; stride < window->content_window->rect.h; buf += pitch, stride++) {
-			int pix;
-#if UINTPTR_MAX == 0xffffffffffffffff
-			if (ALIGNED(buf, 8)) {
-				uint64_t *pixel64 = (uint64_t*) buf;
-				const uint64_t color64 = (uint64_t) color << 32 | color;
-				for (pix = 0; pix < window->content_window->rect.w - 1; pix += 2) {
-					*pixel64++ = color64;
-				}
-				if (pix < window->content_window->rect.w) {
-					*((uint32_t*) pixel64) = color;
-				}
-			}
-			else
-#endif
-			{
-				uint32_t *pixel = (uint32_t*) buf;
-				ASSERT(ALIGNED(buf, 4));
-				for (pix = 0; pix < window->content_window->rect.w; pix++) {
-					*pixel++ = color;
-				}
-			}
+			avbox_blit_fill((uint32_t*) buf, color, window->content_window->rect.w);
 		}
 		avbox_window_unlock(window);
 	}
@@ -523,7 +547,10 @@ avbox_window_scaleblit(
 		int dstpitch, srcpitch;
 		struct SwsContext *swscale;
 
-		if ((swscale = sws_getContext(
+		/* reuse the context from the last call when the
+		 * geometry hasn't changed */
+		if ((swscale = sws_getCachedContext(
+			scaleblit_swscale,
 			src->content_window->rect.w,
 			src->content_window->rect.h,
 			MB_DECODER_PIX_FMT,
@@ -533,17 +560,17 @@ avbox_window_scaleblit(
 			SWS_FAST_BILINEAR,
 			NULL, NULL, NULL)) == NULL) {
 			LOG_PRINT_ERROR("Could not create swscale context!");
+			scaleblit_swscale = NULL;
 			return -1;
 		}
+		scaleblit_swscale = swscale;
 
 		if ((bufdst = avbox_window_lock(dst, MBV_LOCKFLAGS_WRITE, &dstpitch)) == NULL) {
-			sws_freeContext(swscale);
 			return -1;
 		}
 
 		if ((bufsrc = avbox_window_lock(src, MBV_LOCKFLAGS_READ, &srcpitch)) == NULL) {
 			avbox_window_unlock(dst);
-			sws_freeContext(swscale);
 			return -1;
 		}
 
@@ -553,7 +580,6 @@ avbox_window_scaleblit(
 			&srcpitch, 0, src->content_window->rect.h, &bufdst, &dstpitch);
 		avbox_window_unlock(dst);
 		avbox_window_unlock(src);
-		sws_freeContext(swscale);
 		return 0;
 	} else {
 		return driver.surface_scaleblit(
@@ -564,6 +590,36 @@ avbox_window_scaleblit(
 }
 
 
+/**
+ * Converts and scales a decoded frame directly into a
+ * rectangle of the window. Returns -1 and sets errno to
+ * ENOTSUP if the driver or pixel format does not support it.
+ */
+int
+avbox_window_present(struct avbox_window * const window,
+	unsigned int pix_fmt, void **buf, int *pitch,
+	const int src_w, const int src_h,
+	const int x, const int y, const int w, const int h)
+{
+	if (driver.surface_present == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return driver.surface_present(window->content_window->surface,
+		pix_fmt, buf, pitch, src_w, src_h, x, y, w, h);
+}
+
+
+/**
+ * Checks if the video driver can present frames directly.
+ */
+int
+avbox_window_canpresent(void)
+{
+	return driver.surface_present != NULL;
+}
+
+
 static int
 avbox_window_reallyvisible(struct avbox_window * const window)
 {
@@ -589,57 +645,293 @@ avbox_window_reallyvisible(struct avbox_window * const window)
 
 
 /**
- * This is the internal repaint handler
+ * This is the internal repaint handler. It repaints the
+ * window contents and all of it's subwindows. The window
+ * is blitted to the screen by the compositor.
  */
 static int
-avbox_window_paint(struct avbox_window * const window, int update)
+avbox_window_paint(struct avbox_window * const window)
 {
-	int blitflags = MBV_BLITFLAGS_NONE;
-	struct avbox_window_node *damaged_window;
 	struct avbox_window_node *child;
 
 	/* DEBUG_VPRINT("video", "avbox_window_paint(\"%s\")",
 		window->identifier); */
 
-	if (!window->visible || !avbox_window_reallyvisible(window)) {
+	if (!window->visible) {
 		return 0;
 	}
 
-	if (window->flags & AVBOX_WNDFLAGS_ALPHABLEND) {
-		blitflags |= MBV_BLITFLAGS_ALPHABLEND;
-	}
-
 	/* if the window is dirty invoke the user defined
 	 * paint handler */
 	if (window->paint != NULL && window->dirty) {
 		window->paint(window, window->draw_context);
 	}
 
-	/* invoke repaint handler for all subwindows */
+	/* invoke repaint handler for all subwindows. The children
+	 * of the root window are composed separately */
 	LIST_FOREACH(struct avbox_window_node *, child, &window->children) {
-		avbox_window_paint(child->window, update);
+		if (child->window->flags & AVBOX_WNDFLAGS_SUBWINDOW) {
+			avbox_window_paint(child->window);
+		}
 	}
 
-	/* blit window */
-	driver.surface_update(window->surface, blitflags, update);
+	return 0;
+}
+
 
-	/* if this is the root window we need to paint all
-	 * visible windows */
-	if (window->parent == &root_window) {
-		damaged_window = LIST_NEXT(struct avbox_window_node*,
-			&window->stack_node);
-		while (!LIST_ISNULL(&window_stack, damaged_window)) {
-			if (avbox_rect_overlaps(&window->rect, &damaged_window->window->rect)) {
-				avbox_window_paint(damaged_window->window, update);
-				if (avbox_rect_covers(&damaged_window->window->rect, &window->rect)) {
-					break;
+/**
+ * Adds a rectangle to the damaged region of the screen.
+ */
+static void
+avbox_window_damage(const struct avbox_rect * const rect)
+{
+	int i;
+	struct avbox_rect r = *rect;
+
+	if (!avbox_rect_clip(&r, &root_window.rect)) {
+		return;
+	}
+
+	/* merge it with every damaged rectangle it overlaps */
+again:
+	for (i = 0; i < damage_count; i++) {
+		if (avbox_rect_overlaps(&r, &damage[i])) {
+			avbox_rect_union(&r, &damage[i]);
+			damage[i] = damage[--damage_count];
+			goto again;
+		}
+	}
+
+	/* if we've run out of slots use the bounding box */
+	if (damage_count == AVBOX_DAMAGE_MAX_RECTS) {
+		for (i = 0; i < damage_count; i++) {
+			avbox_rect_union(&r, &damage[i]);
+		}
+		damage_count = 0;
+	}
+
+	damage[damage_count++] = r;
+}
+
+
+/**
+ * Checks if a rectangle overlaps the damaged region.
+ */
+static int
+avbox_window_isdamaged(const struct avbox_rect * const rect)
+{
+	int i;
+	for (i = 0; i < damage_count; i++) {
+		if (avbox_rect_overlaps(rect, &damage[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Checks if the whole screen is damaged.
+ */
+static int
+avbox_window_fullydamaged(void)
+{
+	return damage_count == 1 &&
+		avbox_rect_covers(&damage[0], &root_window.rect);
+}
+
+
+/**
+ * Saves or restores the contents of the screen back
+ * buffer under a window.
+ */
+static int
+avbox_window_saveunder(struct avbox_window * const window, const int restore)
+{
+	int pitch, y;
+	uint8_t *buf, *save;
+	struct avbox_rect r = window->rect;
+
+	if (!avbox_rect_clip(&r, &root_window.rect)) {
+		return -1;
+	}
+
+	if (window->saveunder == NULL) {
+		ASSERT(!restore);
+		if ((window->saveunder = malloc(r.w * r.h * 4)) == NULL) {
+			ASSERT(errno == ENOMEM);
+			return -1;
+		}
+	}
+
+	if ((buf = driver.surface_lock(root_window.surface,
+		restore ? MBV_LOCKFLAGS_WRITE : MBV_LOCKFLAGS_READ, &pitch)) == NULL) {
+		return -1;
+	}
+
+	buf += (r.y * pitch) + (r.x * 4);
+	save = window->saveunder;
+	for (y = 0; y < r.h; y++, buf += pitch, save += r.w * 4) {
+		if (restore) {
+			memcpy(buf, save, r.w * 4);
+		} else {
+			memcpy(save, buf, r.w * 4);
+		}
+	}
+
+	driver.surface_unlock(root_window.surface);
+	return 0;
+}
+
+
+/**
+ * Paints a top level window and blits it to
+ * the screen back buffer.
+ */
+static void
+avbox_window_composite(struct avbox_window * const window)
+{
+	int blitflags = MBV_BLITFLAGS_NONE;
+
+	if (!avbox_window_reallyvisible(window)) {
+		window->shown = 0;
+		window->saved = 0;
+		return;
+	}
+
+	avbox_window_paint(window);
+
+	/* save what's under alpha blended windows so we
+	 * can recompose them without repainting the whole
+	 * screen */
+	if (window->flags & AVBOX_WNDFLAGS_ALPHABLEND) {
+		blitflags |= MBV_BLITFLAGS_ALPHABLEND;
+		window->saved = (driver.surface_damage != NULL &&
+			avbox_window_saveunder(window, 0) == 0);
+	} else {
+		window->saved = 0;
+	}
+
+	driver.surface_update(window->surface, blitflags, 0);
+	window->shown = 1;
+}
+
+
+/**
+ * Recomposes the damaged region of the screen and sends
+ * it to the display.
+ *
+ * Windows are always recomposed whole so the damaged region
+ * is first grown to cover every window that overlaps it. If the
+ * driver can keep the parts of the screen that are not damaged
+ * only those windows are repainted and blitted, and what was
+ * under them is restored from the copy saved the last time they
+ * were blitted. Otherwise the whole screen is recomposed.
+ */
+static void
+avbox_window_compose(void)
+{
+	int full, grown, i;
+	struct avbox_window *window;
+	struct avbox_window_node *node;
+
+	full = (driver.surface_damage == NULL || avbox_window_fullydamaged());
+
+	if (!full) {
+		/* grow the damaged region to cover every window
+		 * that overlaps it */
+		do {
+			grown = 0;
+			LIST_FOREACH(struct avbox_window_node*, node, &window_stack) {
+				window = node->window;
+				if (window == &root_window || (!window->visible && !window->shown) ||
+					!avbox_window_isdamaged(&window->rect)) {
+					continue;
+				}
+				for (i = 0; i < damage_count; i++) {
+					if (avbox_rect_covers(&damage[i], &window->rect)) {
+						break;
+					}
+				}
+				if (i == damage_count) {
+					avbox_window_damage(&window->rect);
+					grown = 1;
 				}
-				damaged_window = LIST_NEXT(struct avbox_window_node*,
-					damaged_window);
+			}
+		} while (grown && !avbox_window_fullydamaged());
+
+		/* opaque windows are simply blitted over their old
+		 * contents, but if an alpha blended window or a window
+		 * that is being hidden is on the screen and we don't know
+		 * what's under it we need to recompose everything */
+		LIST_FOREACH(struct avbox_window_node*, node, &window_stack) {
+			window = node->window;
+			window->recompose = (window != &root_window &&
+				avbox_window_isdamaged(&window->rect));
+			if (window->recompose && window->shown && !window->saved &&
+				(!window->visible || (window->flags & AVBOX_WNDFLAGS_ALPHABLEND))) {
+				full = 1;
 			}
 		}
+		full |= avbox_window_fullydamaged();
 	}
-	return 0;
+
+	if (full) {
+		damage_count = 0;
+		avbox_window_damage(&root_window.rect);
+	}
+
+	if (driver.surface_damage != NULL) {
+		driver.surface_damage(root_window.surface, damage, damage_count);
+	}
+
+	if (full) {
+		/* repaint the root window and blit every
+		 * visible window on top of it */
+		avbox_window_paint(&root_window);
+		LIST_FOREACH(struct avbox_window_node*, node, &window_stack) {
+			window = node->window;
+			window->recompose = 0;
+			if (window == &root_window) {
+				continue;
+			} else if (window->visible) {
+				avbox_window_composite(window);
+			} else {
+				window->shown = 0;
+				window->saved = 0;
+			}
+		}
+	} else {
+		/* restore what was under the damaged windows from
+		 * the top of the stack down and then recompose
+		 * them from the bottom up */
+		node = LIST_TAIL(struct avbox_window_node*, &window_stack);
+		while (!LIST_ISNULL(&window_stack, node)) {
+			window = node->window;
+			if (window->recompose) {
+				if (window->shown && window->saved) {
+					avbox_window_saveunder(window, 1);
+				}
+				window->shown = 0;
+			}
+			node = LIST_PREV(struct avbox_window_node*, node);
+		}
+		LIST_FOREACH(struct avbox_window_node*, node, &window_stack) {
+			window = node->window;
+			if (window->recompose) {
+				window->recompose = 0;
+				if (window->visible) {
+					avbox_window_composite(window);
+				} else {
+					window->saved = 0;
+				}
+			}
+		}
+	}
+
+	/* send the back buffer to the screen */
+	driver.surface_update(root_window.surface, MBV_BLITFLAGS_NONE, 0);
+	damage_count = 0;
 }
 
 
@@ -650,7 +942,6 @@ static int
 avbox_window_paintdecor(struct avbox_window * const window, void * const ctx)
 {
 	cairo_t *context;
-	PangoLayout *layout;
 
 	ASSERT(window->content_window != window); /* is a window WITH title */
 
@@ -689,25 +980,13 @@ avbox_window_paintdecor(struct avbox_window * const window, void * const ctx)
 			cairo_set_line_width(context, 2.0);
 			cairo_stroke(context);
 
-			if ((layout = pango_cairo_create_layout(context)) != NULL) {
-
-				pango_layout_set_font_description(layout, font_desc);
-				pango_layout_set_width(layout, window->rect.w * PANGO_SCALE);
-				pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
-				pango_layout_set_text(layout, window->title, -1);
-
-				cairo_set_source_rgba(context, CAIRO_COLOR_RGBA(window->foreground_color));
-				cairo_move_to(context, 0, 0);
-				pango_cairo_update_layout(context, layout);
-				pango_cairo_show_layout(context, layout);
-
-				/* free the layout */
-				g_object_unref(layout);
-
+			cairo_set_source_rgba(context, CAIRO_COLOR_RGBA(window->foreground_color));
+			if (avbox_textcache_draw(context, window->title, font_desc,
+				0, 0, window->rect.w, -1, PANGO_ALIGN_CENTER,
+				PANGO_ELLIPSIZE_NONE) == 0) {
 				window->decor_dirty = 0;
-
 			} else {
-				DEBUG_PRINT("video", "Could not create layout");
+				DEBUG_PRINT("video", "Could not draw title");
 			}
 
 			__window_cairoend(window);
@@ -717,7 +996,7 @@ avbox_window_paintdecor(struct avbox_window * const window, void * const ctx)
 	}
 
 	/* invoke the content window repaint handler */
-	return avbox_window_paint(window->content_window, 1);
+	return avbox_window_paint(window->content_window);
 }
 
 
@@ -754,6 +1033,9 @@ __avbox_window_cleanup(struct avbox_window * const window)
 	if (window->identifier) {
 		free((void*) window->identifier);
 	}
+	if (window->saveunder != NULL) {
+		free(window->saveunder);
+	}
 	driver.surface_destroy(window->surface);
 	free(window);
 }
@@ -914,6 +1196,10 @@ avbox_window_subwindow(struct avbox_window * const window,
 	new_window->decor_dirty = 1;
 	new_window->damaged = 0;
 	new_window->dirty = 1;
+	new_window->shown = 0;
+	new_window->saved = 0;
+	new_window->recompose = 0;
+	new_window->saveunder = NULL;
 	new_window->stack_node.window = new_window;
 	LIST_INIT(&new_window->children);
 
@@ -1039,6 +1325,10 @@ avbox_window_new(
 	window->decor_dirty = 1;
 	window->dirty = 1;
 	window->damaged = 0;
+	window->shown = 0;
+	window->saved = 0;
+	window->recompose = 0;
+	window->saveunder = NULL;
 	window->stack_node.window = window;
 
 	LIST_INIT(&window->children);
@@ -1142,28 +1432,21 @@ avbox_video_getrootwindow(int screen)
 void
 avbox_window_update(struct avbox_window *window)
 {
-	/* if we're updating the root window then we we don't
-	 * need to flip the windows to the front (screen) buffer
-	 * as the whole surface will be flipped. This value is
-	 * passed down the repaint chain so that none of the
-	 * windows get blitted. When we call driver.surface_update()
-	 * bellow the whole back-buffer will be flipped */
-	const int update = (window != &root_window);
+	struct avbox_window *toplevel = window;
 
-	if (!window->visible) {
+	/* find the top level window */
+	while (toplevel != &root_window && toplevel->parent != &root_window) {
+		toplevel = toplevel->parent;
+	}
+
+	if (!window->visible || !toplevel->visible) {
 		DEBUG_PRINT("video", "Not updating invisible window");
 		return;
 	}
 
-#ifdef FORCE_FULL_SCREEN_REPAINTS
-	if (update) {
-		avbox_window_paint(&root_window, 0);
-	} else {
-		avbox_window_paint(window, 0);
-	}
-#else
-	avbox_window_paint(window, update);
-#endif
+	/* damage the whole top level window and recompose */
+	avbox_window_damage(&toplevel->rect);
+	avbox_window_compose();
 }
 
 
@@ -1249,7 +1532,6 @@ void
 avbox_window_drawstring(struct avbox_window *window,
 	char *str, int x, int y)
 {
-	PangoLayout *layout;
 	cairo_t *context;
 	int window_width, window_height;
 
@@ -1268,27 +1550,14 @@ avbox_window_drawstring(struct avbox_window *window,
 
 	if ((context = avbox_window_cairo_begin(window)) != NULL) {
 
-		cairo_translate(context, 0, 0);
-
-		if ((layout = pango_cairo_create_layout(context)) != NULL) {
-
-			/* DEBUG_VPRINT("video", "Drawing string (x=%i,y=%i,w=%i,h=%i): '%s'",
-				x, y, window_width, window_height, str); */
+		/* DEBUG_VPRINT("video", "Drawing string (x=%i,y=%i,w=%i,h=%i): '%s'",
+			x, y, window_width, window_height, str); */
 
-			pango_layout_set_font_description(layout, font_desc);
-			pango_layout_set_width(layout, window_width * PANGO_SCALE);
-			pango_layout_set_height(layout, window_height * PANGO_SCALE);
-			pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
-			pango_layout_set_text(layout, str, -1);
-
-			cairo_set_source_rgba(context, CAIRO_COLOR_RGBA(window->foreground_color));
-			pango_cairo_update_layout(context, layout);
-			pango_cairo_show_layout(context, layout);
-
-			g_object_unref(layout);
-
-		} else {
-			DEBUG_PRINT("video", "Could not create layout");
+		cairo_set_source_rgba(context, CAIRO_COLOR_RGBA(window->foreground_color));
+		if (avbox_textcache_draw(context, str, font_desc, 0, 0,
+			window_width, window_height, PANGO_ALIGN_CENTER,
+			PANGO_ELLIPSIZE_NONE) == -1) {
+			DEBUG_PRINT("video", "Could not draw string");
 		}
 		avbox_window_cairo_end(window);
 	} else {
@@ -1306,7 +1575,6 @@ avbox_window_show(struct avbox_window * const window)
 	/* DEBUG_VPRINT("video", "avbox_window_show(0x%p)",
 		window); */
 
-	int blitflags = MBV_BLITFLAGS_NONE;
 	assert(window != &root_window);
 
 	if (window->visible) {
@@ -1314,18 +1582,13 @@ avbox_window_show(struct avbox_window * const window)
 			window->identifier);
 	}
 
-	if (window->flags & AVBOX_WNDFLAGS_ALPHABLEND) {
-		blitflags |= MBV_BLITFLAGS_ALPHABLEND;
-	}
-
 	/* add to the visible windows stack */
 	LIST_APPEND(&window_stack, &window->stack_node);
 	window->visible = 1;
-#ifdef FORCE_FULL_SCREEN_REPAINTS
-	avbox_window_paint(&root_window, 0);
-#else
-	avbox_window_paint(window, 1);
-#endif
+	window->shown = 0;
+	window->saved = 0;
+	avbox_window_damage(&window->rect);
+	avbox_window_compose();
 
 	/* if the window has input grab it */
 	if (window->flags & AVBOX_WNDFLAGS_INPUT) {
@@ -1340,8 +1603,6 @@ avbox_window_show(struct avbox_window * const window)
 void
 avbox_window_hide(struct avbox_window *window)
 {
-	struct avbox_window_node *damaged_window;
-
 	/* DEBUG_VPRINT("video", "avbox_window_hide(\"%s\")",
 		window->identifier); */
 
@@ -1352,9 +1613,6 @@ avbox_window_hide(struct avbox_window *window)
 		DEBUG_PRINT("video", "Hiding invisible window!");
 	}
 
-	/* remove window from the stack */
-	LIST_REMOVE(&window->stack_node);
-
 	/* if the window has input release it */
 	if (window->flags & AVBOX_WNDFLAGS_INPUT) {
 		ASSERT(window->object != NULL);
@@ -1363,20 +1621,19 @@ avbox_window_hide(struct avbox_window *window)
 
 	window->visible = 0;
 
-	/* Redraw all damaged windows. For now we just redraw
-	 * all the windows that are higher on the stack. */
-	LIST_FOREACH(struct avbox_window_node*, damaged_window, &window_stack) {
-		if (avbox_rect_overlaps(&window->rect, &damaged_window->window->rect)) {
-			/* DEBUG_VPRINT("video", "Repainting damaged window \"%s\"",
-				damaged_window->window->identifier); */
-			damaged_window->window->damaged = (damaged_window->window == &root_window);
-			avbox_window_update(damaged_window->window);
-			damaged_window->window->damaged = 0;
-			if (avbox_rect_covers(&damaged_window->window->rect, &window->rect)) {
-				break;
-			}
-		}
-	}
+	/* Repair the damaged region. The window stays on the stack
+	 * until the compositor restores what was under it. If the
+	 * whole screen needs to be recomposed the root window is
+	 * flagged as damaged so it gets fully repainted. */
+	root_window.damaged = 1;
+	avbox_window_damage(&window->rect);
+	avbox_window_compose();
+	root_window.damaged = 0;
+
+	/* remove window from the stack */
+	LIST_REMOVE(&window->stack_node);
+	window->shown = 0;
+	window->saved = 0;
 }
 
 
@@ -1389,7 +1646,11 @@ avbox_window_tofront(struct avbox_window *window)
 	assert(window != NULL);
 	LIST_REMOVE(&window->stack_node);
 	LIST_APPEND(&window_stack, &window->stack_node);
-	avbox_window_update(window);
+
+	/* the saved contents under the windows are no longer
+	 * valid so recompose the whole screen */
+	avbox_window_damage(&root_window.rect);
+	avbox_window_compose();
 }
 
 
@@ -1459,6 +1720,10 @@ avbox_video_init(int argc, char **argv)
 
 	DEBUG_PRINT("video", "Initializing video subsystem");
 
+	/* select the pixel kernels before any driver
+	 * gets a chance to use them */
+	avbox_blit_init();
+
 	for (i = 1; i < argc; i++) {
 		if (!strncmp(argv[i], "--video:", 8)) {
 			char *arg = argv[i] + 8;
@@ -1604,6 +1869,11 @@ avbox_video_init(int argc, char **argv)
 	root_window.flags = AVBOX_WNDFLAGS_NONE;
 	root_window.stack_node.window = &root_window;
 	root_window.dirty = 1;
+	root_window.damaged = 0;
+	root_window.shown = 1;
+	root_window.saved = 0;
+	root_window.recompose = 0;
+	root_window.saveunder = NULL;
 
 	if ((root_window.identifier = strdup("root_window")) == NULL) {
 		ASSERT(errno == ENOMEM);
@@ -1637,6 +1907,14 @@ avbox_video_init(int argc, char **argv)
 		return -1;
 	}
 
+	if (avbox_textcache_init() == -1) {
+		LOG_PRINT_ERROR("Could not initialize text cache");
+		pango_font_description_free(font_desc);
+		driver.shutdown();
+		free((void*)root_window.identifier);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1680,9 +1958,15 @@ avbox_video_shutdown()
 	}
 #endif
 
-	/* free default font */
+	/* free cached text and default font */
+	avbox_textcache_shutdown();
 	pango_font_description_free(font_desc);
 
+	if (scaleblit_swscale != NULL) {
+		sws_freeContext(scaleblit_swscale);
+		scaleblit_swscale = NULL;
+	}
+
 	/* shutdown driver */
 	driver.shutdown();
 }
@@ -266,6 +266,25 @@ avbox_window_blitbuf(
 	int x, int y);
 
 
+/**
+ * Converts and scales a decoded frame directly into a
+ * rectangle of the window. Returns -1 and sets errno to
+ * ENOTSUP if the driver or pixel format does not support it.
+ */
+int
+avbox_window_present(struct avbox_window * const window,
+	unsigned int pix_fmt, void **buf, int *pitch,
+	const int src_w, const int src_h,
+	const int x, const int y, const int w, const int h);
+
+
+/**
+ * Checks if the video driver can present frames directly.
+ */
+int
+avbox_window_canpresent(void);
+
+
 struct avbox_window*
 avbox_window_new(
 	struct avbox_window *parent,
@@ -51,6 +51,7 @@
 #include "lib/proc_util.h"
 #include "lib/file_util.h"
 #include "lib/db_util.h"
+#include "lib/compiler.h"
 #include "library.h"
 #include "lib/delegate.h"
 #include "lib/thread.h"
@@ -91,6 +92,16 @@
 #define MBOX_LIBRARY_DIRTYPE_BLUETOOTH	(4)
 #define MBOX_LIBRARY_DIRTYPE_TV		(5)
 
+/* the path cache is flushed when it reaches MAX entries.
+ * SIZE is the number of buckets and must be a power of 2 */
+#define MBOX_LIBRARY_PATHCACHE_SIZE	(64)
+#define MBOX_LIBRARY_PATHCACHE_MAX	(512)
+
+#define MBOX_LIBRARY_DB_BUSY_TIMEOUT	(5000)
+
+/* number of imported files per transaction */
+#define MBOX_LIBRARY_BATCH_SIZE		(64)
+
 LISTABLE_STRUCT(mb_mediatomb_inst,
 	int procid;
 );
@@ -110,15 +121,56 @@ LISTABLE_STRUCT(mbox_library_local_watchdir,
 );
 
 
+/**
+ * Path to id cache entry.
+ */
+LISTABLE_STRUCT(mbox_library_pathcache_entry,
+	int64_t start_at;
+	int64_t id;
+	char *path;
+);
+
+
+/* cached statements */
+#define MBOX_LIBRARY_STMT_GETID		(0)
+#define MBOX_LIBRARY_STMT_GETID_BY_URI	(1)
+#define MBOX_LIBRARY_STMT_MKDIR		(2)
+#define MBOX_LIBRARY_STMT_INSERT	(3)
+#define MBOX_LIBRARY_STMT_UPDATE	(4)
+#define MBOX_LIBRARY_STMT_DELETE	(5)
+#define MBOX_LIBRARY_STMT_MAX		(6)
+
+static const char * const local_sql[MBOX_LIBRARY_STMT_MAX] =
+{
+	"SELECT id FROM local_objects WHERE parent_id = ? AND name = ?",
+	"SELECT id FROM local_objects WHERE path = ? LIMIT 1",
+	"INSERT INTO local_objects (parent_id, name, path) VALUES (?, ?, '')",
+	"INSERT INTO local_objects (parent_id, name, path) VALUES (?, ?, ?)",
+	"UPDATE local_objects SET name = ? WHERE id = ?",
+	"DELETE FROM local_objects WHERE path LIKE ?"
+};
+
+
 static char * mediatomb_home = NULL;
 static LIST mediatomb_instances;
 
 static int avmount_process_id = -1;
 static int local_inotify_fd = -1;
 static int local_inotify_quit = 0;
+static int local_scan_quit = 0;
+static struct avbox_delegate *local_scan_delegate = NULL;
 static char *store;
 static pthread_t local_inotify_thread;
 static LIST local_inotify_watches;
+static sqlite3 *local_db = NULL;
+static sqlite3_stmt *local_stmts[MBOX_LIBRARY_STMT_MAX];
+static pthread_mutex_t local_db_lock;
+static LIST local_pathcache[MBOX_LIBRARY_PATHCACHE_SIZE];
+static int local_pathcache_count = 0;
+static int local_txn_open = 0;
+static int local_batch_refs = 0;
+static int local_batch_pending = 0;
+static pthread_key_t local_magic_key;
 
 #if defined(ENABLE_DVD) || defined(ENABLE_USB)
 static struct udev *udev = NULL;
@@ -726,250 +778,592 @@ end:
 
 
 /**
- * Get the id of a library path if it exists.
+ * Opens the shared library database connection.
  */
-static int64_t
-mbox_library_local_getid(const char * const path, int64_t start_at)
+static int
+mbox_library_db_open(void)
 {
-	int64_t ret = -1;
-	int res;
-	size_t len = 0;
-	sqlite3 *db = NULL;
-	sqlite3_stmt *stmt = NULL;
-	const char *ppath;
-	char *name = NULL, *pname;
-	const char * const sql = "SELECT id FROM local_objects WHERE parent_id = ? AND name = ?";
+	int i;
+	pthread_mutexattr_t lockattr;
 
-	ppath = (*path == '/') ?  path + 1 : path;
-	while (*ppath != '/' && *ppath != '\0') {
-		ppath++;
-		len++;
+	ASSERT(local_db == NULL);
+
+	pthread_mutexattr_init(&lockattr);
+	pthread_mutexattr_settype(&lockattr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(&local_db_lock, &lockattr) != 0) {
+		abort();
 	}
+	pthread_mutexattr_destroy(&lockattr);
 
-	/* this is the root directory */
-	if (len == 0) {
-		return start_at;
+	for (i = 0; i < MBOX_LIBRARY_PATHCACHE_SIZE; i++) {
+		LIST_INIT(&local_pathcache[i]);
 	}
+	local_pathcache_count = 0;
 
-	if ((name = malloc(len + 1)) == NULL) {
-		ASSERT(errno == ENOMEM);
+	if (mbox_library_local_open_database(&local_db,
+		SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX) == -1) {
+		if (local_db != NULL) {
+			sqlite3_close(local_db);
+			local_db = NULL;
+		}
 		return -1;
 	}
 
-	/* copy name */
-	ppath = (*path == '/') ?  path + 1 : path;
-	pname = name;
-	while (len > 0) {
-		*pname++ = *ppath++;
-		len--;
+	/* all threads share this connection so readers see the
+	 * scanner's uncommitted writes and are serialized with it
+	 * by local_db_lock. WAL makes commits cheaper (no rollback
+	 * journal to write and delete) and synchronous=NORMAL saves
+	 * an fsync per transaction which is expensive on SD cards */
+	if (sqlite3_exec(local_db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(local_db, "PRAGMA synchronous=NORMAL;", NULL, NULL, NULL) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not configure database: %s",
+			sqlite3_errmsg(local_db));
 	}
-	*pname = '\0';
+	sqlite3_busy_timeout(local_db, MBOX_LIBRARY_DB_BUSY_TIMEOUT);
 
-	ASSERT(*ppath == '/' || *ppath == '\0');
+	return 0;
+}
 
-	/* open db connection */
-	if (mbox_library_local_open_database(&db, SQLITE_OPEN_READONLY) == -1) {
-		LOG_VPRINT_ERROR("Could not open database: %s",
-			sqlite3_errmsg(db));
-		goto end;
+
+/**
+ * Flushes the path to id cache. Must be called with
+ * local_db_lock held.
+ */
+static void
+mbox_library_pathcache_flush(void)
+{
+	int i;
+	struct mbox_library_pathcache_entry *entry;
+	for (i = 0; i < MBOX_LIBRARY_PATHCACHE_SIZE; i++) {
+		LIST_FOREACH_SAFE(struct mbox_library_pathcache_entry*, entry, &local_pathcache[i], {
+			LIST_REMOVE(entry);
+			free(entry->path);
+			free(entry);
+		});
 	}
+	local_pathcache_count = 0;
+}
 
-	/* prepare the query */
-	while ((res = sqlite3_prepare_v2(db, sql, -1, &stmt, 0)) != SQLITE_OK) {
-		if (res == SQLITE_LOCKED) {
-			usleep(100L * 1000L);
-			continue;
-		} else {
-			errno = EFAULT;
+
+/**
+ * Closes the shared library database connection.
+ */
+static void
+mbox_library_db_close(void)
+{
+	int i;
+
+	if (local_db == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&local_db_lock);
+	for (i = 0; i < MBOX_LIBRARY_STMT_MAX; i++) {
+		if (local_stmts[i] != NULL) {
+			sqlite3_finalize(local_stmts[i]);
+			local_stmts[i] = NULL;
 		}
-		LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql);
-		LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
-		goto end;
 	}
+	mbox_library_pathcache_flush();
+	if (local_db != NULL) {
+		/* the connection won't be closed until all
+		 * open directories are closed */
+		sqlite3_close_v2(local_db);
+		local_db = NULL;
+	}
+	pthread_mutex_unlock(&local_db_lock);
+}
 
-	/* bind parameters */
-	if (sqlite3_bind_int(stmt, 1, start_at) != SQLITE_OK ||
-		sqlite3_bind_text(stmt, 2, name, strlen(name), NULL) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
-		goto end;
+
+/**
+ * Gets a cached prepared statement. The statement must be
+ * returned with mbox_library_db_release() and the caller must
+ * hold local_db_lock while using it.
+ */
+static sqlite3_stmt *
+mbox_library_db_stmt(const int which)
+{
+	int res;
+
+	ASSERT(which >= 0 && which < MBOX_LIBRARY_STMT_MAX);
+
+	if (UNLIKELY(local_db == NULL)) {
+		errno = ESHUTDOWN;
+		return NULL;
 	}
 
-	/* execute the query and do it again until
-	 * we resolve the path */
-	while (1) {
-		if ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
-			ret = sqlite3_column_int(stmt, 0);
-			if (strlen(ppath) > 1) {
-				ret = mbox_library_local_getid(ppath, ret);
+	if (local_stmts[which] == NULL) {
+		while ((res = sqlite3_prepare_v2(local_db, local_sql[which],
+			-1, &local_stmts[which], 0)) != SQLITE_OK) {
+			if (res == SQLITE_LOCKED) {
+				usleep(100L * 1000L);
+				continue;
 			}
-			break;
-		} else if (res == SQLITE_BUSY) {
-			usleep(100L * 1000L);
-			continue;
-		} else if (res == SQLITE_DONE) {
-			ret = -1;
-			break;
-		} else if (res == SQLITE_MISUSE) {
-			DEBUG_ABORT(LOG_MODULE, "sqlite misuse");
-		} else if (res == SQLITE_ERROR) {
-			LOG_VPRINT_ERROR("Sqlite error: %s", sqlite3_errmsg(db));
-			ret = -1;
-			break;
-		} else {
-			DEBUG_VPRINT(LOG_MODULE, "Step failed: %i", res);
-			ret = -1;
-			break;
+			errno = EFAULT;
+			LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", local_sql[which]);
+			LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(local_db));
+			return NULL;
 		}
 	}
+	return local_stmts[which];
+}
 
-end:
+
+/**
+ * Returns a cached statement.
+ */
+static void
+mbox_library_db_release(sqlite3_stmt * const stmt)
+{
 	if (stmt != NULL) {
-		sqlite3_finalize(stmt);
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
 	}
-	if (db != NULL) {
-		sqlite3_close(db);
+}
+
+
+/**
+ * Steps a statement retrying while the database is busy.
+ */
+static int
+mbox_library_db_step(sqlite3_stmt * const stmt)
+{
+	int res;
+	while ((res = sqlite3_step(stmt)) == SQLITE_BUSY) {
+		usleep(100L * 1000L);
 	}
-	if (name != NULL) {
-		free(name);
+	if (res == SQLITE_MISUSE) {
+		DEBUG_ABORT(LOG_MODULE, "Sqlite misuse!");
+	} else if (res != SQLITE_ROW && res != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("SQLite Error: %s", sqlite3_errmsg(local_db));
 	}
+	return res;
+}
 
-	return ret;
+
+/**
+ * Gets the path cache bucket for a path.
+ */
+static inline LIST *
+mbox_library_pathcache_bucket(const char *path, const int64_t start_at)
+{
+	unsigned int hash = 5381 + (unsigned int) start_at;
+	while (*path != '\0') {
+		hash = ((hash << 5) + hash) + (unsigned char) *path++;
+	}
+	return &local_pathcache[hash & (MBOX_LIBRARY_PATHCACHE_SIZE - 1)];
 }
 
 
+/**
+ * Get the id of a library path if it exists.
+ */
 static int64_t
-mbox_library_local_getid_by_uri(const char * const uri)
+mbox_library_local_getid(const char * const path, int64_t start_at)
 {
-	int64_t ret = -1;
 	int res;
-	sqlite3 *db = NULL;
+	size_t len;
+	int64_t ret = start_at;
 	sqlite3_stmt *stmt = NULL;
-	const char * const sql = "SELECT id FROM local_objects WHERE path = ? LIMIT 1";
+	const char *ppath;
+	LIST * const bucket = mbox_library_pathcache_bucket(path, start_at);
+	struct mbox_library_pathcache_entry *entry;
 
-	/* open db connection */
-	if (mbox_library_local_open_database(&db, SQLITE_OPEN_READONLY) == -1) {
-		LOG_VPRINT_ERROR("Could not open database: %s",
-			sqlite3_errmsg(db));
-		goto end;
-	}
+	pthread_mutex_lock(&local_db_lock);
 
-	/* prepare the query */
-	while ((res = sqlite3_prepare_v2(db, sql, -1, &stmt, 0)) != SQLITE_OK) {
-		if (res == SQLITE_LOCKED) {
-			usleep(100L * 1000L);
-			continue;
-		} else {
-			errno = EFAULT;
+	/* check the cache first */
+	LIST_FOREACH(struct mbox_library_pathcache_entry*, entry, bucket) {
+		if (entry->start_at == start_at && !strcmp(entry->path, path)) {
+			ret = entry->id;
+			goto end;
 		}
-		LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql);
-		LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
-		goto end;
 	}
 
-	/* bind parameters */
-	if (sqlite3_bind_text(stmt, 1, uri, strlen(uri), NULL) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
+	if ((stmt = mbox_library_db_stmt(MBOX_LIBRARY_STMT_GETID)) == NULL) {
+		ret = -1;
 		goto end;
 	}
 
-	/* execute the query and do it again until
-	 * we resolve the path */
+	/* resolve the path one level at a time using
+	 * the same statement */
+	ppath = path;
 	while (1) {
-		if ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
-			ret = sqlite3_column_int(stmt, 0);
-			break;
-		} else if (res == SQLITE_BUSY) {
-			usleep(100L * 1000L);
-			continue;
-		} else if (res == SQLITE_DONE) {
-			ret = -1;
+		while (*ppath == '/') {
+			ppath++;
+		}
+		for (len = 0; ppath[len] != '/' && ppath[len] != '\0'; len++);
+		if (len == 0) {
 			break;
-		} else if (res == SQLITE_MISUSE) {
-			DEBUG_ABORT(LOG_MODULE, "sqlite misuse");
-		} else if (res == SQLITE_ERROR) {
-			LOG_VPRINT_ERROR("Sqlite error: %s", sqlite3_errmsg(db));
+		}
+
+		if (sqlite3_bind_int64(stmt, 1, ret) != SQLITE_OK ||
+			sqlite3_bind_text(stmt, 2, ppath, len, SQLITE_STATIC) != SQLITE_OK) {
+			LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(local_db));
 			ret = -1;
 			break;
-		} else {
-			DEBUG_VPRINT(LOG_MODULE, "Step failed: %i", res);
+		}
+
+		if ((res = mbox_library_db_step(stmt)) != SQLITE_ROW) {
 			ret = -1;
 			break;
 		}
+		ret = sqlite3_column_int64(stmt, 0);
+		sqlite3_reset(stmt);
+		ppath += len;
 	}
 
+	mbox_library_db_release(stmt);
+
+	/* add it to the cache */
+	if (ret != -1) {
+		if (local_pathcache_count >= MBOX_LIBRARY_PATHCACHE_MAX) {
+			mbox_library_pathcache_flush();
+		}
+		if ((entry = malloc(sizeof(struct mbox_library_pathcache_entry))) != NULL) {
+			if ((entry->path = strdup(path)) != NULL) {
+				entry->start_at = start_at;
+				entry->id = ret;
+				LIST_ADD(bucket, entry);
+				local_pathcache_count++;
+			} else {
+				free(entry);
+			}
+		}
+	}
 end:
-	if (stmt != NULL) {
-		sqlite3_finalize(stmt);
+	pthread_mutex_unlock(&local_db_lock);
+	return ret;
+}
+
+
+static int64_t
+mbox_library_local_getid_by_uri(const char * const uri)
+{
+	int64_t ret = -1;
+	sqlite3_stmt *stmt;
+
+	pthread_mutex_lock(&local_db_lock);
+
+	if ((stmt = mbox_library_db_stmt(MBOX_LIBRARY_STMT_GETID_BY_URI)) == NULL) {
+		goto end;
 	}
-	if (db != NULL) {
-		sqlite3_close(db);
+
+	/* bind parameters */
+	if (sqlite3_bind_text(stmt, 1, uri, strlen(uri), SQLITE_STATIC) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(local_db));
+		goto end;
 	}
 
-	return ret;
+	if (mbox_library_db_step(stmt) == SQLITE_ROW) {
+		ret = sqlite3_column_int64(stmt, 0);
+	}
 
+end:
+	mbox_library_db_release(stmt);
+	pthread_mutex_unlock(&local_db_lock);
+	return ret;
 }
 
 
 static int64_t
 mbox_library_local_mkdir(const char * const name, const int64_t parent_id)
 {
-	int res, ret = -1;
-	sqlite3 *db = NULL;
-	sqlite3_stmt *stmt = NULL;
-	const char * const sql = "INSERT INTO local_objects (parent_id, name, path) VALUES (?, ?, '')";
+	int64_t ret = -1;
+	sqlite3_stmt *stmt;
 
 	ASSERT(name != NULL);
 	ASSERT(strlen(name) > 0);
 
-	/* open db connection */
-	if (mbox_library_local_open_database(&db, SQLITE_OPEN_READWRITE) == -1) {
-		LOG_VPRINT_ERROR("Could not open database: %s",
-			sqlite3_errmsg(db));
+	pthread_mutex_lock(&local_db_lock);
+
+	if ((stmt = mbox_library_db_stmt(MBOX_LIBRARY_STMT_MKDIR)) == NULL) {
 		goto end;
 	}
 
-	/* prepare the query */
-	while ((res = sqlite3_prepare_v2(db, sql, -1, &stmt, 0)) != SQLITE_OK) {
-		if (res == SQLITE_LOCKED) {
-			usleep(100L * 1000L);
-			continue;
+	/* bind parameters */
+	if (sqlite3_bind_int64(stmt, 1, parent_id) != SQLITE_OK ||
+		sqlite3_bind_text(stmt, 2, name, strlen(name), SQLITE_STATIC) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(local_db));
+		goto end;
+	}
+
+	/* execute the statement and get the row id */
+	if (mbox_library_db_step(stmt) == SQLITE_DONE) {
+		ret = sqlite3_last_insert_rowid(local_db);
+	}
+end:
+	mbox_library_db_release(stmt);
+	pthread_mutex_unlock(&local_db_lock);
+	return ret;
+}
+
+
+/**
+ * Opens the shared transaction if it's not already open.
+ * Must be called with local_db_lock held.
+ */
+static void
+mbox_library_db_opentxn(void)
+{
+	if (local_db != NULL && !local_txn_open) {
+		if (sqlite3_exec(local_db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) {
+			LOG_VPRINT_ERROR("Could not begin transaction: %s",
+				sqlite3_errmsg(local_db));
+		} else {
+			local_txn_open = 1;
 		}
+	}
+}
+
+
+/**
+ * Begins a batch of database writes. Since all threads share the
+ * same connection there is only one transaction, so the batch is
+ * shared too: batches may nest (from any thread) and the
+ * transaction is only committed every MBOX_LIBRARY_BATCH_SIZE
+ * writes or when the last batch ends. All batch state is
+ * protected by local_db_lock.
+ */
+static void
+mbox_library_db_begin(void)
+{
+	pthread_mutex_lock(&local_db_lock);
+	if (local_batch_refs++ == 0) {
+		local_batch_pending = 0;
+	}
+	mbox_library_db_opentxn();
+	pthread_mutex_unlock(&local_db_lock);
+}
+
+
+/**
+ * Commits the shared transaction. Must be called with
+ * local_db_lock held.
+ */
+static void
+mbox_library_db_commit(void)
+{
+	if (local_db != NULL && local_txn_open) {
+		if (sqlite3_exec(local_db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+			LOG_VPRINT_ERROR("Could not commit transaction: %s",
+				sqlite3_errmsg(local_db));
+		}
+		local_txn_open = 0;
+	}
+}
+
+
+/**
+ * Counts a write on the shared batch. Every
+ * MBOX_LIBRARY_BATCH_SIZE writes the transaction is committed.
+ */
+static void
+mbox_library_db_batchstep(void)
+{
+	pthread_mutex_lock(&local_db_lock);
+	if (local_batch_refs > 0) {
+		if (++local_batch_pending >= MBOX_LIBRARY_BATCH_SIZE) {
+			mbox_library_db_commit();
+			local_batch_pending = 0;
+		}
+
+		/* if we committed start a new transaction */
+		mbox_library_db_opentxn();
+	}
+	pthread_mutex_unlock(&local_db_lock);
+}
+
+
+/**
+ * Ends a batch of database writes.
+ */
+static void
+mbox_library_db_end(void)
+{
+	pthread_mutex_lock(&local_db_lock);
+	if (local_batch_refs > 0 && --local_batch_refs == 0) {
+		mbox_library_db_commit();
+	}
+	pthread_mutex_unlock(&local_db_lock);
+}
+
+
+/**
+ * Gets the calling thread's magic cookie. The cookie is
+ * loaded the first time it's used and closed when the
+ * thread exits.
+ */
+static magic_t
+mbox_library_getmagic(void)
+{
+	magic_t magic;
+
+	if ((magic = pthread_getspecific(local_magic_key)) != NULL) {
+		return magic;
+	}
+
+	if ((magic = magic_open(MAGIC_MIME)) == NULL) {
+		LOG_PRINT_ERROR("Could not create magic cookie");
 		errno = EFAULT;
-		LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql);
-		LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
-		goto end;
+		return NULL;
 	}
 
-	/* bind parameters */
-	if (sqlite3_bind_int(stmt, 1, parent_id) != SQLITE_OK ||
-		sqlite3_bind_text(stmt, 2, name, strlen(name), NULL) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
-		goto end;
+	if (magic_load(magic, NULL) != 0) {
+		LOG_VPRINT_ERROR("Could not load magic database: %s",
+			magic_error(magic));
+		magic_close(magic);
+		errno = EFAULT;
+		return NULL;
 	}
 
-	/* execute the statement */
-	while ((res = sqlite3_step(stmt)) != SQLITE_DONE) {
-		if (res == SQLITE_BUSY) {
-			usleep(100L * 1000L);
-			continue;
-		} else if (res == SQLITE_ERROR) {
-			LOG_VPRINT_ERROR("SQLite Error: %s", sqlite3_errmsg(db));
-			goto end;
-		} else if (res == SQLITE_MISUSE) {
-			DEBUG_ABORT(LOG_MODULE, "Sqlite misuse!");
+	if (pthread_setspecific(local_magic_key, magic) != 0) {
+		magic_close(magic);
+		errno = EFAULT;
+		return NULL;
+	}
+
+	return magic;
+}
+
+
+/**
+ * Magic cookie destructor.
+ */
+static void
+mbox_library_freemagic(void *magic)
+{
+	magic_close(magic);
+}
+
+
+/**
+ * Guesses the mime type of a file by it's extension. Returns
+ * NULL if the extension is unknown.
+ */
+static const char *
+mbox_library_mimebyext(const char * const path)
+{
+	int i;
+	const char *ext;
+	static const char * const exts[] =
+	{
+		"mkv", "video/x-matroska",
+		"webm", "video/webm",
+		"mp4", "video/mp4",
+		"m4v", "video/mp4",
+		"mov", "video/quicktime",
+		"avi", "video/x-msvideo",
+		"mpg", "video/mpeg",
+		"mpeg", "video/mpeg",
+		"vob", "video/mpeg",
+		"ts", "video/mp2t",
+		"m2ts", "video/mp2t",
+		"wmv", "video/x-ms-asf",
+		"flv", "video/x-flv",
+		"mp3", "audio/mpeg",
+		"flac", "audio/flac",
+		"m4a", "audio/mp4",
+		"wav", "audio/x-wav",
+		"srt", "text/plain",
+		"sub", "text/plain",
+		"idx", "text/plain",
+		"nfo", "text/plain",
+		"txt", "text/plain",
+		"jpg", "image/jpeg",
+		"jpeg", "image/jpeg",
+		"png", "image/png",
+		NULL
+	};
+
+	if ((ext = strrchr(path, '.')) == NULL || strchr(ext, '/') != NULL) {
+		return NULL;
+	}
+	ext++;
+
+	for (i = 0; exts[i] != NULL; i += 2) {
+		if (!strcasecmp(ext, exts[i])) {
+			return exts[i + 1];
 		}
 	}
+	return NULL;
+}
 
-	/* get the row id */
-	ret = sqlite3_last_insert_rowid(db);
-end:
-	if (stmt != NULL) {
-		sqlite3_finalize(stmt);
+
+/**
+ * Guesses the mime type of a file by it's header. Returns
+ * NULL if the container is not recognized.
+ */
+static const char *
+mbox_library_mimebyheader(const uint8_t * const hdr, const size_t len)
+{
+	if (len >= 4 && !memcmp(hdr, "\x1A\x45\xDF\xA3", 4)) {
+		return "video/x-matroska";
+	} else if (len >= 12 && !memcmp(hdr + 4, "ftyp", 4)) {
+		/* the major brand tells audio-only files apart */
+		if (!memcmp(hdr + 8, "M4A ", 4) || !memcmp(hdr + 8, "M4B ", 4) ||
+			!memcmp(hdr + 8, "M4P ", 4)) {
+			return "audio/mp4";
+		}
+		return "video/mp4";
+	} else if (len >= 12 && !memcmp(hdr, "RIFF", 4) && !memcmp(hdr + 8, "AVI ", 4)) {
+		return "video/x-msvideo";
+	} else if (len >= 4 && !memcmp(hdr, "\x00\x00\x01\xBA", 4)) {
+		return "video/mpeg";
+	} else if (len >= 189 && hdr[0] == 0x47 && hdr[188] == 0x47) {
+		return "video/mp2t";
+	} else if (len >= 4 && !memcmp(hdr, "fLaC", 4)) {
+		return "audio/flac";
+	} else if (len >= 3 && !memcmp(hdr, "ID3", 3)) {
+		return "audio/mpeg";
 	}
-	if (db != NULL) {
-		sqlite3_close(db);
+	return NULL;
+}
+
+
+/**
+ * Gets the mime type of a file. We check the extension and
+ * the file header first and only use libmagic when they
+ * don't agree or are unknown.
+ */
+static const char *
+mbox_library_getmime(const char * const path)
+{
+	int fd;
+	ssize_t len;
+	magic_t magic;
+	uint8_t hdr[192];
+	const char *mime, *byext, *byhdr = NULL;
+
+	byext = mbox_library_mimebyext(path);
+
+	/* skip subtitles, artwork, etc */
+	if (byext != NULL && (!strncmp(byext, "text/", 5) || !strncmp(byext, "image/", 6))) {
+		return byext;
 	}
-	return ret;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1) {
+		if ((len = read(fd, hdr, sizeof(hdr))) > 0) {
+			byhdr = mbox_library_mimebyheader(hdr, len);
+		}
+		close(fd);
+	}
+
+	/* if the header is recognized and the extension is either
+	 * unknown or of the same kind trust the header */
+	if (byhdr != NULL && (byext == NULL || !strncmp(byext, byhdr, 6))) {
+		return byhdr;
+	}
+
+	/* fallback to libmagic */
+	if ((magic = mbox_library_getmagic()) == NULL) {
+		return NULL;
+	}
+	if ((mime = magic_file(magic, path)) == NULL) {
+		LOG_PRINT_ERROR("Could not get file magic");
+		errno = EFAULT;
+		return NULL;
+	}
+	return mime;
 }
 
 
@@ -1124,39 +1518,21 @@ mbox_library_local_audio_name(const char * const path, int64_t * const parent_id
 static int64_t
 mbox_library_addcontent(const char * const path)
 {
-	int ret = -1;
-	magic_t magic;
+	int64_t ret = -1;
 	const char *mime = NULL;
 
-	if ((magic = magic_open(MAGIC_MIME)) == NULL) {
-		LOG_PRINT_ERROR("Could not create magic cookie");
-		errno = EFAULT;
-		return -1;
-	}
-
-	if (magic_load(magic, NULL) != 0) {
-		LOG_VPRINT_ERROR("Could not load magic database: %s",
-			magic_error(magic));
-		magic_close(magic);
-		errno = EFAULT;
-		return -1;
-	}
-
-	if ((mime = magic_file(magic, path)) == NULL) {
-		LOG_PRINT_ERROR("Could not get file magic");
-		magic_close(magic);
-		errno = EFAULT;
+	if ((mime = mbox_library_getmime(path)) == NULL) {
 		return -1;
 	}
 
 	if ((!strncmp(mime, "video/", 6) && strcmp(mime, "video/subtitle")) || !strncmp(mime, "video/", 6)) {
-		int res, retries = 0;
 		int64_t id, parent_id;
-		sqlite3 *db = NULL;
 		sqlite3_stmt *stmt = NULL;
 		char * name = NULL;
-		const char * const sql_insert = "INSERT INTO local_objects (parent_id, name, path) VALUES (?, ?, ?)";
-		const char * const sql_update = "UPDATE local_objects SET name = ? WHERE id = ?";
+
+		/* hold the database lock so the lookup and
+		 * insert happen atomically */
+		pthread_mutex_lock(&local_db_lock);
 
 		if (!strcmp(path + (strlen(path) - 3), "sub")) {
 			errno = EINVAL;
@@ -1195,94 +1571,49 @@ mbox_library_addcontent(const char * const path)
 		}
 		#endif
 
-		/* open db connection */
-		if (mbox_library_local_open_database(&db, SQLITE_OPEN_READWRITE) == -1) {
-			LOG_VPRINT_ERROR("Could not open database: %s",
-				sqlite3_errmsg(db));
-			goto end;
-		}
-
 		if (id == -1) {
-			/* prepare the query */
-			while ((res = sqlite3_prepare_v2(db, sql_insert, -1, &stmt, 0)) != SQLITE_OK) {
-				if (res == SQLITE_LOCKED) {
-					if (retries < 3) {
-						usleep(100L * 1000L);
-						retries++;
-						continue;
-					}
-					errno = EAGAIN;
-				} else {
-					errno = EFAULT;
-				}
-				LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql_insert);
-				LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
+			if ((stmt = mbox_library_db_stmt(MBOX_LIBRARY_STMT_INSERT)) == NULL) {
 				goto end;
 			}
 
 			/* bind parameters */
-			if (sqlite3_bind_int(stmt, 1, parent_id) != SQLITE_OK ||
-				sqlite3_bind_text(stmt, 2, name, strlen(name), NULL) != SQLITE_OK ||
-				sqlite3_bind_text(stmt, 3, path, strlen(path), NULL) != SQLITE_OK) {
-				LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
+			if (sqlite3_bind_int64(stmt, 1, parent_id) != SQLITE_OK ||
+				sqlite3_bind_text(stmt, 2, name, strlen(name), SQLITE_STATIC) != SQLITE_OK ||
+				sqlite3_bind_text(stmt, 3, path, strlen(path), SQLITE_STATIC) != SQLITE_OK) {
+				LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(local_db));
 				goto end;
 			}
 		} else {
-			/* prepare the query */
-			while ((res = sqlite3_prepare_v2(db, sql_update, -1, &stmt, 0)) != SQLITE_OK) {
-				if (res == SQLITE_LOCKED) {
-					if (retries < 3) {
-						usleep(100L * 1000L);
-						retries++;
-						continue;
-					}
-					errno = EAGAIN;
-				} else {
-					errno = EFAULT;
-				}
-				LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql_insert);
-				LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
+			if ((stmt = mbox_library_db_stmt(MBOX_LIBRARY_STMT_UPDATE)) == NULL) {
 				goto end;
 			}
 
 			/* bind parameters */
-			if (sqlite3_bind_text(stmt, 1, name, strlen(name), NULL) != SQLITE_OK ||
-				sqlite3_bind_int(stmt, 2, id) != SQLITE_OK) {
-				LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
+			if (sqlite3_bind_text(stmt, 1, name, strlen(name), SQLITE_STATIC) != SQLITE_OK ||
+				sqlite3_bind_int64(stmt, 2, id) != SQLITE_OK) {
+				LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(local_db));
 				goto end;
 			}
 		}
 
 		/* execute the statement */
-		while ((res = sqlite3_step(stmt)) != SQLITE_DONE) {
-			if (res == SQLITE_BUSY) {
-				usleep(100L * 1000L);
-				continue;
-			} else if (res == SQLITE_ERROR) {
-				LOG_VPRINT_ERROR("SQLite Error: %s", sqlite3_errmsg(db));
-				break;
-			} else if (res == SQLITE_MISUSE) {
-				DEBUG_ABORT(LOG_MODULE, "Sqlite misuse!");
-			}
+		if (mbox_library_db_step(stmt) != SQLITE_DONE) {
+			goto end;
 		}
 
-		ret = sqlite3_last_insert_rowid(db);
+		/* the last insert rowid is stale after an update
+		 * so return the id of the existing row instead */
+		ret = (id == -1) ? sqlite3_last_insert_rowid(local_db) : id;
 end:
+		mbox_library_db_release(stmt);
+		pthread_mutex_unlock(&local_db_lock);
 		if (name != NULL) {
 			free(name);
 		}
-		if (stmt != NULL) {
-			sqlite3_finalize(stmt);
-		}
-		if (db != NULL) {
-			sqlite3_close(db);
-		}
 	} else {
 		errno = EINVAL;
 	}
 
-	magic_close(magic);
-
 	return ret;
 }
 
@@ -1305,7 +1636,9 @@ mbox_library_scandir(const char * const path)
 		return -1;
 	}
 
-	while ((ent = readdir(dir)) != NULL) {
+	mbox_library_db_begin();
+
+	while (!local_scan_quit && (ent = readdir(dir)) != NULL) {
 		char *entpath;
 		struct stat st;
 
@@ -1342,6 +1675,8 @@ mbox_library_scandir(const char * const path)
 					LOG_VPRINT_ERROR("Could not add content '%s': %s",
 						entpath, strerror(errno));
 				}
+			} else {
+				mbox_library_db_batchstep();
 			}
 		}
 
@@ -1350,6 +1685,7 @@ mbox_library_scandir(const char * const path)
 
 	ret = 0;
 end:
+	mbox_library_db_end();
 	if (dir != NULL) {
 		closedir(dir);
 	}
@@ -1376,10 +1712,9 @@ mbox_library_local_scan_library(void * const arg)
 static int
 mbox_library_create_db_if_not_exist()
 {
-	int ret = -1;
+	int ret = -1, created = 0;
 	char *filename;
 	struct stat st;
-	struct avbox_delegate *del;
 
 	if ((filename = avbox_dbutil_getdbfile("content.db")) == NULL) {
 		ASSERT(errno == ENOMEM);
@@ -1433,17 +1768,25 @@ mbox_library_create_db_if_not_exist()
 		}
 
 		sqlite3_close(db);
+		created = 1;
+		break;
+	}
 
-		/* scan the internal storage in background thread */
-		if ((del = avbox_workqueue_delegate(
+	/* open the shared connection */
+	if (mbox_library_db_open() == -1) {
+		LOG_PRINT_ERROR("Could not open library database!");
+		goto end;
+	}
+
+	/* scan the internal storage in background thread. We
+	 * keep the delegate so we can wait for it on shutdown */
+	if (created) {
+		local_scan_quit = 0;
+		if ((local_scan_delegate = avbox_workqueue_delegate(
 			mbox_library_local_scan_library, NULL)) == NULL) {
 			LOG_VPRINT_ERROR("Could not start scan worker: %s",
 				strerror(errno));
-		} else {
-			avbox_delegate_dettach(del);
 		}
-
-		break;
 	}
 
 	ret = 0;
@@ -1481,12 +1824,12 @@ mbox_library_local_opendir(const char * const path)
 	}
 
 
-	/* open db connection */
-	if (mbox_library_local_open_database(
-		&dir->state.localdir.db, SQLITE_OPEN_READONLY) == -1) {
-		LOG_VPRINT_ERROR("Could not open database: %s",
-			sqlite3_errmsg(dir->state.localdir.db));
-		errno = EIO;
+	/* directories get their own statement on the
+	 * shared connection since many can be open at once */
+	pthread_mutex_lock(&local_db_lock);
+	dir->state.localdir.stmt = NULL;
+	if ((dir->state.localdir.db = local_db) == NULL) {
+		errno = ESHUTDOWN;
 		goto end;
 	}
 
@@ -1505,7 +1848,7 @@ mbox_library_local_opendir(const char * const path)
 	}
 
 	/* bind parameter */
-	if (sqlite3_bind_int(dir->state.localdir.stmt, 1, id) != SQLITE_OK) {
+	if (sqlite3_bind_int64(dir->state.localdir.stmt, 1, id) != SQLITE_OK) {
 		LOG_VPRINT_ERROR("Could not bind parameter: %s", sql);
 		LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(dir->state.localdir.db));
 		goto end;
@@ -1516,15 +1859,12 @@ mbox_library_local_opendir(const char * const path)
 	dir->state.localdir.dotdot_sent = 0;
 	ret = dir;
 end:
+	pthread_mutex_unlock(&local_db_lock);
 	if (ret == NULL) {
 		if (dir->state.localdir.stmt != NULL) {
 			sqlite3_finalize(dir->state.localdir.stmt);
 			dir->state.localdir.stmt = NULL;
 		}
-		if (dir->state.localdir.db != NULL) {
-			sqlite3_close(dir->state.localdir.db);
-			dir->state.localdir.db = NULL;
-		}
 		if (dir != NULL) {
 			free(dir);
 		}
@@ -2142,7 +2482,6 @@ mbox_library_closedir(struct mbox_library_dir * const dir)
 		ASSERT(dir->state.localdir.db != NULL);
 		ASSERT(dir->state.localdir.stmt != NULL);
 		sqlite3_finalize(dir->state.localdir.stmt);
-		sqlite3_close(dir->state.localdir.db);
 		dir->state.localdir.stmt = NULL;
 		dir->state.localdir.db = NULL;
 		break;
@@ -2276,8 +2615,10 @@ mbox_library_local_add_watch(const char * const path)
 static void *
 mbox_library_local_inotify(void * const arg)
 {
-	char buf[1024];
-	struct inotify_event *event = (struct inotify_event*) buf;
+	ssize_t len;
+	char *pbuf;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
 
 	DEBUG_SET_THREAD_NAME("library-inotify");
 	DEBUG_PRINT(LOG_MODULE, "Starting inotify loop");
@@ -2293,173 +2634,145 @@ mbox_library_local_inotify(void * const arg)
 
 	while (!local_inotify_quit) {
 
-		if (read(local_inotify_fd, buf, sizeof(buf)) == -1) {
-			if (errno == EAGAIN || errno == EINTR) {
-				continue;
-			} else {
+		if ((len = read(local_inotify_fd, buf, sizeof(buf))) == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
 				LOG_VPRINT_ERROR("Inotify read failed: %s",
 					strerror(errno));
 			}
+			continue;
 		}
 
-		if (event->len > 0) {
-
-			char *dir_path = NULL, *path;
-			struct mbox_library_local_watchdir *watchdir;
-			LIST_FOREACH(struct mbox_library_local_watchdir*,
-				watchdir, &local_inotify_watches) {
-				if (event->wd == watchdir->watch_fd) {
-					dir_path = watchdir->path;
+		/* process all the events that we got on a
+		 * single transaction */
+		mbox_library_db_begin();
+		for (pbuf = buf; pbuf < buf + len;
+			pbuf += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event*) pbuf;
+			if (event->len > 0) {
+
+				char *dir_path = NULL, *path;
+				struct mbox_library_local_watchdir *watchdir;
+				LIST_FOREACH(struct mbox_library_local_watchdir*,
+					watchdir, &local_inotify_watches) {
+					if (event->wd == watchdir->watch_fd) {
+						dir_path = watchdir->path;
+					}
 				}
-			}
 
-			if (dir_path == NULL) {
-				DEBUG_VPRINT(LOG_MODULE, "Event for unkown descriptor %i",
-					event->wd);
-				continue;
-			}
+				if (dir_path == NULL) {
+					DEBUG_VPRINT(LOG_MODULE, "Event for unkown descriptor %i",
+						event->wd);
+					continue;
+				}
 
-			/* build the full path
-			 * Note that we are allocating an extra byte in case
-			 * we need to append a % for the sql statement */
-			if ((path = malloc(strlen(dir_path) + 1 + strlen(event->name) + 2)) == NULL) {
-				abort();
-			}
-			strcpy(path, dir_path);
-			if (dir_path[strlen(dir_path) - 1] != '/') {
-				strcat(path, "/");
-			}
-			strcat(path, event->name);
+				/* build the full path
+				 * Note that we are allocating an extra byte in case
+				 * we need to append a % for the sql statement */
+				if ((path = malloc(strlen(dir_path) + 1 + strlen(event->name) + 2)) == NULL) {
+					abort();
+				}
+				strcpy(path, dir_path);
+				if (dir_path[strlen(dir_path) - 1] != '/') {
+					strcat(path, "/");
+				}
+				strcat(path, event->name);
 
-			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
-				/* these are illegal. for now we just abort(). in the future
-				 * we should display a message on the ui and then abort() */
-				abort();
-			} else if (event->mask & IN_MOVED_TO) {
-				struct stat st;
+				if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+					/* these are illegal. for now we just abort(). in the future
+					 * we should display a message on the ui and then abort() */
+					abort();
+				} else if (event->mask & IN_MOVED_TO) {
+					struct stat st;
 
-				DEBUG_VPRINT(LOG_MODULE, "File/directory moved in: %s",
-					path);
+					DEBUG_VPRINT(LOG_MODULE, "File/directory moved in: %s",
+						path);
 
-				if (stat(path, &st) == -1) {
-					LOG_VPRINT_ERROR("Could not stat '%s': %s",
-						path, strerror(errno));
-				} else {
-					if (S_ISDIR(st.st_mode)) {
-						/* scan the directory and add it to the
-						 * watch list */
-						mbox_library_local_add_watch(path);
-						mbox_library_scandir(path);
+					if (stat(path, &st) == -1) {
+						LOG_VPRINT_ERROR("Could not stat '%s': %s",
+							path, strerror(errno));
 					} else {
-						if (mbox_library_addcontent(path) == -1) {
-							if (errno != EINVAL) {
-								LOG_VPRINT_ERROR("Could not create add '%s': %s",
-									path, strerror(errno));
+						if (S_ISDIR(st.st_mode)) {
+							/* scan the directory and add it to the
+							 * watch list */
+							mbox_library_local_add_watch(path);
+							mbox_library_scandir(path);
+						} else {
+							if (mbox_library_addcontent(path) == -1) {
+								if (errno != EINVAL) {
+									LOG_VPRINT_ERROR("Could not create add '%s': %s",
+										path, strerror(errno));
+								}
+							} else {
+								mbox_library_db_batchstep();
 							}
 						}
 					}
-				}
 
-			} else if (event->mask & IN_CREATE) {
-				struct stat st;
+				} else if (event->mask & IN_CREATE) {
+					struct stat st;
 
-				DEBUG_VPRINT(LOG_MODULE, "File/directory created: %s",
-					path);
+					DEBUG_VPRINT(LOG_MODULE, "File/directory created: %s",
+						path);
 
-				if (stat(path, &st) == -1) {
-					LOG_VPRINT_ERROR("Could not stat '%s': %s",
-						path, strerror(errno));
-				} else {
-					if (S_ISDIR(st.st_mode)) {
-						mbox_library_local_add_watch(path);
-
-						/* in a perfect world we don't need to scan
-						 * here but since the message may be delayed
-						 * (or read late) there may be new files in before
-						 * we can add the watch */
-						mbox_library_scandir(path);
+					if (stat(path, &st) == -1) {
+						LOG_VPRINT_ERROR("Could not stat '%s': %s",
+							path, strerror(errno));
 					} else {
-						/* we just wait for the IN_CLOSE_WRITE event */
+						if (S_ISDIR(st.st_mode)) {
+							mbox_library_local_add_watch(path);
+
+							/* in a perfect world we don't need to scan
+							 * here but since the message may be delayed
+							 * (or read late) there may be new files in before
+							 * we can add the watch */
+							mbox_library_scandir(path);
+						} else {
+							/* we just wait for the IN_CLOSE_WRITE event */
+						}
 					}
-				}
 
 
-			} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
-				int res;
-				sqlite3 *db = NULL;
-				sqlite3_stmt *stmt = NULL;
-				const char * const sql = "DELETE FROM local_objects WHERE path LIKE ?";
+				} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					sqlite3_stmt *stmt;
 
-				DEBUG_VPRINT(LOG_MODULE, "File deleted/moved out: %s",
-					path);
+					DEBUG_VPRINT(LOG_MODULE, "File deleted/moved out: %s",
+						path);
 
-				/* append wildcard to path */
-				strcat(path, "%");
+					/* append wildcard to path */
+					strcat(path, "%");
 
-				/* open db connection */
-				if (mbox_library_local_open_database(&db, SQLITE_OPEN_READWRITE) == -1) {
-					LOG_VPRINT_ERROR("Could not open database: %s",
-						sqlite3_errmsg(db));
-					errno = EIO;
-					goto remove_end;
-				}
-
-
-				/* prepare the query */
-				while ((res = sqlite3_prepare_v2(db, sql, -1, &stmt, 0)) != SQLITE_OK) {
-					if (res == SQLITE_LOCKED) {
-						usleep(100L * 1000L);
-						continue;
-					} else {
-						errno = EFAULT;
+					pthread_mutex_lock(&local_db_lock);
+					if ((stmt = mbox_library_db_stmt(MBOX_LIBRARY_STMT_DELETE)) != NULL) {
+						if (sqlite3_bind_text(stmt, 1, path, strlen(path), SQLITE_STATIC) != SQLITE_OK) {
+							LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(local_db));
+						} else {
+							(void) mbox_library_db_step(stmt);
+						}
+						mbox_library_db_release(stmt);
 					}
-					LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql);
-					LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
-					goto remove_end;
-				}
-
-				/* bind parameters */
-				if (sqlite3_bind_text(stmt, 1, path, strlen(path), NULL) != SQLITE_OK) {
-					LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
-					goto remove_end;
-				}
-
-				/* execute the statement */
-				while ((res = sqlite3_step(stmt)) != SQLITE_DONE) {
-					if (res == SQLITE_BUSY) {
-						usleep(100L * 1000L);
-						continue;
-					} else if (res == SQLITE_ERROR) {
-						LOG_VPRINT_ERROR("SQLite Error: %s", sqlite3_errmsg(db));
-						break;
-					} else if (res == SQLITE_MISUSE) {
-						DEBUG_ABORT(LOG_MODULE, "Sqlite misuse!");
+					mbox_library_pathcache_flush();
+					pthread_mutex_unlock(&local_db_lock);
+
+				} else if (event->mask & (IN_CLOSE_WRITE)) {
+					DEBUG_VPRINT(LOG_MODULE, "File closed: %s",
+						path);
+					if (mbox_library_addcontent(path) == -1) {
+						if (errno != EINVAL) {
+							LOG_VPRINT_ERROR("Could not add '%s': %s",
+								path, strerror(errno));
+						}
+					} else {
+						mbox_library_db_batchstep();
 					}
-				}
-remove_end:
-				if (stmt != NULL) {
-					sqlite3_finalize(stmt);
-				}
-				if (db != NULL) {
-					sqlite3_close(db);
+				} else if (event->mask & (IN_MODIFY)) {
+					DEBUG_VPRINT(LOG_MODULE, "File modified: %s",
+						path);
 				}
 
-			} else if (event->mask & (IN_CLOSE_WRITE)) {
-				DEBUG_VPRINT(LOG_MODULE, "File closed: %s",
-					path);
-				if (mbox_library_addcontent(path) == -1) {
-					if (errno != EINVAL) {
-						LOG_VPRINT_ERROR("Could not add '%s': %s",
-							path, strerror(errno));
-					}
-				}
-			} else if (event->mask & (IN_MODIFY)) {
-				DEBUG_VPRINT(LOG_MODULE, "File modified: %s",
-					path);
+				free(path);
 			}
-
-			free(path);
 		}
+		mbox_library_db_end();
 	}
 
 	DEBUG_PRINT(LOG_MODULE, "inotify thread exitting");
@@ -2535,6 +2848,13 @@ mbox_library_local_init()
 
 	}
 
+	/* each thread that imports content loads it's own
+	 * magic cookie */
+	if (pthread_key_create(&local_magic_key, mbox_library_freemagic) != 0) {
+		LOG_PRINT_ERROR("Could not create magic key!");
+		return -1;
+	}
+
 	/* create the library database if it doesn't exist */
 	if (mbox_library_create_db_if_not_exist()) {
 		LOG_PRINT_ERROR("Could not create database!");
@@ -2582,6 +2902,14 @@ mbox_library_local_shutdown(void)
 	pthread_kill(local_inotify_thread, SIGUSR1);
 	pthread_join(local_inotify_thread, NULL);
 
+	/* stop the library scan and wait for it to commit
+	 * what it has done before we close the database */
+	if (local_scan_delegate != NULL) {
+		local_scan_quit = 1;
+		avbox_delegate_wait(local_scan_delegate, NULL);
+		local_scan_delegate = NULL;
+	}
+
 	/* remove all file watches */
 	LIST_FOREACH_SAFE(struct mbox_library_local_watchdir*,
 		watch_dir, &local_inotify_watches, {
@@ -2596,6 +2924,16 @@ mbox_library_local_shutdown(void)
 		local_inotify_fd = -1;
 	}
 
+	mbox_library_db_close();
+
+	/* free this thread's magic cookie. Worker threads free
+	 * their own when they exit so we don't delete the key
+	 * here since a scan may still be running */
+	if (pthread_getspecific(local_magic_key) != NULL) {
+		magic_close(pthread_getspecific(local_magic_key));
+		pthread_setspecific(local_magic_key, NULL);
+	}
+
 	if (store != NULL) {
 		umount(store);
 	}
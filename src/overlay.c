@@ -26,6 +26,7 @@
 #define LOG_MODULE "overlay"
 
 #include "lib/avbox.h"
+#include "lib/ui/textcache.h"
 #include "library.h"
 #include "overlay.h"
 
@@ -99,7 +100,6 @@ static int
 mbox_title_draw(struct avbox_window * const window, void * const ctx)
 {
 	cairo_t *context;
-	PangoLayout *msg;
 	int w, h;
 	struct mbox_overlay * const inst = ctx;
 	PangoFontDescription *font_desc;
@@ -117,20 +117,12 @@ mbox_title_draw(struct avbox_window * const window, void * const ctx)
 		cairo_set_source_rgba(context, 1.0, 1.0, 1.0, 1.0);
 
 		/* draw the title */
-		if ((msg = pango_cairo_create_layout(context)) != NULL) {
-			if ((font_desc = pango_font_description_from_string("Sans Bold 24px")) != NULL) {
-				pango_layout_set_font_description(msg, font_desc);
-				pango_layout_set_width(msg, w * PANGO_SCALE);
-				pango_layout_set_height(msg, h * PANGO_SCALE);
-				pango_layout_set_ellipsize(msg, PANGO_ELLIPSIZE_MIDDLE);
-				pango_layout_set_alignment(msg, mbv_get_pango_alignment(inst->alignment));
-				pango_layout_set_text(msg, inst->title, -1);
-				pango_cairo_update_layout(context, msg);
-				pango_font_description_free(font_desc);
-				cairo_translate(context, 0, 0);
-				pango_cairo_show_layout(context, msg);
-				g_object_unref(msg);
+		if ((font_desc = pango_font_description_from_string("Sans Bold 24px")) != NULL) {
+			if (avbox_textcache_draw(context, inst->title, font_desc, 0, 0, w, h,
+				mbv_get_pango_alignment(inst->alignment), PANGO_ELLIPSIZE_MIDDLE) == -1) {
+				LOG_PRINT_ERROR("Could not draw title");
 			}
+			pango_font_description_free(font_desc);
 		}
 
 		avbox_window_cairo_end(window);
@@ -254,7 +246,6 @@ static int
 mbox_duration_draw(struct avbox_window * const window, void * const ctx)
 {
 	cairo_t *context;
-	PangoLayout *msg;
 	int w, h;
 	struct mbox_overlay * const inst = ctx;
 	PangoFontDescription *font_desc;
@@ -271,21 +262,16 @@ mbox_duration_draw(struct avbox_window * const window, void * const ctx)
 
 		cairo_set_source_rgba(context, 1.0, 1.0, 1.0, 1.0);
 
-		/* draw the duration */
-		if ((msg = pango_cairo_create_layout(context)) != NULL) {
-			if ((font_desc = pango_font_description_from_string("Sans Bold 18px")) != NULL) {
-				char duration[20];
-				avbox_overlay_formatpos(duration, sizeof(duration), inst->position, inst->duration);
-				pango_layout_set_font_description(msg, font_desc);
-				pango_layout_set_width(msg, w * PANGO_SCALE);
-				pango_layout_set_alignment(msg, PANGO_ALIGN_RIGHT);
-				pango_layout_set_text(msg, duration, -1);
-				pango_cairo_update_layout(context, msg);
-				pango_font_description_free(font_desc);
-				cairo_translate(context, 0, 0);
-				pango_cairo_show_layout(context, msg);
-				g_object_unref(msg);
+		/* draw the duration. It changes every second so it's
+		 * cached one character at a time */
+		if ((font_desc = pango_font_description_from_string("Sans Bold 18px")) != NULL) {
+			char duration[20];
+			avbox_overlay_formatpos(duration, sizeof(duration), inst->position, inst->duration);
+			if (avbox_textcache_drawchars(context, duration, font_desc,
+				0, 0, w, PANGO_ALIGN_RIGHT) == -1) {
+				LOG_PRINT_ERROR("Could not draw duration");
 			}
+			pango_font_description_free(font_desc);
 		}
 		avbox_window_cairo_end(window);
 	}
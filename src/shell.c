@@ -29,6 +29,7 @@
 #define LOG_MODULE "shell"
 
 #include "lib/ui/video.h"
+#include "lib/ui/textcache.h"
 #include "lib/ui/progressview.h"
 #include "lib/ui/player.h"
 #include "lib/ui/input.h"
@@ -97,9 +98,8 @@ mbox_shell_getqueue(void)
 static int
 mbox_shell_draw(struct avbox_window *window, void * const ctx)
 {
-	int w, h;
+	int w, h, y;
 	cairo_t *context;
-	PangoLayout *layout_time, *layout_date;
 	PangoFontDescription *font_desc;
 
 	(void) ctx;
@@ -114,50 +114,29 @@ mbox_shell_draw(struct avbox_window *window, void * const ctx)
 	avbox_window_drawline(window, 0, h / 2, w - 1, h / 2);
 
 	if ((context = avbox_window_cairo_begin(window)) != NULL) {
-		if ((layout_time = pango_cairo_create_layout(context)) != NULL) {
-			if ((font_desc = pango_font_description_from_string("Sans Bold 100px")) != NULL) {
-				pango_layout_set_font_description(layout_time, font_desc);
-				pango_layout_set_width(layout_time, w * PANGO_SCALE);
-				pango_layout_set_alignment(layout_time, PANGO_ALIGN_CENTER);
-				pango_layout_set_text(layout_time, time_string, -1);
-				pango_cairo_update_layout(context, layout_time);
-				pango_font_description_free(font_desc);
-			}
-		}
-		if ((layout_date = pango_cairo_create_layout(context)) != NULL) {
-			pango_layout_set_font_description(layout_date, mbv_getdefaultfont());
-			pango_layout_set_width(layout_date, w * PANGO_SCALE);
-			pango_layout_set_alignment(layout_date, PANGO_ALIGN_CENTER);
-			pango_layout_set_text(layout_date, date_string, -1);
-			pango_cairo_update_layout(context, layout_date);
-		}
-
 		cairo_set_source_rgba(context, 1.0, 1.0, 1.0, 1.0);
 
-		if (layout_time != NULL && layout_date != NULL) {
-			cairo_translate(context, 0, (h / 2) - (10 + 128 + 48));
-			pango_cairo_show_layout(context, layout_time);
-			cairo_translate(context, 0, 128 + 10);
-			pango_cairo_show_layout(context, layout_date);
-		}
-
-		if (layout_time != NULL) {
-			g_object_unref(layout_time);
+		/* the time changes every minute so it's cached one
+		 * character at a time. The date and addresses change
+		 * rarely so they are cached whole */
+		y = (h / 2) - (10 + 128 + 48);
+		if ((font_desc = pango_font_description_from_string("Sans Bold 100px")) != NULL) {
+			if (avbox_textcache_drawchars(context, time_string, font_desc,
+				0, y, w, PANGO_ALIGN_CENTER) == -1) {
+				LOG_PRINT_ERROR("Could not draw time");
+			}
+			pango_font_description_free(font_desc);
 		}
-		if (layout_date != NULL) {
-			g_object_unref(layout_date);
+		y += 128 + 10;
+		if (avbox_textcache_draw(context, date_string, mbv_getdefaultfont(),
+			0, y, w, -1, PANGO_ALIGN_CENTER, PANGO_ELLIPSIZE_NONE) == -1) {
+			LOG_PRINT_ERROR("Could not draw date");
 		}
 
 		if (ip_addresses != NULL) {
-			PangoLayout *layout_ip;
-			if ((layout_ip = pango_cairo_create_layout(context)) != NULL) {
-				pango_layout_set_font_description(layout_ip, mbv_getdefaultfont());
-				pango_layout_set_width(layout_ip, w * PANGO_SCALE);
-				pango_layout_set_alignment(layout_ip, PANGO_ALIGN_CENTER);
-				pango_layout_set_text(layout_ip, ip_addresses, -1);
-				pango_cairo_update_layout(context, layout_ip);
-				cairo_move_to(context, 0, 70);
-				pango_cairo_show_layout(context, layout_ip);
+			if (avbox_textcache_draw(context, ip_addresses, mbv_getdefaultfont(),
+				0, y + 70, w, -1, PANGO_ALIGN_CENTER, PANGO_ELLIPSIZE_NONE) == -1) {
+				LOG_PRINT_ERROR("Could not draw addresses");
 			}
 		}
 